@@ -74,7 +74,7 @@ def analyze(audio_file, frame_rate=300, window_size=1001, window_type=pysms.SMS_
 
     # free memory and return
     pysms.sms_freeAnalysis(analysis_params)
-    pysms.sms_closeSF()
+    pysms.sms_closeSF(snd_header)
     pysms.sms_free()
     return analysis_frames, sms_header, snd_header
 
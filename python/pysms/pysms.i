@@ -97,6 +97,7 @@ typedef struct
 {
     SMS_Header *header;
     SMS_Data *smsData;
+    SMS_TrackModel tracks; /* the same frames track by track, built by the first getTrack */
     int allocated;
 } SMS_File;
 
@@ -161,6 +162,27 @@ void pysms_windowCentered(int sizeWaveform, float *pWaveform, int sizeWindow,
     }
     sms_windowCentered(sizeWindow, pWaveform, pWindow, sizeFft, pFftBuffer);
 }
+/* a track is a row of the track model: the model is only built when a
+   track is first asked for, so that files read frame by frame are not kept twice */
+static int pysms_loadTracks(SMS_File *pFile)
+{
+    int i;
+    SMS_Model model;
+    if(pFile->tracks.pValues)
+        return 0;
+    if(sms_initModel(&model, pFile->header) < 0)
+        return -1;
+    for(i = 0; i < pFile->header->nFrames; i++)
+        if(sms_addModelFrame(&pFile->smsData[i], &model) < 0)
+            break;
+    if(i < pFile->header->nFrames || sms_modelToTracks(&model, &pFile->tracks) < 0)
+    {
+        sms_freeModel(&model);
+        return -1;
+    }
+    sms_freeModel(&model);
+    return 0;
+}
 void pysms_synthesize_wrapper(SMS_Data *pSmsData, int sizeHop, float *pSynthesis, SMS_SynthParams *pSynthParams)
 {
     if(sizeHop != pSynthParams->sizeHop)
@@ -180,6 +202,7 @@ void pysms_synthesize_wrapper(SMS_Data *pSmsData, int sizeHop, float *pSynthesis
         int i;
         FILE *pSmsFile;
         $self->allocated = 0;
+        memset(&$self->tracks, 0, sizeof(SMS_TrackModel));
         sms_getHeader(pFilename, &$self->header, &pSmsFile);
         if(sms_errorCheck()) return;
 
@@ -205,6 +228,7 @@ void pysms_synthesize_wrapper(SMS_Data *pSmsData, int sizeHop, float *pSynthesis
         for(i = 0; i < $self->header->nFrames; i++)
             sms_freeFrame(&$self->smsData[i]);
         free($self->smsData);
+        sms_freeTrackModel(&$self->tracks);
     }
     /* return a pointer to a frame, which can be passed around to other libsms functions */
     void getFrame(int i, SMS_Data *frame)
@@ -225,7 +249,7 @@ void pysms_synthesize_wrapper(SMS_Data *pSmsData, int sizeHop, float *pSynthesis
             sms_error("file not yet alloceted");
             return ;
         }
-        if(track >= $self->header->nTracks)
+        if(track < 0 || track >= $self->header->nTracks)
         {
             sms_error("desired track is greater than number of tracks in file");
             return;
@@ -235,13 +259,16 @@ void pysms_synthesize_wrapper(SMS_Data *pSmsData, int sizeHop, float *pSynthesis
             sms_error("freq and amp arrays are different in size");
             return;
         }
+        if(pysms_loadTracks($self) < 0)
+            return;
         /* make sure arrays are big enough, or return less data */
         int nFrames = MIN (sizeFreq, $self->header->nFrames);
+        int iRow = track * $self->header->nFrames;
         int i;
         for(i=0; i < nFrames; i++)
         {
-            pFreq[i] = $self->smsData[i].pFSinFreq[track];
-            pAmp[i] = $self->smsData[i].pFSinAmp[track];
+            pFreq[i] = $self->tracks.pFSinFreq[iRow + i];
+            pAmp[i] = $self->tracks.pFSinAmp[iRow + i];
         }
     }
         // TODO turn into getTrackP - and check if phase exists
@@ -254,7 +281,7 @@ void pysms_synthesize_wrapper(SMS_Data *pSmsData, int sizeHop, float *pSynthesis
             sms_error("file not yet alloceted");
             return ;
         }
-        if(track >= $self->header->nTracks)
+        if(track < 0 || track >= $self->header->nTracks)
         {
             sms_error("desired track is greater than number of tracks in file");
             return;
@@ -264,13 +291,16 @@ void pysms_synthesize_wrapper(SMS_Data *pSmsData, int sizeHop, float *pSynthesis
             sms_error("freq and amp arrays are different in size");
             return;
         }
+        if(pysms_loadTracks($self) < 0)
+            return;
         /* make sure arrays are big enough, or return less data */
         int nFrames = MIN (sizeFreq, $self->header->nFrames);
+        int iRow = track * $self->header->nFrames;
         int i;
         for(i=0; i < nFrames; i++)
         {
-            pFreq[i] = $self->smsData[i].pFSinFreq[track];
-            pAmp[i] = $self->smsData[i].pFSinFreq[track];
+            pFreq[i] = $self->tracks.pFSinFreq[iRow + i];
+            pAmp[i] = $self->tracks.pFSinAmp[iRow + i];
         }
         if($self->header->iFormat < SMS_FORMAT_HP)
             return;
@@ -281,7 +311,7 @@ void pysms_synthesize_wrapper(SMS_Data *pSmsData, int sizeHop, float *pSynthesis
             return;
         }
         for(i=0; i < nFrames; i++)
-            pPhase[i] = $self->smsData[i].pFSinPha[track];
+            pPhase[i] = $self->tracks.pFSinPha[iRow + i];
     }
     void getFrameDet(int i, int sizeFreq, float *pFreq, int sizeAmp, float *pAmp)
     {
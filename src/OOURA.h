@@ -9,8 +9,8 @@
 # endif
 #endif
 
-#define NMAX 8192
-#define NMAXSQRT 64
+#define NMAX 32768
+#define NMAXSQRT 128
 
 #define DECORATE(x) _sms_ooura_##x
 
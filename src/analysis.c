@@ -24,44 +24,180 @@
  *
  * the analysis routine here calls all necessary functions to perform the complete
  * SMS analysis, once the desired analysis parameters are set in SMS_AnalParams.
+ *
+ * Once the fundamental has been stable for a few frames, the previous frames
+ * that do not fit it are analyzed again (ReAnalyzeFrame). How many of them is
+ * bounded by SMS_AnalParams::iMaxReAnalysis and fMaxReAnalysisTime, and they
+ * can be analyzed on SMS_AnalParams::pReAnalysisPool while sms_analyze()
+ * returns: the rest of sms_analyze() only uses older frames, and the next
+ * call (or anything else that changes the analysis) waits for them first.
+ * The pool must not be one that sms_analyze() itself runs on, the analyses
+ * of parallelAnalysis.c do not defer their re-analysis.
  */
 
 #include "sms.h"
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+/* state of the re-analysis deferred to SMS_AnalParams::pReAnalysisPool,
+ * with its own spectrum buffers */
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t doneCond;
+    int isPending;              /* whether a re-analysis is queued or running */
+    int iCurrentFrame;
+    SMS_AnalParams *pAnalParams;
+    sfloat *pWindow;
+    sfloat *pMag;
+    sfloat *pPhase;
+    sfloat *pFftBuffer;
+} ReAnalysisWork;
+
+/* a monotonic time in seconds */
+static double Seconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER count, frequency;
+
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (double)count.QuadPart / frequency.QuadPart;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + 1e-9 * now.tv_nsec;
+#endif
+}
 
-/*! \brief compute spectrum, find peaks, and fundamental of one frame
+/*! \brief compute the spectrum of a frame of sound and find its peaks
  *
- * This is the main core of analysis calls
+ * This is the part of the frame analysis that does not depend on the
+ * previous frames, it only uses the buffers given to it.
  *
- * \param iCurrentFrame          frame number to be computed
- * \param pAnalParams     structure of analysis parameters
- * \param fRefFundamental      reference fundamental
+ * \param sizeWindow         size of the analysis window
+ * \param pFData               pointer to the sound of the frame (sizeWindow samples)
+ * \param iWindowType       type of the analysis window \see SMS_WINDOWS
+ * \param pWindow             buffer for the window if it is not in the window cache (sizeWindow)
+ * \param pMag                  buffer for the magnitude spectrum (sms_power2(sizeWindow))
+ * \param pPhase               buffer for the phase spectrum (sms_power2(sizeWindow))
+ * \param pFftBuffer          buffer for the FFT (2 * sms_power2(sizeWindow))
+ * \param pSpectralPeaks     array of peaks to fill (iMaxPeaks)
+ * \param pPeakParams       peak detection parameters
+ * \return the number of peaks found
  */
-void sms_analyzeFrame(int iCurrentFrame, SMS_AnalParams *pAnalParams, sfloat fRefFundamental)
+int sms_findPeaks(int sizeWindow, const sfloat *pFData, int iWindowType, sfloat *pWindow,
+                  sfloat *pMag, sfloat *pPhase, sfloat *pFftBuffer, SMS_Peak *pSpectralPeaks,
+                  const SMS_PeakParams *pPeakParams)
 {
-    SMS_AnalFrame *pCurrentFrame = pAnalParams->ppFrames[iCurrentFrame];
-    int iSoundLoc = pCurrentFrame->iFrameSample -((pCurrentFrame->iFrameSize + 1) >> 1) + 1;
-    sfloat *pFData = &(pAnalParams->soundBuffer.pFBuffer[iSoundLoc - pAnalParams->soundBuffer.iMarker]);
+    int nPeaks;
 
-    /* TODO: this doesn't have to be done every time */
-    int sizeWindow =  pCurrentFrame->iFrameSize;
+    sms_findPeaksFrames(1, 0, sizeWindow, pFData, iWindowType, pWindow, pMag, pPhase,
+                        pFftBuffer, pSpectralPeaks, &nPeaks, pPeakParams);
+    return nPeaks;
+}
+
+/*! \brief compute the spectra of several frames of sound and find their peaks
+ *
+ * The same as sms_findPeaks() for frames of the same size at a regular
+ * distance, with the FFTs done in one batch.
+ *
+ * \param nFrames            number of frames
+ * \param sizeHop            distance in samples from the start of one frame to the next
+ * \param sizeWindow         size of the analysis window
+ * \param pFData               pointer to the sound of the first frame
+ * \param iWindowType       type of the analysis window \see SMS_WINDOWS
+ * \param pWindow             buffer for the window if it is not in the window cache (sizeWindow)
+ * \param pMag                  buffer for the magnitude spectra (nFrames * sms_power2(sizeWindow))
+ * \param pPhase               buffer for the phase spectra (nFrames * sms_power2(sizeWindow))
+ * \param pFftBuffer          buffer for the FFTs (nFrames * 2 * sms_power2(sizeWindow))
+ * \param pSpectralPeaks     arrays of peaks to fill, one after the other (nFrames * iMaxPeaks)
+ * \param pNPeaks             the number of peaks found in each frame (nFrames)
+ * \param pPeakParams       peak detection parameters
+ */
+void sms_findPeaksFrames(int nFrames, int sizeHop, int sizeWindow, const sfloat *pFData,
+                         int iWindowType, sfloat *pWindow, sfloat *pMag, sfloat *pPhase,
+                         sfloat *pFftBuffer, SMS_Peak *pSpectralPeaks, int *pNPeaks,
+                         const SMS_PeakParams *pPeakParams)
+{
+    int iFrame;
     int sizeMag = sms_power2(sizeWindow);
-    sms_getWindow(sizeWindow, pAnalParams->spectrumWindow, pAnalParams->iWindowType);
-    sms_scaleWindow(sizeWindow, pAnalParams->spectrumWindow);
+    const sfloat *pScaledWindow = sms_getScaledWindow(sizeWindow, iWindowType);
+
+    /* all the windows of the cache are in use, make it here */
+    if(pScaledWindow == NULL)
+    {
+        sms_getWindow(sizeWindow, pWindow, iWindowType);
+        sms_scaleWindow(sizeWindow, pWindow);
+        pScaledWindow = pWindow;
+    }
 
     /* compute the magnitude and (zero-windowed) phase spectra */
-    sms_spectrum(sizeWindow, pFData, pAnalParams->spectrumWindow, sizeMag,
-                 pAnalParams->magSpectrum, pAnalParams->phaseSpectrum,
-                 pAnalParams->fftBuffer);
+    sms_spectra(nFrames, sizeHop, sizeWindow, pFData, pScaledWindow, sizeMag, pMag, pPhase, pFftBuffer);
+    if(pScaledWindow != pWindow)
+        sms_releaseScaledWindow(pScaledWindow);
 
-    /* convert magnitude spectra to dB */
-    sms_arrayMagToDB(sizeMag, pAnalParams->magSpectrum);
+    for(iFrame = 0; iFrame < nFrames; iFrame++)
+    {
+        sfloat *pFrameMag = pMag + (long)iFrame * sizeMag;
 
-    /* find the prominent peaks */
-    pCurrentFrame->nPeaks = sms_detectPeaks(sizeMag,
-                                            pAnalParams->magSpectrum,
-                                            pAnalParams->phaseSpectrum,
-                                            pCurrentFrame->pSpectralPeaks,
-                                            &pAnalParams->peakParams);
+        /* convert magnitude spectra to dB */
+        sms_arrayMagToDB(sizeMag, pFrameMag);
+
+        /* find the prominent peaks */
+        pNPeaks[iFrame] = sms_detectPeaks(sizeMag, pFrameMag, pPhase + (long)iFrame * sizeMag,
+                                          pSpectralPeaks + (long)iFrame * pPeakParams->iMaxPeaks,
+                                          pPeakParams);
+    }
+}
+
+/* the peaks of a frame if they have been computed ahead with the same
+ * window size, NULL otherwise */
+static const SMS_FramePeaks *FindFramePeaks(const SMS_AnalParams *pAnalParams,
+                                            const SMS_AnalFrame *pFrame)
+{
+    const SMS_FramePeaks *pFramePeaks;
+    int iEntry;
+
+    if(pAnalParams->pFramePeaks == NULL || pAnalParams->nFramePeaks <= 0)
+        return NULL;
+    iEntry = pFrame->iFrameNum - pAnalParams->pFramePeaks[0].iFrameNum;
+    if(iEntry < 0 || iEntry >= pAnalParams->nFramePeaks)
+        return NULL;
+    pFramePeaks = &pAnalParams->pFramePeaks[iEntry];
+    if(pFramePeaks->nPeaks < 0 || pFramePeaks->iFrameSize != pFrame->iFrameSize)
+        return NULL;
+    return pFramePeaks;
+}
+
+/* sms_analyzeFrame with the given spectrum buffers */
+static void AnalyzeFrame(int iCurrentFrame, SMS_AnalParams *pAnalParams, sfloat fRefFundamental,
+                         sfloat *pWindow, sfloat *pMag, sfloat *pPhase, sfloat *pFftBuffer)
+{
+    SMS_AnalFrame *pCurrentFrame = pAnalParams->ppFrames[iCurrentFrame];
+    const SMS_FramePeaks *pFramePeaks = FindFramePeaks(pAnalParams, pCurrentFrame);
+
+    if(pFramePeaks)
+    {
+        memcpy(pCurrentFrame->pSpectralPeaks, pFramePeaks->pSpectralPeaks,
+               pAnalParams->peakParams.iMaxPeaks * sizeof(SMS_Peak));
+        pCurrentFrame->nPeaks = pFramePeaks->nPeaks;
+    }
+    else
+    {
+        int iSoundLoc = pCurrentFrame->iFrameSample -((pCurrentFrame->iFrameSize + 1) >> 1) + 1;
+        sfloat *pFData = sms_soundBufferPointer(&pAnalParams->soundBuffer, iSoundLoc);
+
+        pCurrentFrame->nPeaks = sms_findPeaks(pCurrentFrame->iFrameSize, pFData,
+                                              pAnalParams->iWindowType, pWindow, pMag, pPhase,
+                                              pFftBuffer, pCurrentFrame->pSpectralPeaks,
+                                              &pAnalParams->peakParams);
+    }
 
     /* find a reference harmonic */
     if(pCurrentFrame->nPeaks > 0 &&
@@ -69,60 +205,251 @@ void sms_analyzeFrame(int iCurrentFrame, SMS_AnalParams *pAnalParams, sfloat fRe
         sms_harmDetection(pCurrentFrame, fRefFundamental, &pAnalParams->peakParams);
 }
 
+/*! \brief compute spectrum, find peaks, and fundamental of one frame
+ *
+ * This is the main core of analysis calls. If the peaks of the frame have
+ * already been computed with the same window size (see
+ * SMS_AnalParams::pFramePeaks) they are used instead of computing them again.
+ *
+ * \param iCurrentFrame          frame number to be computed
+ * \param pAnalParams     structure of analysis parameters
+ * \param fRefFundamental      reference fundamental
+ */
+void sms_analyzeFrame(int iCurrentFrame, SMS_AnalParams *pAnalParams, sfloat fRefFundamental)
+{
+    AnalyzeFrame(iCurrentFrame, pAnalParams, fRefFundamental, pAnalParams->spectrumWindow,
+                 pAnalParams->magSpectrum, pAnalParams->phaseSpectrum, pAnalParams->fftBuffer);
+}
+
 /*! \brief re-analyze the previous frames if necessary
  *
- * \todo explain when this is necessary
+ * A frame is analyzed with the window size of the fundamental found before
+ * it, so the frames before a change of fundamental have windows that do not
+ * fit it. Once the last SMS_AnalParams::minGoodFrames frames are stable,
+ * the frames before them are walked back, and the ones with a fundamental
+ * or a window size far from the frame after them are analyzed again with
+ * the fundamental of that frame as reference. The walk ends at the first
+ * frame recomputed before, at the start of the sound or after
+ * SMS_AnalParams::analDelay frames.
+ *
+ * At most SMS_AnalParams::iMaxReAnalysis frames are recomputed, and none
+ * after SMS_AnalParams::fMaxReAnalysisTime seconds. The frame the budget
+ * stops at is kept in SMS_AnalParams::iReAnalysisFrame and the next call
+ * goes on from there once it reaches the frames recomputed by this one,
+ * unless the frame has left the last analDelay frames by then.
  *
  * \param iCurrentFrame             current frame number
  * \param pAnalParams              structure with analysis parameters
- * \return 1 if frames are good, -1 if analysis is necessary
- * \todo is the return value info correct? Why isn't it used in sms_analyze?
+ * \param pWindow, pMag, pPhase, pFftBuffer  spectrum buffers \see sms_findPeaks
+ * \return 1 if the previous frames fit the fundamental, 0 if stopped by the budget,
+ * -1 if the last frames are not stable or a recomputed frame still does not fit
  */
-static int ReAnalyzeFrame(int iCurrentFrame, SMS_AnalParams *pAnalParams)
+static int ReAnalyzeFrame(int iCurrentFrame, SMS_AnalParams *pAnalParams, sfloat *pWindow,
+                          sfloat *pMag, sfloat *pPhase, sfloat *pFftBuffer)
 {
+    SMS_ReAnalysisStats *pStats = &pAnalParams->reAnalysisStats;
+    SMS_AnalFrame *pFrame;
     sfloat fFund, fLastFund, fDev;
-    int iNewFrameSize, i;
+    int iNewFrameSize, iFrame, iStatus = 1, nFrames = 0, iResume = -1;
+    double fStart = 0, fSeconds;
     sfloat fAvgDeviation = sms_fundDeviation(pAnalParams, iCurrentFrame);
     int iFirstFrame = iCurrentFrame - pAnalParams->minGoodFrames;
+    int iLastFrame = iFirstFrame - pAnalParams->analDelay + 1;
 
-    /*! \todo make this a < 0 check, but first make sure sms_fundDeviation does not
-        return values below zero */
-    if(fAvgDeviation == -1)
+    /* where the walk cut by the budget goes on, if that frame is still in reach */
+    if(pAnalParams->iReAnalysisFrame > 0)
+    {
+        iResume = iFirstFrame - (pAnalParams->ppFrames[iFirstFrame]->iFrameNum -
+                                 pAnalParams->iReAnalysisFrame);
+        if(iResume < iLastFrame || iResume >= iFirstFrame ||
+           pAnalParams->ppFrames[iResume]->iFrameNum != pAnalParams->iReAnalysisFrame)
+        {
+            pStats->nDropped++;
+            pAnalParams->iReAnalysisFrame = 0;
+            iResume = -1;
+        }
+    }
+
+    /* sms_fundDeviation returns -1 when there are not enough frames with a fundamental */
+    if(fAvgDeviation < 0 || fAvgDeviation > pAnalParams->maxDeviation)
         return -1;
 
-    /* if the last SMS_MIN_GOOD_FRAMES are stable look before them
-     *  and recompute the frames that are not stable */
-    if(fAvgDeviation <= pAnalParams->maxDeviation)
+    /* the last frames are stable, look before them and recompute
+     * the frames that are not */
+    for(iFrame = iFirstFrame; iFrame >= iLastFrame; iFrame--)
     {
-        for(i = 0; i < pAnalParams->analDelay; i++)
+        pFrame = pAnalParams->ppFrames[iFrame];
+        if(pFrame->iFrameNum <= 0)
+            break;
+        if(pFrame->iStatus == SMS_FRAME_RECOMPUTED)
         {
-            if(pAnalParams->ppFrames[iFirstFrame - i]->iFrameNum <= 0 ||
-               pAnalParams->ppFrames[iFirstFrame - i]->iStatus == SMS_FRAME_RECOMPUTED)
-                return -1;
-            fFund = pAnalParams->ppFrames[iFirstFrame - i]->fFundamental;
-            fLastFund = pAnalParams->ppFrames[iFirstFrame - i + 1]->fFundamental;
-            fDev = fabs (fFund - fLastFund) / fLastFund;
-            iNewFrameSize = ((pAnalParams->iSamplingRate / fLastFund) *
-                            pAnalParams->fSizeWindow/2) * 2 + 1;
-
-            if(fFund <= 0 || fDev > .2 ||
-               fabs((pAnalParams->ppFrames[iFirstFrame - i]->iFrameSize -
-                     iNewFrameSize)) / iNewFrameSize >= .2)
+            /* the frames up to the cut were recomputed by an earlier call */
+            if(iResume < 0 || iResume >= iFrame)
+                break;
+            iFrame = iResume;
+            iResume = -1;
+            pAnalParams->iReAnalysisFrame = 0;
+            pFrame = pAnalParams->ppFrames[iFrame];
+        }
+        fFund = pFrame->fFundamental;
+        fLastFund = pAnalParams->ppFrames[iFrame + 1]->fFundamental;
+        fDev = fabs (fFund - fLastFund) / fLastFund;
+        iNewFrameSize = ((pAnalParams->iSamplingRate / fLastFund) *
+                        pAnalParams->fSizeWindow/2) * 2 + 1;
+        iNewFrameSize = MIN(iNewFrameSize, pAnalParams->iMaxSizeWindow);
+
+        if(fFund <= 0 || fDev > .2 ||
+           fabs((pFrame->iFrameSize - iNewFrameSize)) / iNewFrameSize >= .2)
+        {
+            /* out of budget, the next call goes on from this frame */
+            if((pAnalParams->iMaxReAnalysis >= 0 && nFrames >= pAnalParams->iMaxReAnalysis) ||
+               (pAnalParams->fMaxReAnalysisTime > 0 && nFrames > 0 &&
+                Seconds() - fStart >= pAnalParams->fMaxReAnalysisTime))
             {
-                pAnalParams->ppFrames[iFirstFrame - i]->iFrameSize = iNewFrameSize;
-                pAnalParams->ppFrames[iFirstFrame - i]->iStatus = SMS_FRAME_READY;
+                pAnalParams->iReAnalysisFrame = pFrame->iFrameNum;
+                iStatus = 0;
+                break;
+            }
+            if(nFrames++ == 0)
+                fStart = Seconds();
+
+            pFrame->iFrameSize = iNewFrameSize;
+            pFrame->iStatus = SMS_FRAME_READY;
 
-                /* recompute frame */
-                sms_analyzeFrame(iFirstFrame - i, pAnalParams, fLastFund);
-                pAnalParams->ppFrames[iFirstFrame - i]->iStatus = SMS_FRAME_RECOMPUTED;
+            /* recompute frame */
+            AnalyzeFrame(iFrame, pAnalParams, fLastFund, pWindow, pMag, pPhase, pFftBuffer);
+            pFrame->iStatus = SMS_FRAME_RECOMPUTED;
 
-                if(fabs(pAnalParams->ppFrames[iFirstFrame - i]->fFundamental - fLastFund) /
-                        fLastFund >= .2)
-                    return -1;
+            if(fabs(pFrame->fFundamental - fLastFund) / fLastFund >= .2)
+            {
+                iStatus = -1;
+                break;
             }
         }
     }
-    return 1;
+
+    if(nFrames > 0)
+    {
+        fSeconds = Seconds() - fStart;
+        pStats->nRuns++;
+        pStats->nFrames += nFrames;
+        pStats->fSeconds += fSeconds;
+        pStats->fMaxSeconds = MAX(pStats->fMaxSeconds, fSeconds);
+    }
+    return iStatus;
+}
+
+/* count the outcome of a call of ReAnalyzeFrame */
+static void CountReAnalysis(SMS_ReAnalysisStats *pStats, int iStatus)
+{
+    pStats->nChecks++;
+    if(iStatus > 0)
+        pStats->nGood++;
+    else if(iStatus == 0)
+        pStats->nCut++;
+    else
+        pStats->nFailed++;
+}
+
+static void ReAnalysisTask(void *pArg)
+{
+    ReAnalysisWork *pWork = (ReAnalysisWork *)pArg;
+
+    CountReAnalysis(&pWork->pAnalParams->reAnalysisStats,
+                    ReAnalyzeFrame(pWork->iCurrentFrame, pWork->pAnalParams, pWork->pWindow,
+                                   pWork->pMag, pWork->pPhase, pWork->pFftBuffer));
+    pthread_mutex_lock(&pWork->lock);
+    pWork->isPending = 0;
+    pthread_cond_broadcast(&pWork->doneCond);
+    pthread_mutex_unlock(&pWork->lock);
+}
+
+/*! \brief prepare the re-analysis of the previous frames of an analysis
+ *
+ * Clears SMS_AnalParams::reAnalysisStats and, when
+ * SMS_AnalParams::pReAnalysisPool is set, allocates what the re-analysis
+ * needs to run on it. Called by sms_initAnalysis(), after the spectrum
+ * buffers are sized.
+ *
+ * \param pAnalParams analysis parameters
+ * \return 0 on success, -1 on error
+ */
+int sms_initReAnalysis(SMS_AnalParams *pAnalParams)
+{
+    ReAnalysisWork *pWork;
+
+    memset(&pAnalParams->reAnalysisStats, 0, sizeof(SMS_ReAnalysisStats));
+    pAnalParams->iReAnalysisFrame = 0;
+    if(pAnalParams->pReAnalysisPool == NULL || pAnalParams->pReAnalysisWork != NULL)
+        return 0;
+
+    if((pWork = (ReAnalysisWork *)calloc(1, sizeof(ReAnalysisWork))) == NULL)
+    {
+        sms_error("could not allocate memory for the re-analysis");
+        return -1;
+    }
+    pWork->pAnalParams = pAnalParams;
+    pWork->pWindow = (sfloat *)calloc(pAnalParams->iMaxSizeWindow, sizeof(sfloat));
+    pWork->pMag = (sfloat *)calloc(pAnalParams->sizeSpectrum, sizeof(sfloat));
+    pWork->pPhase = (sfloat *)calloc(pAnalParams->sizeSpectrum, sizeof(sfloat));
+    pWork->pFftBuffer = (sfloat *)calloc(2 * pAnalParams->sizeSpectrum, sizeof(sfloat));
+    if(!pWork->pWindow || !pWork->pMag || !pWork->pPhase || !pWork->pFftBuffer)
+    {
+        free(pWork->pWindow);
+        free(pWork->pMag);
+        free(pWork->pPhase);
+        free(pWork->pFftBuffer);
+        free(pWork);
+        sms_error("could not allocate memory for the re-analysis");
+        return -1;
+    }
+    pthread_mutex_init(&pWork->lock, NULL);
+    pthread_cond_init(&pWork->doneCond, NULL);
+    pAnalParams->pReAnalysisWork = pWork;
+    return 0;
+}
+
+/*! \brief wait until the previous frames are re-analyzed
+ *
+ * When the re-analysis runs on SMS_AnalParams::pReAnalysisPool, it may go
+ * on after sms_analyze() returns. sms_analyze(), sms_getSoundBufferSpace()
+ * and sms_freeAnalysis() wait for it, anything else that reads the frames
+ * or changes the analysis between two calls of sms_analyze() has to call
+ * this first.
+ *
+ * \param pAnalParams analysis parameters
+ */
+void sms_waitReAnalysis(SMS_AnalParams *pAnalParams)
+{
+    ReAnalysisWork *pWork = (ReAnalysisWork *)pAnalParams->pReAnalysisWork;
+
+    if(pWork == NULL)
+        return;
+    pthread_mutex_lock(&pWork->lock);
+    while(pWork->isPending)
+        pthread_cond_wait(&pWork->doneCond, &pWork->lock);
+    pthread_mutex_unlock(&pWork->lock);
+}
+
+/*! \brief free what sms_initReAnalysis allocated, once the re-analysis is done
+ *
+ * \param pAnalParams analysis parameters
+ */
+void sms_freeReAnalysis(SMS_AnalParams *pAnalParams)
+{
+    ReAnalysisWork *pWork = (ReAnalysisWork *)pAnalParams->pReAnalysisWork;
+
+    if(pWork == NULL)
+        return;
+    sms_waitReAnalysis(pAnalParams);
+    pthread_mutex_destroy(&pWork->lock);
+    pthread_cond_destroy(&pWork->doneCond);
+    free(pWork->pWindow);
+    free(pWork->pMag);
+    free(pWork->pPhase);
+    free(pWork->pFftBuffer);
+    free(pWork);
+    pAnalParams->pReAnalysisWork = NULL;
 }
 
 /*! \brief main function to perform the SMS analysis on a single frame
@@ -140,8 +467,13 @@ int sms_analyze(int sizeWaveform, const sfloat *pWaveform, SMS_Data *pSmsData, S
     int iCurrentFrame = pAnalParams->iMaxDelayFrames - 1;  /* frame # of current frame */
     int delayFrames = pAnalParams->minGoodFrames + pAnalParams->analDelay;
     int i, iExtraSamples;         /* samples used for next analysis frame */
+    int isDeferred;               /* whether the previous frames are re-analyzed on the pool */
     sfloat fRefFundamental = 0;   /* reference fundamental for current frame */
     SMS_AnalFrame *pTmpAnalFrame;
+    ReAnalysisWork *pReAnalysisWork = (ReAnalysisWork *)pAnalParams->pReAnalysisWork;
+
+    /* the previous frames may still be re-analyzed from the last call */
+    sms_waitReAnalysis(pAnalParams);
 
     /* set the frame delay, checking that it does not exceed the given maximum
      *
@@ -175,7 +507,7 @@ int sms_analyze(int sizeWaveform, const sfloat *pWaveform, SMS_Data *pSmsData, S
     sms_initFrame(iCurrentFrame, pAnalParams, pAnalParams->sizeWindow);
     if(sms_errorCheck())
     {
-        printf("error in init frame: %s \n", sms_errorString());
+        printf("error in init frame: %s \n", sms_errorMessage());
         return -1;
     }
 
@@ -208,10 +540,31 @@ int sms_analyze(int sizeWaveform, const sfloat *pWaveform, SMS_Data *pSmsData, S
 
         pAnalParams->sizeNextRead = MAX(0, (pAnalParams->sizeWindow+1)/2 - iExtraSamples);
 
-        /* check again the previous frames and recompute if necessary */
-        /*! \todo when deviation is really off, this function returns -1, yet it
-          isn't used.. is it being recomputed ?? */
-        ReAnalyzeFrame(iCurrentFrame, pAnalParams);
+        /* check again the previous frames and recompute if necessary, on the
+         * re-analysis pool when the rest of this call only uses older frames
+         * (and the peaks of the frames are not changed between calls) */
+        isDeferred = 0;
+        if(pReAnalysisWork && pAnalParams->pReAnalysisPool && pAnalParams->pFramePeaks == NULL &&
+           delayFrames == pAnalParams->minGoodFrames + pAnalParams->analDelay &&
+           iCurrentFrame - delayFrames >= 1)
+        {
+            pReAnalysisWork->iCurrentFrame = iCurrentFrame;
+            pReAnalysisWork->isPending = 1;
+            if(sms_threadPoolSubmit(pAnalParams->pReAnalysisPool, ReAnalysisTask, pReAnalysisWork) == 0)
+            {
+                pAnalParams->reAnalysisStats.nDeferred++;
+                isDeferred = 1;
+            }
+            else
+                pReAnalysisWork->isPending = 0;
+        }
+        /* the outcome only goes to the counters: a frame that still does not
+         * fit is tracked as it is, and a cut is taken up by the next call */
+        if(!isDeferred)
+            CountReAnalysis(&pAnalParams->reAnalysisStats,
+                            ReAnalyzeFrame(iCurrentFrame, pAnalParams, pAnalParams->spectrumWindow,
+                                           pAnalParams->magSpectrum, pAnalParams->phaseSpectrum,
+                                           pAnalParams->fftBuffer));
     }
 
     /* incorporate the peaks into the corresponding tracks */
@@ -253,8 +606,7 @@ int sms_analyze(int sizeWaveform, const sfloat *pWaveform, SMS_Data *pSmsData, S
            pAnalParams->ppFrames[0]->iStatus != SMS_FRAME_END)
         {
             int iSoundLoc = pAnalParams->ppFrames[0]->iFrameSample - pAnalParams->sizeHop;
-            sfloat *pOriginal = &(pAnalParams->soundBuffer.pFBuffer[iSoundLoc -
-                                  pAnalParams->soundBuffer.iMarker]);
+            sfloat *pOriginal = sms_soundBufferPointer(&pAnalParams->soundBuffer, iSoundLoc);
 
             int sizeData = MIN(pAnalParams->soundBuffer.sizeBuffer -
                                (iSoundLoc - pAnalParams->soundBuffer.iMarker),
@@ -276,12 +628,13 @@ int sms_analyze(int sizeWaveform, const sfloat *pWaveform, SMS_Data *pSmsData, S
                                                             pAnalParams->synthBuffer.pFBuffer,
                                                             pOriginal,
                                                             pAnalParams->residual,
-                                                            pAnalParams->residualWindow);
+                                                            pAnalParams->residualWindow,
+                                                            pAnalParams);
 
             if(pAnalParams->iStochasticType == SMS_STOC_APPROX)
             {
                 /* filter residual with a high pass filter (it solves some problems) */
-                sms_filterHighPass(sizeData, pAnalParams->residual, pAnalParams->iSamplingRate);
+                sms_filterHighPass(sizeData, pAnalParams->residual, pAnalParams);
 
                 /* approximate residual */
                 sms_stocAnalysis(sizeData, pAnalParams->residual, pAnalParams->residualWindow,
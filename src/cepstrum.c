@@ -45,8 +45,21 @@ typedef struct
         gsl_permutation *pPerm;
 } CepstrumMatrices;
 
+/* work buffers of one SMS_SEnvParams (pointed to by pWork) */
+typedef struct
+{
+        CepstrumMatrices m;
+        int sizeBuff;          /* size of pFreqBuff and pMagBuff */
+        sfloat *pFreqBuff;
+        sfloat *pMagBuff;
+        int sizeFft;           /* size of pFftBuffer */
+        sfloat *pFftBuffer;
+} SEnvWork;
+
 void FreeDCepstrum(CepstrumMatrices *m)
 {
+        if(m->nPoints == 0 && m->nCoeff == 0)
+                return;
         gsl_matrix_free(m->pM);
         gsl_matrix_free(m->pMt);
         gsl_matrix_free(m->pR);
@@ -55,13 +68,13 @@ void FreeDCepstrum(CepstrumMatrices *m)
         gsl_vector_free(m->pMtXk);
         gsl_vector_free(m->pC);
         gsl_permutation_free (m->pPerm);
-
+        m->nPoints = 0;
+        m->nCoeff = 0;
 }
 
 void AllocateDCepstrum(int nPoints, int nCoeff, CepstrumMatrices *m)
 {
-        if(m->nPoints != 0 || m->nCoeff != 0)
-                FreeDCepstrum(m);
+        FreeDCepstrum(m);
         m->nPoints = nPoints;
         m->nCoeff = nCoeff;
         m->pM = gsl_matrix_alloc(nPoints, nCoeff);
@@ -74,83 +87,158 @@ void AllocateDCepstrum(int nPoints, int nCoeff, CepstrumMatrices *m)
         m->pPerm = gsl_permutation_alloc (nCoeff);
 }
 
-/*! \brief Discrete Cepstrum Transform
- *
- * method for computing cepstrum aenalysis from a discrete
- * set of partial peaks (frequency and amplitude)
- *
- * This implementation is owed to the help of Jordi Janer (thanks!) from the MTG,
- * along with the following paper:
- * "Regularization Techniques for Discrete Cepstrum Estimation"
- * Olivier Cappe and Eric Moulines, IEEE Signal Processing Letters, Vol. 3
- * No.4, April 1996
- *
- * \todo add anchor point add at frequency = 0 with the same magnitude as the first
- * peak in pMag.  This does not change the size of the cepstrum, only helps to smoothen it
- * at the very beginning.
- *
- * \param sizeCepstrum order+1 of the discrete cepstrum
- * \param pCepstrum pointer to output array of cepstrum coefficients
- * \param sizeFreq number of partials peaks (the size of pFreq should be the same as pMag
- * \param pFreq pointer to partial peak frequencies (hertz)
- * \param pMag pointer to partial peak magnitudes (linear)
- * \param fLambda regularization factor
- * \param iMaxFreq maximum frequency of cepstrum
- */
-void sms_dCepstrum( int sizeCepstrum, sfloat *pCepstrum, int sizeFreq, const sfloat *pFreq, const sfloat *pMag,
-                    sfloat fLambda, int iMaxFreq)
+/* discrete cepstrum using the given matrices, which are (re)allocated only
+ * if they are too small.  Only the first sizeFreq rows of M are used. */
+static void DCepstrum(CepstrumMatrices *m, int sizeCepstrum, sfloat *pCepstrum, int sizeFreq,
+                      const sfloat *pFreq, const sfloat *pMag, sfloat fLambda, int iMaxFreq)
 {
         int i, k;
         sfloat factor;
         sfloat fNorm = PI  / (float)iMaxFreq; /* value to normalize frequencies to 0:0.5 */
-        //static sizeCepstrumStatic
-        static CepstrumMatrices m;
-        //printf("nPoints: %d, nCoeff: %d \n", m.nPoints, m.nCoeff);
-        if(m.nPoints != sizeCepstrum || m.nCoeff != sizeFreq)
-                AllocateDCepstrum(sizeFreq, sizeCepstrum, &m);
         int s; /* signum: "(-1)^n, where n is the number of interchanges in the permutation." */
+        gsl_matrix_view M, Mt;
+        gsl_vector_view Xk;
+
+        if(m->nPoints < sizeFreq || m->nCoeff != sizeCepstrum)
+                AllocateDCepstrum(sizeFreq, sizeCepstrum, m);
+        M = gsl_matrix_submatrix(m->pM, 0, 0, sizeFreq, sizeCepstrum);
+        Mt = gsl_matrix_submatrix(m->pMt, 0, 0, sizeCepstrum, sizeFreq);
+        Xk = gsl_vector_subvector(m->pXk, 0, sizeFreq);
+
         /* compute matrix M (eq. 4)*/
 	for (i=0; i<sizeFreq; i++)
 	{
-                gsl_matrix_set (m.pM, i, 0, 1.); // first colum is all 1
+                gsl_matrix_set (&M.matrix, i, 0, 1.); // first colum is all 1
 		for (k=1; k <sizeCepstrum; k++)
-                        gsl_matrix_set (m.pM, i, k , 2.*sms_sine(PI_2 + fNorm * k * pFreq[i]) );
-                        /*gsl_matrix_set (m.pM, i, k , 2.*cos((2.0*PI) + fNorm * k * pFreq[i]) );*/
+                        gsl_matrix_set (&M.matrix, i, k , 2.*sms_sine(PI_2 + fNorm * k * pFreq[i]) );
+                        /*gsl_matrix_set (&M.matrix, i, k , 2.*cos((2.0*PI) + fNorm * k * pFreq[i]) );*/
 	}
 
         /* compute transpose of M */
-        gsl_matrix_transpose_memcpy (m.pMt, m.pM);
+        gsl_matrix_transpose_memcpy (&Mt.matrix, &M.matrix);
 
         /* compute R diagonal matrix (for eq. 7)*/
         factor = COEF * (fLambda / (1.-fLambda)); /* \todo why is this divided like this again? */
 	for (k=0; k<sizeCepstrum; k++)
-                gsl_matrix_set(m.pR, k, k, factor * powf((sfloat) k,2.));
+                gsl_matrix_set(m->pR, k, k, factor * powf((sfloat) k,2.));
 
         /* MtM = Mt * M, later will add R */
-        gsl_blas_dgemm  (CblasNoTrans, CblasNoTrans, 1., m.pMt, m.pM, 0.0, m.pMtMR);
+        gsl_blas_dgemm  (CblasNoTrans, CblasNoTrans, 1., &Mt.matrix, &M.matrix, 0.0, m->pMtMR);
         /* add R to make MtMR */
-        gsl_matrix_add (m.pMtMR, m.pR);
+        gsl_matrix_add (m->pMtMR, m->pR);
 
         /* set pMag in X and multiply with Mt to get pMtXk */
         for(k = 0; k <sizeFreq; k++)
-                gsl_vector_set(m.pXk, k, log(pMag[k]));
-        gsl_blas_dgemv (CblasNoTrans, 1., m.pMt, m.pXk, 0., m.pMtXk);
+                gsl_vector_set(&Xk.vector, k, log(pMag[k]));
+        gsl_blas_dgemv (CblasNoTrans, 1., &Mt.matrix, &Xk.vector, 0., m->pMtXk);
 
         /* solve x (the cepstrum) in Ax = b, where A=MtMR and b=pMtXk */
 
         /* ==== the Cholesky Decomposition way ==== */
         /* MtM is 'symmetric and positive definite?' */
-        //gsl_linalg_cholesky_decomp (m.pMtMR);
-        //gsl_linalg_cholesky_solve (m.pMtMR, m.pMtXk, m.pC);
+        //gsl_linalg_cholesky_decomp (m->pMtMR);
+        //gsl_linalg_cholesky_solve (m->pMtMR, m->pMtXk, m->pC);
 
         /* ==== the LU decomposition way ==== */
-        gsl_linalg_LU_decomp (m.pMtMR, m.pPerm, &s);
-        gsl_linalg_LU_solve (m.pMtMR, m.pPerm, m.pMtXk, m.pC);
+        gsl_linalg_LU_decomp (m->pMtMR, m->pPerm, &s);
+        gsl_linalg_LU_solve (m->pMtMR, m->pPerm, m->pMtXk, m->pC);
 
 
         /* copy pC to pCepstrum */
         for(i = 0; i  < sizeCepstrum; i++)
-                pCepstrum[i] = gsl_vector_get (m.pC, i);
+                pCepstrum[i] = gsl_vector_get (m->pC, i);
+}
+
+/* spectrum envelope from cepstrum, using pFftBuffer (sizeFft, a power of 2) as work area */
+static void DCepstrumEnvelope(int sizeCepstrum, const sfloat *pCepstrum, int sizeEnv, sfloat *pEnv,
+                              int sizeFft, sfloat *pFftBuffer)
+{
+        int i;
+
+        memset(pFftBuffer, 0, sizeFft * sizeof(sfloat));
+
+        pFftBuffer[0] = pCepstrum[0] * 0.5;
+        for (i = 1; i < sizeCepstrum-1; i++)
+                pFftBuffer[i] = pCepstrum[i];
+
+        sms_fft(sizeFft, pFftBuffer);
+
+        for (i = 0; i < sizeEnv; i++)
+                pEnv[i] = powf(EXP, 2. * pFftBuffer[i*2]);
+}
+
+/* make sure the work buffers can hold nPoints peaks and an FFT of sizeFft */
+static int GrowSEnvWork(SEnvWork *pWork, int nPoints, int sizeFft)
+{
+        if(nPoints > pWork->sizeBuff)
+        {
+                sfloat *pFreq = (sfloat *) realloc(pWork->pFreqBuff, nPoints * sizeof(sfloat));
+                sfloat *pMag;
+                if(pFreq == NULL)
+                        return -1;
+                pWork->pFreqBuff = pFreq;
+                if((pMag = (sfloat *) realloc(pWork->pMagBuff, nPoints * sizeof(sfloat))) == NULL)
+                        return -1;
+                pWork->pMagBuff = pMag;
+                pWork->sizeBuff = nPoints;
+        }
+        if(sizeFft > pWork->sizeFft)
+        {
+                sfloat *pFft = (sfloat *) realloc(pWork->pFftBuffer, sizeFft * sizeof(sfloat));
+                if(pFft == NULL)
+                        return -1;
+                pWork->pFftBuffer = pFft;
+                pWork->sizeFft = sizeFft;
+        }
+        return 0;
+}
+
+static void FreeSEnvWork(SEnvWork *pWork)
+{
+        FreeDCepstrum(&pWork->m);
+        if(pWork->pFreqBuff)
+                free(pWork->pFreqBuff);
+        if(pWork->pMagBuff)
+                free(pWork->pMagBuff);
+        if(pWork->pFftBuffer)
+                free(pWork->pFftBuffer);
+        memset(pWork, 0, sizeof(SEnvWork));
+}
+
+/*! \brief Discrete Cepstrum Transform
+ *
+ * method for computing cepstrum aenalysis from a discrete
+ * set of partial peaks (frequency and amplitude)
+ *
+ * This implementation is owed to the help of Jordi Janer (thanks!) from the MTG,
+ * along with the following paper:
+ * "Regularization Techniques for Discrete Cepstrum Estimation"
+ * Olivier Cappe and Eric Moulines, IEEE Signal Processing Letters, Vol. 3
+ * No.4, April 1996
+ *
+ * The matrices are allocated for each call, sms_spectralEnvelope() keeps
+ * them in the SMS_SEnvParams instead.
+ *
+ * \todo add anchor point add at frequency = 0 with the same magnitude as the first
+ * peak in pMag.  This does not change the size of the cepstrum, only helps to smoothen it
+ * at the very beginning.
+ *
+ * \param sizeCepstrum order+1 of the discrete cepstrum
+ * \param pCepstrum pointer to output array of cepstrum coefficients
+ * \param sizeFreq number of partials peaks (the size of pFreq should be the same as pMag
+ * \param pFreq pointer to partial peak frequencies (hertz)
+ * \param pMag pointer to partial peak magnitudes (linear)
+ * \param fLambda regularization factor
+ * \param iMaxFreq maximum frequency of cepstrum
+ */
+void sms_dCepstrum( int sizeCepstrum, sfloat *pCepstrum, int sizeFreq, const sfloat *pFreq, const sfloat *pMag,
+                    sfloat fLambda, int iMaxFreq)
+{
+        CepstrumMatrices m;
+
+        memset(&m, 0, sizeof(m));
+        DCepstrum(&m, sizeCepstrum, pCepstrum, sizeFreq, pFreq, pMag, fLambda, iMaxFreq);
+        FreeDCepstrum(&m);
 }
 
 /*! \brief Spectrum Envelope from Cepstrum
@@ -164,35 +252,66 @@ void sms_dCepstrum( int sizeCepstrum, sfloat *pCepstrum, int sizeFreq, const sfl
  */
 void sms_dCepstrumEnvelope(int sizeCepstrum, const sfloat *pCepstrum, int sizeEnv, sfloat *pEnv)
 {
+        int sizeFft = sms_power2(sizeEnv << 1);
+        sfloat *pFftBuffer;
 
-        static sfloat *pFftBuffer;
-        static int sizeFftArray = 0;
-        int sizeFft = sizeEnv << 1;
-        int i;
-        if(sizeFftArray != sizeFft)
+        if(sizeFft != sizeEnv << 1)
         {
-                if(sizeFftArray != 0) free(pFftBuffer);
-                sizeFftArray = sms_power2(sizeFft);
-                if(sizeFftArray != sizeFft)
-                {
-                        sms_error("bad fft size, incremented to power of 2");
-                }
-                if ((pFftBuffer = (sfloat *) malloc(sizeFftArray * sizeof(float))) == NULL)
-                {
-                        sms_error("could not allocate memory for fft array");
-                        return;
-                }
+                sms_error("bad fft size, incremented to power of 2");
         }
-        memset(pFftBuffer, 0, sizeFftArray * sizeof(sfloat));
+        if ((pFftBuffer = (sfloat *) malloc(sizeFft * sizeof(sfloat))) == NULL)
+        {
+                sms_error("could not allocate memory for fft array");
+                return;
+        }
+        DCepstrumEnvelope(sizeCepstrum, pCepstrum, sizeEnv, pEnv, sizeFft, pFftBuffer);
+        free(pFftBuffer);
+}
 
-        pFftBuffer[0] = pCepstrum[0] * 0.5;
-        for (i = 1; i < sizeCepstrum-1; i++)
-                pFftBuffer[i] = pCepstrum[i];
+/*! \brief allocate the work buffers for spectral enveloping
+ *
+ * sms_initAnalysis() calls this for its own SMS_SEnvParams. The buffers
+ * belong to pSpecEnvParams, so that several analyses can compute envelopes
+ * at the same time.
+ *
+ * \param pSpecEnvParams pointer to a structure of parameters for spectral enveloping
+ * \param nTracks number of sinusoidal tracks of the frames that will be enveloped
+ * \return 0 on success, -1 on error
+ */
+int sms_initSpectralEnvelope(SMS_SEnvParams *pSpecEnvParams, int nTracks)
+{
+        SEnvWork *pWork = (SEnvWork *) pSpecEnvParams->pWork;
 
-        sms_fft(sizeFftArray, pFftBuffer);
+        if(pWork == NULL)
+        {
+                if((pWork = (SEnvWork *) calloc(1, sizeof(SEnvWork))) == NULL)
+                {
+                        sms_error("could not allocate memory for spectral envelope");
+                        return -1;
+                }
+                pSpecEnvParams->pWork = pWork;
+        }
+        /* one more point for the anchor */
+        if(GrowSEnvWork(pWork, nTracks + 1, sms_power2(pSpecEnvParams->nCoeff << 1)) < 0)
+        {
+                sms_error("could not allocate memory for spectral envelope");
+                return -1;
+        }
+        return 0;
+}
 
-        for (i = 0; i < sizeEnv; i++)
-                pEnv[i] = powf(EXP, 2. * pFftBuffer[i*2]);
+/*! \brief free the work buffers allocated by sms_initSpectralEnvelope
+ *
+ * \param pSpecEnvParams pointer to a structure of parameters for spectral enveloping
+ */
+void sms_freeSpectralEnvelope(SMS_SEnvParams *pSpecEnvParams)
+{
+        if(pSpecEnvParams->pWork)
+        {
+                FreeSEnvWork((SEnvWork *) pSpecEnvParams->pWork);
+                free(pSpecEnvParams->pWork);
+                pSpecEnvParams->pWork = NULL;
+        }
 }
 
 /*! \brief main function for computing spectral envelope from sinusoidal peaks
@@ -201,6 +320,9 @@ void sms_dCepstrumEnvelope(int sizeCepstrum, const sfloat *pCepstrum, int sizeEn
  * If pSmsData->iEnvelope == SMS_ENV_CEP, will return cepstrum coefficeints
  * If pSmsData->iEnvelope == SMS_ENV_FBINS, will return linear magnitude spectrum
  *
+ * The work buffers set up by sms_initSpectralEnvelope() are used if present,
+ * otherwise temporary ones are allocated for this call.
+ *
  * \param pSmsData pointer to SMS_Data structure with all the arrays necessary
  * \param pSpecEnvParams pointer to a structure of parameters for spectral enveloping
  */
@@ -208,8 +330,10 @@ void sms_spectralEnvelope( SMS_Data *pSmsData, const SMS_SEnvParams *pSpecEnvPar
 {
         int i, k;
         int sizeCepstrum = pSpecEnvParams->iOrder+1;
+        int sizeFft = sms_power2(pSpecEnvParams->nCoeff << 1);
+        SEnvWork tmpWork;
+        SEnvWork *pWork = (SEnvWork *) pSpecEnvParams->pWork;
         //int nPeaks = 0;
-        static sfloat pFreqBuff[1000], pMagBuff[1000];
 
         /* \todo see if this memset is even necessary, once working */
         //memset(pSmsData->pSpecEnv, 0, pSpecEnvParams->nCoeff * sizeof(sfloat));
@@ -222,6 +346,19 @@ void sms_spectralEnvelope( SMS_Data *pSmsData, const SMS_SEnvParams *pSpecEnvPar
                 return;
         }
 
+        if(pWork == NULL)
+        {
+                memset(&tmpWork, 0, sizeof(tmpWork));
+                pWork = &tmpWork;
+        }
+        if(GrowSEnvWork(pWork, pSmsData->nTracks + 1, sizeFft) < 0)
+        {
+                sms_error("could not allocate memory for spectral envelope");
+                if(pWork == &tmpWork)
+                        FreeSEnvWork(&tmpWork);
+                return;
+        }
+
         /* find out how many tracks were actually found... many are zero
            \todo is this necessary? */
         for(i = 0, k=0; i < pSmsData->nTracks; i++)
@@ -233,27 +370,31 @@ void sms_spectralEnvelope( SMS_Data *pSmsData, const SMS_SEnvParams *pSpecEnvPar
                                 if(k == 0) /* add anchor at beginning */
 
                                 {
-                                        pFreqBuff[k] = 0.0;
-                                        pMagBuff[k] = pSmsData->pFSinAmp[i];
+                                        pWork->pFreqBuff[k] = 0.0;
+                                        pWork->pMagBuff[k] = pSmsData->pFSinAmp[i];
                                         k++;
                                 }
                         }
-                        pFreqBuff[k] = pSmsData->pFSinFreq[i];
-                        pMagBuff[k] = pSmsData->pFSinAmp[i];
+                        pWork->pFreqBuff[k] = pSmsData->pFSinFreq[i];
+                        pWork->pMagBuff[k] = pSmsData->pFSinAmp[i];
                         k++;
                 }
         }
         /* \todo see if adding an anchor at the max freq helps */
 
 
-        if(k < 1) // how few can this be?  try out a few in python
-                return;
-        sms_dCepstrum(sizeCepstrum, pSmsData->pSpecEnv, k, pFreqBuff, pMagBuff,
-                      pSpecEnvParams->fLambda, pSpecEnvParams->iMaxFreq);
-
-        if(pSpecEnvParams->iType == SMS_ENV_FBINS)
+        if(k >= 1) // how few can this be?  try out a few in python
         {
-                sms_dCepstrumEnvelope(sizeCepstrum, pSmsData->pSpecEnv,
-                                      pSpecEnvParams->nCoeff, pSmsData->pSpecEnv);
+                DCepstrum(&pWork->m, sizeCepstrum, pSmsData->pSpecEnv, k, pWork->pFreqBuff,
+                          pWork->pMagBuff, pSpecEnvParams->fLambda, pSpecEnvParams->iMaxFreq);
+
+                if(pSpecEnvParams->iType == SMS_ENV_FBINS)
+                {
+                        DCepstrumEnvelope(sizeCepstrum, pSmsData->pSpecEnv, pSpecEnvParams->nCoeff,
+                                          pSmsData->pSpecEnv, sizeFft, pWork->pFftBuffer);
+                }
         }
+
+        if(pWork == &tmpWork)
+                FreeSEnvWork(&tmpWork);
 }
@@ -23,6 +23,17 @@
  */
 
 #include "sms.h"
+#include <limits.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 /*! \brief file identification constant
  *
@@ -31,7 +42,627 @@
  */
 #define SMS_MAGIC 767
 
-static char pChTextString[1000]; /*!< string to store analysis parameters in sms header */
+/* Files of version 2 and later read the same on every machine. All their
+ * numbers are little-endian and they are made of:
+ *  - the header fields, 32 bits each except for the 64-bit offset of the
+ *    frame index (see EncodeHeader). The fields store their own size, so
+ *    later versions can add fields that older readers skip.
+ *  - the text of the header, padded with zeros to a multiple of 8 bytes.
+ *    iHeadBSize is the offset of the first frame.
+ *  - the frames, with their values in the order of SMS_Data::pSmsData and
+ *    iSampleBytes bytes each. With SMS_ENC_TRACKCOUNT each frame starts
+ *    with its number of tracks (32 bits and 32 zero bits) and only has the
+ *    values of these tracks. With SMS_ENC_SPARSE each frame starts with the
+ *    number of active tracks in the same way, has only their values, and
+ *    ends with their track numbers (32 bits each). With SMS_ENC_QUANTIZED
+ *    the frames are in blocks of SMS_QUANT_BLOCK_FRAMES frames, made of the
+ *    size in bytes of the bits of the block and its number of frames (32
+ *    bits each), then the bits of its frames (see EncodeQuantizedFrame).
+ *  - the frame index, the 64-bit offset of every frame in the file (of its
+ *    block with SMS_ENC_QUANTIZED).
+ * Files of version 1 are a copy of the SMS_Header structure of the machine
+ * that wrote them (SMS_HeaderV1), the text and the frames as in memory.
+ */
+#define SMS_HEADER_FIELDS_BSIZE 80
+#define SMS_IO_CHUNK 256 /* number of values converted at once when reading or writing */
+#define SMS_WRITE_BUFFER_BSIZE (1 << 20) /* size of the buffers of an SMS_FileWriter */
+#define SMS_WRITE_ALIGN 4096             /* alignment of the buffers of an SMS_FileWriter */
+
+#define SMS_QUANT_BLOCK_FRAMES 32  /* frames per block of the quantized encoding */
+#define SMS_QUANT_FREQ_STEPS 2400. /* frequency steps per octave (half cents) */
+#define SMS_QUANT_FREQ_BITS 20     /* bits of a frequency that is not coded as a difference */
+#define SMS_QUANT_AMP_STEP .1      /* step in dB of the (linear) amplitudes */
+#define SMS_QUANT_AMP_BITS 16      /* bits of an amplitude that is not coded as a difference */
+#define SMS_QUANT_AMP_ZERO -32767  /* level of the amplitudes read back as 0, the levels above
+                                      it are in dB of full scale, from -3276.6 to 3276.7 dB */
+#define SMS_QUANT_PHASE_BITS 12
+#define SMS_QUANT_STOC_STEP .1     /* step in dB of the stochastic coefficients */
+#define SMS_QUANT_STOC_ZERO 1023   /* level of the stochastic coefficients read back as 0 */
+#define SMS_QUANT_INACTIVE 0x7fffffff /* quantized frequency of an inactive track */
+#define SMS_RICE_ESCAPE 24         /* longest unary part of a Rice code */
+#define SMS_RICE_MAX_BITS 56       /* longest Rice code */
+
+static const unsigned char pFileMagic[4] = {'S', 'M', 'S', 'F'};
+
+/* the header of version 1 files */
+typedef struct
+{
+    int iSmsMagic;
+    int iHeadBSize;
+    int nFrames;
+    int iFrameBSize;
+    int iSamplingRate;
+    int iFormat;
+    int nTracks;
+    int iFrameRate;
+    int iStochasticType;
+    int nStochasticCoeff;
+    int iEnvType;
+    int nEnvCoeff;
+    int iMaxFreq;
+    sfloat fResidualPerc;
+    int nTextCharacters;
+    char *pChTextCharacters;
+} SMS_HeaderV1;
+
+static SMS_THREAD_LOCAL char pChTextString[1000]; /*!< string to store analysis parameters in sms header */
+
+static int IsLittleEndian(void)
+{
+    const unsigned int one = 1;
+
+    return *(const unsigned char *)&one == 1;
+}
+
+static void PutU32(unsigned char *pBytes, unsigned int value)
+{
+    pBytes[0] = value & 0xff;
+    pBytes[1] = (value >> 8) & 0xff;
+    pBytes[2] = (value >> 16) & 0xff;
+    pBytes[3] = (value >> 24) & 0xff;
+}
+
+static unsigned int GetU32(const unsigned char *pBytes)
+{
+    return pBytes[0] | (pBytes[1] << 8) | (pBytes[2] << 16) | ((unsigned int)pBytes[3] << 24);
+}
+
+static void PutU64(unsigned char *pBytes, unsigned long long value)
+{
+    PutU32(pBytes, (unsigned int)(value & 0xffffffff));
+    PutU32(pBytes + 4, (unsigned int)(value >> 32));
+}
+
+static unsigned long long GetU64(const unsigned char *pBytes)
+{
+    return GetU32(pBytes) | ((unsigned long long)GetU32(pBytes + 4) << 32);
+}
+
+/* convert values to little-endian numbers of iSampleBytes (4 or 8) bytes */
+static void EncodeValues(unsigned char *pBytes, const sfloat *pValues, int nValues, int iSampleBytes)
+{
+    int i;
+
+    if(iSampleBytes == sizeof(sfloat) && IsLittleEndian())
+    {
+        memcpy(pBytes, pValues, nValues * sizeof(sfloat));
+        return;
+    }
+    for(i = 0; i < nValues; i++)
+    {
+        if(iSampleBytes == 4)
+        {
+            union { float f; unsigned int u; } value;
+            value.f = (float)pValues[i];
+            PutU32(pBytes + 4 * i, value.u);
+        }
+        else
+        {
+            union { double f; unsigned long long u; } value;
+            value.f = pValues[i];
+            PutU64(pBytes + 8 * i, value.u);
+        }
+    }
+}
+
+/* convert little-endian numbers of iSampleBytes (4 or 8) bytes to values */
+static void DecodeValues(sfloat *pValues, const unsigned char *pBytes, int nValues, int iSampleBytes)
+{
+    int i;
+
+    if(iSampleBytes == sizeof(sfloat) && IsLittleEndian())
+    {
+        memcpy(pValues, pBytes, nValues * sizeof(sfloat));
+        return;
+    }
+    for(i = 0; i < nValues; i++)
+    {
+        if(iSampleBytes == 4)
+        {
+            union { float f; unsigned int u; } value;
+            value.u = GetU32(pBytes + 4 * i);
+            pValues[i] = value.f;
+        }
+        else
+        {
+            union { double f; unsigned long long u; } value;
+            value.u = GetU64(pBytes + 8 * i);
+            pValues[i] = value.f;
+        }
+    }
+}
+
+/* read values stored with iSampleBytes bytes */
+static int ReadValues(FILE *pSmsFile, sfloat *pValues, int nValues, int iSampleBytes)
+{
+    unsigned char pBytes[SMS_IO_CHUNK * 8];
+    int n;
+
+    if(iSampleBytes == sizeof(sfloat) && IsLittleEndian())
+        return (fread(pValues, sizeof(sfloat), nValues, pSmsFile) < (size_t)nValues) ? -1 : 0;
+    for(; nValues > 0; nValues -= n, pValues += n)
+    {
+        n = MIN(nValues, SMS_IO_CHUNK);
+        if(fread(pBytes, iSampleBytes, n, pSmsFile) < (size_t)n)
+            return -1;
+        DecodeValues(pValues, pBytes, n, iSampleBytes);
+    }
+    return 0;
+}
+
+/* get the number of values per track (freq, mag[, phase]) and the number
+ * of values after the tracks in a frame */
+static void FrameLayout(const SMS_Header *pSmsHeader, int *pNDet, int *pNTail)
+{
+    if(pSmsHeader->iFormat == SMS_FORMAT_H ||
+       pSmsHeader->iFormat == SMS_FORMAT_IH)
+        *pNDet = 2;
+    else
+        *pNDet = 3;
+    *pNTail = sms_frameSizeB(pSmsHeader) / sizeof(sfloat) - *pNDet * pSmsHeader->nTracks;
+}
+
+/* whether a track of a frame has any value that is not 0 */
+static int IsTrackActive(const sfloat *pValues, int nTracks, int nDet, int iTrack)
+{
+    int iDet;
+
+    for(iDet = 0; iDet < nDet; iDet++)
+        if(pValues[iDet * nTracks + iTrack] != 0)
+            return 1;
+    return 0;
+}
+
+/* move the values of the tracks of a sparse frame to their place. The values
+ * of the nStored tracks have been read to the end of their rows, pIds holds
+ * the numbers of the tracks iFirst to iFirst + nIds - 1 of them, which
+ * increase, and *piTrack is the first track that is not in place yet. The
+ * tracks in between are cleared. */
+static int ScatterTracks(sfloat *pValues, int nTracks, int nDet, int nStored,
+                         const unsigned char *pIds, int iFirst, int nIds, int *piTrack)
+{
+    int k, iDet;
+
+    for(k = iFirst; k < iFirst + nIds; k++)
+    {
+        unsigned int iId = GetU32(pIds + 4 * (k - iFirst));
+
+        if(iId < (unsigned int)*piTrack || iId >= (unsigned int)nTracks)
+            return -1;
+        for(; *piTrack < (int)iId; (*piTrack)++)
+            for(iDet = 0; iDet < nDet; iDet++)
+                pValues[iDet * nTracks + *piTrack] = 0;
+        for(iDet = 0; iDet < nDet; iDet++)
+            pValues[iDet * nTracks + iId] = pValues[iDet * nTracks + nTracks - nStored + k];
+        *piTrack = iId + 1;
+    }
+    return 0;
+}
+
+/* state of an adaptive Rice code: the parameter follows the mean of the
+ * last values coded */
+typedef struct
+{
+    unsigned int sum;   /* sum of the last values */
+    unsigned int count; /* number of the last values */
+} RiceState;
+
+/* state of the quantized encoding within a block of frames, with the block */
+typedef struct
+{
+    RiceState freqRice;    /* code of the frequency differences */
+    RiceState ampRice;     /* code of the amplitude differences */
+    RiceState stocRice;    /* code of the differences between stochastic coefficients */
+    int *pFreq;            /* quantized frequency of each track in the last frame, SMS_QUANT_INACTIVE if not active */
+    int *pAmp;             /* quantized amplitude of each track in the last frame */
+    unsigned char *pBlock; /* the bits of the block */
+    size_t sizeBlock;      /* the largest size in bytes of a block */
+    size_t iBit;           /* position in the block */
+    size_t nBits;          /* when reading, number of bits in the block */
+    int nFrames;           /* number of frames written to or decoded from the block */
+    int nBlockFrames;      /* when reading, number of frames in the block */
+    int iBlock;            /* when reading, first frame of the block, -1 if none */
+    int iFrame;            /* when reading, frame in pValues */
+    sfloat *pValues;       /* when reading, the last frame decoded */
+} QuantState;
+
+/* append the nBits (<= 32) lowest bits of value to the block, the bytes
+ * after the position are 0 */
+static void PutBits(QuantState *pState, unsigned int value, int nBits)
+{
+    while(nBits > 0)
+    {
+        int nFree = 8 - (int)(pState->iBit & 7), n = MIN(nFree, nBits);
+
+        pState->pBlock[pState->iBit >> 3] |=
+            (unsigned char)(((value >> (nBits - n)) & ((1u << n) - 1)) << (nFree - n));
+        nBits -= n;
+        pState->iBit += n;
+    }
+}
+
+static unsigned int GetBits(QuantState *pState, int nBits)
+{
+    unsigned int value = 0;
+
+    while(nBits > 0)
+    {
+        int nLeft = 8 - (int)(pState->iBit & 7), n = MIN(nLeft, nBits);
+
+        value = (value << n) | ((pState->pBlock[pState->iBit >> 3] >> (nLeft - n)) & ((1u << n) - 1));
+        nBits -= n;
+        pState->iBit += n;
+    }
+    return value;
+}
+
+static void PutFloatBits(QuantState *pState, sfloat fValue)
+{
+    union { float f; unsigned int u; } value;
+
+    value.f = (float)fValue;
+    PutBits(pState, value.u, 32);
+}
+
+static sfloat GetFloatBits(QuantState *pState)
+{
+    union { float f; unsigned int u; } value;
+
+    value.u = GetBits(pState, 32);
+    return value.f;
+}
+
+static void ResetRice(RiceState *pRice)
+{
+    pRice->sum = 4;
+    pRice->count = 1;
+}
+
+static int RiceParameter(const RiceState *pRice)
+{
+    int k;
+
+    for(k = 0; (pRice->count << k) < pRice->sum && k < 31; k++);
+    return k;
+}
+
+static void UpdateRice(RiceState *pRice, unsigned int value)
+{
+    pRice->sum += value;
+    if(++pRice->count == 64)
+    {
+        pRice->sum >>= 1;
+        pRice->count >>= 1;
+    }
+}
+
+/* write a signed value with a Rice code: the quotient in unary and the k
+ * bits of the remainder, or, for large values, an escape and 32 bits */
+static void PutRice(QuantState *pState, RiceState *pRice, int value)
+{
+    unsigned int u = (value < 0) ? ((unsigned int)-value << 1) - 1 : (unsigned int)value << 1;
+    int k = RiceParameter(pRice);
+    unsigned int quotient = u >> k;
+
+    if(quotient < SMS_RICE_ESCAPE)
+    {
+        PutBits(pState, ((1u << quotient) - 1) << 1, quotient + 1);
+        PutBits(pState, u, k);
+    }
+    else
+    {
+        PutBits(pState, (1u << SMS_RICE_ESCAPE) - 1, SMS_RICE_ESCAPE);
+        PutBits(pState, u, 32);
+    }
+    UpdateRice(pRice, u);
+}
+
+static int GetRice(QuantState *pState, RiceState *pRice)
+{
+    int k = RiceParameter(pRice);
+    unsigned int quotient = 0, u;
+
+    while(quotient < SMS_RICE_ESCAPE && GetBits(pState, 1))
+        quotient++;
+    if(quotient < SMS_RICE_ESCAPE)
+        u = (quotient << k) | GetBits(pState, k);
+    else
+        u = GetBits(pState, 32);
+    UpdateRice(pRice, u);
+    return (u & 1) ? -(int)((u >> 1) + 1) : (int)(u >> 1);
+}
+
+/* round a value to an integer that fits in nBits bits with a sign */
+static int QuantizeValue(double value, int nBits)
+{
+    double limit = (1 << (nBits - 1)) - 1;
+
+    return (int)floor(MAX(-limit, MIN(limit, value)) + .5);
+}
+
+/* the level of a linear amplitude in tenths of dB of full scale, the ones
+ * too small for the smallest level and 0 are SMS_QUANT_AMP_ZERO */
+static int QuantizeAmp(double fAmp)
+{
+    if(fAmp <= 0)
+        return SMS_QUANT_AMP_ZERO;
+    return MAX(SMS_QUANT_AMP_ZERO + 1,
+               QuantizeValue(20 * log10(fAmp) / SMS_QUANT_AMP_STEP, SMS_QUANT_AMP_BITS));
+}
+
+static int InQuantRange(long long value, int nBits)
+{
+    return value > -(1LL << (nBits - 1)) && value < (1LL << (nBits - 1));
+}
+
+static unsigned int QuantizePhase(sfloat fPhase)
+{
+    double turns = fPhase * INV_TWO_PI;
+
+    return (unsigned int)floor((turns - floor(turns)) * (1 << SMS_QUANT_PHASE_BITS) + .5) &
+        ((1u << SMS_QUANT_PHASE_BITS) - 1);
+}
+
+static sfloat DequantizePhase(unsigned int iPhase)
+{
+    sfloat fPhase = iPhase * (TWO_PI / (1 << SMS_QUANT_PHASE_BITS));
+
+    return (fPhase > PI) ? fPhase - TWO_PI : fPhase;
+}
+
+/* number of values of the stochastic component at the start of the tail of a frame */
+static int StocValues(const SMS_Header *pSmsHeader)
+{
+    if(pSmsHeader->iStochasticType == SMS_STOC_APPROX)
+        return pSmsHeader->nStochasticCoeff + 1;
+    else if(pSmsHeader->iStochasticType == SMS_STOC_IFFT)
+        return 2 * pSmsHeader->nStochasticCoeff + 1;
+    return 0;
+}
+
+/* the largest size in bytes of a frame in the quantized encoding */
+static size_t QuantFrameBSize(const SMS_Header *pSmsHeader)
+{
+    int nDet, nTail;
+
+    FrameLayout(pSmsHeader, &nDet, &nTail);
+    return ((size_t)pSmsHeader->nTracks * (1 + 2 * SMS_RICE_MAX_BITS + SMS_QUANT_PHASE_BITS) +
+            (size_t)nTail * SMS_RICE_MAX_BITS + 32) / 8 + 1;
+}
+
+/* size in bytes of the state of the quantized encoding of a file. A block
+ * being read has room for the bits of one more frame, so that decoding a
+ * bad block stays in memory */
+static size_t QuantStateBSize(const SMS_Header *pSmsHeader)
+{
+    return sizeof(QuantState) + ((2 * pSmsHeader->nTracks * sizeof(int) + 7) & ~(size_t)7) +
+        sms_frameSizeB(pSmsHeader) + (SMS_QUANT_BLOCK_FRAMES + 1) * QuantFrameBSize(pSmsHeader);
+}
+
+/* start a block: the frames are coded without the ones before it */
+static void ResetQuantState(QuantState *pState, int nTracks)
+{
+    int iTrack;
+
+    ResetRice(&pState->freqRice);
+    ResetRice(&pState->ampRice);
+    ResetRice(&pState->stocRice);
+    for(iTrack = 0; iTrack < nTracks; iTrack++)
+        pState->pFreq[iTrack] = SMS_QUANT_INACTIVE;
+    pState->iBit = 0;
+    pState->nFrames = 0;
+}
+
+/* set up the state of the quantized encoding in pMemory, of
+ * QuantStateBSize() bytes and filled with zeros */
+static QuantState *InitQuantState(void *pMemory, const SMS_Header *pSmsHeader)
+{
+    QuantState *pState = (QuantState *)pMemory;
+
+    pState->pFreq = (int *)(pState + 1);
+    pState->pAmp = pState->pFreq + pSmsHeader->nTracks;
+    pState->pValues = (sfloat *)((char *)pState->pFreq +
+                                 ((2 * pSmsHeader->nTracks * sizeof(int) + 7) & ~(size_t)7));
+    pState->pBlock = (unsigned char *)pState->pValues + sms_frameSizeB(pSmsHeader);
+    pState->sizeBlock = SMS_QUANT_BLOCK_FRAMES * QuantFrameBSize(pSmsHeader);
+    pState->iBlock = -1;
+    pState->iFrame = -1;
+    ResetQuantState(pState, pSmsHeader->nTracks);
+    return pState;
+}
+
+/* append a frame to the block being written */
+static void EncodeQuantizedFrame(const SMS_Header *pSmsHeader, QuantState *pState, const sfloat *pValues)
+{
+    int nTracks = pSmsHeader->nTracks, nStoc = pSmsHeader->nStochasticCoeff;
+    int nDet, nTail, iTrack, i;
+    const sfloat *pTail;
+
+    FrameLayout(pSmsHeader, &nDet, &nTail);
+    pTail = pValues + nDet * nTracks;
+    for(iTrack = 0; iTrack < nTracks; iTrack++)
+    {
+        int iFreq, iAmp;
+
+        /* a track without frequency is not active */
+        if(pValues[iTrack] <= 0)
+        {
+            PutBits(pState, 0, 1);
+            pState->pFreq[iTrack] = SMS_QUANT_INACTIVE;
+            continue;
+        }
+        iFreq = QuantizeValue(SMS_QUANT_FREQ_STEPS * log(pValues[iTrack]) / log(2.),
+                              SMS_QUANT_FREQ_BITS);
+        iAmp = QuantizeAmp(pValues[nTracks + iTrack]);
+        PutBits(pState, 1, 1);
+        if(pState->pFreq[iTrack] == SMS_QUANT_INACTIVE)
+        {
+            PutBits(pState, iFreq + (1 << (SMS_QUANT_FREQ_BITS - 1)), SMS_QUANT_FREQ_BITS);
+            PutBits(pState, iAmp + (1 << (SMS_QUANT_AMP_BITS - 1)), SMS_QUANT_AMP_BITS);
+        }
+        else
+        {
+            PutRice(pState, &pState->freqRice, iFreq - pState->pFreq[iTrack]);
+            PutRice(pState, &pState->ampRice, iAmp - pState->pAmp[iTrack]);
+        }
+        if(nDet == 3)
+            PutBits(pState, QuantizePhase(pValues[2 * nTracks + iTrack]), SMS_QUANT_PHASE_BITS);
+        pState->pFreq[iTrack] = iFreq;
+        pState->pAmp[iTrack] = iAmp;
+    }
+
+    if(pSmsHeader->iStochasticType != SMS_STOC_NONE)
+    {
+        /* the coefficients in dB below the largest one, each as the
+         * difference to the one before */
+        sfloat fMax = 0;
+        int iLevel, iLastLevel = 0;
+
+        for(i = 0; i < nStoc; i++)
+            fMax = MAX(fMax, pTail[i]);
+        PutFloatBits(pState, fMax);
+        if(fMax > 0)
+        {
+            for(i = 0; i < nStoc; i++)
+            {
+                iLevel = SMS_QUANT_STOC_ZERO;
+                if(pTail[i] > 0)
+                    iLevel = MIN(SMS_QUANT_STOC_ZERO,
+                                 (int)floor(-20 * log10(pTail[i] / fMax) / SMS_QUANT_STOC_STEP + .5));
+                PutRice(pState, &pState->stocRice, iLevel - iLastLevel);
+                iLastLevel = iLevel;
+            }
+        }
+        if(pSmsHeader->iStochasticType == SMS_STOC_IFFT)
+            for(i = 0; i < nStoc; i++)
+                PutBits(pState, QuantizePhase(pTail[nStoc + i]), SMS_QUANT_PHASE_BITS);
+    }
+    /* the stochastic gain and the envelope */
+    for(i = MAX(0, StocValues(pSmsHeader) - 1); i < nTail; i++)
+        PutFloatBits(pState, pTail[i]);
+    pState->nFrames++;
+}
+
+/* decode the next frame of the block being read */
+static int DecodeQuantizedFrame(const SMS_Header *pSmsHeader, QuantState *pState, sfloat *pValues)
+{
+    int nTracks = pSmsHeader->nTracks, nStoc = pSmsHeader->nStochasticCoeff;
+    int nDet, nTail, iTrack, i;
+    sfloat *pTail;
+
+    FrameLayout(pSmsHeader, &nDet, &nTail);
+    pTail = pValues + nDet * nTracks;
+    for(iTrack = 0; iTrack < nTracks; iTrack++)
+    {
+        long long iFreq, iAmp;
+
+        if(!GetBits(pState, 1))
+        {
+            pValues[iTrack] = 0;
+            pValues[nTracks + iTrack] = 0;
+            if(nDet == 3)
+                pValues[2 * nTracks + iTrack] = 0;
+            pState->pFreq[iTrack] = SMS_QUANT_INACTIVE;
+            continue;
+        }
+        if(pState->pFreq[iTrack] == SMS_QUANT_INACTIVE)
+        {
+            iFreq = (int)GetBits(pState, SMS_QUANT_FREQ_BITS) - (1 << (SMS_QUANT_FREQ_BITS - 1));
+            iAmp = (int)GetBits(pState, SMS_QUANT_AMP_BITS) - (1 << (SMS_QUANT_AMP_BITS - 1));
+        }
+        else
+        {
+            iFreq = pState->pFreq[iTrack] + (long long)GetRice(pState, &pState->freqRice);
+            iAmp = pState->pAmp[iTrack] + (long long)GetRice(pState, &pState->ampRice);
+        }
+        if(!InQuantRange(iFreq, SMS_QUANT_FREQ_BITS) || !InQuantRange(iAmp, SMS_QUANT_AMP_BITS))
+            return -1;
+        pValues[iTrack] = pow(2., iFreq / SMS_QUANT_FREQ_STEPS);
+        pValues[nTracks + iTrack] = (iAmp > SMS_QUANT_AMP_ZERO)
+            ? pow(10., iAmp * SMS_QUANT_AMP_STEP / 20) : 0;
+        if(nDet == 3)
+            pValues[2 * nTracks + iTrack] = DequantizePhase(GetBits(pState, SMS_QUANT_PHASE_BITS));
+        pState->pFreq[iTrack] = (int)iFreq;
+        pState->pAmp[iTrack] = (int)iAmp;
+    }
+
+    if(pSmsHeader->iStochasticType != SMS_STOC_NONE)
+    {
+        sfloat fMax = GetFloatBits(pState);
+        long long iLevel = 0;
+
+        for(i = 0; i < nStoc; i++)
+        {
+            if(fMax > 0)
+            {
+                iLevel += GetRice(pState, &pState->stocRice);
+                if(iLevel < 0 || iLevel > SMS_QUANT_STOC_ZERO)
+                    return -1;
+            }
+            pTail[i] = (fMax > 0 && iLevel < SMS_QUANT_STOC_ZERO)
+                ? fMax * pow(10., iLevel * SMS_QUANT_STOC_STEP / -20) : 0;
+        }
+        if(pSmsHeader->iStochasticType == SMS_STOC_IFFT)
+            for(i = 0; i < nStoc; i++)
+                pTail[nStoc + i] = DequantizePhase(GetBits(pState, SMS_QUANT_PHASE_BITS));
+    }
+    for(i = MAX(0, StocValues(pSmsHeader) - 1); i < nTail; i++)
+        pTail[i] = GetFloatBits(pState);
+    pState->nFrames++;
+    return (pState->iBit <= pState->nBits) ? 0 : -1;
+}
+
+/* put the block being written, with its size and number of frames, to
+ * pBytes and start the next. Returns the number of bytes put. */
+static size_t EncodeQuantizedBlock(const SMS_Header *pSmsHeader, QuantState *pState,
+                                   unsigned char *pBytes)
+{
+    size_t sizeBlock = (pState->iBit + 7) / 8;
+
+    if(pState->nFrames == 0)
+        return 0;
+    PutU32(pBytes, (unsigned int)sizeBlock);
+    PutU32(pBytes + 4, pState->nFrames);
+    memcpy(pBytes + 8, pState->pBlock, sizeBlock);
+    memset(pState->pBlock, 0, sizeBlock);
+    ResetQuantState(pState, pSmsHeader->nTracks);
+    return 8 + sizeBlock;
+}
+
+/* start decoding a block from its first 8 bytes, its size in bytes and its
+ * number of frames. The bits of the block are loaded to pState->pBlock next. */
+static int StartQuantizedBlock(QuantState *pState, const SMS_Header *pSmsHeader,
+                               const unsigned char *pBlockHead)
+{
+    unsigned int sizeBlock = GetU32(pBlockHead), nFrames = GetU32(pBlockHead + 4);
+
+    if(sizeBlock > pState->sizeBlock || nFrames == 0 || nFrames > SMS_QUANT_BLOCK_FRAMES)
+        return -1;
+    ResetQuantState(pState, pSmsHeader->nTracks);
+    pState->nBits = 8 * (size_t)sizeBlock;
+    pState->nBlockFrames = nFrames;
+    return 0;
+}
 
 /*! \brief initialize the header structure of an SMS file
  *
@@ -53,6 +684,12 @@ void sms_initHeader(SMS_Header *pSmsHeader)
     pSmsHeader->fResidualPerc = 0;
     pSmsHeader->nTextCharacters = 0;
     pSmsHeader->pChTextCharacters = NULL;
+    pSmsHeader->iFileVersion = SMS_FILE_VERSION;
+    pSmsHeader->iFrameEncoding = SMS_ENC_DENSE;
+    pSmsHeader->iSampleBytes = sizeof(sfloat);
+    pSmsHeader->pFrameOffsets = NULL;
+    pSmsHeader->pReadState = NULL;
+    pSmsHeader->pWriteState = NULL;
 }
 
 /*! \brief fill an SMS header with necessary information for storage
@@ -110,60 +747,705 @@ void sms_fillHeader(SMS_Header *pSmsHeader, const SMS_AnalParams *pAnalParams,
             pAnalParams->iMaxSleepingTime,  pAnalParams->iStochasticType,
             pAnalParams->nStochasticCoeff, pSmsHeader->iEnvType, pSmsHeader->nEnvCoeff);
 
-    pSmsHeader->nTextCharacters = strlen (pChTextString) + 1;
-    pSmsHeader->pChTextCharacters = (char *) pChTextString;
+    pSmsHeader->nTextCharacters = strlen (pChTextString) + 1;
+    pSmsHeader->pChTextCharacters = (char *) pChTextString;
+}
+
+/* size of the header of a version 2 file, up to the first frame */
+static int HeadBSize(const SMS_Header *pSmsHeader)
+{
+    return (SMS_HEADER_FIELDS_BSIZE + pSmsHeader->nTextCharacters + 7) & ~7;
+}
+
+static void EncodeHeader(unsigned char *pFields, const SMS_Header *pSmsHeader, int nFrames,
+                         unsigned long long indexOffset)
+{
+    union { float f; unsigned int u; } residualPerc;
+
+    residualPerc.f = pSmsHeader->fResidualPerc;
+    memcpy(pFields, pFileMagic, 4);
+    PutU32(pFields + 4, SMS_FILE_VERSION);
+    PutU32(pFields + 8, SMS_HEADER_FIELDS_BSIZE);
+    PutU32(pFields + 12, HeadBSize(pSmsHeader));
+    PutU32(pFields + 16, nFrames);
+    PutU32(pFields + 20, pSmsHeader->iFrameEncoding);
+    PutU32(pFields + 24, sizeof(sfloat));
+    PutU32(pFields + 28, pSmsHeader->iSamplingRate);
+    PutU32(pFields + 32, pSmsHeader->iFormat);
+    PutU32(pFields + 36, pSmsHeader->nTracks);
+    PutU32(pFields + 40, pSmsHeader->iFrameRate);
+    PutU32(pFields + 44, pSmsHeader->iStochasticType);
+    PutU32(pFields + 48, pSmsHeader->nStochasticCoeff);
+    PutU32(pFields + 52, pSmsHeader->iEnvType);
+    PutU32(pFields + 56, pSmsHeader->nEnvCoeff);
+    PutU32(pFields + 60, pSmsHeader->iMaxFreq);
+    PutU32(pFields + 64, residualPerc.u);
+    PutU32(pFields + 68, pSmsHeader->nTextCharacters);
+    PutU64(pFields + 72, indexOffset);
+}
+
+/* read the header fields of a version 2 file, the magic has been checked */
+static int DecodeHeader(const unsigned char *pFields, SMS_Header *pSmsHeader, int *pFieldsBSize,
+                        unsigned long long *pIndexOffset)
+{
+    union { float f; unsigned int u; } residualPerc;
+
+    sms_initHeader(pSmsHeader);
+    pSmsHeader->iFileVersion = GetU32(pFields + 4);
+    *pFieldsBSize = GetU32(pFields + 8);
+    pSmsHeader->iHeadBSize = GetU32(pFields + 12);
+    pSmsHeader->nFrames = GetU32(pFields + 16);
+    pSmsHeader->iFrameEncoding = GetU32(pFields + 20);
+    pSmsHeader->iSampleBytes = GetU32(pFields + 24);
+    pSmsHeader->iSamplingRate = GetU32(pFields + 28);
+    pSmsHeader->iFormat = GetU32(pFields + 32);
+    pSmsHeader->nTracks = GetU32(pFields + 36);
+    pSmsHeader->iFrameRate = GetU32(pFields + 40);
+    pSmsHeader->iStochasticType = GetU32(pFields + 44);
+    pSmsHeader->nStochasticCoeff = GetU32(pFields + 48);
+    pSmsHeader->iEnvType = GetU32(pFields + 52);
+    pSmsHeader->nEnvCoeff = GetU32(pFields + 56);
+    pSmsHeader->iMaxFreq = GetU32(pFields + 60);
+    residualPerc.u = GetU32(pFields + 64);
+    pSmsHeader->fResidualPerc = residualPerc.f;
+    pSmsHeader->nTextCharacters = GetU32(pFields + 68);
+    *pIndexOffset = GetU64(pFields + 72);
+
+    if(pSmsHeader->iFileVersion < 2 || pSmsHeader->iFileVersion > SMS_FILE_VERSION)
+    {
+        sms_error("unsupported SMS file version");
+        return -1;
+    }
+    if(*pFieldsBSize < SMS_HEADER_FIELDS_BSIZE || pSmsHeader->nTextCharacters < 0 ||
+       pSmsHeader->iHeadBSize < *pFieldsBSize + pSmsHeader->nTextCharacters)
+    {
+        sms_error("bad SMS header size");
+        return -1;
+    }
+    if(pSmsHeader->nFrames <= 0)
+    {
+        sms_error("number of frames <= 0");
+        return -1;
+    }
+    if((pSmsHeader->iSampleBytes != 4 && pSmsHeader->iSampleBytes != 8) ||
+       pSmsHeader->iFrameEncoding < SMS_ENC_DENSE || pSmsHeader->iFrameEncoding > SMS_ENC_QUANTIZED ||
+       pSmsHeader->nTracks < 0 || pSmsHeader->nStochasticCoeff < 0 || pSmsHeader->nEnvCoeff < 0)
+    {
+        sms_error("bad SMS header");
+        return -1;
+    }
+    pSmsHeader->iFrameBSize = sms_frameSizeB(pSmsHeader);
+    return 0;
+}
+
+static void HeaderFromV1(SMS_Header *pSmsHeader, const SMS_HeaderV1 *pHeaderV1)
+{
+    sms_initHeader(pSmsHeader);
+    pSmsHeader->iFileVersion = 1;
+    pSmsHeader->iHeadBSize = pHeaderV1->iHeadBSize;
+    pSmsHeader->nFrames = pHeaderV1->nFrames;
+    pSmsHeader->iFrameBSize = pHeaderV1->iFrameBSize;
+    pSmsHeader->iSamplingRate = pHeaderV1->iSamplingRate;
+    pSmsHeader->iFormat = pHeaderV1->iFormat;
+    pSmsHeader->nTracks = pHeaderV1->nTracks;
+    pSmsHeader->iFrameRate = pHeaderV1->iFrameRate;
+    pSmsHeader->iStochasticType = pHeaderV1->iStochasticType;
+    pSmsHeader->nStochasticCoeff = pHeaderV1->nStochasticCoeff;
+    pSmsHeader->iEnvType = pHeaderV1->iEnvType;
+    pSmsHeader->nEnvCoeff = pHeaderV1->nEnvCoeff;
+    pSmsHeader->iMaxFreq = pHeaderV1->iMaxFreq;
+    pSmsHeader->fResidualPerc = pHeaderV1->fResidualPerc;
+    pSmsHeader->nTextCharacters = pHeaderV1->nTextCharacters;
+}
+
+/* check the header of a version 1 file */
+static int CheckHeaderV1(const SMS_Header *pSmsHeader)
+{
+    if(pSmsHeader->iHeadBSize <= 0 || pSmsHeader->nTextCharacters < 0 ||
+       pSmsHeader->iHeadBSize < (int)sizeof(SMS_HeaderV1) + pSmsHeader->nTextCharacters)
+    {
+        sms_error("bad SMS header size");
+        return -1;
+    }
+    if(pSmsHeader->nFrames <= 0)
+    {
+        sms_error("number of frames <= 0");
+        return -1;
+    }
+    if(pSmsHeader->iFrameBSize <= 0)
+    {
+        sms_error("size bytes of frames <= 0");
+        return -1;
+    }
+    return 0;
+}
+
+/* copy a header to a block of memory that also holds its frame index, its
+ * text and, if sizeState > 0, the state for reading quantized frames, to be
+ * freed with free() */
+static SMS_Header *AllocHeader(const SMS_Header *pHeader, const char *pText, int nOffsets,
+                               size_t sizeState)
+{
+    SMS_Header *pSmsHeader;
+    size_t sizeHeader = (sizeof(SMS_Header) + nOffsets * sizeof(long long) +
+                         pHeader->nTextCharacters + 7) & ~(size_t)7;
+
+    if((pSmsHeader = (SMS_Header *)malloc(sizeHeader + sizeState)) == NULL)
+    {
+        sms_error("cannot allocate memory for header");
+        return NULL;
+    }
+    *pSmsHeader = *pHeader;
+    pSmsHeader->pFrameOffsets = (nOffsets > 0) ? (long long *)(pSmsHeader + 1) : NULL;
+    if(pHeader->nTextCharacters > 0)
+    {
+        pSmsHeader->pChTextCharacters = (char *)(pSmsHeader + 1) + nOffsets * sizeof(long long);
+        if(pText)
+            memcpy(pSmsHeader->pChTextCharacters, pText, pHeader->nTextCharacters);
+    }
+    else
+        pSmsHeader->pChTextCharacters = NULL;
+    if(sizeState > 0)
+    {
+        memset((char *)pSmsHeader + sizeHeader, 0, sizeState);
+        pSmsHeader->pReadState = InitQuantState((char *)pSmsHeader + sizeHeader, pSmsHeader);
+    }
+    return pSmsHeader;
+}
+
+/* write the header at the current position of the file */
+static int WriteHeader(FILE *pSmsFile, const SMS_Header *pSmsHeader, int nFrames,
+                       unsigned long long indexOffset)
+{
+    unsigned char pFields[SMS_HEADER_FIELDS_BSIZE];
+    static const char pPadding[8] = {0};
+    int sizePadding = HeadBSize(pSmsHeader) - SMS_HEADER_FIELDS_BSIZE - pSmsHeader->nTextCharacters;
+
+    EncodeHeader(pFields, pSmsHeader, nFrames, indexOffset);
+    if(fwrite(pFields, 1, SMS_HEADER_FIELDS_BSIZE, pSmsFile) < SMS_HEADER_FIELDS_BSIZE)
+    {
+        sms_error("cannot write output file (header)");
+        return -1;
+    }
+    if(pSmsHeader->nTextCharacters > 0 &&
+       fwrite(pSmsHeader->pChTextCharacters, 1, pSmsHeader->nTextCharacters, pSmsFile) <
+       (size_t)pSmsHeader->nTextCharacters)
+    {
+        sms_error("cannot write output file (nTextCharacters)");
+        return -1;
+    }
+    if(fwrite(pPadding, 1, sizePadding, pSmsFile) < (size_t)sizePadding)
+    {
+        sms_error("cannot write output file (header)");
+        return -1;
+    }
+    return 0;
+}
+
+/* the frames of a file being written, in the order of the file: all of the
+ * values of the active tracks, then the rest of the frame */
+static size_t EncodeFrame(const SMS_Header *pSmsHeader, QuantState *pState, const sfloat *pValues,
+                          unsigned char *pBytes)
+{
+    int nTracks = pSmsHeader->nTracks, nStored = nTracks, nDet, nTail, iTrack, iDet, n;
+    unsigned char *pStart = pBytes;
+
+    FrameLayout(pSmsHeader, &nDet, &nTail);
+    if(pSmsHeader->iFrameEncoding == SMS_ENC_QUANTIZED)
+    {
+        EncodeQuantizedFrame(pSmsHeader, pState, pValues);
+        if(pState->nFrames < SMS_QUANT_BLOCK_FRAMES)
+            return 0;
+        return EncodeQuantizedBlock(pSmsHeader, pState, pBytes);
+    }
+    if(pSmsHeader->iFrameEncoding == SMS_ENC_TRACKCOUNT)
+        while(nStored > 0 && !IsTrackActive(pValues, nTracks, nDet, nStored - 1))
+            nStored--;
+    else if(pSmsHeader->iFrameEncoding == SMS_ENC_SPARSE)
+        for(iTrack = 0, nStored = 0; iTrack < nTracks; iTrack++)
+            nStored += IsTrackActive(pValues, nTracks, nDet, iTrack);
+    if(pSmsHeader->iFrameEncoding != SMS_ENC_DENSE)
+    {
+        memset(pBytes, 0, 8);
+        PutU32(pBytes, nStored);
+        pBytes += 8;
+    }
+    for(iDet = 0; iDet < nDet; iDet++)
+    {
+        const sfloat *pDet = pValues + iDet * nTracks;
+
+        if(pSmsHeader->iFrameEncoding == SMS_ENC_SPARSE)
+        {
+            for(iTrack = 0; iTrack < nTracks; iTrack++)
+                if(IsTrackActive(pValues, nTracks, nDet, iTrack))
+                {
+                    EncodeValues(pBytes, pDet + iTrack, 1, sizeof(sfloat));
+                    pBytes += sizeof(sfloat);
+                }
+        }
+        else
+        {
+            EncodeValues(pBytes, pDet, nStored, sizeof(sfloat));
+            pBytes += nStored * sizeof(sfloat);
+        }
+    }
+    EncodeValues(pBytes, pValues + nDet * nTracks, nTail, sizeof(sfloat));
+    pBytes += nTail * sizeof(sfloat);
+    if(pSmsHeader->iFrameEncoding == SMS_ENC_SPARSE)
+    {
+        for(iTrack = 0, n = 0; iTrack < nTracks; iTrack++)
+            if(IsTrackActive(pValues, nTracks, nDet, iTrack))
+                PutU32(pBytes + 4 * n++, iTrack);
+        pBytes += 4 * nStored;
+    }
+    return pBytes - pStart;
+}
+
+/* the most bytes EncodeFrame() puts at once */
+static size_t MaxRecordBSize(const SMS_Header *pSmsHeader)
+{
+    if(pSmsHeader->iFrameEncoding == SMS_ENC_QUANTIZED)
+        return 8 + SMS_QUANT_BLOCK_FRAMES * QuantFrameBSize(pSmsHeader);
+    return 8 + sms_frameSizeB(pSmsHeader) + 4 * pSmsHeader->nTracks;
+}
+
+struct SMS_FileWriter
+{
+    FILE *pSmsFile;             /* the temporary file written to */
+    char *pChFileName;          /* the name of the file once it is complete */
+    char *pChTempName;
+    SMS_Header *pSmsHeader;     /* copy of the header the frames are written with */
+    QuantState *pQuantState;    /* state of the quantized encoding, NULL for the others */
+    void *pMemory;              /* the buffers, before alignment */
+    unsigned char *pBuffers[2]; /* one is filled while the thread writes the other */
+    size_t sizeBuffer;
+    size_t sizeFilled;          /* bytes in the buffer being filled */
+    int iFill;                  /* buffer being filled */
+    long long offset;           /* offset in the file of the next byte put in the buffer */
+    long long *pOffsets;        /* offset of every frame */
+    int nFrames;
+    int sizeOffsets;
+    int nPending;               /* frames of the quantized block being encoded */
+    /* the writing thread */
+    int useThread;
+    pthread_t thread;
+    pthread_mutex_t lock;       /* protects the members below */
+    pthread_cond_t cond;        /* signaled when a buffer is handed over or written */
+    int iWrite;                 /* buffer to write */
+    size_t sizeWrite;           /* bytes of it to write, 0 once written */
+    int isFailed;               /* whether a write failed */
+    int quit;
+};
+
+static void *WriterThread(void *pData)
+{
+    SMS_FileWriter *pWriter = (SMS_FileWriter *)pData;
+
+    pthread_mutex_lock(&pWriter->lock);
+    while(1)
+    {
+        while(pWriter->sizeWrite == 0 && !pWriter->quit)
+            pthread_cond_wait(&pWriter->cond, &pWriter->lock);
+        if(pWriter->sizeWrite == 0)
+            break;
+        pthread_mutex_unlock(&pWriter->lock);
+        if(fwrite(pWriter->pBuffers[pWriter->iWrite], 1, pWriter->sizeWrite, pWriter->pSmsFile) <
+           pWriter->sizeWrite)
+            pWriter->isFailed = 1;
+        pthread_mutex_lock(&pWriter->lock);
+        pWriter->sizeWrite = 0;
+        pthread_cond_broadcast(&pWriter->cond);
+    }
+    pthread_mutex_unlock(&pWriter->lock);
+    return NULL;
+}
+
+/* write the buffer being filled, or hand it to the writing thread once it
+ * has written the other one */
+static int FlushWriter(SMS_FileWriter *pWriter)
+{
+    int isFailed;
+
+    if(pWriter->sizeFilled == 0)
+        return 0;
+    if(!pWriter->useThread)
+    {
+        isFailed = (fwrite(pWriter->pBuffers[0], 1, pWriter->sizeFilled, pWriter->pSmsFile) <
+                    pWriter->sizeFilled);
+        pWriter->sizeFilled = 0;
+        if(isFailed)
+            sms_error("cannot write frame to output file");
+        return isFailed ? -1 : 0;
+    }
+    pthread_mutex_lock(&pWriter->lock);
+    while(pWriter->sizeWrite > 0)
+        pthread_cond_wait(&pWriter->cond, &pWriter->lock);
+    isFailed = pWriter->isFailed;
+    if(!isFailed)
+    {
+        pWriter->iWrite = pWriter->iFill;
+        pWriter->sizeWrite = pWriter->sizeFilled;
+        pthread_cond_broadcast(&pWriter->cond);
+    }
+    pthread_mutex_unlock(&pWriter->lock);
+    pWriter->iFill = 1 - pWriter->iFill;
+    pWriter->sizeFilled = 0;
+    if(isFailed)
+        sms_error("cannot write frame to output file");
+    return isFailed ? -1 : 0;
+}
+
+/* wait until everything handed to the writing thread is written and stop it */
+static int StopWriterThread(SMS_FileWriter *pWriter)
+{
+    if(!pWriter->useThread)
+        return 0;
+    pthread_mutex_lock(&pWriter->lock);
+    pWriter->quit = 1;
+    pthread_cond_broadcast(&pWriter->cond);
+    pthread_mutex_unlock(&pWriter->lock);
+    pthread_join(pWriter->thread, NULL);
+    pthread_mutex_destroy(&pWriter->lock);
+    pthread_cond_destroy(&pWriter->cond);
+    pWriter->useThread = 0;
+    if(pWriter->isFailed)
+    {
+        sms_error("cannot write frame to output file");
+        return -1;
+    }
+    return 0;
+}
+
+static void FreeWriter(SMS_FileWriter *pWriter)
+{
+    free(pWriter->pChFileName);
+    free(pWriter->pSmsHeader);
+    free(pWriter->pQuantState);
+    free(pWriter->pMemory);
+    free(pWriter->pOffsets);
+    free(pWriter);
+}
+
+/*! \brief open a buffered writer for an SMS file
+ *
+ * The frames are put in a large buffer and written in big sequential
+ * writes, by a thread of the writer if useThread is set, so that encoding
+ * the next frames goes on while they are written. Everything is written to
+ * pChFileName with ".tmp" appended, which becomes pChFileName when the
+ * writer is closed with sms_closeFileWriter(). An unfinished file never has
+ * the name of a complete one. The file is written in the current version
+ * of the format, with the frame encoding of pSmsHeader->iFrameEncoding.
+ *
+ * \param pChFileName      file name for SMS file
+ * \param pSmsHeader       header for SMS file, it is copied
+ * \param useThread        whether to write from a thread of the writer
+ * \return the writer, NULL on error
+ */
+SMS_FileWriter *sms_openFileWriter(const char *pChFileName, const SMS_Header *pSmsHeader, int useThread)
+{
+    SMS_FileWriter *pWriter;
+    size_t sizeName = strlen(pChFileName) + 1;
+
+    if(pSmsHeader->iSmsMagic != SMS_MAGIC)
+    {
+        sms_error("not an SMS file");
+        return NULL;
+    }
+    if((pWriter = (SMS_FileWriter *)calloc(1, sizeof(SMS_FileWriter))) == NULL ||
+       (pWriter->pChFileName = (char *)malloc(2 * sizeName + 4)) == NULL ||
+       (pWriter->pSmsHeader = AllocHeader(pSmsHeader, pSmsHeader->pChTextCharacters, 0, 0)) == NULL)
+    {
+        if(pWriter)
+            FreeWriter(pWriter);
+        sms_error("cannot allocate memory for SMS file writer");
+        return NULL;
+    }
+    pWriter->pSmsHeader->pReadState = NULL;
+    pWriter->pSmsHeader->pWriteState = NULL;
+    pWriter->pChTempName = pWriter->pChFileName + sizeName;
+    memcpy(pWriter->pChFileName, pChFileName, sizeName);
+    sprintf(pWriter->pChTempName, "%s.tmp", pChFileName);
+
+    /* room for a few records at least, in aligned buffers */
+    pWriter->sizeBuffer = MAX(SMS_WRITE_BUFFER_BSIZE, 4 * MaxRecordBSize(pSmsHeader));
+    pWriter->sizeBuffer = (pWriter->sizeBuffer + SMS_WRITE_ALIGN - 1) & ~(size_t)(SMS_WRITE_ALIGN - 1);
+    if((pWriter->pMemory = malloc((useThread ? 2 : 1) * pWriter->sizeBuffer + SMS_WRITE_ALIGN)) == NULL)
+    {
+        FreeWriter(pWriter);
+        sms_error("cannot allocate memory for SMS file writer");
+        return NULL;
+    }
+    pWriter->pBuffers[0] = (unsigned char *)(((size_t)pWriter->pMemory + SMS_WRITE_ALIGN - 1) &
+                                             ~(size_t)(SMS_WRITE_ALIGN - 1));
+    pWriter->pBuffers[1] = pWriter->pBuffers[0] + (useThread ? pWriter->sizeBuffer : 0);
+
+    if(pSmsHeader->iFrameEncoding == SMS_ENC_QUANTIZED)
+    {
+        void *pMemory = calloc(1, QuantStateBSize(pSmsHeader));
+
+        if(pMemory == NULL)
+        {
+            FreeWriter(pWriter);
+            sms_error("cannot allocate memory for the frame encoding");
+            return NULL;
+        }
+        pWriter->pQuantState = InitQuantState(pMemory, pSmsHeader);
+    }
+
+    if((pWriter->pSmsFile = fopen(pWriter->pChTempName, "wb")) == NULL)
+    {
+        FreeWriter(pWriter);
+        sms_error("cannot open file for writing");
+        return NULL;
+    }
+    /* the writes are buffered here already */
+    setvbuf(pWriter->pSmsFile, NULL, _IONBF, 0);
+
+    /* the header is written again, complete, when the writer is closed */
+    pWriter->offset = HeadBSize(pSmsHeader);
+    if(WriteHeader(pWriter->pSmsFile, pSmsHeader, 0, 0) < 0)
+    {
+        sms_abortFileWriter(pWriter);
+        return NULL;
+    }
+
+    if(useThread)
+    {
+        pthread_mutex_init(&pWriter->lock, NULL);
+        pthread_cond_init(&pWriter->cond, NULL);
+        pWriter->useThread = 1;
+        if(pthread_create(&pWriter->thread, NULL, WriterThread, pWriter) != 0)
+        {
+            pthread_mutex_destroy(&pWriter->lock);
+            pthread_cond_destroy(&pWriter->cond);
+            pWriter->useThread = 0;
+            sms_abortFileWriter(pWriter);
+            sms_error("could not start SMS file writer thread");
+            return NULL;
+        }
+    }
+    return pWriter;
+}
+
+/* put bytes in the buffer, flushing it when it is full */
+static int PutWriterBytes(SMS_FileWriter *pWriter, const unsigned char *pBytes, size_t size)
+{
+    while(size > 0)
+    {
+        size_t n = MIN(size, pWriter->sizeBuffer - pWriter->sizeFilled);
+
+        memcpy(pWriter->pBuffers[pWriter->iFill] + pWriter->sizeFilled, pBytes, n);
+        pWriter->sizeFilled += n;
+        pWriter->offset += n;
+        pBytes += n;
+        size -= n;
+        if(pWriter->sizeFilled == pWriter->sizeBuffer && FlushWriter(pWriter) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* the frames encoded since the last record start at the offset of the record */
+static int AddWriterOffsets(SMS_FileWriter *pWriter, long long offset)
+{
+    for(; pWriter->nPending > 0; pWriter->nPending--)
+    {
+        if(pWriter->nFrames == pWriter->sizeOffsets)
+        {
+            int sizeOffsets = MAX(1024, 2 * pWriter->sizeOffsets);
+            long long *pOffsets = (long long *)realloc(pWriter->pOffsets, sizeOffsets * sizeof(long long));
+
+            if(pOffsets == NULL)
+            {
+                sms_error("cannot allocate memory for the frame index");
+                return -1;
+            }
+            pWriter->pOffsets = pOffsets;
+            pWriter->sizeOffsets = sizeOffsets;
+        }
+        pWriter->pOffsets[pWriter->nFrames++] = offset;
+    }
+    return 0;
+}
+
+/*! \brief add a frame to an SMS file writer
+ *
+ * With the SMS_ENC_TRACKCOUNT encoding, the inactive tracks at the end of the
+ * frame (all of their values are 0) are not written, with SMS_ENC_SPARSE none
+ * of the inactive tracks are. With SMS_ENC_QUANTIZED, the frame is added to
+ * the block of frames that is written when it is full, or when the writer
+ * is closed.
+ *
+ * \param pWriter       the writer
+ * \param pSmsFrame   pointer to SMS data frame
+ * \return 0 on success, -1 on failure
+ */
+int sms_writerAddFrame(SMS_FileWriter *pWriter, const SMS_Data *pSmsFrame)
+{
+    size_t sizeRecord;
+
+    /* records are encoded right into the buffer */
+    if(pWriter->sizeBuffer - pWriter->sizeFilled < MaxRecordBSize(pWriter->pSmsHeader) &&
+       FlushWriter(pWriter) < 0)
+        return -1;
+    sizeRecord = EncodeFrame(pWriter->pSmsHeader, pWriter->pQuantState, pSmsFrame->pSmsData,
+                             pWriter->pBuffers[pWriter->iFill] + pWriter->sizeFilled);
+    pWriter->nPending++;
+    if(sizeRecord == 0)
+        return 0;
+    if(AddWriterOffsets(pWriter, pWriter->offset) < 0)
+        return -1;
+    pWriter->sizeFilled += sizeRecord;
+    pWriter->offset += sizeRecord;
+    return 0;
 }
 
-/*! \brief write SMS header to file
+/*! \brief finish the file of an SMS file writer and free the writer
  *
- * \param pChFileName      file name for SMS file
- * \param pSmsHeader header for SMS file
- * \param ppSmsFile     (double pointer to)  file to be created
- * \return error code \see SMS_WRERR in SMS_ERRORS
+ * The rest of the frames and the frame index are written, then the header
+ * with the number of frames written. The file is flushed to disk before it
+ * gets its name, which replaces any file of that name at once.
+ *
+ * \param pWriter       the writer
+ * \param pSmsHeader header to write, NULL for the one given to sms_openFileWriter(). It can
+ * change fields such as fResidualPerc, not the size of the frames or of the text.
+ * \return 0 on success, -1 on error, the file is removed then
  */
-int sms_writeHeader(const char *pChFileName, SMS_Header *pSmsHeader, FILE **ppSmsFile)
+int sms_closeFileWriter(SMS_FileWriter *pWriter, const SMS_Header *pSmsHeader)
 {
-    int iVariableSize = 0;
+    const SMS_Header *pOpenHeader = pWriter->pSmsHeader;
+    unsigned char pBytes[8];
+    long long indexOffset;
+    int i;
 
-    if(pSmsHeader->iSmsMagic != SMS_MAGIC)
+    if(pSmsHeader == NULL)
+        pSmsHeader = pOpenHeader;
+    if(pSmsHeader->nTextCharacters != pOpenHeader->nTextCharacters ||
+       pSmsHeader->iFrameEncoding != pOpenHeader->iFrameEncoding ||
+       pSmsHeader->iFormat != pOpenHeader->iFormat || pSmsHeader->nTracks != pOpenHeader->nTracks ||
+       pSmsHeader->iStochasticType != pOpenHeader->iStochasticType ||
+       pSmsHeader->nStochasticCoeff != pOpenHeader->nStochasticCoeff ||
+       pSmsHeader->nEnvCoeff != pOpenHeader->nEnvCoeff)
     {
-        sms_error("not an SMS file");
+        sms_abortFileWriter(pWriter);
+        sms_error("the header does not match the frames written");
         return -1;
     }
-    if((*ppSmsFile = fopen (pChFileName, "w+")) == NULL)
+
+    /* the last block of quantized frames */
+    if(pWriter->pQuantState && pWriter->pQuantState->nFrames > 0)
     {
-        sms_error("cannot open file for writing");
-        return -1;
+        if((pWriter->sizeBuffer - pWriter->sizeFilled < MaxRecordBSize(pOpenHeader) &&
+            FlushWriter(pWriter) < 0) ||
+           AddWriterOffsets(pWriter, pWriter->offset) < 0)
+        {
+            sms_abortFileWriter(pWriter);
+            return -1;
+        }
+        i = (int)EncodeQuantizedBlock(pOpenHeader, pWriter->pQuantState,
+                                      pWriter->pBuffers[pWriter->iFill] + pWriter->sizeFilled);
+        pWriter->sizeFilled += i;
+        pWriter->offset += i;
     }
-    /* check variable size of header */
-    iVariableSize = sizeof(char) * pSmsHeader->nTextCharacters;
 
-    pSmsHeader->iHeadBSize = sizeof(SMS_Header) + iVariableSize;
+    /* the index */
+    indexOffset = pWriter->offset;
+    for(i = 0; i < pWriter->nFrames; i++)
+    {
+        PutU64(pBytes, pWriter->pOffsets[i]);
+        if(PutWriterBytes(pWriter, pBytes, 8) < 0)
+        {
+            sms_abortFileWriter(pWriter);
+            return -1;
+        }
+    }
+    if(FlushWriter(pWriter) < 0 || StopWriterThread(pWriter) < 0)
+    {
+        sms_abortFileWriter(pWriter);
+        return -1;
+    }
 
-    /* write header */
-    if(fwrite((void *)pSmsHeader, (size_t)1, (size_t)sizeof(SMS_Header),
-              *ppSmsFile) < (size_t)sizeof(SMS_Header))
+    /* the complete header, then the file gets its name */
+    if(fseek(pWriter->pSmsFile, 0, SEEK_SET) < 0 ||
+       WriteHeader(pWriter->pSmsFile, pSmsHeader, pWriter->nFrames, indexOffset) < 0 ||
+       fflush(pWriter->pSmsFile) != 0 ||
+#ifdef _WIN32
+       _commit(_fileno(pWriter->pSmsFile)) != 0)
+#else
+       fsync(fileno(pWriter->pSmsFile)) != 0)
+#endif
     {
-        sms_error("cannot write output file");
+        sms_abortFileWriter(pWriter);
+        sms_error("cannot write output file (header)");
         return -1;
     }
-    /* write variable part of header */
-    if(pSmsHeader->nTextCharacters > 0)
+    fclose(pWriter->pSmsFile);
+    pWriter->pSmsFile = NULL;
+#ifdef _WIN32
+    if(!MoveFileExA(pWriter->pChTempName, pWriter->pChFileName,
+                    MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+#else
+    if(rename(pWriter->pChTempName, pWriter->pChFileName) != 0)
+#endif
     {
-        char *pChStart = (char *) pSmsHeader->pChTextCharacters;
-        int iSize = sizeof(char) * pSmsHeader->nTextCharacters;
+        sms_abortFileWriter(pWriter);
+        sms_error("cannot rename the output file");
+        return -1;
+    }
+    FreeWriter(pWriter);
+    return 0;
+}
 
-        if(fwrite((void *)pChStart, (size_t)1, (size_t)iSize, *ppSmsFile) <
-           (size_t)iSize)
-        {
-            sms_error("cannot write output file (nTextCharacters)");
-            return -1;
-        }
+/*! \brief stop an SMS file writer, remove its file and free it
+ *
+ * \param pWriter       the writer
+ */
+void sms_abortFileWriter(SMS_FileWriter *pWriter)
+{
+    if(pWriter == NULL)
+        return;
+    if(pWriter->useThread)
+    {
+        pthread_mutex_lock(&pWriter->lock);
+        pWriter->quit = 1;
+        pthread_cond_broadcast(&pWriter->cond);
+        pthread_mutex_unlock(&pWriter->lock);
+        pthread_join(pWriter->thread, NULL);
+        pthread_mutex_destroy(&pWriter->lock);
+        pthread_cond_destroy(&pWriter->cond);
     }
+    if(pWriter->pSmsFile)
+        fclose(pWriter->pSmsFile);
+    remove(pWriter->pChTempName);
+    FreeWriter(pWriter);
+}
+
+/*! \brief write SMS header to file
+ *
+ * Opens an SMS file writer (see sms_openFileWriter()) for the header, that
+ * sms_writeFrame() and sms_writeFile() use. The file has its name once
+ * sms_writeFile() is done.
+ *
+ * \param pChFileName      file name for SMS file
+ * \param pSmsHeader header for SMS file
+ * \param ppSmsFile     (double pointer to)  file to be created
+ * \return error code \see SMS_WRERR in SMS_ERRORS
+ */
+int sms_writeHeader(const char *pChFileName, SMS_Header *pSmsHeader, FILE **ppSmsFile)
+{
+    SMS_FileWriter *pWriter = sms_openFileWriter(pChFileName, pSmsHeader, 0);
+
+    if(pWriter == NULL)
+        return -1;
+    pSmsHeader->pWriteState = pWriter;
+    *ppSmsFile = pWriter->pSmsFile;
     return 0;
 }
 
-/*! \brief rewrite SMS header and close file
+/*! \brief write the frame index, rewrite SMS header and close file
+ *
+ * The number of frames written to the header is the number of frames
+ * in the file.
  *
  * \param pSmsFile       pointer to SMS file
  * \param pSmsHeader pointer to header for SMS file
@@ -171,41 +1453,38 @@ int sms_writeHeader(const char *pChFileName, SMS_Header *pSmsHeader, FILE **ppSm
  */
 int sms_writeFile(FILE *pSmsFile, SMS_Header *pSmsHeader)
 {
-    int iVariableSize;
-
-    rewind(pSmsFile);
-
-    /* check variable size of header */
-    iVariableSize = sizeof(char) * pSmsHeader->nTextCharacters;
+    SMS_FileWriter *pWriter = (SMS_FileWriter *)pSmsHeader->pWriteState;
 
-    pSmsHeader->iHeadBSize = sizeof(SMS_Header) + iVariableSize;
-
-    /* write header */
-    if(fwrite((void *)pSmsHeader, (size_t)1, (size_t)sizeof(SMS_Header),
-              pSmsFile) < (size_t)sizeof(SMS_Header))
+    if(pWriter == NULL || pWriter->pSmsFile != pSmsFile)
     {
-        sms_error("cannot write output file (header)");
+        sms_error("SMS file was not opened with sms_writeHeader()");
         return -1;
     }
+    pSmsHeader->pWriteState = NULL;
+    return sms_closeFileWriter(pWriter, pSmsHeader);
+}
 
-    if(pSmsHeader->nTextCharacters > 0)
-    {
-        char *pChStart = (char *) pSmsHeader->pChTextCharacters;
-        int iSize = sizeof(char) * pSmsHeader->nTextCharacters;
-
-        if(fwrite((void *)pChStart, (size_t)1, (size_t)iSize, pSmsFile) <
-           (size_t)iSize)
-        {
-            sms_error("cannot write output file (nTextCharacters)");
-            return -1;
-        }
-    }
+/*! \brief stop writing an SMS file and remove it
+ *
+ * For a file opened with sms_writeHeader() that cannot be finished: an
+ * unfinished file never gets the name of the SMS file.
+ *
+ * \param pSmsFile       pointer to SMS file
+ * \param pSmsHeader pointer to header for SMS file
+ */
+void sms_abortFile(FILE *pSmsFile, SMS_Header *pSmsHeader)
+{
+    SMS_FileWriter *pWriter = (SMS_FileWriter *)pSmsHeader->pWriteState;
 
-    fclose(pSmsFile);
-    return 0;
+    if(pWriter == NULL || pWriter->pSmsFile != pSmsFile)
+        return;
+    pSmsHeader->pWriteState = NULL;
+    sms_abortFileWriter(pWriter);
 }
 
 /*! \brief write SMS frame
+ *
+ * \see sms_writerAddFrame()
  *
  * \param pSmsFile          pointer to SMS file
  * \param pSmsHeader  pointer to SMS header
@@ -214,16 +1493,16 @@ int sms_writeFile(FILE *pSmsFile, SMS_Header *pSmsHeader)
  */
 int sms_writeFrame(FILE *pSmsFile, const SMS_Header *pSmsHeader, const SMS_Data *pSmsFrame)
 {
-    if(fwrite((void *)pSmsFrame->pSmsData, 1, pSmsHeader->iFrameBSize,
-              pSmsFile) < (unsigned int) pSmsHeader->iFrameBSize)
+    SMS_FileWriter *pWriter = (SMS_FileWriter *)pSmsHeader->pWriteState;
+
+    if(pWriter == NULL || pWriter->pSmsFile != pSmsFile)
     {
-        sms_error("cannot write frame to output file");
+        sms_error("SMS file was not opened with sms_writeHeader()");
         return -1;
     }
-    return 0;
+    return sms_writerAddFrame(pWriter, pSmsFrame);
 }
 
-
 /*! \brief get the size in bytes of the frame in a SMS file
  *
  * \param pSmsHeader    pointer to SMS header
@@ -255,7 +1534,26 @@ int sms_frameSizeB(const SMS_Header *pSmsHeader)
 }
 
 
+/* seek to a byte offset from the start of a file, also beyond the range of
+ * long; an offset that the file position cannot hold is an error */
+static int SeekFile(FILE *pFile, unsigned long long offset)
+{
+#ifdef _WIN32
+    if(offset > (unsigned long long)LLONG_MAX)
+        return -1;
+    return _fseeki64(pFile, (__int64)offset, SEEK_SET);
+#else
+    if(offset > ((1ULL << (sizeof(off_t) * 8 - 1)) - 1))
+        return -1;
+    return fseeko(pFile, (off_t)offset, SEEK_SET);
+#endif
+}
+
 /*! \brief function to read SMS header
+ *
+ * Files of all versions are read, the header describes the file they
+ * were read from (iFileVersion, iFrameEncoding, iSampleBytes). It is one
+ * block of memory with its text and frame index, to be freed with free().
  *
  * \param pChFileName             file name for SMS file
  * \param ppSmsHeader   (double pointer to) SMS header
@@ -264,89 +1562,218 @@ int sms_frameSizeB(const SMS_Header *pSmsHeader)
  */
 int sms_getHeader(const char *pChFileName, SMS_Header **ppSmsHeader, FILE **ppSmsFile)
 {
-    int iHeadBSize, iFrameBSize, nFrames;
-    int iMagicNumber;
+    unsigned char pFields[SMS_HEADER_FIELDS_BSIZE];
+    SMS_Header header;
+    unsigned long long indexOffset = 0;
+    int iFieldsBSize, nOffsets = 0, i;
 
     /* open file for reading */
-    if((*ppSmsFile = fopen (pChFileName, "r")) == NULL)
+    if((*ppSmsFile = fopen (pChFileName, "rb")) == NULL)
     {
         sms_error("could not open SMS header");
         return -1;
     }
     /* read magic number */
-    if(fread((void *) &iMagicNumber, (size_t) sizeof(int), (size_t)1,
-             *ppSmsFile) < (size_t)1)
+    if(fread(pFields, 1, 4, *ppSmsFile) < 4)
     {
         sms_error("could not read SMS header");
         return -1;
     }
 
-    if(iMagicNumber != SMS_MAGIC)
+    if(memcmp(pFields, pFileMagic, 4) == 0)
     {
-        sms_error("not an SMS file");
-        return -1;
+        if(fread(pFields + 4, 1, SMS_HEADER_FIELDS_BSIZE - 4, *ppSmsFile) < SMS_HEADER_FIELDS_BSIZE - 4)
+        {
+            sms_error("could not read SMS header");
+            return -1;
+        }
+        if(DecodeHeader(pFields, &header, &iFieldsBSize, &indexOffset) < 0)
+            return -1;
+        /* the frames have to be found through the index when they differ in size */
+        if(header.iFrameEncoding != SMS_ENC_DENSE)
+            nOffsets = header.nFrames;
     }
-
-    /* read size of of header */
-    if(fread((void *) &iHeadBSize, (size_t) sizeof(int), (size_t)1,
-             *ppSmsFile) < (size_t)1)
+    else
     {
-        sms_error("could not read SMS header (iHeadBSize)");
-        return -1;
+        SMS_HeaderV1 headerV1;
+
+        rewind(*ppSmsFile);
+        if(fread(&headerV1, sizeof(SMS_HeaderV1), 1, *ppSmsFile) < 1)
+        {
+            sms_error("could not read SMS header");
+            return -1;
+        }
+        if(headerV1.iSmsMagic != SMS_MAGIC)
+        {
+            sms_error("not an SMS file");
+            return -1;
+        }
+        HeaderFromV1(&header, &headerV1);
+        if(CheckHeaderV1(&header) < 0)
+            return -1;
+        iFieldsBSize = sizeof(SMS_HeaderV1);
     }
 
-    if(iHeadBSize <= 0)
+    if((*ppSmsHeader = AllocHeader(&header, NULL, nOffsets,
+                                   (header.iFrameEncoding == SMS_ENC_QUANTIZED)
+                                   ? QuantStateBSize(&header) : 0)) == NULL)
+        return -1;
+
+    /* read text */
+    if(header.nTextCharacters > 0 &&
+       (fseek(*ppSmsFile, iFieldsBSize, SEEK_SET) < 0 ||
+        fread((*ppSmsHeader)->pChTextCharacters, 1, header.nTextCharacters, *ppSmsFile) <
+        (size_t)header.nTextCharacters))
     {
-        sms_error("bad SMS header size");
+        free(*ppSmsHeader);
+        *ppSmsHeader = NULL;
+        sms_error("cannot read header of SMS file");
         return -1;
     }
 
-    /* read number of data Frames */
-    if(fread((void *) &nFrames, (size_t) sizeof(int), (size_t)1,
-              *ppSmsFile) < (size_t)1)
+    /* read frame index */
+    if(nOffsets > 0)
     {
-        sms_error("could not read SMS number of frames");
-        return -1;
+        long long *pOffsets = (*ppSmsHeader)->pFrameOffsets;
+
+        if(SeekFile(*ppSmsFile, indexOffset) < 0 ||
+           fread(pOffsets, sizeof(long long), nOffsets, *ppSmsFile) < (size_t)nOffsets)
+        {
+            free(*ppSmsHeader);
+            *ppSmsHeader = NULL;
+            sms_error("cannot read the frame index of SMS file");
+            return -1;
+        }
+        for(i = 0; i < nOffsets; i++)
+            pOffsets[i] = GetU64((const unsigned char *)&pOffsets[i]);
     }
 
-    if(nFrames <= 0)
+    return 0;
+}
+
+/* read a frame of a quantized file: the frames of its block are decoded up
+ * to it, from the last frame read if it is before it in the same block */
+static int ReadQuantizedFrame(FILE *pSmsFile, const SMS_Header *pSmsHeader, int iFrame,
+                              SMS_Data *pSmsFrame)
+{
+    QuantState *pState = (QuantState *)pSmsHeader->pReadState;
+    int iBlock = iFrame - iFrame % SMS_QUANT_BLOCK_FRAMES;
+
+    if(pState == NULL)
     {
-        sms_error("number of frames <= 0");
+        sms_error("SMS header was not read with sms_getHeader()");
         return -1;
     }
+    if(pState->iBlock != iBlock || pState->iFrame > iFrame)
+    {
+        unsigned char pBlockHead[8];
 
-    /* read size of data Frames */
-    if(fread((void *) &iFrameBSize, (size_t) sizeof(int), (size_t)1,
-              *ppSmsFile) < (size_t)1)
+        pState->iBlock = -1;
+        if(SeekFile(pSmsFile, pSmsHeader->pFrameOffsets[iFrame]) < 0 ||
+           fread(pBlockHead, 1, 8, pSmsFile) < 8 ||
+           StartQuantizedBlock(pState, pSmsHeader, pBlockHead) < 0 ||
+           fread(pState->pBlock, 1, pState->nBits / 8, pSmsFile) < pState->nBits / 8)
+        {
+            sms_error("cannot read SMS frame");
+            return -1;
+        }
+        pState->iBlock = iBlock;
+        pState->iFrame = iBlock - 1;
+    }
+    while(pState->iFrame < iFrame)
     {
-        sms_error("could not read size of SMS data");
-        return -1;
+        if(pState->nFrames >= pState->nBlockFrames ||
+           DecodeQuantizedFrame(pSmsHeader, pState, pState->pValues) < 0)
+        {
+            pState->iBlock = -1;
+            sms_error("bad SMS frame");
+            return -1;
+        }
+        pState->iFrame++;
     }
+    memcpy(pSmsFrame->pSmsData, pState->pValues, sms_frameSizeB(pSmsHeader));
+    return 0;
+}
 
-    if(iFrameBSize <= 0)
+/* read a frame of a version 2 file */
+static int ReadFrame(FILE *pSmsFile, const SMS_Header *pSmsHeader, int iFrame, SMS_Data *pSmsFrame)
+{
+    sfloat *pValues = pSmsFrame->pSmsData;
+    unsigned int nStored = pSmsHeader->nTracks;
+    int nTracks = pSmsHeader->nTracks, nDet, nTail, iDet;
+    unsigned long long offset;
+
+    if(iFrame < 0 || iFrame >= pSmsHeader->nFrames)
     {
-        sms_error("size bytes of frames <= 0");
+        sms_error("SMS frame number out of range");
         return -1;
     }
-
-    /* allocate memory for header */
-    if(((*ppSmsHeader) = (SMS_Header *)malloc (iHeadBSize)) == NULL)
+    if(pSmsHeader->iFrameEncoding == SMS_ENC_QUANTIZED)
+        return ReadQuantizedFrame(pSmsFile, pSmsHeader, iFrame, pSmsFrame);
+    FrameLayout(pSmsHeader, &nDet, &nTail);
+    if(pSmsHeader->pFrameOffsets)
+        offset = pSmsHeader->pFrameOffsets[iFrame];
+    else
+        offset = pSmsHeader->iHeadBSize +
+            (unsigned long long)iFrame * (nDet * nTracks + nTail) * pSmsHeader->iSampleBytes;
+    if(SeekFile(pSmsFile, offset) < 0)
     {
-        sms_error("cannot allocate memory for header");
+        sms_error("cannot seek to the SMS frame");
         return -1;
     }
+    if(pSmsHeader->iFrameEncoding != SMS_ENC_DENSE)
+    {
+        unsigned char pCount[8];
+
+        if(fread(pCount, 1, 8, pSmsFile) < 8)
+        {
+            sms_error("cannot read SMS frame");
+            return -1;
+        }
+        if((nStored = GetU32(pCount)) > (unsigned int)nTracks)
+        {
+            sms_error("bad number of tracks in SMS frame");
+            return -1;
+        }
+    }
+    for(iDet = 0; iDet < nDet; iDet++)
+    {
+        sfloat *pDet = pValues + iDet * nTracks;
 
-    /* read header */
-    rewind(*ppSmsFile);
-    if(fread((void *)(*ppSmsHeader), 1, iHeadBSize, *ppSmsFile) < (unsigned int) iHeadBSize)
+        /* the tracks of a sparse frame are read to the end of the row first */
+        if(pSmsHeader->iFrameEncoding == SMS_ENC_SPARSE)
+            pDet += nTracks - nStored;
+        if(ReadValues(pSmsFile, pDet, nStored, pSmsHeader->iSampleBytes) < 0)
+        {
+            sms_error("cannot read SMS frame");
+            return -1;
+        }
+        if(pSmsHeader->iFrameEncoding == SMS_ENC_TRACKCOUNT)
+            memset(pDet + nStored, 0, (nTracks - nStored) * sizeof(sfloat));
+    }
+    if(ReadValues(pSmsFile, pValues + nDet * nTracks, nTail, pSmsHeader->iSampleBytes) < 0)
     {
-        sms_error("cannot read header of SMS file");
+        sms_error("cannot read SMS frame");
         return -1;
     }
+    if(pSmsHeader->iFrameEncoding == SMS_ENC_SPARSE)
+    {
+        unsigned char pIds[SMS_IO_CHUNK * 4];
+        int iTrack = 0, k, n;
 
-    if((*ppSmsHeader)->nTextCharacters > 0)
-        (*ppSmsHeader)->pChTextCharacters = (char *)(*ppSmsHeader) + sizeof(SMS_Header);
-
+        for(k = 0; k < (int)nStored; k += n)
+        {
+            n = MIN((int)nStored - k, SMS_IO_CHUNK);
+            if(fread(pIds, 4, n, pSmsFile) < (size_t)n ||
+               ScatterTracks(pValues, nTracks, nDet, nStored, pIds, k, n, &iTrack) < 0)
+            {
+                sms_error("cannot read SMS frame");
+                return -1;
+            }
+        }
+        for(iDet = 0; iDet < nDet; iDet++)
+            memset(pValues + iDet * nTracks + iTrack, 0, (nTracks - iTrack) * sizeof(sfloat));
+    }
     return 0;
 }
 
@@ -360,8 +1787,11 @@ int sms_getHeader(const char *pChFileName, SMS_Header **ppSmsHeader, FILE **ppSm
  */
 int sms_getFrame(FILE *pSmsFile, SMS_Header *pSmsHeader, int iFrame, SMS_Data *pSmsFrame)
 {
-    if(fseek(pSmsFile, pSmsHeader->iHeadBSize + iFrame *
-             pSmsHeader->iFrameBSize, SEEK_SET) < 0)
+    if(pSmsHeader->iFileVersion >= 2)
+        return ReadFrame(pSmsFile, pSmsHeader, iFrame, pSmsFrame);
+
+    if(SeekFile(pSmsFile, pSmsHeader->iHeadBSize +
+                (unsigned long long)iFrame * pSmsHeader->iFrameBSize) < 0)
     {
         sms_error("cannot seek to the SMS frame");
         return -1;
@@ -377,54 +1807,16 @@ int sms_getFrame(FILE *pSmsFile, SMS_Header *pSmsHeader, int iFrame, SMS_Data *p
     return 0;
 }
 
-/*! \brief  allocate memory for a frame of SMS data
- *
- * \param pSmsFrame      pointer to a frame of SMS data
- * \param nTracks             number of sinusoidal tracks in frame
- * \param nStochCoeff             number of stochastic coefficients in frame
- * \param iPhase              whether phase information is in the frame
- * \param stochType           stochastic resynthesis type
- * \param nStochCoeff             number of envelope coefficients in frame
- * \param nEnvCoeff           number of envelope coefficients in frame
- * \return  0 on success, -1 on error
- */
-int sms_allocFrame(SMS_Data *pSmsFrame, int nTracks, int nStochCoeff, int iPhase,
-                   int stochType, int nEnvCoeff)
+/* set the sizes and the pointers to data types within the smsData array */
+static void SetFramePointers(SMS_Data *pSmsFrame, int nTracks, int nStochCoeff, int iPhase,
+                             int stochType, int nEnvCoeff)
 {
     sfloat *dataPos;  /* a marker to locate specific data witin smsData */
 
-    /* calculate size of frame */
-    int sizeData = sizeof(sfloat); /* nSamples */
-    /* frequencies and magnitudes */
-    sizeData += 2 * nTracks * sizeof(sfloat);
-    /* phases */
-    if(iPhase > 0)
-        sizeData += nTracks * sizeof(sfloat);
-    /* stochastic coefficients */
-    if(stochType == SMS_STOC_APPROX)
-        sizeData += (nStochCoeff + 1) * sizeof(sfloat);
-    else if(stochType == SMS_STOC_IFFT)
-        sizeData += ((2*nStochCoeff) + 1) * sizeof(sfloat);
-    /* spectral envelope */
-    sizeData += nEnvCoeff * sizeof(sfloat); /* add in number of envelope coefficients (cep or fbins) if any */
-
-    /* allocate memory for data */
-    pSmsFrame->pSmsData = (sfloat *)malloc(sizeData);
-    if(pSmsFrame->pSmsData == NULL)
-    {
-        sms_error("cannot allocate memory for SMS frame data");
-        return -1;
-    }
-    memset(pSmsFrame->pSmsData, 0, sizeData);
-
-    /* set the variables in the structure */
-    /* \todo why not set these in init functions, then allocate with them?? */
-    pSmsFrame->sizeData = sizeData;
     pSmsFrame->nTracks = nTracks;
     pSmsFrame->nCoeff = nStochCoeff;
     pSmsFrame->nEnvCoeff = nEnvCoeff;
 
-    /* set pointers to data types within smsData array */
     pSmsFrame->pFSinFreq = pSmsFrame->pSmsData;
     dataPos = (sfloat *)(pSmsFrame->pFSinFreq + nTracks);
 
@@ -440,34 +1832,77 @@ int sms_allocFrame(SMS_Data *pSmsFrame, int nTracks, int nStochCoeff, int iPhase
         pSmsFrame->pFSinPha = NULL;
 
     if(stochType == SMS_STOC_APPROX)
-    {
-        pSmsFrame->pFStocCoeff = dataPos;
-        dataPos = (sfloat *)(pSmsFrame->pFStocCoeff + nStochCoeff);
-
-        pSmsFrame->pFStocGain = dataPos;
-        dataPos = (sfloat *)(pSmsFrame->pFStocGain + 1);
-    }
+    {
+        pSmsFrame->pFStocCoeff = dataPos;
+        dataPos = (sfloat *)(pSmsFrame->pFStocCoeff + nStochCoeff);
+
+        pSmsFrame->pFStocGain = dataPos;
+        dataPos = (sfloat *)(pSmsFrame->pFStocGain + 1);
+    }
+    else if(stochType == SMS_STOC_IFFT)
+    {
+        pSmsFrame->pFStocCoeff = dataPos;
+        dataPos = (sfloat *)(pSmsFrame->pFStocCoeff + nStochCoeff);
+        pSmsFrame->pResPhase = dataPos;
+        dataPos = (sfloat *)(pSmsFrame->pResPhase + nStochCoeff);
+        pSmsFrame->pFStocGain = dataPos;
+        dataPos = (sfloat *)(pSmsFrame->pFStocGain + 1);
+    }
+    else
+    {
+        pSmsFrame->pFStocCoeff = NULL;
+        pSmsFrame->pResPhase = NULL;
+        pSmsFrame->pFStocGain = NULL;
+    }
+
+    if(nEnvCoeff > 0)
+        pSmsFrame->pSpecEnv = dataPos;
+    else
+        pSmsFrame->pSpecEnv = NULL;
+}
+
+/*! \brief  allocate memory for a frame of SMS data
+ *
+ * \param pSmsFrame      pointer to a frame of SMS data
+ * \param nTracks             number of sinusoidal tracks in frame
+ * \param nStochCoeff             number of stochastic coefficients in frame
+ * \param iPhase              whether phase information is in the frame
+ * \param stochType           stochastic resynthesis type
+ * \param nStochCoeff             number of envelope coefficients in frame
+ * \param nEnvCoeff           number of envelope coefficients in frame
+ * \return  0 on success, -1 on error
+ */
+int sms_allocFrame(SMS_Data *pSmsFrame, int nTracks, int nStochCoeff, int iPhase,
+                   int stochType, int nEnvCoeff)
+{
+    /* calculate size of frame */
+    int sizeData = sizeof(sfloat); /* nSamples */
+    /* frequencies and magnitudes */
+    sizeData += 2 * nTracks * sizeof(sfloat);
+    /* phases */
+    if(iPhase > 0)
+        sizeData += nTracks * sizeof(sfloat);
+    /* stochastic coefficients */
+    if(stochType == SMS_STOC_APPROX)
+        sizeData += (nStochCoeff + 1) * sizeof(sfloat);
     else if(stochType == SMS_STOC_IFFT)
+        sizeData += ((2*nStochCoeff) + 1) * sizeof(sfloat);
+    /* spectral envelope */
+    sizeData += nEnvCoeff * sizeof(sfloat); /* add in number of envelope coefficients (cep or fbins) if any */
+
+    /* allocate memory for data */
+    pSmsFrame->pSmsData = (sfloat *)malloc(sizeData);
+    if(pSmsFrame->pSmsData == NULL)
     {
-        pSmsFrame->pFStocCoeff = dataPos;
-        dataPos = (sfloat *)(pSmsFrame->pFStocCoeff + nStochCoeff);
-        pSmsFrame->pResPhase = dataPos;
-        dataPos = (sfloat *)(pSmsFrame->pResPhase + nStochCoeff);
-        pSmsFrame->pFStocGain = dataPos;
-        dataPos = (sfloat *)(pSmsFrame->pFStocGain + 1);
-    }
-    else
-    {
-        pSmsFrame->pFStocCoeff = NULL;
-        pSmsFrame->pResPhase = NULL;
-        pSmsFrame->pFStocGain = NULL;
+        sms_error("cannot allocate memory for SMS frame data");
+        return -1;
     }
+    memset(pSmsFrame->pSmsData, 0, sizeData);
 
-    if(nEnvCoeff > 0)
-        pSmsFrame->pSpecEnv = dataPos;
-    else
-        pSmsFrame->pSpecEnv = NULL;
-
+    /* set the variables in the structure */
+    /* \todo why not set these in init functions, then allocate with them?? */
+    pSmsFrame->sizeData = sizeData;
+    SetFramePointers(pSmsFrame, nTracks, nStochCoeff, iPhase, stochType, nEnvCoeff);
     return 0;
 }
 
@@ -560,6 +1995,9 @@ void sms_copyFrame(SMS_Data *pCopySmsData, const SMS_Data *pOriginalSmsData)
         if(pOriginalSmsData->pFStocCoeff != NULL &&
            pCopySmsData->pFStocCoeff != NULL)
         {
+            memcpy(pCopySmsData->pFStocCoeff,
+                   pOriginalSmsData->pFStocCoeff,
+                   sizeof(sfloat) * nCoeff);
             if(pOriginalSmsData->pResPhase != NULL &&
                pCopySmsData->pResPhase != NULL)
                 memcpy(pCopySmsData->pResPhase,
@@ -571,6 +2009,11 @@ void sms_copyFrame(SMS_Data *pCopySmsData, const SMS_Data *pOriginalSmsData)
             memcpy(pCopySmsData->pFStocGain,
                    pOriginalSmsData->pFStocGain,
                    sizeof(sfloat));
+        if(pOriginalSmsData->pSpecEnv != NULL &&
+           pCopySmsData->pSpecEnv != NULL)
+            memcpy(pCopySmsData->pSpecEnv,
+                   pOriginalSmsData->pSpecEnv,
+                   sizeof(sfloat) * MIN(pCopySmsData->nEnvCoeff, pOriginalSmsData->nEnvCoeff));
     }
 }
 
@@ -619,3 +2062,596 @@ void sms_interpolateFrames(const SMS_Data *pSmsFrame1, const SMS_Data *pSmsFrame
         pSmsFrameOut->pSpecEnv[i] = pSmsFrame1->pSpecEnv[i] + fInterpFactor *
                                     (pSmsFrame2->pSpecEnv[i] - pSmsFrame1->pSpecEnv[i]);
 }
+
+/* decode a frame of a version 2 file in memory, to the layout of SMS_Data::pSmsData */
+static int DecodeFrame(const unsigned char *pFile, size_t sizeFile, unsigned long long offset,
+                       const SMS_Header *pSmsHeader, sfloat *pValues)
+{
+    unsigned int nStored = pSmsHeader->nTracks;
+    int nTracks = pSmsHeader->nTracks, nDet, nTail, iDet;
+    size_t sizeFrame;
+
+    FrameLayout(pSmsHeader, &nDet, &nTail);
+    if(pSmsHeader->iFrameEncoding != SMS_ENC_DENSE)
+    {
+        if(offset > sizeFile || sizeFile - offset < 8 ||
+           (nStored = GetU32(pFile + offset)) > (unsigned int)nTracks)
+            return -1;
+        offset += 8;
+    }
+    sizeFrame = (size_t)(nDet * nStored + nTail) * pSmsHeader->iSampleBytes;
+    if(pSmsHeader->iFrameEncoding == SMS_ENC_SPARSE)
+        sizeFrame += 4 * nStored;
+    if(offset > sizeFile || sizeFile - offset < sizeFrame)
+        return -1;
+    for(iDet = 0; iDet < nDet; iDet++)
+    {
+        sfloat *pDet = pValues + iDet * nTracks;
+
+        if(pSmsHeader->iFrameEncoding == SMS_ENC_SPARSE)
+            pDet += nTracks - nStored;
+        DecodeValues(pDet, pFile + offset, nStored, pSmsHeader->iSampleBytes);
+        if(pSmsHeader->iFrameEncoding == SMS_ENC_TRACKCOUNT)
+            memset(pDet + nStored, 0, (nTracks - nStored) * sizeof(sfloat));
+        offset += nStored * pSmsHeader->iSampleBytes;
+    }
+    DecodeValues(pValues + nDet * nTracks, pFile + offset, nTail, pSmsHeader->iSampleBytes);
+    if(pSmsHeader->iFrameEncoding == SMS_ENC_SPARSE)
+    {
+        int iTrack = 0;
+
+        offset += nTail * pSmsHeader->iSampleBytes;
+        if(ScatterTracks(pValues, nTracks, nDet, nStored, pFile + offset, 0, nStored, &iTrack) < 0)
+            return -1;
+        for(iDet = 0; iDet < nDet; iDet++)
+            memset(pValues + iDet * nTracks + iTrack, 0, (nTracks - iTrack) * sizeof(sfloat));
+    }
+    return 0;
+}
+
+/* check the header of an SMS file in memory, and whether its frames are
+ * stored as they are in memory */
+static int ParseFileHeader(const unsigned char *pBytes, size_t sizeBytes, SMS_Header *pHeader,
+                           int *pFieldsBSize, unsigned long long *pIndexOffset, int *pIsNative)
+{
+    *pIndexOffset = 0;
+    if(sizeBytes >= SMS_HEADER_FIELDS_BSIZE && memcmp(pBytes, pFileMagic, 4) == 0)
+    {
+        if(DecodeHeader(pBytes, pHeader, pFieldsBSize, pIndexOffset) < 0)
+            return -1;
+        if(pHeader->iFrameEncoding != SMS_ENC_DENSE &&
+           (*pIndexOffset > sizeBytes || (sizeBytes - *pIndexOffset) / 8 < (size_t)pHeader->nFrames))
+        {
+            sms_error("SMS file is shorter than its header says");
+            return -1;
+        }
+        *pIsNative = (pHeader->iFrameEncoding == SMS_ENC_DENSE &&
+                      pHeader->iSampleBytes == sizeof(sfloat) && IsLittleEndian());
+    }
+    else if(sizeBytes >= sizeof(SMS_HeaderV1) &&
+            ((const SMS_HeaderV1 *)pBytes)->iSmsMagic == SMS_MAGIC)
+    {
+        HeaderFromV1(pHeader, (const SMS_HeaderV1 *)pBytes);
+        if(CheckHeaderV1(pHeader) < 0 || pHeader->iFrameBSize != sms_frameSizeB(pHeader))
+        {
+            sms_error("bad SMS header");
+            return -1;
+        }
+        *pFieldsBSize = sizeof(SMS_HeaderV1);
+        *pIsNative = 1;
+    }
+    else
+    {
+        sms_error("not an SMS file");
+        return -1;
+    }
+    if(sizeBytes < (size_t)pHeader->iHeadBSize ||
+       (*pIsNative && sizeBytes - pHeader->iHeadBSize < (size_t)pHeader->nFrames * pHeader->iFrameBSize))
+    {
+        sms_error("SMS file is shorter than its header says");
+        return -1;
+    }
+    return 0;
+}
+
+/* decode all of the frames of an SMS file in memory to pFrames, one after
+ * the other in the layout of SMS_Data::pSmsData */
+static int DecodeFrames(const unsigned char *pBytes, size_t sizeBytes, const SMS_Header *pHeader,
+                        unsigned long long indexOffset, int isNative, char *pFrames)
+{
+    int iFrame;
+
+    if(isNative)
+        memcpy(pFrames, pBytes + pHeader->iHeadBSize, (size_t)pHeader->nFrames * pHeader->iFrameBSize);
+    else if(pHeader->iFrameEncoding == SMS_ENC_QUANTIZED)
+    {
+        void *pMemory = calloc(1, QuantStateBSize(pHeader));
+        QuantState *pState;
+
+        if(pMemory == NULL)
+        {
+            sms_error("cannot allocate memory for the SMS frames");
+            return -1;
+        }
+        pState = InitQuantState(pMemory, pHeader);
+        for(iFrame = 0; iFrame < pHeader->nFrames; iFrame++)
+        {
+            unsigned long long offset = GetU64(pBytes + indexOffset + 8 * iFrame);
+            int isBad = 0;
+
+            if(iFrame % SMS_QUANT_BLOCK_FRAMES == 0)
+            {
+                isBad = (offset > sizeBytes - 8 ||
+                         StartQuantizedBlock(pState, pHeader, pBytes + offset) < 0 ||
+                         pState->nBits / 8 > sizeBytes - 8 - offset);
+                if(!isBad)
+                    memcpy(pState->pBlock, pBytes + offset + 8, pState->nBits / 8);
+            }
+            if(isBad || pState->nFrames >= pState->nBlockFrames ||
+               DecodeQuantizedFrame(pHeader, pState,
+                                    (sfloat *)(pFrames + (size_t)iFrame * pHeader->iFrameBSize)) < 0)
+            {
+                free(pMemory);
+                sms_error("bad SMS frame");
+                return -1;
+            }
+        }
+        free(pMemory);
+    }
+    else
+    {
+        int nDet, nTail;
+        size_t sizeFrame;
+
+        FrameLayout(pHeader, &nDet, &nTail);
+        sizeFrame = (size_t)(nDet * pHeader->nTracks + nTail) * pHeader->iSampleBytes;
+        for(iFrame = 0; iFrame < pHeader->nFrames; iFrame++)
+        {
+            unsigned long long offset = (pHeader->iFrameEncoding == SMS_ENC_DENSE)
+                ? pHeader->iHeadBSize + iFrame * sizeFrame
+                : GetU64(pBytes + indexOffset + 8 * iFrame);
+
+            if(DecodeFrame(pBytes, sizeBytes, offset, pHeader,
+                           (sfloat *)(pFrames + (size_t)iFrame * pHeader->iFrameBSize)) < 0)
+            {
+                sms_error("bad SMS frame");
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* release what sms_mapFile has got so far */
+static void UnmapFile(SMS_MappedFile *pMappedFile)
+{
+    if(pMappedFile->pMap)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(pMappedFile->pMap);
+#else
+        munmap(pMappedFile->pMap, pMappedFile->sizeMap);
+#endif
+    }
+#ifdef _WIN32
+    if(pMappedFile->hMapping)
+        CloseHandle((HANDLE)pMappedFile->hMapping);
+#endif
+    pMappedFile->pMap = NULL;
+    pMappedFile->hMapping = NULL;
+}
+
+/*! \brief map an SMS file into memory for reading
+ *
+ * The file is mapped read-only and shared, so any number of models can be
+ * open at the same time and only the frames that are used are ever read
+ * from disk. If the frames are not stored as they are in memory (another
+ * frame encoding or sample size, a big-endian machine, or an older file
+ * with unaligned frames), they are converted once into memory instead.
+ * Free with sms_unmapFile().
+ *
+ * \param pChFileName      file name for SMS file
+ * \param pMappedFile      the mapped file to fill
+ * \return 0 on success, -1 on error
+ */
+int sms_mapFile(const char *pChFileName, SMS_MappedFile *pMappedFile)
+{
+    const unsigned char *pBytes;
+    SMS_Header header;
+    unsigned long long indexOffset;
+    int iFieldsBSize, isNative;
+
+    memset(pMappedFile, 0, sizeof(SMS_MappedFile));
+
+#ifdef _WIN32
+    {
+        HANDLE hFile = CreateFileA(pChFileName, GENERIC_READ, FILE_SHARE_READ, NULL,
+                                   OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        LARGE_INTEGER size;
+
+        if(hFile == INVALID_HANDLE_VALUE)
+        {
+            sms_error("could not open SMS file");
+            return -1;
+        }
+        if(!GetFileSizeEx(hFile, &size) || size.QuadPart == 0)
+        {
+            CloseHandle(hFile);
+            sms_error("could not get the size of the SMS file");
+            return -1;
+        }
+        pMappedFile->sizeMap = (size_t)size.QuadPart;
+        pMappedFile->hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        CloseHandle(hFile);
+        if(pMappedFile->hMapping)
+            pMappedFile->pMap = MapViewOfFile((HANDLE)pMappedFile->hMapping, FILE_MAP_READ, 0, 0, 0);
+        if(pMappedFile->pMap == NULL)
+        {
+            UnmapFile(pMappedFile);
+            sms_error("could not map the SMS file");
+            return -1;
+        }
+    }
+#else
+    {
+        struct stat fileStat;
+        int iFile = open(pChFileName, O_RDONLY);
+
+        if(iFile < 0)
+        {
+            sms_error("could not open SMS file");
+            return -1;
+        }
+        if(fstat(iFile, &fileStat) < 0 || fileStat.st_size == 0)
+        {
+            close(iFile);
+            sms_error("could not get the size of the SMS file");
+            return -1;
+        }
+        pMappedFile->sizeMap = (size_t)fileStat.st_size;
+        pMappedFile->pMap = mmap(NULL, pMappedFile->sizeMap, PROT_READ, MAP_SHARED, iFile, 0);
+        close(iFile);
+        if(pMappedFile->pMap == MAP_FAILED)
+        {
+            pMappedFile->pMap = NULL;
+            sms_error("could not map the SMS file");
+            return -1;
+        }
+    }
+#endif
+
+    /* check the header, and keep a copy of it with its text */
+    pBytes = (const unsigned char *)pMappedFile->pMap;
+    if(ParseFileHeader(pBytes, pMappedFile->sizeMap, &header, &iFieldsBSize, &indexOffset, &isNative) < 0 ||
+       (pMappedFile->pSmsHeader = AllocHeader(&header, (const char *)pBytes + iFieldsBSize, 0, 0)) == NULL)
+    {
+        UnmapFile(pMappedFile);
+        return -1;
+    }
+
+    pMappedFile->pFrames = (const char *)pMappedFile->pMap + header.iHeadBSize;
+    if(isNative && header.iHeadBSize % sizeof(sfloat) == 0)
+        return 0;
+
+    /* the frames have to be copied or converted */
+    if((pMappedFile->pFrameCopy = malloc((size_t)header.nFrames * header.iFrameBSize)) == NULL)
+    {
+        sms_unmapFile(pMappedFile);
+        sms_error("cannot allocate memory for the SMS frames");
+        return -1;
+    }
+    if(DecodeFrames(pBytes, pMappedFile->sizeMap, &header, indexOffset, isNative,
+                    (char *)pMappedFile->pFrameCopy) < 0)
+    {
+        sms_unmapFile(pMappedFile);
+        return -1;
+    }
+    pMappedFile->pFrames = (const char *)pMappedFile->pFrameCopy;
+    UnmapFile(pMappedFile);
+    return 0;
+}
+
+/*! \brief set a frame to the data of a mapped SMS file
+ *
+ * The pointers of pSmsFrame are set to the data in the mapping, nothing is
+ * copied. The frame is read-only, it must not be changed or given to
+ * sms_freeFrame(), and it is only good until sms_unmapFile(). Copy it with
+ * sms_copyFrame() to modify it.
+ *
+ * \param pMappedFile      the mapped file
+ * \param iFrame               frame number
+ * \param pSmsFrame       pointer to SMS frame
+ * \return  0 on sucess, -1 on error
+ */
+int sms_getMappedFrame(const SMS_MappedFile *pMappedFile, int iFrame, SMS_Data *pSmsFrame)
+{
+    const SMS_Header *pSmsHeader = pMappedFile->pSmsHeader;
+
+    if(iFrame < 0 || iFrame >= pSmsHeader->nFrames)
+    {
+        sms_error("SMS frame number out of range");
+        return -1;
+    }
+    pSmsFrame->pSmsData = (sfloat *)(pMappedFile->pFrames + (size_t)iFrame * pSmsHeader->iFrameBSize);
+    pSmsFrame->sizeData = pSmsHeader->iFrameBSize;
+    SetFramePointers(pSmsFrame, pSmsHeader->nTracks, pSmsHeader->nStochasticCoeff,
+                     (pSmsHeader->iFormat == SMS_FORMAT_HP || pSmsHeader->iFormat == SMS_FORMAT_IHP),
+                     pSmsHeader->iStochasticType, pSmsHeader->nEnvCoeff);
+    return 0;
+}
+
+/*! \brief unmap an SMS file
+ *
+ * \param pMappedFile      the mapped file
+ */
+void sms_unmapFile(SMS_MappedFile *pMappedFile)
+{
+    UnmapFile(pMappedFile);
+    if(pMappedFile->pFrameCopy)
+        free(pMappedFile->pFrameCopy);
+    if(pMappedFile->pSmsHeader)
+        free(pMappedFile->pSmsHeader);
+    pMappedFile->pFrameCopy = NULL;
+    pMappedFile->pSmsHeader = NULL;
+    pMappedFile->pFrames = NULL;
+}
+
+/*! \brief initialize an empty SMS model
+ *
+ * The model gets a copy of the header, with its text, and no frames. Add
+ * the frames with sms_addModelFrame(), free with sms_freeModel().
+ *
+ * \param pModel       the model to initialize
+ * \param pSmsHeader header of the frames of the model, its number of frames is not used
+ * \return 0 on success, -1 on error
+ */
+int sms_initModel(SMS_Model *pModel, const SMS_Header *pSmsHeader)
+{
+    SMS_Header header = *pSmsHeader;
+
+    memset(pModel, 0, sizeof(SMS_Model));
+    if(header.iFrameEncoding < SMS_ENC_DENSE || header.iFrameEncoding > SMS_ENC_QUANTIZED)
+    {
+        sms_error("unknown frame encoding");
+        return -1;
+    }
+    header.nFrames = 0;
+    header.iFrameBSize = sms_frameSizeB(&header);
+    header.iHeadBSize = HeadBSize(&header);
+    header.iFileVersion = SMS_FILE_VERSION;
+    header.iSampleBytes = sizeof(sfloat);
+    header.pFrameOffsets = NULL;
+    header.pReadState = NULL;
+    header.pWriteState = NULL;
+    if((pModel->pSmsHeader = AllocHeader(&header, pSmsHeader->pChTextCharacters, 0, 0)) == NULL)
+        return -1;
+    return 0;
+}
+
+/*! \brief add a frame at the end of an SMS model
+ *
+ * This is an SMS_FrameFunc, so a model can be given to sms_analyzePipelined()
+ * or sms_analyzeSegments() to be built as the sound is analyzed. The frame is
+ * copied, it can have another number of tracks or coefficients than the
+ * model, the rest of the frame of the model is 0 then.
+ *
+ * \param pSmsFrame   pointer to SMS data frame
+ * \param pModel       the SMS_Model to add the frame to
+ * \return 0 on success, -1 on error
+ */
+int sms_addModelFrame(const SMS_Data *pSmsFrame, void *pModel)
+{
+    SMS_Model *pSmsModel = (SMS_Model *)pModel;
+    SMS_Header *pSmsHeader = pSmsModel->pSmsHeader;
+    SMS_Data modelFrame;
+
+    if(pSmsHeader->nFrames == pSmsModel->nAllocFrames)
+    {
+        int nAllocFrames = MAX(2 * pSmsModel->nAllocFrames, 64);
+        char *pFrames = (char *)realloc(pSmsModel->pFrames, (size_t)nAllocFrames * pSmsHeader->iFrameBSize);
+
+        if(pFrames == NULL)
+        {
+            sms_error("cannot allocate memory for the SMS frames");
+            return -1;
+        }
+        pSmsModel->pFrames = pFrames;
+        pSmsModel->nAllocFrames = nAllocFrames;
+    }
+    pSmsHeader->nFrames++;
+    sms_getModelFrame(pSmsModel, pSmsHeader->nFrames - 1, &modelFrame);
+    sms_clearFrame(&modelFrame);
+    sms_copyFrame(&modelFrame, pSmsFrame);
+    return 0;
+}
+
+/*! \brief set a frame to the data of an SMS model
+ *
+ * The pointers of pSmsFrame are set to the data in the model, nothing is
+ * copied, so the frame can be modified and synthesized where it is. It must
+ * not be given to sms_freeFrame(), and it is only good until the next frame
+ * is added to the model or the model is freed.
+ *
+ * \param pModel       the model
+ * \param iFrame               frame number
+ * \param pSmsFrame       pointer to SMS frame
+ * \return  0 on sucess, -1 on error
+ */
+int sms_getModelFrame(const SMS_Model *pModel, int iFrame, SMS_Data *pSmsFrame)
+{
+    const SMS_Header *pSmsHeader = pModel->pSmsHeader;
+
+    if(iFrame < 0 || iFrame >= pSmsHeader->nFrames)
+    {
+        sms_error("SMS frame number out of range");
+        return -1;
+    }
+    pSmsFrame->pSmsData = (sfloat *)(pModel->pFrames + (size_t)iFrame * pSmsHeader->iFrameBSize);
+    pSmsFrame->sizeData = pSmsHeader->iFrameBSize;
+    SetFramePointers(pSmsFrame, pSmsHeader->nTracks, pSmsHeader->nStochasticCoeff,
+                     (pSmsHeader->iFormat == SMS_FORMAT_HP || pSmsHeader->iFormat == SMS_FORMAT_IHP),
+                     pSmsHeader->iStochasticType, pSmsHeader->nEnvCoeff);
+    return 0;
+}
+
+/* make room in a growing buffer for size more bytes after the first sizeUsed */
+static int GrowBytes(unsigned char **ppBytes, size_t *pSizeAlloc, size_t sizeUsed, size_t size)
+{
+    unsigned char *pBytes;
+    size_t sizeAlloc = *pSizeAlloc;
+
+    if(sizeAlloc - sizeUsed >= size)
+        return 0;
+    while(sizeAlloc - sizeUsed < size)
+        sizeAlloc = MAX(2 * sizeAlloc, 4096);
+    if((pBytes = (unsigned char *)realloc(*ppBytes, sizeAlloc)) == NULL)
+    {
+        sms_error("cannot allocate memory for the serialized SMS model");
+        return -1;
+    }
+    *ppBytes = pBytes;
+    *pSizeAlloc = sizeAlloc;
+    return 0;
+}
+
+/*! \brief serialize an SMS model to the bytes of an SMS file
+ *
+ * The bytes are those of the file sms_closeFileWriter() would write with
+ * the header and the frames of the model, in the frame encoding of its
+ * header, so they can be saved as they are or read back with
+ * sms_deserializeModel().
+ *
+ * \param pModel       the model
+ * \param ppBytes       set to the bytes, to be freed with free()
+ * \param pSize          set to the number of bytes
+ * \return 0 on success, -1 on error
+ */
+int sms_serializeModel(const SMS_Model *pModel, void **ppBytes, size_t *pSize)
+{
+    const SMS_Header *pSmsHeader = pModel->pSmsHeader;
+    unsigned char *pBytes = NULL;
+    long long *pOffsets = NULL;
+    QuantState *pState = NULL;
+    void *pMemory = NULL;
+    size_t sizeAlloc = 0, size = HeadBSize(pSmsHeader), sizeRecord, sizeRecordMax;
+    unsigned long long indexOffset;
+    int iFrame, nPending = 0, nOffsets = 0;
+
+    *ppBytes = NULL;
+    *pSize = 0;
+    if(pSmsHeader->nFrames <= 0)
+    {
+        sms_error("number of frames <= 0");
+        return -1;
+    }
+    sizeRecordMax = MaxRecordBSize(pSmsHeader);
+    if((pOffsets = (long long *)malloc(pSmsHeader->nFrames * sizeof(long long))) == NULL ||
+       (pSmsHeader->iFrameEncoding == SMS_ENC_QUANTIZED &&
+        (pMemory = calloc(1, QuantStateBSize(pSmsHeader))) == NULL))
+    {
+        free(pOffsets);
+        sms_error("cannot allocate memory for the serialized SMS model");
+        return -1;
+    }
+    if(pMemory)
+        pState = InitQuantState(pMemory, pSmsHeader);
+    if(GrowBytes(&pBytes, &sizeAlloc, 0, size) < 0)
+        goto failed;
+
+    /* the frames, the offset of a record goes to the frames it completes */
+    for(iFrame = 0; iFrame <= pSmsHeader->nFrames; iFrame++)
+    {
+        if(GrowBytes(&pBytes, &sizeAlloc, size, sizeRecordMax) < 0)
+            goto failed;
+        if(iFrame < pSmsHeader->nFrames)
+        {
+            sizeRecord = EncodeFrame(pSmsHeader, pState, (const sfloat *)(pModel->pFrames + (size_t)iFrame *
+                                                                         pSmsHeader->iFrameBSize),
+                                     pBytes + size);
+            nPending++;
+        }
+        else if(pState && pState->nFrames > 0)
+            sizeRecord = EncodeQuantizedBlock(pSmsHeader, pState, pBytes + size);
+        else
+            break;
+        if(sizeRecord == 0)
+            continue;
+        for(; nPending > 0; nPending--)
+            pOffsets[nOffsets++] = size;
+        size += sizeRecord;
+    }
+
+    /* the index, then the header */
+    indexOffset = size;
+    if(GrowBytes(&pBytes, &sizeAlloc, size, 8 * (size_t)nOffsets) < 0)
+        goto failed;
+    for(iFrame = 0; iFrame < nOffsets; iFrame++, size += 8)
+        PutU64(pBytes + size, pOffsets[iFrame]);
+    EncodeHeader(pBytes, pSmsHeader, pSmsHeader->nFrames, indexOffset);
+    memset(pBytes + SMS_HEADER_FIELDS_BSIZE, 0, HeadBSize(pSmsHeader) - SMS_HEADER_FIELDS_BSIZE);
+    if(pSmsHeader->nTextCharacters > 0)
+        memcpy(pBytes + SMS_HEADER_FIELDS_BSIZE, pSmsHeader->pChTextCharacters, pSmsHeader->nTextCharacters);
+
+    free(pOffsets);
+    free(pMemory);
+    *ppBytes = pBytes;
+    *pSize = size;
+    return 0;
+
+failed:
+    free(pBytes);
+    free(pOffsets);
+    free(pMemory);
+    return -1;
+}
+
+/*! \brief read an SMS model from the bytes of an SMS file
+ *
+ * The bytes can be in any version of the file format and any frame
+ * encoding, the frames are decoded into the model, which does not keep the
+ * bytes. Free with sms_freeModel().
+ *
+ * \param pModel       the model to fill
+ * \param pBytes       the bytes of the file
+ * \param size          the number of bytes
+ * \return 0 on success, -1 on error
+ */
+int sms_deserializeModel(SMS_Model *pModel, const void *pBytes, size_t size)
+{
+    SMS_Header header;
+    unsigned long long indexOffset;
+    int iFieldsBSize, isNative;
+
+    memset(pModel, 0, sizeof(SMS_Model));
+    if(ParseFileHeader((const unsigned char *)pBytes, size, &header, &iFieldsBSize, &indexOffset,
+                       &isNative) < 0 ||
+       (pModel->pSmsHeader = AllocHeader(&header, (const char *)pBytes + iFieldsBSize, 0, 0)) == NULL)
+        return -1;
+    if((pModel->pFrames = (char *)malloc((size_t)header.nFrames * header.iFrameBSize)) == NULL)
+    {
+        sms_freeModel(pModel);
+        sms_error("cannot allocate memory for the SMS frames");
+        return -1;
+    }
+    pModel->nAllocFrames = header.nFrames;
+    if(DecodeFrames((const unsigned char *)pBytes, size, &header, indexOffset, isNative,
+                    pModel->pFrames) < 0)
+    {
+        sms_freeModel(pModel);
+        return -1;
+    }
+    return 0;
+}
+
+/*! \brief free an SMS model
+ *
+ * \param pModel       the model
+ */
+void sms_freeModel(SMS_Model *pModel)
+{
+    if(pModel->pFrames)
+        free(pModel->pFrames);
+    if(pModel->pSmsHeader)
+        free(pModel->pSmsHeader);
+    memset(pModel, 0, sizeof(SMS_Model));
+}
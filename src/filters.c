@@ -24,9 +24,6 @@
 
 #include "sms.h"
 
-/*! \brief coefficient for pre_emphasis filter */
-#define SMS_EMPH_COEF    .9
-
 /* pre-emphasis filter function, it returns the filtered value
  *
  * sfloat fInput;   sound sample
@@ -59,23 +56,18 @@ sfloat sms_deEmphasis(sfloat fInput, SMS_SynthParams *pSynthParams)
 
 /*! \brief  function to implement a zero-pole filter
  *
- * \todo will forgetting to reset  pD to zero at the beginning of a new analysis
- * (when there are multiple analyses within the life of one program)
- * cause problems?
- *
+ * \param pD         pointer to the delay line of the filter (nCoeff values)
  * \param pFa        pointer to numerator coefficients
  * \param pFb        pointer to denominator coefficients
  * \param nCoeff    number of coefficients
  * \param fInput     input sample
  * \return value is the  filtered sample
  */
-static sfloat ZeroPoleFilter (sfloat *pFa, sfloat *pFb, int nCoeff, sfloat fInput )
+static sfloat ZeroPoleFilter (sfloat *pD, sfloat *pFa, sfloat *pFb, int nCoeff, sfloat fInput )
 {
     double fOut = 0;
     int iSection;
 
-    static sfloat pD[5] = {0, 0, 0, 0, 0};
-
     pD[0] = fInput;
     for (iSection = nCoeff-1; iSection > 0; iSection--)
     {
@@ -95,9 +87,9 @@ static sfloat ZeroPoleFilter (sfloat *pFa, sfloat *pFb, int nCoeff, sfloat fInpu
  *
  * \param sizeResidual        size of signal
  * \param pResidual          pointer to residual signal
- * \param iSamplingRate      sampling rate of signal
+ * \param pAnalParams        pointer to analysis parameters (sampling rate and filter state)
  */
-void sms_filterHighPass ( int sizeResidual, sfloat *pResidual, int iSamplingRate)
+void sms_filterHighPass ( int sizeResidual, sfloat *pResidual, SMS_AnalParams *pAnalParams)
 {
 
 
@@ -114,6 +106,7 @@ void sms_filterHighPass ( int sizeResidual, sfloat *pResidual, int iSamplingRate
         0.872061, 1, -3.72641, 5.21605, -3.25002, 0.76049};
     sfloat *pFCoeff, fSample = 0;
     int i;
+    int iSamplingRate = pAnalParams->iSamplingRate;
 
     if (iSamplingRate <= 32000)
         pFCoeff = pFCoeff32k;
@@ -134,7 +127,7 @@ void sms_filterHighPass ( int sizeResidual, sfloat *pResidual, int iSamplingRate
 
         fSample = pResidual[i];
         pResidual[i] =
-            ZeroPoleFilter (&pFCoeff[0], &pFCoeff[5], 5, fSample);
+            ZeroPoleFilter (pAnalParams->highPassDelay, &pFCoeff[0], &pFCoeff[5], 5, fSample);
     }
 }
 
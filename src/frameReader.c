@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2008 MUSIC TECHNOLOGY GROUP (MTG)
+ *                         UNIVERSITAT POMPEU FABRA
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+/*! \file frameReader.c
+ * \brief reading the frames of an SMS file ahead on a thread
+ *
+ * A reader thread reads the frames that playback needs next into a set of
+ * slots. The playing thread sets the position and the rate of playback,
+ * which give the frames it wants: the two frames around the position and
+ * around each of the positions that follow at that rate, in the order they
+ * are played, as many as there are slots. Playing faster than a frame per
+ * frame skips the frames in between.
+ *  - the wanted frames are handed to the reader thread under a lock, which
+ *    it only holds to choose the next frame to read, never while reading.
+ *  - each slot has the number of its frame, set once the frame is read.
+ *    The reader thread only reads into the slots of frames that are not
+ *    wanted, after taking their number away under the lock, so a wanted
+ *    frame that the playing thread finds in a slot stays there.
+ *  - the reader thread sleeps when every wanted frame is read, and wakes
+ *    up when the wanted frames change. sms_waitReaderFrame() sleeps until
+ *    the reader thread has read a frame.
+ * Setting the position only takes the lock when the wanted frames change,
+ * and looking for a frame in the slots never takes it, so the playing
+ * thread never waits for a frame to be read unless it asks to, with
+ * sms_waitReaderFrame().
+ */
+#include "sms.h"
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+struct SMS_FrameReader
+{
+    FILE *pSmsFile;
+    SMS_Header *pSmsHeader;
+    SMS_Data *pSlots;            /* the frames read */
+    volatile int *pSlotFrame;    /* number of the frame in each slot, -1 if none */
+    int nSlots;
+    pthread_t thread;
+    int isStarted;               /* whether the reader thread is running */
+    int *pNextWanted;            /* the wanted frames of a new position, before they are handed over */
+    int *pIsRead;                /* whether each wanted frame is in a slot, used by the reader thread */
+    pthread_mutex_t lock;        /* protects the members below */
+    pthread_cond_t wake;         /* signaled when the wanted frames change, or to quit */
+    pthread_cond_t frameRead;    /* signaled when a frame is read, or cannot be read */
+    int *pWanted;                /* the frames to read, in the order they are played,
+                                    only written by the playing thread */
+    int nWanted;
+    int iFailedFrame;            /* a wanted frame that cannot be read, -1 if none */
+    int quit;
+};
+
+static int LoadAcquire(volatile int *pValue)
+{
+#ifdef _MSC_VER
+    return InterlockedCompareExchange((volatile LONG *)pValue, 0, 0);
+#else
+    return __atomic_load_n(pValue, __ATOMIC_ACQUIRE);
+#endif
+}
+
+static void StoreRelease(volatile int *pValue, int value)
+{
+#ifdef _MSC_VER
+    InterlockedExchange((volatile LONG *)pValue, value);
+#else
+    __atomic_store_n(pValue, value, __ATOMIC_RELEASE);
+#endif
+}
+
+/* index of a frame in the wanted frames, -1 if it is not wanted. They are
+ * in the order they are played, so they are sorted one way or the other. */
+static int WantedIndex(const int *pWanted, int nWanted, int iFrame)
+{
+    int iDirection = (nWanted > 1 && pWanted[1] < pWanted[0]) ? -1 : 1;
+    int iLow = 0, iHigh = nWanted, iMiddle;
+
+    while(iLow < iHigh)
+    {
+        iMiddle = (iLow + iHigh) / 2;
+        if((pWanted[iMiddle] - iFrame) * iDirection < 0)
+            iLow = iMiddle + 1;
+        else
+            iHigh = iMiddle;
+    }
+    return (iLow < nWanted && pWanted[iLow] == iFrame) ? iLow : -1;
+}
+
+/* slot of a frame, -1 if it is not in a slot */
+static int FindSlot(SMS_FrameReader *pReader, int iFrame)
+{
+    int i;
+
+    for(i = 0; i < pReader->nSlots; i++)
+        if(LoadAcquire(&pReader->pSlotFrame[i]) == iFrame)
+            return i;
+    return -1;
+}
+
+/* the next frame for the reader thread to read and the slot to read it
+ * into, with the lock held. Returns 0 when there is nothing to read. */
+static int NextRead(SMS_FrameReader *pReader, int *pFrame, int *pSlot)
+{
+    int i, iSlot, iFreeSlot = -1;
+
+    memset(pReader->pIsRead, 0, pReader->nWanted * sizeof(int));
+    for(iSlot = 0; iSlot < pReader->nSlots; iSlot++)
+    {
+        i = WantedIndex(pReader->pWanted, pReader->nWanted, pReader->pSlotFrame[iSlot]);
+        if(i >= 0)
+            pReader->pIsRead[i] = 1;
+        else if(iFreeSlot < 0)
+            iFreeSlot = iSlot;
+    }
+    if(iFreeSlot < 0)
+        return 0;
+    for(i = 0; i < pReader->nWanted; i++)
+        if(!pReader->pIsRead[i] && pReader->pWanted[i] != pReader->iFailedFrame)
+        {
+            *pFrame = pReader->pWanted[i];
+            *pSlot = iFreeSlot;
+            return 1;
+        }
+    return 0;
+}
+
+static void *ReaderThread(void *pData)
+{
+    SMS_FrameReader *pReader = (SMS_FrameReader *)pData;
+    int iFrame, iSlot, status;
+
+    pthread_mutex_lock(&pReader->lock);
+    while(!pReader->quit)
+    {
+        if(!NextRead(pReader, &iFrame, &iSlot))
+        {
+            pthread_cond_wait(&pReader->wake, &pReader->lock);
+            continue;
+        }
+        /* the slot is emptied under the lock, from then on it cannot be found */
+        StoreRelease(&pReader->pSlotFrame[iSlot], -1);
+        pthread_mutex_unlock(&pReader->lock);
+        status = sms_getFrame(pReader->pSmsFile, pReader->pSmsHeader, iFrame, &pReader->pSlots[iSlot]);
+        pthread_mutex_lock(&pReader->lock);
+        if(status < 0)
+            pReader->iFailedFrame = iFrame;
+        else
+            StoreRelease(&pReader->pSlotFrame[iSlot], iFrame);
+        pthread_cond_broadcast(&pReader->frameRead);
+    }
+    pthread_mutex_unlock(&pReader->lock);
+    return NULL;
+}
+
+/*! \brief open an SMS file and start reading its frames ahead on a thread
+ *
+ * The frames are read from frame 0 on until the position is set with
+ * sms_setReaderPosition(). Free with sms_closeFrameReader().
+ *
+ * \param pChFileName      file name for SMS file
+ * \param nFramesAhead     number of frames kept in memory, from the position on
+ * \return the reader, NULL on error
+ */
+SMS_FrameReader *sms_openFrameReader(const char *pChFileName, int nFramesAhead)
+{
+    SMS_FrameReader *pReader;
+    int i;
+
+    if(nFramesAhead < 2)
+    {
+        sms_error("a frame reader needs at least 2 frames");
+        return NULL;
+    }
+    if((pReader = (SMS_FrameReader *)calloc(1, sizeof(SMS_FrameReader))) == NULL)
+    {
+        sms_error("could not allocate memory for frame reader");
+        return NULL;
+    }
+    if(sms_getHeader(pChFileName, &pReader->pSmsHeader, &pReader->pSmsFile) < 0)
+    {
+        if(pReader->pSmsFile)
+            fclose(pReader->pSmsFile);
+        free(pReader);
+        return NULL;
+    }
+    if((pReader->pSlots = (SMS_Data *)calloc(nFramesAhead, sizeof(SMS_Data))) == NULL ||
+       (pReader->pWanted = (int *)malloc(4 * nFramesAhead * sizeof(int))) == NULL)
+    {
+        sms_error("could not allocate memory for frame reader");
+        sms_closeFrameReader(pReader);
+        return NULL;
+    }
+    pReader->pNextWanted = pReader->pWanted + nFramesAhead;
+    pReader->pIsRead = pReader->pNextWanted + nFramesAhead;
+    pReader->pSlotFrame = pReader->pIsRead + nFramesAhead;
+    for(i = 0; i < nFramesAhead; i++)
+    {
+        pReader->pSlotFrame[i] = -1;
+        if(sms_allocFrameH(pReader->pSmsHeader, &pReader->pSlots[i]) < 0)
+        {
+            sms_closeFrameReader(pReader);
+            return NULL;
+        }
+        pReader->nSlots++;
+    }
+    pReader->iFailedFrame = -1;
+    pthread_mutex_init(&pReader->lock, NULL);
+    pthread_cond_init(&pReader->wake, NULL);
+    pthread_cond_init(&pReader->frameRead, NULL);
+    sms_setReaderPosition(pReader, 0, 1);
+    if(pthread_create(&pReader->thread, NULL, ReaderThread, pReader) != 0)
+    {
+        sms_error("could not start frame reader thread");
+        pthread_mutex_destroy(&pReader->lock);
+        pthread_cond_destroy(&pReader->wake);
+        pthread_cond_destroy(&pReader->frameRead);
+        sms_closeFrameReader(pReader);
+        return NULL;
+    }
+    pReader->isStarted = 1;
+    return pReader;
+}
+
+/*! \brief header of the file of a frame reader
+ *
+ * \param pReader pointer to the reader
+ * \return the header, owned by the reader
+ */
+const SMS_Header *sms_getReaderHeader(const SMS_FrameReader *pReader)
+{
+    return pReader->pSmsHeader;
+}
+
+/*! \brief set the playback position and rate of a frame reader
+ *
+ * The frames wanted next are the frames floor(fFrame) and floor(fFrame) + 1,
+ * then the same two frames around fFrame + fRate, fFrame + 2 * fRate and so
+ * on, as many as the frames kept. A rate slower than a frame per frame (or
+ * 0) wants every frame from the position on. Playing faster skips the frames
+ * in between, so the frames are read ahead as far as when playing at normal
+ * speed. The frames that are no longer wanted make room for the others, the
+ * ones already read stay. This never waits for a frame to be read.
+ *
+ * \param pReader pointer to the reader
+ * \param fFrame frame position
+ * \param fRate frames played per frame played, negative to play backward
+ */
+void sms_setReaderPosition(SMS_FrameReader *pReader, sfloat fFrame, sfloat fRate)
+{
+    int nFrames = pReader->pSmsHeader->nFrames, iDirection = (fRate < 0) ? -1 : 1;
+    int nWanted = 0, iLastFrame = 0, iFrame, i;
+    double fStep = iDirection * MAX(1., fabs(fRate)), fPosition = MAX(0, MIN(nFrames - 1, fFrame));
+
+    /* the frames around each position, in the order they are played */
+    while(nWanted < pReader->nSlots && fPosition > -1 && fPosition < nFrames)
+    {
+        for(i = 0; i < 2 && nWanted < pReader->nSlots; i++)
+        {
+            iFrame = (int)floor(fPosition) + ((iDirection > 0) ? i : 1 - i);
+            if(iFrame < 0 || iFrame >= nFrames ||
+               (nWanted > 0 && (iFrame - iLastFrame) * iDirection <= 0))
+                continue;
+            pReader->pNextWanted[nWanted++] = iLastFrame = iFrame;
+        }
+        fPosition += fStep;
+    }
+    /* the reader thread only reads the wanted frames, so they can be
+     * compared without the lock */
+    if(nWanted == pReader->nWanted &&
+       memcmp(pReader->pNextWanted, pReader->pWanted, nWanted * sizeof(int)) == 0)
+        return;
+    pthread_mutex_lock(&pReader->lock);
+    memcpy(pReader->pWanted, pReader->pNextWanted, nWanted * sizeof(int));
+    pReader->nWanted = nWanted;
+    if(WantedIndex(pReader->pWanted, nWanted, pReader->iFailedFrame) < 0)
+        pReader->iFailedFrame = -1;
+    pthread_cond_signal(&pReader->wake);
+    pthread_mutex_unlock(&pReader->lock);
+}
+
+/*! \brief get a frame from a frame reader if it has been read
+ *
+ * This never waits for the reader thread. The frame is read-only, and stays
+ * valid until it is no longer wanted by a new position.
+ *
+ * \param pReader pointer to the reader
+ * \param iFrame frame number
+ * \return the frame, NULL if it is not wanted or has not been read (yet)
+ */
+const SMS_Data *sms_getReaderFrame(SMS_FrameReader *pReader, int iFrame)
+{
+    int iSlot;
+
+    if(WantedIndex(pReader->pWanted, pReader->nWanted, iFrame) < 0 ||
+       (iSlot = FindSlot(pReader, iFrame)) < 0)
+        return NULL;
+    return &pReader->pSlots[iSlot];
+}
+
+/*! \brief get a frame from a frame reader, waiting until it is read
+ *
+ * For playback that does not have to keep up with a clock.
+ *
+ * \param pReader pointer to the reader
+ * \param iFrame frame number
+ * \return the frame, NULL if it is not wanted by the position or cannot be read
+ */
+const SMS_Data *sms_waitReaderFrame(SMS_FrameReader *pReader, int iFrame)
+{
+    const SMS_Data *pSmsFrame;
+
+    if(WantedIndex(pReader->pWanted, pReader->nWanted, iFrame) < 0)
+    {
+        sms_error("frame is not wanted by the position of the reader");
+        return NULL;
+    }
+    if((pSmsFrame = sms_getReaderFrame(pReader, iFrame)) != NULL)
+        return pSmsFrame;
+    pthread_mutex_lock(&pReader->lock);
+    while((pSmsFrame = sms_getReaderFrame(pReader, iFrame)) == NULL &&
+          pReader->iFailedFrame != iFrame)
+        pthread_cond_wait(&pReader->frameRead, &pReader->lock);
+    pthread_mutex_unlock(&pReader->lock);
+    if(pSmsFrame == NULL)
+        sms_error("cannot read SMS frame");
+    return pSmsFrame;
+}
+
+/*! \brief stop the reader thread, close the file and free a frame reader
+ *
+ * \param pReader pointer to the reader
+ */
+void sms_closeFrameReader(SMS_FrameReader *pReader)
+{
+    int i;
+
+    if(pReader == NULL)
+        return;
+    if(pReader->isStarted)
+    {
+        pthread_mutex_lock(&pReader->lock);
+        pReader->quit = 1;
+        pthread_cond_signal(&pReader->wake);
+        pthread_mutex_unlock(&pReader->lock);
+        pthread_join(pReader->thread, NULL);
+        pthread_mutex_destroy(&pReader->lock);
+        pthread_cond_destroy(&pReader->wake);
+        pthread_cond_destroy(&pReader->frameRead);
+    }
+    for(i = 0; i < pReader->nSlots; i++)
+        sms_freeFrame(&pReader->pSlots[i]);
+    free(pReader->pSlots);
+    free(pReader->pWanted);
+    if(pReader->pSmsFile)
+        fclose(pReader->pSmsFile);
+    free(pReader->pSmsHeader);
+    free(pReader);
+}
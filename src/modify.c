@@ -30,19 +30,18 @@
  */
 void sms_initModify(const SMS_Header *header, SMS_ModifyParams *params)
 {
-        static int sizeEnvArray = 0;
         params->maxFreq = header->iMaxFreq;
         params->sizeSinEnv = header->nEnvCoeff;
 
-        if(sizeEnvArray < params->sizeSinEnv)
+        if(params->sizeSinEnv > 0)
         {
-                if(sizeEnvArray != 0) free(params->sinEnv);
-                if ((params->sinEnv = (sfloat *) malloc(params->sizeSinEnv * sizeof(sfloat))) == NULL)
+                sfloat *pEnv = (sfloat *) realloc(params->sinEnv, params->sizeSinEnv * sizeof(sfloat));
+                if (pEnv == NULL)
                 {
                         sms_error("could not allocate memory for envelope array");
                         return;
                 }
-                sizeEnvArray = params->sizeSinEnv;
+                params->sinEnv = pEnv;
         }
         params->ready = 1;
 }
@@ -63,9 +62,11 @@ void sms_initModifyParams(SMS_ModifyParams *params)
 	params->doSinEnv = 0;
 	params->sinEnvInterp = 0.;
 	params->sizeSinEnv = 0;
+	params->sinEnv = NULL;
 	params->doResEnv = 0;
 	params->resEnvInterp = 0.;
 	params->sizeResEnv = 0;
+	params->resEnv = NULL;
 }
 
 /*! \brief free memory allocated during initialization
@@ -74,6 +75,11 @@ void sms_initModifyParams(SMS_ModifyParams *params)
  */
 void sms_freeModify(SMS_ModifyParams *params)
 {
+        if(params->sinEnv)
+                free(params->sinEnv);
+        params->sinEnv = NULL;
+        params->sizeSinEnv = 0;
+        params->ready = 0;
 }
 
 /*! \brief linear interpolation between 2 spectral envelopes.
@@ -0,0 +1,1018 @@
+/*
+ * Copyright (c) 2008 MUSIC TECHNOLOGY GROUP (MTG)
+ *                         UNIVERSITAT POMPEU FABRA
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+/*! \file parallelAnalysis.c
+ * \brief analysis of a single sound on several threads
+ *
+ * sms_analyze() is sequential: the frame delay line, the re-analysis of
+ * previous frames and the guides of the peak continuation all depend on
+ * the frames before. sms_analyzeSegments() cuts a long sound into segments
+ * that are analyzed independently on an SMS_ThreadPool. Every segment starts
+ * a number of warm-up frames before its first output frame, so that the
+ * fundamental tracker, the guides, the track cleaning and the filters have
+ * settled when the frames that are kept are analyzed. The warm-up frames
+ * overlap with the end of the previous segment and are used to stitch the
+ * tracks at the seam.
+ *
+ * sms_analyzePipelined() keeps the analysis in one piece and only moves the
+ * spectral front end (window, spectrum and peak detection) to the thread
+ * pool, which computes the peaks of the next frames while the calling thread
+ * does the harmonic detection, peak continuation, track cleaning and
+ * stochastic analysis of the current ones. The results are the same as those
+ * of sms_analyze().
+ *
+ * sms_analyzeChannels() analyzes all of the channels of a sound at the same
+ * time, each with its own analysis, reading the sound only once: a chunk of
+ * all of the channels is read, then every analysis goes as far into the
+ * chunk as it can on the thread pool.
+ */
+#include "sms.h"
+
+#define SEGMENT_MAX_SECONDS 60 /* default segment length is at most this long */
+#define SEAM_FREQ_DEVIATION .01 /* tracks at a seam with a smaller relative difference are the same */
+#define PIPELINE_TASK_FRAMES 8  /* frames analyzed by one task of the spectral front end */
+#define PIPELINE_BATCH_TASKS 2  /* tasks per thread in a batch of frames */
+#define CHANNEL_CHUNK_SAMPLES 16384 /* samples of each channel read at once for sms_analyzeChannels */
+
+/* make sure there is an error when the frame function stops the analysis,
+ * it does not have to report one */
+static void FrameFuncError(void)
+{
+    if(!sms_errorCheck())
+        sms_error("the frame function stopped the analysis");
+}
+
+typedef struct
+{
+    const char *pChInputSoundFile;
+    const SMS_AnalParams *pAnalParams; /* parameters before sms_initAnalysis */
+    int iFirstFrame;       /* first frame analyzed, including warm-up */
+    int nWarmupFrames;     /* frames analyzed before the first output frame */
+    int nFrames;           /* frames to output, 0 for the last segment (until the end) */
+    SMS_Data smsData;      /* frame layout of the output, used to pass frames on */
+    sfloat *pFrameData;    /* seam frame, then the output frames (smsData.sizeData bytes each) */
+    int sizeFrameData;     /* number of frames allocated in pFrameData */
+    int nOutFrames;        /* number of output frames in pFrameData */
+    int hasSeamFrame;      /* the last warm-up frame is stored in pFrameData */
+    sfloat fResidualAccumPerc; /* residual percentage of the output frames */
+    int iStatus;           /* 0 on success, -1 on error */
+    char pChError[256];
+} Segment;
+
+/* number of frames analyzed before the first output frame of a segment:
+ * enough to fill the delay line (and the re-analysis that works on it) and
+ * to let the track cleaning see complete short tracks and sleeping gaps */
+static int WarmupFrames(const SMS_AnalParams *pAnalParams)
+{
+    return pAnalParams->iMaxDelayFrames +
+        MAX(pAnalParams->iMinTrackLength, pAnalParams->iMaxSleepingTime);
+}
+
+/* store one analyzed frame of a segment, iFrame 0 is the seam frame */
+static int StoreFrame(Segment *pSegment, int iFrame, const SMS_Data *pSmsData)
+{
+    int sizeFrame = pSegment->smsData.sizeData / sizeof(sfloat);
+
+    if(iFrame >= pSegment->sizeFrameData)
+    {
+        int sizeFrameData = MAX(2 * pSegment->sizeFrameData, 64);
+        sfloat *pFrameData = (sfloat *)realloc(pSegment->pFrameData,
+                                               (size_t)sizeFrameData * sizeFrame * sizeof(sfloat));
+        if(pFrameData == NULL)
+        {
+            sms_error("could not allocate memory for segment frames");
+            return -1;
+        }
+        pSegment->pFrameData = pFrameData;
+        pSegment->sizeFrameData = sizeFrameData;
+    }
+    memcpy(pSegment->pFrameData + (size_t)iFrame * sizeFrame, pSmsData->pSmsData,
+           pSegment->smsData.sizeData);
+    return 0;
+}
+
+/* analyze one segment, this is the same loop as in smsAnal, started
+ * at the first sample of the first warm-up frame */
+static int AnalyzeSegment(Segment *pSegment, SMS_AnalParams *pAnalParams)
+{
+    SMS_SndHeader soundHeader;
+    SMS_Header smsHeader;
+    sfloat *pSoundData;
+    long iOffset, nSamples, iSample = 0, sizeNewData = 0;
+    int iStatus = 0, iFrame = 0, iError = 0;
+    sfloat fResidualAccumPerc;
+
+    if(sms_openSF(pSegment->pChInputSoundFile, &soundHeader))
+        return -1;
+    if(sms_initAnalysis(pAnalParams, &soundHeader))
+    {
+        sms_closeSF(&soundHeader);
+        sms_freeAnalysis(pAnalParams);
+        return -1;
+    }
+
+    /* frame n of the analysis is centered at sample n * sizeHop, so
+     * starting at the first sample of a frame keeps the frames aligned */
+    iOffset = (long)pSegment->iFirstFrame * pAnalParams->sizeHop;
+    nSamples = soundHeader.nSamples - iOffset;
+    pAnalParams->iSizeSound = nSamples;
+
+    sms_fillHeader(&smsHeader, pAnalParams, "sms_analyzeSegments");
+    if(sms_allocFrameH(&smsHeader, &pSegment->smsData))
+    {
+        sms_closeSF(&soundHeader);
+        sms_freeAnalysis(pAnalParams);
+        return -1;
+    }
+
+    while(iStatus != -1)
+    {
+        iSample += sizeNewData;
+        if((iSample + pAnalParams->sizeNextRead) < nSamples)
+            sizeNewData = pAnalParams->sizeNextRead;
+        else
+            sizeNewData = nSamples - iSample;
+
+        pSoundData = sms_getSoundBufferSpace(sizeNewData, pAnalParams);
+        if(pSoundData == NULL ||
+           sms_getSound(&soundHeader, sizeNewData, pSoundData, iOffset + iSample, pAnalParams))
+        {
+            iError = -1;
+            break;
+        }
+
+        fResidualAccumPerc = pAnalParams->fResidualAccumPerc;
+        iStatus = sms_analyze(sizeNewData, pSoundData, &pSegment->smsData, pAnalParams);
+
+        if(iStatus == 1)
+        {
+            /* keep the last warm-up frame for stitching and everything after it */
+            if(iFrame >= pSegment->nWarmupFrames - 1)
+            {
+                int iOutFrame = iFrame - pSegment->nWarmupFrames + 1;
+                if(StoreFrame(pSegment, iOutFrame, &pSegment->smsData))
+                {
+                    iError = -1;
+                    break;
+                }
+                if(iOutFrame == 0)
+                    pSegment->hasSeamFrame = 1;
+                else
+                {
+                    pSegment->nOutFrames = iOutFrame;
+                    pSegment->fResidualAccumPerc +=
+                        pAnalParams->fResidualAccumPerc - fResidualAccumPerc;
+                }
+            }
+            iFrame++;
+            if(pSegment->nFrames > 0 && pSegment->nOutFrames == pSegment->nFrames)
+                break;
+        }
+    }
+
+    sms_closeSF(&soundHeader);
+    sms_freeAnalysis(pAnalParams);
+    return iError;
+}
+
+/* task run by the thread pool for each segment */
+static void SegmentTask(void *pArg)
+{
+    Segment *pSegment = (Segment *)pArg;
+    SMS_AnalParams *pAnalParams;
+    char *pChError;
+
+    /* each segment has its own copy of the parameters */
+    if((pAnalParams = (SMS_AnalParams *)malloc(sizeof(SMS_AnalParams))) == NULL)
+    {
+        pSegment->iStatus = -1;
+        strcpy(pSegment->pChError, "could not allocate memory for analysis parameters");
+        return;
+    }
+    memcpy(pAnalParams, pSegment->pAnalParams, sizeof(SMS_AnalParams));
+    /* the segments run on the pool, they do not wait on it */
+    pAnalParams->pReAnalysisPool = NULL;
+
+    pSegment->iStatus = AnalyzeSegment(pSegment, pAnalParams);
+    if(pSegment->iStatus < 0)
+    {
+        pChError = sms_errorString();
+        strncpy(pSegment->pChError, pChError ? pChError : "unknown error",
+                sizeof(pSegment->pChError) - 1);
+    }
+    free(pAnalParams);
+}
+
+/* find the output track of every track of a segment, by matching the
+ * frequencies of the seam frame of the segment with the frequencies of the
+ * last frame given out (the same frame, analyzed by the previous segment).
+ * Closest pairs within SEAM_FREQ_DEVIATION are matched first. The remaining
+ * tracks that are active in the seam frame, and then those that start in
+ * the frame after it (pNextFreq), take the output tracks that were not
+ * active, so that they do not continue a different track. */
+static void MatchTracks(int nTracks, const sfloat *pLastFreq, const sfloat *pSeamFreq,
+                        const sfloat *pNextFreq, int *pTrackMap, int *pIsUsed)
+{
+    int i, j, iPass, iBestLast, iBestSeam;
+    sfloat fDist, fBestDist;
+
+    for(j = 0; j < nTracks; j++)
+    {
+        pTrackMap[j] = -1;
+        pIsUsed[j] = 0;
+    }
+
+    while(1)
+    {
+        iBestLast = iBestSeam = -1;
+        fBestDist = 0;
+        for(j = 0; j < nTracks; j++)
+        {
+            if(pTrackMap[j] >= 0 || pSeamFreq[j] <= 0)
+                continue;
+            for(i = 0; i < nTracks; i++)
+            {
+                if(pIsUsed[i] || pLastFreq[i] <= 0)
+                    continue;
+                fDist = fabs(pSeamFreq[j] - pLastFreq[i]);
+                if(fDist <= pLastFreq[i] * SEAM_FREQ_DEVIATION &&
+                   (iBestSeam < 0 || fDist < fBestDist))
+                {
+                    fBestDist = fDist;
+                    iBestLast = i;
+                    iBestSeam = j;
+                }
+            }
+        }
+        if(iBestSeam < 0)
+            break;
+        pTrackMap[iBestSeam] = iBestLast;
+        pIsUsed[iBestLast] = 1;
+    }
+
+    /* pass 0: active in the seam frame, 1: starting after it, 2: the rest */
+    for(iPass = 0; iPass < 3; iPass++)
+        for(j = 0; j < nTracks; j++)
+        {
+            if(pTrackMap[j] >= 0 ||
+               (iPass == 0 && pSeamFreq[j] <= 0) ||
+               (iPass == 1 && pNextFreq[j] <= 0))
+                continue;
+            for(i = 0; i < nTracks; i++)
+                if(!pIsUsed[i] && pLastFreq[i] <= 0)
+                    break;
+            if(i == nTracks)
+                for(i = 0; i < nTracks && pIsUsed[i]; i++);
+            pTrackMap[j] = i;
+            pIsUsed[i] = 1;
+        }
+}
+
+/* move the tracks of a frame to their output track */
+static void MapTracks(int nTracks, sfloat *pValues, const int *pTrackMap, sfloat *pTmp)
+{
+    int j;
+
+    if(pValues == NULL)
+        return;
+    memcpy(pTmp, pValues, nTracks * sizeof(sfloat));
+    for(j = 0; j < nTracks; j++)
+        pValues[pTrackMap[j]] = pTmp[j];
+}
+
+/*! \brief analyze a sound in overlapping segments on a thread pool
+ *
+ * The sound is cut into segments of nSegmentFrames frames that are analyzed
+ * at the same time, each with its own copy of pAnalParams. The frames are
+ * passed on to pFrameFunc in order, from the calling thread.
+ *
+ * Every segment but the first starts with warm-up frames that are
+ * analyzed but not passed on (iMaxDelayFrames plus the longer of
+ * iMinTrackLength and iMaxSleepingTime). When the sound fits in one
+ * segment the frames are the same as those of sms_analyze(). After a seam
+ * the frames can differ slightly from a sequential analysis: the phases of
+ * the deterministic synthesis used for the residual, the pre-emphasis and
+ * the high pass filter only start at the warm-up, and in the inharmonic
+ * formats the track numbers are matched across the seam by frequency, tracks
+ * that do not match start or end at the seam. In the harmonic formats the track number is the harmonic
+ * number, so the tracks are kept as they are.
+ *
+ * Only forward analysis is supported.
+ *
+ * \param pChInputSoundFile   name of the sound file, every segment opens it on its own
+ * \param pAnalParams       analysis parameters as set by the user, not initialized with
+ * sms_initAnalysis (this is done for every segment)
+ * \param pPool              thread pool to run the segments on
+ * \param nSegmentFrames    number of frames in a segment, 0 for a segment per thread (at
+ * most SEGMENT_MAX_SECONDS long)
+ * \param pFrameFunc        function called for every frame
+ * \param pUserData           passed on to pFrameFunc
+ * \param pResidualAccumPerc  if not NULL, set to the accumulated residual percentage of all
+ * frames (as in SMS_AnalParams::fResidualAccumPerc)
+ * \return the number of frames analyzed, -1 on error
+ */
+int sms_analyzeSegments(const char *pChInputSoundFile, const SMS_AnalParams *pAnalParams,
+                        SMS_ThreadPool *pPool, int nSegmentFrames, SMS_FrameFunc pFrameFunc,
+                        void *pUserData, sfloat *pResidualAccumPerc)
+{
+    SMS_SndHeader soundHeader;
+    Segment *pSegments;
+    int nSegments, nThreads, nWarmupFrames, nFrames, sizeHop;
+    int iSegment, iBatch, nBatch, iFrame, i, sizeFrame;
+    int nFramesOut = 0, isHarmonic, hasLastFrame = 0, iError = 0;
+    int *pTrackMap = NULL, *pIsUsed = NULL;
+    sfloat *pLastFreq = NULL, *pTmp = NULL;
+    sfloat fResidualAccumPerc = 0;
+
+    if(pAnalParams->iAnalysisDirection == SMS_DIR_REV)
+    {
+        sms_error("sms_analyzeSegments: only forward analysis can be done in segments");
+        return -1;
+    }
+
+    /* the frame count as sms_initAnalysis computes it */
+    if(sms_openSF(pChInputSoundFile, &soundHeader))
+        return -1;
+    sms_closeSF(&soundHeader);
+    sizeHop = (int)(soundHeader.iSamplingRate / (sfloat)pAnalParams->iFrameRate);
+    if(sizeHop <= 0)
+    {
+        sms_error("sms_analyzeSegments: wrong frame rate");
+        return -1;
+    }
+    nFrames = soundHeader.nSamples / sizeHop;
+
+    nThreads = sms_threadPoolSize(pPool);
+    nWarmupFrames = WarmupFrames(pAnalParams);
+    if(nSegmentFrames <= 0)
+        nSegmentFrames = MIN(nFrames / nThreads + 1,
+                             SEGMENT_MAX_SECONDS * pAnalParams->iFrameRate);
+    /* a segment has to be longer than its warm-up for this to pay off */
+    nSegmentFrames = MAX(nSegmentFrames, 4 * nWarmupFrames);
+    nSegments = MAX(1, (nFrames + nSegmentFrames - 1) / nSegmentFrames);
+
+    if((pSegments = (Segment *)calloc(nSegments, sizeof(Segment))) == NULL)
+    {
+        sms_error("could not allocate memory for segments");
+        return -1;
+    }
+    for(iSegment = 0; iSegment < nSegments; iSegment++)
+    {
+        Segment *pSegment = &pSegments[iSegment];
+        pSegment->pChInputSoundFile = pChInputSoundFile;
+        pSegment->pAnalParams = pAnalParams;
+        pSegment->nWarmupFrames = (iSegment == 0) ? 0 : nWarmupFrames;
+        pSegment->iFirstFrame = iSegment * nSegmentFrames - pSegment->nWarmupFrames;
+        pSegment->nFrames = (iSegment == nSegments - 1) ? 0 : nSegmentFrames;
+    }
+
+    isHarmonic = (pAnalParams->iFormat == SMS_FORMAT_H || pAnalParams->iFormat == SMS_FORMAT_HP);
+
+    /* a batch of segments per thread, to bound the memory used by the frames */
+    for(iBatch = 0; iBatch < nSegments && !iError; iBatch += nThreads)
+    {
+        nBatch = MIN(nThreads, nSegments - iBatch);
+        for(iSegment = iBatch; iSegment < iBatch + nBatch; iSegment++)
+            if(sms_threadPoolSubmit(pPool, SegmentTask, &pSegments[iSegment]) < 0)
+            {
+                /* run it here instead */
+                SegmentTask(&pSegments[iSegment]);
+            }
+        sms_threadPoolWait(pPool);
+
+        for(iSegment = iBatch; iSegment < iBatch + nBatch && !iError; iSegment++)
+        {
+            Segment *pSegment = &pSegments[iSegment];
+            SMS_Data *pSmsData = &pSegment->smsData;
+            int nTracks = pSmsData->nTracks;
+
+            if(pSegment->iStatus < 0)
+            {
+                sms_error(pSegment->pChError);
+                iError = -1;
+                break;
+            }
+            if(pSegment->nOutFrames == 0)
+                continue;
+
+            sizeFrame = pSmsData->sizeData / sizeof(sfloat);
+            if(pTrackMap == NULL)
+            {
+                pTrackMap = (int *)malloc(nTracks * sizeof(int));
+                pIsUsed = (int *)malloc(nTracks * sizeof(int));
+                pLastFreq = (sfloat *)malloc(nTracks * sizeof(sfloat));
+                pTmp = (sfloat *)malloc(nTracks * sizeof(sfloat));
+                if(!pTrackMap || !pIsUsed || !pLastFreq || !pTmp)
+                {
+                    sms_error("could not allocate memory for track stitching");
+                    iError = -1;
+                    break;
+                }
+            }
+
+            /* stitch the tracks at the seam */
+            if(!isHarmonic && hasLastFrame && pSegment->hasSeamFrame)
+                MatchTracks(nTracks, pLastFreq, pSegment->pFrameData,
+                            pSegment->pFrameData + sizeFrame, pTrackMap, pIsUsed);
+            else
+                for(i = 0; i < nTracks; i++)
+                    pTrackMap[i] = i;
+
+            for(iFrame = 1; iFrame <= pSegment->nOutFrames; iFrame++)
+            {
+                memcpy(pSmsData->pSmsData, pSegment->pFrameData + (size_t)iFrame * sizeFrame,
+                       pSmsData->sizeData);
+                MapTracks(nTracks, pSmsData->pFSinFreq, pTrackMap, pTmp);
+                MapTracks(nTracks, pSmsData->pFSinAmp, pTrackMap, pTmp);
+                MapTracks(nTracks, pSmsData->pFSinPha, pTrackMap, pTmp);
+                if(pFrameFunc(pSmsData, pUserData))
+                {
+                    FrameFuncError();
+                    iError = -1;
+                    break;
+                }
+                nFramesOut++;
+            }
+            memcpy(pLastFreq, pSmsData->pFSinFreq, nTracks * sizeof(sfloat));
+            hasLastFrame = 1;
+            fResidualAccumPerc += pSegment->fResidualAccumPerc;
+
+            /* the end of the sound came before the end of the segment */
+            if(pSegment->nFrames > 0 && pSegment->nOutFrames < pSegment->nFrames)
+                nSegments = iSegment + 1;
+        }
+
+        for(iSegment = iBatch; iSegment < iBatch + nBatch; iSegment++)
+        {
+            sms_freeFrame(&pSegments[iSegment].smsData);
+            if(pSegments[iSegment].pFrameData)
+                free(pSegments[iSegment].pFrameData);
+        }
+    }
+
+    if(pResidualAccumPerc)
+        *pResidualAccumPerc = fResidualAccumPerc;
+
+    free(pSegments);
+    if(pTrackMap)
+        free(pTrackMap);
+    if(pIsUsed)
+        free(pIsUsed);
+    if(pLastFreq)
+        free(pLastFreq);
+    if(pTmp)
+        free(pTmp);
+    return iError ? -1 : nFramesOut;
+}
+
+/* spectral front end of a few consecutive frames */
+typedef struct
+{
+    const SMS_AnalParams *pAnalParams;
+    const sfloat *pSound;       /* pre-emphasized sound, pSound[0] is sample iSoundStart */
+    long iSoundStart;
+    SMS_FramePeaks *pFramePeaks;
+    int nFrames;
+} PeakTask;
+
+/* a batch of frames, computed while the previous batch is analyzed */
+typedef struct
+{
+    SMS_FramePeaks *pFramePeaks;
+    SMS_Peak *pPeaks;           /* storage for the peaks of all frames */
+    PeakTask *pTasks;
+    int nFrames;
+} PeakBatch;
+
+/* the part of the sound needed by the front end and the analysis */
+typedef struct
+{
+    sfloat *pRaw;               /* sound as read from the file */
+    sfloat *pEmph;              /* the same after pre-emphasis, as in sms_fillSoundBuffer */
+    long iStart;                /* sample number of the first sample in the buffers */
+    long iEnd;                  /* sample number after the last sample in the buffers */
+    long sizeBuffer;            /* number of samples allocated */
+    sfloat fEmphLastValue;      /* last value of the pre-emphasis filter */
+} PipelineSound;
+
+static void PeakTaskFunc(void *pArg)
+{
+    PeakTask *pTask = (PeakTask *)pArg;
+    const SMS_AnalParams *pAnalParams = pTask->pAnalParams;
+    SMS_FramePeaks *pFramePeaks = pTask->pFramePeaks;
+    sfloat *pWindow, *pMag, *pPhase, *pFftBuffer;
+    int i, iSoundLoc, nPeaks[PIPELINE_TASK_FRAMES];
+    int sizeWindow = pFramePeaks[0].iFrameSize;
+    long sizeMag = sms_power2(sizeWindow);
+
+    /* the frames of a task are consecutive, of the same size and their
+     * peaks are stored one after the other, so they make one batch.
+     * If the memory is not there the frames are left to sms_analyze. */
+    if((pWindow = (sfloat *)malloc((sizeWindow + 4 * pTask->nFrames * sizeMag) * sizeof(sfloat))) == NULL)
+        return;
+    pMag = pWindow + sizeWindow;
+    pPhase = pMag + pTask->nFrames * sizeMag;
+    pFftBuffer = pPhase + pTask->nFrames * sizeMag;
+
+    iSoundLoc = (pFramePeaks[0].iFrameNum - 1) * pAnalParams->sizeHop -
+        ((sizeWindow + 1) >> 1) + 1;
+    sms_findPeaksFrames(pTask->nFrames, pAnalParams->sizeHop, sizeWindow,
+                        pTask->pSound + (iSoundLoc - pTask->iSoundStart),
+                        pAnalParams->iWindowType, pWindow, pMag, pPhase, pFftBuffer,
+                        pFramePeaks[0].pSpectralPeaks, nPeaks, &pAnalParams->peakParams);
+    for(i = 0; i < pTask->nFrames; i++)
+        pFramePeaks[i].nPeaks = nPeaks[i];
+    free(pWindow);
+}
+
+/* make the sound buffers hold the samples up to iEnd, and drop the ones before iKeep */
+static int ReadSound(PipelineSound *pSound, long iKeep, long iEnd,
+                     SMS_SndHeader *pSoundHeader, SMS_AnalParams *pAnalParams)
+{
+    long sizeRead, sizeMaxRead = SMS_MAX_FRAME_SIZE / pSoundHeader->channelCount;
+    int i;
+
+    iEnd = MIN(iEnd, pSoundHeader->nSamples);
+    if(iKeep > pSound->iStart)
+    {
+        long nDrop = MIN(iKeep, pSound->iEnd) - pSound->iStart;
+        memmove(pSound->pRaw, pSound->pRaw + nDrop, (pSound->iEnd - pSound->iStart - nDrop) * sizeof(sfloat));
+        memmove(pSound->pEmph, pSound->pEmph + nDrop, (pSound->iEnd - pSound->iStart - nDrop) * sizeof(sfloat));
+        pSound->iStart += nDrop;
+    }
+    if(iEnd <= pSound->iEnd)
+        return 0;
+
+    if(iEnd - pSound->iStart > pSound->sizeBuffer)
+    {
+        long sizeBuffer = MAX(2 * pSound->sizeBuffer, iEnd - pSound->iStart);
+        sfloat *pRaw = (sfloat *)realloc(pSound->pRaw, sizeBuffer * sizeof(sfloat));
+        sfloat *pEmph;
+        if(pRaw == NULL)
+        {
+            sms_error("could not allocate memory for the sound");
+            return -1;
+        }
+        pSound->pRaw = pRaw;
+        if((pEmph = (sfloat *)realloc(pSound->pEmph, sizeBuffer * sizeof(sfloat))) == NULL)
+        {
+            sms_error("could not allocate memory for the sound");
+            return -1;
+        }
+        pSound->pEmph = pEmph;
+        pSound->sizeBuffer = sizeBuffer;
+    }
+
+    while(pSound->iEnd < iEnd)
+    {
+        sfloat *pRaw = pSound->pRaw + (pSound->iEnd - pSound->iStart);
+        sfloat *pEmph = pSound->pEmph + (pSound->iEnd - pSound->iStart);
+
+        /* the analysis sees silence before the start of the sound */
+        if(pSound->iEnd < 0)
+        {
+            sizeRead = MIN(iEnd, 0) - pSound->iEnd;
+            memset(pRaw, 0, sizeRead * sizeof(sfloat));
+            memset(pEmph, 0, sizeRead * sizeof(sfloat));
+        }
+        else
+        {
+            sizeRead = MIN(iEnd - pSound->iEnd, sizeMaxRead);
+            if(sms_getSound(pSoundHeader, sizeRead, pRaw, pSound->iEnd, pAnalParams))
+                return -1;
+            for(i = 0; i < sizeRead; i++)
+            {
+                if(pAnalParams->preEmphasis)
+                {
+                    pEmph[i] = pRaw[i] - SMS_EMPH_COEF * pSound->fEmphLastValue;
+                    pSound->fEmphLastValue = pEmph[i];
+                }
+                else
+                    pEmph[i] = pRaw[i];
+            }
+        }
+        pSound->iEnd += sizeRead;
+    }
+    return 0;
+}
+
+/* compute the peaks of the frames from iFirstFrame on in the thread pool,
+ * with the window size the analysis is using now */
+static int SubmitBatch(PeakBatch *pBatch, int iFirstFrame, int nFrames, PipelineSound *pSound,
+                       long iKeep, SMS_ThreadPool *pPool, SMS_SndHeader *pSoundHeader,
+                       SMS_AnalParams *pAnalParams)
+{
+    int i, iTask, nTasks;
+    int sizeWindow = pAnalParams->sizeWindow ? pAnalParams->sizeWindow : pAnalParams->iDefaultSizeWindow;
+    long iFrameSample, iFirstSample = -1, iLastSample = 0;
+
+    pBatch->nFrames = 0;
+    for(i = 0; i < nFrames; i++)
+    {
+        SMS_FramePeaks *pFramePeaks = &pBatch->pFramePeaks[i];
+
+        iFrameSample = (long)(iFirstFrame + i - 1) * pAnalParams->sizeHop;
+        /* the same check for the end of sound as in sms_initFrame */
+        if(iFrameSample + (sizeWindow + 1) / 2 >= pAnalParams->iSizeSound)
+            break;
+        pFramePeaks->iFrameNum = iFirstFrame + i;
+        pFramePeaks->iFrameSize = sizeWindow;
+        pFramePeaks->nPeaks = -1;
+        if(iFirstSample < 0)
+            iFirstSample = iFrameSample - ((sizeWindow + 1) >> 1) + 1;
+        iLastSample = iFrameSample + (sizeWindow >> 1) + 1;
+        pBatch->nFrames++;
+    }
+    if(pBatch->nFrames == 0)
+        return 0;
+
+    if(ReadSound(pSound, MIN(iKeep, iFirstSample), iLastSample, pSoundHeader, pAnalParams))
+        return -1;
+
+    nTasks = (pBatch->nFrames + PIPELINE_TASK_FRAMES - 1) / PIPELINE_TASK_FRAMES;
+    for(iTask = 0; iTask < nTasks; iTask++)
+    {
+        PeakTask *pTask = &pBatch->pTasks[iTask];
+        pTask->pAnalParams = pAnalParams;
+        pTask->pSound = pSound->pEmph;
+        pTask->iSoundStart = pSound->iStart;
+        pTask->pFramePeaks = &pBatch->pFramePeaks[iTask * PIPELINE_TASK_FRAMES];
+        pTask->nFrames = MIN(PIPELINE_TASK_FRAMES, pBatch->nFrames - iTask * PIPELINE_TASK_FRAMES);
+        if(sms_threadPoolSubmit(pPool, PeakTaskFunc, pTask) < 0)
+            pTask->nFrames = 0; /* sms_analyze will compute them */
+    }
+    return 0;
+}
+
+static int AllocBatch(PeakBatch *pBatch, int nFrames, int nTasks, int nMaxPeaks)
+{
+    int i;
+
+    pBatch->pFramePeaks = (SMS_FramePeaks *)calloc(nFrames, sizeof(SMS_FramePeaks));
+    pBatch->pPeaks = (SMS_Peak *)calloc((size_t)nFrames * nMaxPeaks, sizeof(SMS_Peak));
+    pBatch->pTasks = (PeakTask *)calloc(nTasks, sizeof(PeakTask));
+    pBatch->nFrames = 0;
+    if(!pBatch->pFramePeaks || !pBatch->pPeaks || !pBatch->pTasks)
+    {
+        sms_error("could not allocate memory for the frame peaks");
+        return -1;
+    }
+    for(i = 0; i < nFrames; i++)
+        pBatch->pFramePeaks[i].pSpectralPeaks = pBatch->pPeaks + (size_t)i * nMaxPeaks;
+    return 0;
+}
+
+static void FreeBatch(PeakBatch *pBatch)
+{
+    if(pBatch->pFramePeaks)
+        free(pBatch->pFramePeaks);
+    if(pBatch->pPeaks)
+        free(pBatch->pPeaks);
+    if(pBatch->pTasks)
+        free(pBatch->pTasks);
+}
+
+/*! \brief analyze a sound with the spectral front end running ahead on a thread pool
+ *
+ * This does the same as calling sms_getSound and sms_analyze in a loop (as
+ * smsAnal does), and gives the same frames. Meanwhile the thread pool
+ * computes the spectra and peaks of the following frames (one batch of a
+ * few frames per thread ahead) and hands them to sms_analyzeFrame through
+ * SMS_AnalParams::pFramePeaks. The peak continuation, track cleaning and
+ * stochastic analysis stay on the calling thread, in frame order.
+ *
+ * The front end uses the window size of the analysis at the time the batch
+ * is started. When the analysis ends up using another size for a frame (the
+ * window follows the fundamental in harmonic analysis of phrases) the peaks
+ * of that frame are computed again by sms_analyzeFrame. In the inharmonic
+ * formats and for single notes the window size does not change.
+ *
+ * Only forward analysis is supported.
+ *
+ * \param pSoundHeader     sound opened with sms_openSF
+ * \param pAnalParams       analysis parameters initialized with sms_initAnalysis
+ * \param pPool              thread pool for the spectral front end
+ * \param pFrameFunc        function called for every frame
+ * \param pUserData           passed on to pFrameFunc
+ * \return the number of frames analyzed, -1 on error
+ */
+int sms_analyzePipelined(SMS_SndHeader *pSoundHeader, SMS_AnalParams *pAnalParams,
+                         SMS_ThreadPool *pPool, SMS_FrameFunc pFrameFunc, void *pUserData)
+{
+    PipelineSound sound;
+    PeakBatch batches[2];
+    SMS_Data smsData;
+    SMS_Header smsHeader;
+    int nBatchFrames, nBatchTasks, iBatch = 0, iNextFrame = 1, nConsume, iStatus = 0;
+    int iFrame = 0, iError = 0;
+    long iSample = 0, sizeNewData = 0;
+
+    if(pAnalParams->iAnalysisDirection == SMS_DIR_REV)
+    {
+        sms_error("sms_analyzePipelined: only forward analysis can be pipelined");
+        return -1;
+    }
+
+    nBatchTasks = sms_threadPoolSize(pPool) * PIPELINE_BATCH_TASKS;
+    nBatchFrames = nBatchTasks * PIPELINE_TASK_FRAMES;
+
+    memset(&sound, 0, sizeof(PipelineSound));
+    memset(batches, 0, sizeof(batches));
+    sound.iStart = sound.iEnd = -pAnalParams->iMaxSizeWindow;
+    sms_fillHeader(&smsHeader, pAnalParams, "sms_analyzePipelined");
+    if(AllocBatch(&batches[0], nBatchFrames, nBatchTasks, pAnalParams->peakParams.iMaxPeaks) ||
+       AllocBatch(&batches[1], nBatchFrames, nBatchTasks, pAnalParams->peakParams.iMaxPeaks) ||
+       sms_allocFrameH(&smsHeader, &smsData))
+    {
+        FreeBatch(&batches[0]);
+        FreeBatch(&batches[1]);
+        return -1;
+    }
+
+    if(SubmitBatch(&batches[0], iNextFrame, nBatchFrames, &sound, 0, pPool,
+                   pSoundHeader, pAnalParams))
+        iError = -1;
+    iNextFrame += batches[0].nFrames;
+
+    while(iStatus != -1 && !iError)
+    {
+        PeakBatch *pBatch = &batches[iBatch];
+
+        sms_threadPoolWait(pPool);
+        pAnalParams->pFramePeaks = pBatch->pFramePeaks;
+        pAnalParams->nFramePeaks = pBatch->nFrames;
+
+        /* start on the next batch while this one is analyzed */
+        if(pBatch->nFrames > 0 &&
+           SubmitBatch(&batches[1 - iBatch], iNextFrame, nBatchFrames, &sound,
+                       iSample + sizeNewData, pPool, pSoundHeader, pAnalParams))
+        {
+            iError = -1;
+            break;
+        }
+        iNextFrame += batches[1 - iBatch].nFrames;
+
+        /* every call of sms_analyze starts one frame, after the last batch go on to the end */
+        for(nConsume = pBatch->nFrames; (nConsume > 0 || pBatch->nFrames == 0) && iStatus != -1; nConsume--)
+        {
+            iSample += sizeNewData;
+            if((iSample + pAnalParams->sizeNextRead) < pSoundHeader->nSamples)
+                sizeNewData = pAnalParams->sizeNextRead;
+            else
+                sizeNewData = pSoundHeader->nSamples - iSample;
+
+            if(iSample + sizeNewData > sound.iEnd)
+            {
+                /* the front end reads the same buffers */
+                sms_threadPoolWait(pPool);
+                if(ReadSound(&sound, sound.iStart, iSample + sizeNewData, pSoundHeader, pAnalParams))
+                {
+                    iError = -1;
+                    break;
+                }
+            }
+
+            iStatus = sms_analyze(sizeNewData, sound.pRaw + (iSample - sound.iStart),
+                                  &smsData, pAnalParams);
+            if(iStatus == 1)
+            {
+                if(pFrameFunc(&smsData, pUserData))
+                {
+                    FrameFuncError();
+                    iError = -1;
+                    break;
+                }
+                iFrame++;
+            }
+        }
+        iBatch = 1 - iBatch;
+    }
+
+    sms_threadPoolWait(pPool);
+    pAnalParams->pFramePeaks = NULL;
+    pAnalParams->nFramePeaks = 0;
+    FreeBatch(&batches[0]);
+    FreeBatch(&batches[1]);
+    sms_freeFrame(&smsData);
+    if(sound.pRaw)
+        free(sound.pRaw);
+    if(sound.pEmph)
+        free(sound.pEmph);
+    return iError ? -1 : iFrame;
+}
+
+typedef struct
+{
+    SMS_AnalParams *pAnalParams;
+    const sfloat *pSound;  /* the samples of the channel from iChunkStart on */
+    long iChunkStart;
+    long iChunkEnd;        /* first sample after the chunk */
+    long nSamples;         /* samples in the sound */
+    long iSample;          /* next sample to analyze */
+    SMS_Data smsData;
+    SMS_Model frames;      /* the frames analyzed in the chunk */
+    int iStatus;           /* status of the last sms_analyze, -1 at the end of the sound */
+    int iError;
+    char pChError[256];
+} ChannelTask;
+
+/* task run by the thread pool for each channel: analyze the chunk, this is
+ * the same loop as in smsAnal */
+static void AnalyzeChannelTask(void *pArg)
+{
+    ChannelTask *pTask = (ChannelTask *)pArg;
+    SMS_AnalParams *pAnalParams = pTask->pAnalParams;
+    long sizeNewData;
+    char *pChError;
+
+    while(pTask->iStatus != -1)
+    {
+        if((pTask->iSample + pAnalParams->sizeNextRead) < pTask->nSamples)
+            sizeNewData = pAnalParams->sizeNextRead;
+        else
+            sizeNewData = pTask->nSamples - pTask->iSample;
+        if(pTask->iSample + sizeNewData > pTask->iChunkEnd)
+            break;
+
+        pTask->iStatus = sms_analyze(sizeNewData, pTask->pSound + (pTask->iSample - pTask->iChunkStart),
+                                     &pTask->smsData, pAnalParams);
+        pTask->iSample += sizeNewData;
+        if(pTask->iStatus == 1 && sms_addModelFrame(&pTask->smsData, &pTask->frames) < 0)
+        {
+            pTask->iError = -1;
+            pChError = sms_errorString();
+            strncpy(pTask->pChError, pChError ? pChError : "unknown error", sizeof(pTask->pChError) - 1);
+            return;
+        }
+    }
+}
+
+/*! \brief analyze all of the channels of a sound in one pass
+ *
+ * Every channel has its own analysis, the sound is read only once for all
+ * of them, and the analyses run at the same time on the thread pool. The
+ * frames are the same as those of sms_getSound and sms_analyze in a loop
+ * for each channel (with SMS_SndHeader::iReadChannel set to it). They are
+ * passed on to pFrameFunc in the order of each channel, from the calling
+ * thread, the frames of the channels in turn.
+ *
+ * Only forward analysis is supported.
+ *
+ * \param pSoundHeader     sound opened with sms_openSF
+ * \param ppAnalParams     analysis parameters of each channel (channelCount of them),
+ * initialized with sms_initAnalysis
+ * \param pPool              thread pool to run the analyses on, NULL to run them on the calling thread
+ * \param pFrameFunc        function called for every frame
+ * \param ppUserData        passed on to pFrameFunc with the frames of each channel
+ * \return the number of frames analyzed in all of the channels, -1 on error
+ */
+int sms_analyzeChannels(SMS_SndHeader *pSoundHeader, SMS_AnalParams **ppAnalParams,
+                        SMS_ThreadPool *pPool, SMS_FrameFunc pFrameFunc, void **ppUserData)
+{
+    int nChannels = pSoundHeader->channelCount, iChannel, iFrame, nFrames = 0, iError = 0;
+    long sizeChunk = CHANNEL_CHUNK_SAMPLES, iChunkStart, iChunkEnd;
+    ChannelTask *pTasks;
+    sfloat **ppSound, **ppRead;
+    SMS_Header smsHeader;
+    SMS_Data smsData;
+
+    if(nChannels < 1)
+    {
+        sms_error("sms_analyzeChannels: the sound has no channels");
+        return -1;
+    }
+    for(iChannel = 0; iChannel < nChannels; iChannel++)
+    {
+        if(ppAnalParams[iChannel]->iAnalysisDirection == SMS_DIR_REV)
+        {
+            sms_error("sms_analyzeChannels: only forward analysis is supported");
+            return -1;
+        }
+        /* an analysis is never more than half a window behind another one */
+        sizeChunk = MAX(sizeChunk, 2 * ppAnalParams[iChannel]->iMaxSizeWindow);
+        /* the channels run on the pool, they do not wait on it */
+        ppAnalParams[iChannel]->pReAnalysisPool = NULL;
+    }
+
+    pTasks = (ChannelTask *)calloc(nChannels, sizeof(ChannelTask));
+    ppSound = (sfloat **)calloc(nChannels, sizeof(sfloat *));
+    ppRead = (sfloat **)calloc(nChannels, sizeof(sfloat *));
+    if(pTasks == NULL || ppSound == NULL || ppRead == NULL)
+    {
+        sms_error("could not allocate memory for the channels");
+        iError = -1;
+    }
+    for(iChannel = 0; iChannel < nChannels && !iError; iChannel++)
+    {
+        ChannelTask *pTask = &pTasks[iChannel];
+
+        pTask->pAnalParams = ppAnalParams[iChannel];
+        pTask->nSamples = pSoundHeader->nSamples;
+        sms_fillHeader(&smsHeader, ppAnalParams[iChannel], "sms_analyzeChannels");
+        if((ppSound[iChannel] = (sfloat *)malloc(sizeChunk * sizeof(sfloat))) == NULL)
+        {
+            sms_error("could not allocate memory for the channels");
+            iError = -1;
+        }
+        else if(sms_allocFrameH(&smsHeader, &pTask->smsData) < 0 ||
+                sms_initModel(&pTask->frames, &smsHeader) < 0)
+            iError = -1;
+    }
+
+    while(!iError)
+    {
+        /* the next chunk starts with the first sample an analysis still needs */
+        iChunkStart = -1;
+        for(iChannel = 0; iChannel < nChannels; iChannel++)
+        {
+            ChannelTask *pTask = &pTasks[iChannel];
+
+            ppRead[iChannel] = (pTask->iStatus != -1) ? ppSound[iChannel] : NULL;
+            if(pTask->iStatus != -1 && (iChunkStart < 0 || pTask->iSample < iChunkStart))
+                iChunkStart = pTask->iSample;
+        }
+        if(iChunkStart < 0)
+            break;
+        iChunkEnd = MIN(pSoundHeader->nSamples, iChunkStart + sizeChunk);
+        if(sms_getSoundChannels(pSoundHeader, iChunkEnd - iChunkStart, ppRead, iChunkStart) < 0)
+        {
+            iError = -1;
+            break;
+        }
+
+        for(iChannel = 0; iChannel < nChannels; iChannel++)
+        {
+            ChannelTask *pTask = &pTasks[iChannel];
+
+            if(pTask->iStatus == -1)
+                continue;
+            pTask->pSound = ppSound[iChannel];
+            pTask->iChunkStart = iChunkStart;
+            pTask->iChunkEnd = iChunkEnd;
+            if(pPool == NULL)
+                AnalyzeChannelTask(pTask);
+            else if(sms_threadPoolSubmit(pPool, AnalyzeChannelTask, pTask) < 0)
+            {
+                iError = -1;
+                break;
+            }
+        }
+        if(pPool)
+            sms_threadPoolWait(pPool);
+
+        /* pass the frames on */
+        for(iChannel = 0; iChannel < nChannels && !iError; iChannel++)
+        {
+            ChannelTask *pTask = &pTasks[iChannel];
+
+            if(pTask->iError)
+            {
+                sms_error(pTask->pChError);
+                iError = -1;
+                break;
+            }
+            for(iFrame = 0; iFrame < pTask->frames.pSmsHeader->nFrames; iFrame++)
+            {
+                sms_getModelFrame(&pTask->frames, iFrame, &smsData);
+                if(pFrameFunc(&smsData, ppUserData[iChannel]))
+                {
+                    FrameFuncError();
+                    iError = -1;
+                    break;
+                }
+                nFrames++;
+            }
+            pTask->frames.pSmsHeader->nFrames = 0;
+        }
+    }
+
+    for(iChannel = 0; pTasks && iChannel < nChannels; iChannel++)
+    {
+        sms_freeFrame(&pTasks[iChannel].smsData);
+        if(pTasks[iChannel].frames.pSmsHeader)
+            sms_freeModel(&pTasks[iChannel].frames);
+        if(ppSound && ppSound[iChannel])
+            free(ppSound[iChannel]);
+    }
+    free(pTasks);
+    free(ppSound);
+    free(ppRead);
+    return iError ? -1 : nFrames;
+}
@@ -20,6 +20,16 @@
  */
 /*! \file peakContinuation.c
  * \brief peak continuation algorithm and functions
+ *
+ * With SMS_TRACK_GREEDY each guide takes the best of the peaks close to
+ * it, one guide after the other, and a guide loses its peak to a later
+ * one that is at least as close to it. With SMS_TRACK_ASSIGN the peaks of
+ * a frame are assigned to all guides at once, so that the sum of the
+ * distances of the guides to their peaks (relative to the maximum
+ * deviation) is the smallest, a guide left without a peak counting as the
+ * maximum deviation. The assignment is solved with shortest augmenting
+ * paths over the few closest peaks of each guide, which stay short in
+ * practice.
  */
 
 #include "sms.h"
@@ -32,78 +42,114 @@
 /*!< maximum number of peak continuation candidates */
 #define MAX_CONT_CANDIDATES 5
 
+/*! \brief first peak not as far below a guide as a distance
+ *
+ * The peaks are in order of frequency, so their distances below the guide
+ * only get smaller, and a binary search finds the first one.
+ *
+ * \param pSpectralPeaks    array of peaks, in order of frequency
+ * \param iStart            first peak to look at
+ * \param iEnd              peak after the last one to look at
+ * \param fGuideFreq        guide's frequency
+ * \param fFloorDistance    distance (rounded down)
+ * \return the first peak from iStart on with floor(fGuideFreq - fFreq) < fFloorDistance, iEnd if none
+ */
+static int FirstPeakWithin(const SMS_Peak *pSpectralPeaks, int iStart, int iEnd,
+                           sfloat fGuideFreq, double fFloorDistance)
+{
+    int iMid;
+    sfloat fDistance;
+
+    while(iStart < iEnd)
+    {
+        iMid = (iStart + iEnd) >> 1;
+        fDistance = fGuideFreq - pSpectralPeaks[iMid].fFreq;
+        if(floor(fDistance) < fFloorDistance)
+            iEnd = iMid;
+        else
+            iStart = iMid + 1;
+    }
+    return iStart;
+}
+
 /*! \brief function to get the next closest peak from a guide
+ *
+ * The peaks below and above the guide are looked up with binary searches
+ * from a first guess of the peak closest to the guide, which gives the
+ * same peaks as walking to them one peak at a time.
  *
  * \param fGuideFreq        guide's frequency
  * \param pFFreqDistance    distance of last best peak from guide
- * \param pSpectralPeaks    array of peaks
+ * \param pSpectralPeaks    array of peaks, in order of frequency
+ * \param nPeaks            number of peaks
  * \param pAnalParams           analysis parameters
  * \param fFreqDev              maximum deviation from guide
  * \return peak number or -1 if nothing is good
  */
 static int GetNextClosestPeak(sfloat fGuideFreq, sfloat *pFFreqDistance,
-                              const SMS_Peak *pSpectralPeaks, const SMS_AnalParams *pAnalParams,
-                              sfloat fFreqDev)
+                              const SMS_Peak *pSpectralPeaks, int nPeaks,
+                              const SMS_AnalParams *pAnalParams, sfloat fFreqDev)
 {
-    int iInitialPeak = SMS_MAX_NPEAKS * fGuideFreq / (pAnalParams->iSamplingRate * .5);
-    int iLowPeak, iHighPeak, iChosenPeak = -1;
-    sfloat fLowDistance, fHighDistance, fFreq;
+    int nMaxPeaks = pAnalParams->peakParams.iMaxPeaks;
+    int iInitialPeak = nMaxPeaks * fGuideFreq / (pAnalParams->iSamplingRate * .5);
+    int iLowPeak, iHighPeak, iEndPeak, iChosenPeak = -1;
+    double fFloorDistance = floor(*pFFreqDistance);
+    sfloat fLowDistance, fHighDistance;
 
-    if(iInitialPeak >= pAnalParams->peakParams.iMaxPeaks)
-        iInitialPeak = 0;
-    else if(pSpectralPeaks[iInitialPeak].fFreq <= 0)
+    if(iInitialPeak >= nMaxPeaks || iInitialPeak >= nPeaks)
         iInitialPeak = 0;
 
-    /* find a low peak to start */
+    /* find a low peak to start: the last one further below the guide
+     * than the last best peak */
     fLowDistance = fGuideFreq - pSpectralPeaks[iInitialPeak].fFreq;
-    if(floor(fLowDistance) < floor(*pFFreqDistance))
+    if(floor(fLowDistance) < fFloorDistance)
     {
-        while(floor(fLowDistance) <= floor(*pFFreqDistance) &&
-              iInitialPeak > 0)
-        {
+        iInitialPeak = FirstPeakWithin(pSpectralPeaks, 0, iInitialPeak,
+                                       fGuideFreq, fFloorDistance + 1);
+        if(iInitialPeak > 0)
             iInitialPeak--;
-            fLowDistance = fGuideFreq - pSpectralPeaks[iInitialPeak].fFreq;
-        }
     }
     else
     {
-        while(floor(fLowDistance) >= floor(*pFFreqDistance) &&
-              iInitialPeak < (pAnalParams->peakParams.iMaxPeaks - 1))
-        {
-            iInitialPeak++;
-            if((fFreq = pSpectralPeaks[iInitialPeak].fFreq) == 0)
-                return -1;
-            fLowDistance = fGuideFreq - fFreq;
-        }
+        iEndPeak = FirstPeakWithin(pSpectralPeaks, iInitialPeak + 1, nPeaks,
+                                   fGuideFreq, fFloorDistance);
+        iEndPeak = MAX(iEndPeak, iInitialPeak + 1);
+        /* all peaks are below it */
+        if(iEndPeak >= nPeaks && iEndPeak < nMaxPeaks)
+            return -1;
+        iInitialPeak = MIN(iEndPeak, nMaxPeaks - 1);
         if(iInitialPeak > 0)
             iInitialPeak--;
-        fLowDistance = fGuideFreq - pSpectralPeaks[iInitialPeak].fFreq;
     }
+    fLowDistance = fGuideFreq - pSpectralPeaks[iInitialPeak].fFreq;
 
-    if(floor(fLowDistance) <= floor(*pFFreqDistance) ||
+    if(floor(fLowDistance) <= fFloorDistance ||
        fLowDistance > fFreqDev)
         iLowPeak = -1;
     else
         iLowPeak = iInitialPeak;
 
-    /* find a high peak to finish */
+    /* find a high peak to finish: the first one further above the guide
+     * than the last best peak */
     iHighPeak = iInitialPeak;
     fHighDistance = fGuideFreq - pSpectralPeaks[iHighPeak].fFreq;
-    while(floor(fHighDistance) >= floor(-*pFFreqDistance) &&
-          iHighPeak < (pAnalParams->peakParams.iMaxPeaks - 1))
+    if(floor(fHighDistance) >= floor(-*pFFreqDistance))
     {
-        iHighPeak++;
-        if((fFreq = pSpectralPeaks[iHighPeak].fFreq) == 0)
-        {
+        iEndPeak = FirstPeakWithin(pSpectralPeaks, iHighPeak + 1, nPeaks,
+                                   fGuideFreq, floor(-*pFFreqDistance));
+        iEndPeak = MAX(iEndPeak, iHighPeak + 1);
+        if(iEndPeak >= nMaxPeaks)
+            iHighPeak = nMaxPeaks - 1;
+        else if(iEndPeak >= nPeaks)
             iHighPeak = -1;
-            break;
-        }
-        fHighDistance = fGuideFreq - fFreq;
+        else
+            iHighPeak = iEndPeak;
+        if(iHighPeak >= 0)
+            fHighDistance = fGuideFreq - pSpectralPeaks[iHighPeak].fFreq;
     }
-    if(fHighDistance > 0 || fabs(fHighDistance) > fFreqDev ||
-       floor(fabs(fHighDistance)) <= floor(*pFFreqDistance))
+    if(iHighPeak < 0 || fHighDistance > 0 || fabs(fHighDistance) > fFreqDev ||
+       floor(fabs(fHighDistance)) <= fFloorDistance)
         iHighPeak = -1;
-
     /* chose between the two extrema */
     if(iHighPeak >= 0 && iLowPeak >= 0)
     {
@@ -215,12 +261,13 @@ static int BestGuide(int iConflictingGuide, int iGuide, const SMS_Guide *pGuides
  * \param pGuides       guide attributes
  * \param iGuide        number of guide
  * \param pSpectralPeaks    peak values at the current frame
+ * \param nPeaks            number of peaks at the current frame
  * \param pAnalParams           analysis parameters
  * \param fFreqDev                  frequency deviation allowed
  * \return the peak number
  */
 static int GetBestPeak(SMS_Guide *pGuides, int iGuide, const SMS_Peak *pSpectralPeaks,
-                       const SMS_AnalParams *pAnalParams, sfloat fFreqDev)
+                       int nPeaks, const SMS_AnalParams *pAnalParams, sfloat fFreqDev)
 {
     int iCand = 0, iPeak, iBestPeak, iConflictingGuide, iWinnerGuide;
     sfloat fGuideFreq = pGuides[iGuide].fFreq,
@@ -234,7 +281,7 @@ static int GetBestPeak(SMS_Guide *pGuides, int iGuide, const SMS_Peak *pSpectral
     {
         /* find the next best peak */
         if((iPeak = GetNextClosestPeak(fGuideFreq, &fFreqDistance,
-                                       pSpectralPeaks, pAnalParams,
+                                       pSpectralPeaks, nPeaks, pAnalParams,
                                        fFreqDev)) < 0)
         {
             break;
@@ -360,6 +407,300 @@ static int GetStartingPeak(int iGuide, SMS_Guide *pGuides, int nGuides,
     return 1;
 }
 
+/*! cost of a guide without a peak in SMS_TRACK_ASSIGN, the cost of a peak at the maximum deviation */
+#define ASSIGN_BOUND 1.
+
+/* work buffers of SMS_TRACK_ASSIGN (pointed to by SMS_AnalParams::pTrackingWork).
+ * The rows are the guides looking for a peak, the columns are the peaks
+ * followed by one column for each row that stands for no peak. */
+typedef struct
+{
+    int nMaxRows;       /* sizes the buffers are allocated for */
+    int nMaxCols;
+    int nRows;
+    int *pRowGuide;     /* guide of each row */
+    sfloat *pRowDev;    /* maximum frequency deviation of each row */
+    int *pEdgeStart;    /* first edge of each row, nRows + 1 of them */
+    int *pEdgeCol;      /* MAX_CONT_CANDIDATES + 1 edges per row */
+    double *pEdgeCost;
+    int *pRowCol;       /* column assigned to each row */
+    double *pRowCost;   /* cost of the edge to that column */
+    int *pColRow;       /* row assigned to each column, -1 if none */
+    double *pColPot;    /* potential of each column */
+    double *pDist;      /* distance of each column on the search of a path */
+    int *pPred;         /* row before each column on the search of a path */
+    int *pState;        /* 0: not reached, 1: reached, 2: distance final */
+    int *pReached;      /* columns reached on the search of a path */
+} AssignWork;
+
+static void FreeAssignWork(AssignWork *pWork)
+{
+    free(pWork->pRowGuide);
+    free(pWork->pRowDev);
+    free(pWork->pEdgeStart);
+    free(pWork->pEdgeCol);
+    free(pWork->pEdgeCost);
+    free(pWork->pRowCol);
+    free(pWork->pRowCost);
+    free(pWork->pColRow);
+    free(pWork->pColPot);
+    free(pWork->pDist);
+    free(pWork->pPred);
+    free(pWork->pState);
+    free(pWork->pReached);
+    memset(pWork, 0, sizeof(AssignWork));
+}
+
+/*! \brief prepare the peak continuation of an analysis
+ *
+ * Allocates the work buffers of SMS_TRACK_ASSIGN when
+ * SMS_AnalParams::iTracking asks for it, called by sms_initAnalysis().
+ *
+ * \param pAnalParams analysis parameters
+ * \return 0 on success, -1 on error
+ */
+int sms_initPeakContinuation(SMS_AnalParams *pAnalParams)
+{
+    AssignWork *pWork = (AssignWork *) pAnalParams->pTrackingWork;
+    int nRows = pAnalParams->nGuides;
+    int nCols = pAnalParams->peakParams.iMaxPeaks + nRows;
+    int nEdges = nRows * (MAX_CONT_CANDIDATES + 1);
+
+    if(pAnalParams->iTracking != SMS_TRACK_ASSIGN)
+        return 0;
+    if(pWork == NULL)
+    {
+        if((pWork = (AssignWork *) calloc(1, sizeof(AssignWork))) == NULL)
+        {
+            sms_error("could not allocate memory for peak continuation");
+            return -1;
+        }
+        pAnalParams->pTrackingWork = pWork;
+    }
+    if(pWork->nMaxRows >= nRows && pWork->nMaxCols >= nCols)
+        return 0;
+
+    FreeAssignWork(pWork);
+    pWork->pRowGuide = (int *) malloc(nRows * sizeof(int));
+    pWork->pRowDev = (sfloat *) malloc(nRows * sizeof(sfloat));
+    pWork->pEdgeStart = (int *) malloc((nRows + 1) * sizeof(int));
+    pWork->pEdgeCol = (int *) malloc(nEdges * sizeof(int));
+    pWork->pEdgeCost = (double *) malloc(nEdges * sizeof(double));
+    pWork->pRowCol = (int *) malloc(nRows * sizeof(int));
+    pWork->pRowCost = (double *) malloc(nRows * sizeof(double));
+    pWork->pColRow = (int *) malloc(nCols * sizeof(int));
+    pWork->pColPot = (double *) malloc(nCols * sizeof(double));
+    pWork->pDist = (double *) malloc(nCols * sizeof(double));
+    pWork->pPred = (int *) malloc(nCols * sizeof(int));
+    pWork->pState = (int *) calloc(nCols, sizeof(int));
+    pWork->pReached = (int *) malloc(nCols * sizeof(int));
+    if(!pWork->pRowGuide || !pWork->pRowDev || !pWork->pEdgeStart || !pWork->pEdgeCol ||
+       !pWork->pEdgeCost || !pWork->pRowCol || !pWork->pRowCost || !pWork->pColRow ||
+       !pWork->pColPot || !pWork->pDist || !pWork->pPred || !pWork->pState || !pWork->pReached)
+    {
+        FreeAssignWork(pWork);
+        sms_error("could not allocate memory for peak continuation");
+        return -1;
+    }
+    pWork->nMaxRows = nRows;
+    pWork->nMaxCols = nCols;
+    return 0;
+}
+
+/*! \brief free the work buffers allocated by sms_initPeakContinuation
+ *
+ * \param pAnalParams analysis parameters
+ */
+void sms_freePeakContinuation(SMS_AnalParams *pAnalParams)
+{
+    if(pAnalParams->pTrackingWork)
+    {
+        FreeAssignWork((AssignWork *) pAnalParams->pTrackingWork);
+        free(pAnalParams->pTrackingWork);
+        pAnalParams->pTrackingWork = NULL;
+    }
+}
+
+/* the edges of a row: the closest peaks (MAX_CONT_CANDIDATES at most)
+ * within the deviation and not too soft for the guide, as in GetBestPeak,
+ * then no peak */
+static void AddAssignEdges(AssignWork *pWork, int iRow, const SMS_Guide *pGuide, sfloat fFreqDev,
+                           const SMS_Peak *pSpectralPeaks, int nPeaks)
+{
+    int iEdge = pWork->pEdgeStart[iRow], nCand = 0, iLow, iHigh, iStart = 0, iEnd = nPeaks, iPeak;
+    sfloat fLowDistance, fHighDistance, fDistance;
+
+    /* the first peak at or above the guide */
+    while(iStart < iEnd)
+    {
+        int iMid = (iStart + iEnd) >> 1;
+
+        if(pSpectralPeaks[iMid].fFreq < pGuide->fFreq)
+            iStart = iMid + 1;
+        else
+            iEnd = iMid;
+    }
+    iLow = iStart - 1;
+    iHigh = iStart;
+
+    /* then the closest peaks on both sides */
+    while(nCand < MAX_CONT_CANDIDATES && fFreqDev > 0)
+    {
+        fLowDistance = (iLow >= 0) ? pGuide->fFreq - pSpectralPeaks[iLow].fFreq : fFreqDev + 1;
+        fHighDistance = (iHigh < nPeaks) ? pSpectralPeaks[iHigh].fFreq - pGuide->fFreq : fFreqDev + 1;
+        if(fHighDistance <= fLowDistance)
+        {
+            iPeak = iHigh++;
+            fDistance = fHighDistance;
+        }
+        else
+        {
+            iPeak = iLow--;
+            fDistance = fLowDistance;
+        }
+        if(fDistance > fFreqDev)
+            break;
+        if(pSpectralPeaks[iPeak].fMag - pGuide->fMag > -20.0)
+        {
+            pWork->pEdgeCol[iEdge] = iPeak;
+            pWork->pEdgeCost[iEdge++] = fDistance / fFreqDev;
+            nCand++;
+        }
+    }
+    pWork->pEdgeCol[iEdge] = nPeaks + iRow;
+    pWork->pEdgeCost[iEdge++] = ASSIGN_BOUND;
+    pWork->pEdgeStart[iRow + 1] = iEdge;
+}
+
+/* assign a column to a row along the shortest augmenting path (Dijkstra
+ * over the reduced costs, kept positive by the column potentials) */
+static void AugmentRow(AssignWork *pWork, int iStartRow)
+{
+    int i, iEdge, iCol, iRow, nReached = 0;
+    double fDist, fMinDist;
+
+    for(iEdge = pWork->pEdgeStart[iStartRow]; iEdge < pWork->pEdgeStart[iStartRow + 1]; iEdge++)
+    {
+        iCol = pWork->pEdgeCol[iEdge];
+        pWork->pDist[iCol] = pWork->pEdgeCost[iEdge] - pWork->pColPot[iCol];
+        pWork->pPred[iCol] = iStartRow;
+        pWork->pState[iCol] = 1;
+        pWork->pReached[nReached++] = iCol;
+    }
+
+    /* the own column of no peak of the row is always free, so this ends */
+    while(1)
+    {
+        /* the closest column reached, its distance is final */
+        iCol = -1;
+        fMinDist = 0;
+        for(i = 0; i < nReached; i++)
+        {
+            if(pWork->pState[pWork->pReached[i]] == 1 &&
+               (iCol < 0 || pWork->pDist[pWork->pReached[i]] < fMinDist))
+            {
+                iCol = pWork->pReached[i];
+                fMinDist = pWork->pDist[iCol];
+            }
+        }
+        pWork->pState[iCol] = 2;
+        if((iRow = pWork->pColRow[iCol]) < 0)
+            break;
+
+        /* go on through the row assigned to it */
+        for(iEdge = pWork->pEdgeStart[iRow]; iEdge < pWork->pEdgeStart[iRow + 1]; iEdge++)
+        {
+            int iNextCol = pWork->pEdgeCol[iEdge];
+
+            if(pWork->pState[iNextCol] == 2)
+                continue;
+            fDist = fMinDist + pWork->pEdgeCost[iEdge] - pWork->pColPot[iNextCol] -
+                (pWork->pRowCost[iRow] - pWork->pColPot[iCol]);
+            if(pWork->pState[iNextCol] == 0)
+            {
+                pWork->pState[iNextCol] = 1;
+                pWork->pReached[nReached++] = iNextCol;
+            }
+            else if(fDist >= pWork->pDist[iNextCol])
+                continue;
+            pWork->pDist[iNextCol] = fDist;
+            pWork->pPred[iNextCol] = iRow;
+        }
+    }
+
+    /* update the potentials of the columns with a final distance */
+    for(i = 0; i < nReached; i++)
+    {
+        int iReached = pWork->pReached[i];
+
+        if(pWork->pState[iReached] == 2)
+            pWork->pColPot[iReached] += pWork->pDist[iReached] - fMinDist;
+        pWork->pState[iReached] = 0;
+    }
+
+    /* assign along the path, back from the free column */
+    while(1)
+    {
+        int iPrevCol;
+
+        iRow = pWork->pPred[iCol];
+        iPrevCol = pWork->pRowCol[iRow];
+        pWork->pRowCol[iRow] = iCol;
+        pWork->pColRow[iCol] = iRow;
+        for(iEdge = pWork->pEdgeStart[iRow]; pWork->pEdgeCol[iEdge] != iCol; iEdge++)
+            ;
+        pWork->pRowCost[iRow] = pWork->pEdgeCost[iEdge];
+        if(iRow == iStartRow)
+            break;
+        iCol = iPrevCol;
+    }
+}
+
+/*! \brief assign the peaks of a frame to the guides all at once
+ *
+ * The guides are the rows added for the frame, the peak of each one is
+ * set in iPeakChosen (-1 for none).
+ *
+ * \param pWork             work buffers with the rows of the frame
+ * \param pGuides           array of guides
+ * \param pSpectralPeaks    peaks of the frame, in order of frequency
+ * \param nPeaks            number of peaks
+ * \param iDebugMode        debug mode of the analysis
+ */
+static void AssignPeaks(AssignWork *pWork, SMS_Guide *pGuides, const SMS_Peak *pSpectralPeaks,
+                        int nPeaks, int iDebugMode)
+{
+    int iRow, iCol, nCols = nPeaks + pWork->nRows;
+
+    pWork->pEdgeStart[0] = 0;
+    for(iRow = 0; iRow < pWork->nRows; iRow++)
+    {
+        AddAssignEdges(pWork, iRow, &pGuides[pWork->pRowGuide[iRow]], pWork->pRowDev[iRow],
+                       pSpectralPeaks, nPeaks);
+        pWork->pRowCol[iRow] = -1;
+    }
+    for(iCol = 0; iCol < nCols; iCol++)
+    {
+        pWork->pColRow[iCol] = -1;
+        pWork->pColPot[iCol] = 0;
+    }
+
+    for(iRow = 0; iRow < pWork->nRows; iRow++)
+        AugmentRow(pWork, iRow);
+
+    for(iRow = 0; iRow < pWork->nRows; iRow++)
+    {
+        int iGuide = pWork->pRowGuide[iRow];
+
+        iCol = pWork->pRowCol[iRow];
+        pGuides[iGuide].iPeakChosen = (iCol < nPeaks) ? iCol : -1;
+        if(iDebugMode == SMS_DBG_PEAK_CONT || iDebugMode == SMS_DBG_ALL)
+            fprintf(stdout, "Assigned: guide %d (%f): peak %d\n", iGuide, pGuides[iGuide].fFreq,
+                    pGuides[iGuide].iPeakChosen);
+    }
+    pWork->nRows = 0;
+}
+
 /*! \brief  function to advance the guides through the next frame
  *
  * the output is the frequency, magnitude, and phase tracks
@@ -373,6 +714,8 @@ int sms_peakContinuation(int iFrame, const SMS_AnalParams *pAnalParams)
     int iGuide, iCurrentPeak = -1, iGoodPeak = -1;
     sfloat fFund = pAnalParams->ppFrames[iFrame]->fFundamental,
     fFreqDev = fFund * pAnalParams->fFreqDeviation, fCurrentMax = 1000;
+    AssignWork *pAssignWork = (pAnalParams->iTracking == SMS_TRACK_ASSIGN) ?
+        (AssignWork *) pAnalParams->pTrackingWork : NULL;
 
     /* update guides with fundamental contribution */
     if(fFund > 0 && (pAnalParams->iFormat == SMS_FORMAT_H ||
@@ -416,11 +759,21 @@ int sms_peakContinuation(int iFrame, const SMS_AnalParams *pAnalParams)
         if(pAnalParams->iFormat == SMS_FORMAT_IH || pAnalParams->iFormat == SMS_FORMAT_IHP)
             fFreqDev = pAnalParams->guides[iGuide].fFreq * pAnalParams->fFreqDeviation;
 
-        /* get the best peak for the guide */
-        iGoodPeak = GetBestPeak(pAnalParams->guides, iGuide,
-                                pAnalParams->ppFrames[iFrame]->pSpectralPeaks,
-                                pAnalParams, fFreqDev);
+        /* get the best peak for the guide, or for all of them at once below */
+        if(pAssignWork)
+        {
+            pAssignWork->pRowGuide[pAssignWork->nRows] = iGuide;
+            pAssignWork->pRowDev[pAssignWork->nRows++] = fFreqDev;
+        }
+        else
+            iGoodPeak = GetBestPeak(pAnalParams->guides, iGuide,
+                                    pAnalParams->ppFrames[iFrame]->pSpectralPeaks,
+                                    pAnalParams->ppFrames[iFrame]->nPeaks,
+                                    pAnalParams, fFreqDev);
     }
+    if(pAssignWork)
+        AssignPeaks(pAssignWork, pAnalParams->guides, pAnalParams->ppFrames[iFrame]->pSpectralPeaks,
+                    pAnalParams->ppFrames[iFrame]->nPeaks, pAnalParams->iDebugMode);
 
     /* try to find good peaks for the GUIDE_DEAD guides */
     if(pAnalParams->iFormat == SMS_FORMAT_IH || pAnalParams->iFormat == SMS_FORMAT_IHP)
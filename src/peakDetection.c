@@ -24,6 +24,8 @@
 
 #include "sms.h"
 
+#define PEAK_BATCH 64 /* local maxima found at once */
+
 /*! \brief function used for the parabolic interpolation of the spectral peaks
  *
  * it performs the interpolation in a log scale and
@@ -45,86 +47,6 @@ static sfloat PeakInterpolation(sfloat fMaxVal, sfloat fLeftBinVal,
     return fMaxVal - (.25 * (fLeftBinVal - fRightBinVal) * *pFDiffFromMax);
 }
 
-/*! \brief detect the next local maximum in the spectrum
- *
- * stores the value in pFMaxVal
- *
- * \todo export this to sms.h and wrap in pysms
- *
- * \param pFMagSpectrum   magnitude spectrum
- * \param iHighBinBound      highest bin to search
- * \param pICurrentLoc      current bin location
- * \param pFMaxVal        value of the maximum found
- * \param fMinPeakMag  minimum magnitude to accept a peak
- * \return the bin location of the maximum
- */
-static int FindNextMax(const sfloat *pFMagSpectrum, int iHighBinBound,
-                       int *pICurrentLoc, sfloat *pFMaxVal, sfloat fMinPeakMag)
-{
-    int iCurrentBin = *pICurrentLoc;
-    sfloat fPrevVal = pFMagSpectrum[iCurrentBin - 1];
-    sfloat fCurrentVal = pFMagSpectrum[iCurrentBin];
-    sfloat fNextVal = (iCurrentBin >= iHighBinBound) ? 0 : pFMagSpectrum[iCurrentBin + 1];
-
-    /* try to find a local maximum */
-    while(iCurrentBin <= iHighBinBound)
-    {
-        if(fCurrentVal > fMinPeakMag &&
-           fCurrentVal >= fPrevVal &&
-           fCurrentVal >= fNextVal)
-            break;
-        iCurrentBin++;
-        fPrevVal = fCurrentVal;
-        fCurrentVal = fNextVal;
-        fNextVal = pFMagSpectrum[1+iCurrentBin];
-    }
-
-    /* save the current location, value of maximum and return */
-    /*    location of max */
-    *pICurrentLoc = iCurrentBin + 1;
-    *pFMaxVal = fCurrentVal;
-    return iCurrentBin;
-}
-
-/*! \brief function to detect the next spectral peak
- *
- * \param pFMagSpectrum    magnitude spectrum
- * \param iHighestBin       highest bin to search
- * \param pICurrentLoc       current bin location
- * \param pFPeakMag        magnitude value of peak
- * \param pFPeakLoc        location of peak
- * \param fMinPeakMag  minimum magnitude to accept a peak
- * \return 1 if found, 0 if not
- */
-static int FindNextPeak(const sfloat *pFMagSpectrum, int iHighestBin,
-                        int *pICurrentLoc, sfloat *pFPeakMag,
-                        sfloat *pFPeakLoc, sfloat fMinPeakMag)
-{
-    int iPeakBin = 0;    /* location of the local peak */
-    sfloat fPeakMag = 0; /* value of local peak */
-
-    /* keep trying to find a good peak while inside the freq range */
-    while((iPeakBin = FindNextMax(pFMagSpectrum, iHighestBin,
-                                  pICurrentLoc, &fPeakMag, fMinPeakMag))
-          <= iHighestBin)
-    {
-        /* get the neighboring samples */
-        sfloat fDiffFromMax = 0;
-        sfloat fLeftBinVal = pFMagSpectrum[iPeakBin - 1];
-        sfloat fRightBinVal = pFMagSpectrum[iPeakBin + 1];
-        if(fLeftBinVal <= 0 || fRightBinVal <= 0) //ahah! there you are!
-            continue;
-        /* interpolate the spectral samples to obtain
-           a more accurate magnitude and freq */
-        *pFPeakMag = PeakInterpolation(fPeakMag, fLeftBinVal,
-                                       fRightBinVal, &fDiffFromMax);
-        *pFPeakLoc = iPeakBin + fDiffFromMax;
-        return 1;
-    }
-    /* if it does not find a peak return 0 */
-    return 0;
-}
-
 /*! \brief get the corresponding phase value for a given peak
  *
  * performs linear interpolation for a more accurate phase
@@ -154,6 +76,10 @@ static sfloat GetPhaseVal(const sfloat *pPhaseSpectrum, sfloat fPeakLoc)
  *
  * uses a dB spectrum
  *
+ * The local maxima are found with sms_vecFindMaxima() a batch at a time,
+ * then turned into peaks one after the other. A maximum next to a bin of
+ * 0 dB is not a peak.
+ *
  * \param sizeSpec       size of magnitude spectrum
  * \param pMag           pointer to power spectrum
  * \param pPhase         pointer to phase spectrum
@@ -170,36 +96,46 @@ int sms_detectPeaks(int sizeSpec, const sfloat *pMag, const sfloat *pPhase,
      * QUESTION: why not allow a peak in bin 1 or 0? */
     /* rte: changed the first argument of MAX from 2 to 1 */
     int iFirstBin = MAX(1, sizeFft * pPeakParams->fLowestFreq / pPeakParams->iSamplingRate);
-    int iHighestBin = MIN(sizeSpec-1,
+    /* and to end on the one before the last, which has no bin after it */
+    int iHighestBin = MIN(sizeSpec-2,
                           sizeFft * pPeakParams->fHighestFreq / pPeakParams->iSamplingRate);
+    int pMaxBins[PEAK_BATCH]; /* bins of a batch of local maxima */
+    int nMaxBins, iMax, iBin;
     int iPeak = 0;      /* index for spectral search */
-
-    /* clear peak structure */
-    for(iPeak = 0; iPeak < pPeakParams->iMaxPeaks; iPeak++)
-    {
-        pSpectralPeaks[iPeak].fFreq = 0.0;
-        pSpectralPeaks[iPeak].fMag = 0.0;
-        pSpectralPeaks[iPeak].fPhase = 0.0;
-    }
-
-    /* set starting search values */
-    int iCurrentLoc = iFirstBin;
-    sfloat fPeakMag = 0.0;  /* magnitude of peak */
-    sfloat fPeakLoc = 0.0;  /* location of peak */
-    iPeak = 0;
+    int iCurrentBin = iFirstBin;
+    sfloat fPeakMag, fDiffFromMax, fPeakLoc;
 
     /* find peaks */
-    while((iPeak < pPeakParams->iMaxPeaks) &&
-          (FindNextPeak(pMag, iHighestBin, &iCurrentLoc, &fPeakMag,
-                        &fPeakLoc, pPeakParams->fMinPeakMag) == 1))
+    while(iPeak < pPeakParams->iMaxPeaks && iCurrentBin <= iHighestBin)
     {
-        /* store peak values */
-        pSpectralPeaks[iPeak].fFreq = pPeakParams->iSamplingRate * fPeakLoc * fInvSizeFft;
-        pSpectralPeaks[iPeak].fMag = fPeakMag;
-        pSpectralPeaks[iPeak].fPhase = GetPhaseVal(pPhase, fPeakLoc);
-        iPeak++;
+        /* no more maxima than peaks still wanted, most maxima are peaks */
+        int nWanted = MIN(PEAK_BATCH, pPeakParams->iMaxPeaks - iPeak);
+
+        nMaxBins = sms_vecFindMaxima(pMag, iCurrentBin, iHighestBin,
+                                     pPeakParams->fMinPeakMag, pMaxBins, nWanted);
+        iCurrentBin = (nMaxBins == nWanted) ? pMaxBins[nMaxBins - 1] + 1 : iHighestBin + 1;
+
+        for(iMax = 0; iMax < nMaxBins && iPeak < pPeakParams->iMaxPeaks; iMax++)
+        {
+            iBin = pMaxBins[iMax];
+            if(pMag[iBin - 1] <= 0 || pMag[iBin + 1] <= 0)
+                continue;
+            /* interpolate the spectral samples to obtain
+               a more accurate magnitude and freq */
+            fPeakMag = PeakInterpolation(pMag[iBin], pMag[iBin - 1], pMag[iBin + 1], &fDiffFromMax);
+            fPeakLoc = iBin + fDiffFromMax;
+
+            /* store peak values */
+            pSpectralPeaks[iPeak].fFreq = pPeakParams->iSamplingRate * fPeakLoc * fInvSizeFft;
+            pSpectralPeaks[iPeak].fMag = fPeakMag;
+            pSpectralPeaks[iPeak].fPhase = GetPhaseVal(pPhase, fPeakLoc);
+            iPeak++;
+        }
     }
 
+    /* clear the rest of the peak structure */
+    memset(pSpectralPeaks + iPeak, 0, (pPeakParams->iMaxPeaks - iPeak) * sizeof(SMS_Peak));
+
     /* return the number of peaks found */
     return iPeak;
 }
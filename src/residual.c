@@ -31,13 +31,15 @@
  * \param pOriginal  pointer to original waveform
  * \param pResidual  pointer to output residual waveform
  * \param pWindow    pointer to windowing array
+ * \param pAnalParams pointer to analysis parameters (holds the running energies)
  * \return residual percentage (0 if residual was not large enough)
  \todo why is residual energy percentage computed this way? should be optional and in a seperate function
  */
-int sms_residual(int sizeWindow, const sfloat *pSynthesis, const sfloat *pOriginal, sfloat *pResidual, const sfloat *pWindow)
+int sms_residual(int sizeWindow, const sfloat *pSynthesis, const sfloat *pOriginal, sfloat *pResidual, const sfloat *pWindow,
+                 SMS_AnalParams *pAnalParams)
 {
-    static sfloat fResidualMag = 0.;
-    static sfloat fOriginalMag = 0.;
+    sfloat fResidualMag = pAnalParams->fResidualMag;
+    sfloat fOriginalMag = pAnalParams->fOriginalMag;
     sfloat fScale = 1.;
     sfloat fCurrentResidualMag = 0.;
     sfloat fCurrentOriginalMag = 0.;
@@ -60,6 +62,8 @@ int sms_residual(int sizeWindow, const sfloat *pSynthesis, const sfloat *pOrigin
 
         fOriginalMag = .5 * (fCurrentOriginalMag/sizeWindow + fOriginalMag);
         fResidualMag = .5 * (fCurrentResidualMag/sizeWindow + fResidualMag);
+        pAnalParams->fOriginalMag = fOriginalMag;
+        pAnalParams->fResidualMag = fResidualMag;
 
         /* scale residual if need to be */
         if(fResidualMag > fOriginalMag)
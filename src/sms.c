@@ -28,8 +28,11 @@
 char *pChDebugFile = "debug.txt"; /*!< debug text file */
 FILE *pDebug; /*!< pointer to debug file */
 
-static char error_message[256];
-static int error_status = 0;
+static SMS_THREAD_LOCAL char error_message[256]; /*!< last error of the calling thread, sms_threadPoolWait() passes the errors of the tasks on */
+static SMS_THREAD_LOCAL int error_status = 0;
+#ifdef MERSENNE_TWISTER
+static SMS_THREAD_LOCAL int randomIsSeeded = 0; /*!< whether the calling thread's generator is seeded */
+#endif
 static sfloat mag_thresh = .00001; /*!< magnitude threshold for db conversion (-100db)*/
 static sfloat inv_mag_thresh = 100000.; /*!< inv(.00001) */
 static int initIsDone = 0; /* \todo is this variable necessary? */
@@ -41,11 +44,14 @@ static int initIsDone = 0; /* \todo is this variable necessary? */
 
 /*! \brief initialize global data
  *
- * Currently, just generating the sine and sinc tables.
- * This is necessary before both analysis and synthesis.
+ * Currently, just generating the sine and sinc tables and the FFT tables.
+ * This is necessary before both analysis and synthesis. The tables are
+ * read-only afterwards, so call this once before starting any analysis or
+ * synthesis threads.
  *
  * If using the Mersenne Twister algorithm for random number
- * generation, initialize (seed) it.
+ * generation, initialize (seed) it. Every thread has its own generator,
+ * threads that did not call sms_init are seeded on first use.
  *
  * \return error code \see SMS_MALLOC or SMS_OK in SMS_ERRORS
  */
@@ -64,10 +70,19 @@ int sms_init(void)
             sms_error("cannot allocate memory for sinc table");
             return -1;
         }
+        if(sms_prepFFT(SMS_MAX_SIZE_FFT))
+        {
+            sms_error("cannot prepare fft tables");
+            return -1;
+        }
+    }
 #ifdef MERSENNE_TWISTER
+    if(!randomIsSeeded)
+    {
         init_gen_rand(1234);
-#endif
+        randomIsSeeded = 1;
     }
+#endif
 
     return 0;
 }
@@ -81,6 +96,8 @@ void sms_free(void)
     initIsDone = 0;
     sms_clearSine();
     sms_clearSinc();
+    sms_clearWindows();
+    sms_clearFFT();
 }
 
 /*! \brief give default values to an SMS_AnalParams struct
@@ -111,11 +128,14 @@ void sms_initAnalParams(SMS_AnalParams *pAnalParams)
     pAnalParams->fPeakContToGuide = .4;
     pAnalParams->fFundContToGuide = .5;
     pAnalParams->fFreqDeviation = .45;
+    pAnalParams->iTracking = SMS_TRACK_GREEDY;
     pAnalParams->iSamplingRate = 44100;
     pAnalParams->iDefaultSizeWindow = 1001;
     pAnalParams->sizeWindow = 0;
     pAnalParams->sizeHop = 110;
     pAnalParams->fSizeWindow = 3.5;
+    pAnalParams->iSizeWindowStep = 0;
+    pAnalParams->iMaxSizeWindow = 0;
     pAnalParams->nTracks = 60;
     pAnalParams->nGuides = 100;
     pAnalParams->iCleanTracks = 1;
@@ -133,12 +153,22 @@ void sms_initAnalParams(SMS_AnalParams *pAnalParams)
     pAnalParams->minGoodFrames = 3;
     pAnalParams->maxDeviation = 0.01;
     pAnalParams->analDelay = 100;
+    pAnalParams->iMaxReAnalysis = -1;
+    pAnalParams->fMaxReAnalysisTime = 0;
+    pAnalParams->pReAnalysisPool = NULL;
+    pAnalParams->pReAnalysisWork = NULL;
+    pAnalParams->iReAnalysisFrame = 0;
     pAnalParams->iMaxDelayFrames =
         MAX(pAnalParams->iMinTrackLength, pAnalParams->iMaxSleepingTime) + 2 +
         (pAnalParams->minGoodFrames + pAnalParams->analDelay);
     pAnalParams->fResidualAccumPerc = 0.;
     pAnalParams->preEmphasis = 1; /*!< perform pre-emphasis by default */
     pAnalParams->preEmphasisLastValue = 0.;
+    /* residual */
+    pAnalParams->fResidualMag = 0.;
+    pAnalParams->fOriginalMag = 0.;
+    for(i = 0; i < 5; i++)
+        pAnalParams->highPassDelay[i] = 0.;
     /* spectral envelope params */
     pAnalParams->specEnvParams.iType = SMS_ENV_NONE; /* turn off enveloping */
     pAnalParams->specEnvParams.iOrder = 25; /* ... but set default params anyway */
@@ -146,20 +176,20 @@ void sms_initAnalParams(SMS_AnalParams *pAnalParams)
     pAnalParams->specEnvParams.iMaxFreq = 0;
     pAnalParams->specEnvParams.nCoeff = 0;
     pAnalParams->specEnvParams.iAnchor = 0; /* not yet implemented */
-    /* fft */
-    for(i = 0; i < SMS_MAX_SPEC; i++)
-    {
-        pAnalParams->magSpectrum[i] = 0.0;
-        pAnalParams->phaseSpectrum[i] = 0.0;
-        pAnalParams->spectrumWindow[i] = 0.0;
-        pAnalParams->fftBuffer[i] = 0.0;
-        pAnalParams->fftBuffer[i+SMS_MAX_SPEC] = 0.0;
-    }
+    pAnalParams->specEnvParams.pWork = NULL;
+    /* fft, allocated by sms_initAnalysis */
+    pAnalParams->sizeSpectrum = 0;
+    pAnalParams->magSpectrum = NULL;
+    pAnalParams->phaseSpectrum = NULL;
+    pAnalParams->spectrumWindow = NULL;
+    pAnalParams->fftBuffer = NULL;
     /* peak detection parameters */
     pAnalParams->peakParams.iMaxPeaks = SMS_MAX_NPEAKS;
     /* analysis frames */
     pAnalParams->pFrames = NULL;
     pAnalParams->ppFrames = NULL;
+    pAnalParams->pFramePeaks = NULL;
+    pAnalParams->nFramePeaks = 0;
     /* residual */
     pAnalParams->sizeResidual = pAnalParams->sizeHop * 2;
     pAnalParams->residual = NULL;
@@ -167,9 +197,7 @@ void sms_initAnalParams(SMS_AnalParams *pAnalParams)
     /* peak continuation */
     pAnalParams->guideStates = NULL;
     pAnalParams->guides = NULL;
-    /* audio input frame */
-    for(i = 0; i < SMS_MAX_FRAME_SIZE; i++)
-        pAnalParams->inputBuffer[i] = 0.0;
+    pAnalParams->pTrackingWork = NULL;
     /* stochastic analysis */
     pAnalParams->stocMagSpectrum = NULL;
     pAnalParams->approxEnvelope = NULL;
@@ -181,6 +209,10 @@ void sms_initAnalParams(SMS_AnalParams *pAnalParams)
  *  initialize the sound, synth, and fft arrays. It is necessary before analysis.
  *  there can be multple SMS_AnalParams at the same time
  *
+ *  The spectrum buffers are as large as the largest analysis window needs,
+ *  SMS_AnalParams::iMaxSizeWindow, which by default is the window of the
+ *  lowest fundamental.
+ *
  * \param pAnalParams    pointer to analysis paramaters
  * \param pSoundHeader    pointer to sound header
  * \return 0 on success, -1 on error
@@ -205,7 +237,24 @@ int sms_initAnalysis(SMS_AnalParams *pAnalParams, const SMS_SndHeader *pSoundHea
         (int)((pAnalParams->iSamplingRate / pAnalParams->fDefaultFundamental) *
                pAnalParams->fSizeWindow / 2) * 2 + 1;
 
-    int sizeBuffer = (pAnalParams->iMaxDelayFrames * pAnalParams->sizeHop) + SMS_MAX_WINDOW;
+    /* the largest window, the one of the lowest fundamental (plus the rounding to iSizeWindowStep) */
+    if(pAnalParams->iMaxSizeWindow <= 0)
+    {
+        pAnalParams->iMaxSizeWindow =
+            (int)((pAnalParams->iSamplingRate / pAnalParams->fLowestFundamental) *
+                   pAnalParams->fSizeWindow / 2) * 2 + 1;
+        if(pAnalParams->iSizeWindowStep > 1)
+            pAnalParams->iMaxSizeWindow += pAnalParams->iSizeWindowStep | 1;
+    }
+    pAnalParams->iMaxSizeWindow = MAX(pAnalParams->iMaxSizeWindow, pAnalParams->iDefaultSizeWindow);
+    pAnalParams->sizeSpectrum = sms_power2(pAnalParams->iMaxSizeWindow);
+    if((pAnalParams->sizeSpectrum << 1) > SMS_MAX_SIZE_FFT)
+    {
+        sms_error("analysis window too large, raise the lowest fundamental or set a smaller iMaxSizeWindow");
+        return -1;
+    }
+
+    int sizeBuffer = (pAnalParams->iMaxDelayFrames * pAnalParams->sizeHop) + pAnalParams->iMaxSizeWindow;
 
     /* if storing residual phases, restrict number of stochastic coefficients to the size of the spectrum (sizeHop = 1/2 sizeFft)*/
     if(pAnalParams->iStochasticType == SMS_STOC_IFFT)
@@ -219,6 +268,10 @@ int sms_initAnalysis(SMS_AnalParams *pAnalParams, const SMS_SndHeader *pSoundHea
     /* if specEnvParams.iMaxFreq is still 0, set it to the same as fHighestFreq (normally what you want)*/
     if(pAnalParams->specEnvParams.iMaxFreq == 0)
         pAnalParams->specEnvParams.iMaxFreq = pAnalParams->fHighestFreq;
+    /* work buffers for the spectral envelope */
+    if(pAnalParams->specEnvParams.iType != SMS_ENV_NONE &&
+       sms_initSpectralEnvelope(&pAnalParams->specEnvParams, pAnalParams->nTracks) < 0)
+        return -1;
 
     /* allocate memory for previous frame */
     sms_allocFrame(&pAnalParams->prevFrame, pAnalParams->nGuides,
@@ -226,8 +279,10 @@ int sms_initAnalysis(SMS_AnalParams *pAnalParams, const SMS_SndHeader *pSoundHea
 
     pAnalParams->sizeNextRead = (pAnalParams->iDefaultSizeWindow + 1) * 0.5; /* \todo REMOVE THIS from other files first */
 
-    /* sound buffer */
-    pSoundBuf->pFBuffer = (sfloat *)calloc(sizeBuffer, sizeof(sfloat));
+    /* sound buffer, a ring with the largest window (or residual) repeated after it */
+    pSoundBuf->sizeRing = sms_power2(sizeBuffer);
+    pSoundBuf->sizeMirror = MAX(pAnalParams->iMaxSizeWindow, pAnalParams->sizeHop * 2);
+    pSoundBuf->pFBuffer = (sfloat *)calloc(pSoundBuf->sizeRing + pSoundBuf->sizeMirror, sizeof(sfloat));
     if(pSoundBuf->pFBuffer == NULL)
     {
         sms_error("could not allocate memory");
@@ -260,6 +315,7 @@ int sms_initAnalysis(SMS_AnalParams *pAnalParams, const SMS_SndHeader *pSoundHea
 
     /* deterministic synthesis buffer */
     pSynthBuf->sizeBuffer = pAnalParams->sizeHop << 1;
+    pSynthBuf->sizeRing = pSynthBuf->sizeMirror = 0;
     pSynthBuf->pFBuffer = (sfloat *)calloc(pSynthBuf->sizeBuffer, sizeof(sfloat));
     if(pSynthBuf->pFBuffer == NULL)
     {
@@ -380,6 +436,8 @@ int sms_initAnalysis(SMS_AnalParams *pAnalParams, const SMS_SndHeader *pSoundHea
         pAnalParams->guides[i].iPeakChosen = -1;
         pAnalParams->guides[i].iStatus = 0;
     }
+    if(sms_initPeakContinuation(pAnalParams) < 0)
+        return -1;
 
     /* stochastic analysis */
     pAnalParams->sizeStocMagSpectrum = sms_power2(pAnalParams->sizeResidual) >> 1;
@@ -396,6 +454,23 @@ int sms_initAnalysis(SMS_AnalParams *pAnalParams, const SMS_SndHeader *pSoundHea
         return -1;
     }
 
+    /* spectrum buffers, the fft buffer is also used by the stochastic analysis */
+    pAnalParams->magSpectrum = (sfloat *)calloc(pAnalParams->sizeSpectrum, sizeof(sfloat));
+    pAnalParams->phaseSpectrum = (sfloat *)calloc(pAnalParams->sizeSpectrum, sizeof(sfloat));
+    pAnalParams->spectrumWindow = (sfloat *)calloc(pAnalParams->iMaxSizeWindow, sizeof(sfloat));
+    pAnalParams->fftBuffer =
+        (sfloat *)calloc(2 * MAX(pAnalParams->sizeSpectrum, pAnalParams->sizeStocMagSpectrum), sizeof(sfloat));
+    if(pAnalParams->magSpectrum == NULL || pAnalParams->phaseSpectrum == NULL ||
+       pAnalParams->spectrumWindow == NULL || pAnalParams->fftBuffer == NULL)
+    {
+        sms_error("Could not allocate memory for the spectrum");
+        return -1;
+    }
+
+    /* re-analysis of the previous frames */
+    if(sms_initReAnalysis(pAnalParams) < 0)
+        return -1;
+
     return 0;
 }
 
@@ -422,6 +497,9 @@ void sms_initSynthParams(SMS_SynthParams *synthParams)
     synthParams->pMagBuff = NULL;
     synthParams->pPhaseBuff = NULL;
     synthParams->pSpectra = NULL;
+    synthParams->pBatchSpectra = NULL;
+    synthParams->pBatchStoc = NULL;
+    synthParams->nBatchFrames = 0;
     synthParams->approxEnvelope = NULL;
 }
 
@@ -507,6 +585,8 @@ int sms_changeSynthHop(SMS_SynthParams *pSynthParams, int sizeHop)
     pSynthParams->pFDetWindow =
         (sfloat *)realloc(pSynthParams->pFDetWindow, sizeFft * sizeof(float));
     sms_getWindow(sizeFft, pSynthParams->pFDetWindow, SMS_WIN_IFFT);
+    /* the batch spectra are made again for the new size */
+    pSynthParams->nBatchFrames = 0;
 
     pSynthParams->sizeHop = sizeHop;
     return SMS_OK;
@@ -521,6 +601,9 @@ int sms_changeSynthHop(SMS_SynthParams *pSynthParams, int sizeHop)
  */
 void sms_freeAnalysis(SMS_AnalParams *pAnalParams)
 {
+    /* the frames may still be re-analyzed */
+    sms_freeReAnalysis(pAnalParams);
+
     if(pAnalParams->pFrames)
     {
         int i;
@@ -557,6 +640,16 @@ void sms_freeAnalysis(SMS_AnalParams *pAnalParams)
         free(pAnalParams->stocMagSpectrum);
     if(pAnalParams->approxEnvelope)
         free(pAnalParams->approxEnvelope);
+    if(pAnalParams->magSpectrum)
+        free(pAnalParams->magSpectrum);
+    if(pAnalParams->phaseSpectrum)
+        free(pAnalParams->phaseSpectrum);
+    if(pAnalParams->spectrumWindow)
+        free(pAnalParams->spectrumWindow);
+    if(pAnalParams->fftBuffer)
+        free(pAnalParams->fftBuffer);
+    sms_freeSpectralEnvelope(&pAnalParams->specEnvParams);
+    sms_freePeakContinuation(pAnalParams);
 }
 
 /*! \brief free analysis data
@@ -584,7 +677,12 @@ void sms_freeSynth(SMS_SynthParams *pSynthParams)
         free(pSynthParams->pPhaseBuff);
     if(pSynthParams->approxEnvelope)
         free(pSynthParams->approxEnvelope);
+    if(pSynthParams->pBatchSpectra)
+        free(pSynthParams->pBatchSpectra);
+    if(pSynthParams->pBatchStoc)
+        free(pSynthParams->pBatchStoc);
 
+    sms_freeModify(&pSynthParams->modParams);
     sms_freeFrame(&pSynthParams->prevFrame);
 }
 
@@ -605,17 +703,27 @@ int sms_sizeNextWindow(int iCurrentFrame, const SMS_AnalParams *pAnalParams)
 
     /* if the previous fundamental was stable use it to set the window size */
     if(fPrevFund > 0 && fabs(fPrevFund - fFund) / fFund <= .2)
+    {
         sizeWindow = (int)((pAnalParams->iSamplingRate / fFund) *
                            pAnalParams->fSizeWindow * .5) * 2 + 1;
+        /* fewer different sizes, so that their windows can be reused: the
+         * closest odd multiple of the (odd) step, which is at least the step */
+        if(pAnalParams->iSizeWindowStep > 1)
+        {
+            int iStep = pAnalParams->iSizeWindowStep | 1;
+
+            sizeWindow = (sizeWindow / (2 * iStep) * 2 + 1) * iStep;
+        }
+    }
     /* otherwise use the default size window */
     else
         sizeWindow = pAnalParams->iDefaultSizeWindow;
 
-    if(sizeWindow > SMS_MAX_WINDOW)
+    if(sizeWindow > pAnalParams->iMaxSizeWindow)
     {
         fprintf(stderr, "sms_sizeNextWindow error: sizeWindow (%d) too big, set to %d\n", sizeWindow,
-                SMS_MAX_WINDOW);
-        sizeWindow = SMS_MAX_WINDOW;
+                pAnalParams->iMaxSizeWindow);
+        sizeWindow = pAnalParams->iMaxSizeWindow;
     }
 
     return sizeWindow;
@@ -839,31 +947,30 @@ sfloat sms_dBToMag(sfloat x)
  *
  * Depends on a  linear threshold that indicates the bottom end
  * of the dB scale (magnutdes at this value will convert to zero).
- * \see sms_setMagThresh
+ * The whole array is converted at once, within 1e-5 dB of sms_magToDB()
+ * for results below 256 dB.
+ * \see sms_setMagThresh \see sms_vecMagToDB
  *
  * \param sizeArray size of array
  * \param pArray pointer to array
  */
 void sms_arrayMagToDB(int sizeArray, sfloat *pArray)
 {
-    int i;
-    for(i = 0; i < sizeArray; i++)
-        pArray[i] = sms_magToDB(pArray[i]);
+    sms_vecMagToDB(sizeArray, pArray, pArray, mag_thresh);
 }
 
 /*! \brief convert and array from decibel (0-100) to magnitude (0-1)
  *
  * depends on the magnitude threshold
- * \see sms_setMagThresh
+ * The whole array is converted at once, within 2e-6 (relative) of sms_dBToMag().
+ * \see sms_setMagThresh \see sms_vecDBToMag
  *
  * \param sizeArray size of array
  * \param pArray pointer to array
  */
 void sms_arrayDBToMag(int sizeArray, sfloat *pArray)
 {
-    int i;
-    for(i = 0; i < sizeArray; i++)
-        pArray[i] = sms_dBToMag(pArray[i]);
+    sms_vecDBToMag(sizeArray, pArray, pArray, mag_thresh);
 }
 /*! \brief set the linear magnitude threshold
  *
@@ -888,7 +995,11 @@ void sms_setMagThresh(sfloat x)
  */
 void sms_error(const char *pErrorMessage)
 {
-    strncpy(error_message, pErrorMessage, 256);
+    if(pErrorMessage != error_message)
+    {
+        strncpy(error_message, pErrorMessage, sizeof(error_message) - 1);
+        error_message[sizeof(error_message) - 1] = '\0';
+    }
     error_status = -1;
 }
 
@@ -915,6 +1026,19 @@ char* sms_errorString()
     return NULL;
 }
 
+/*! \brief get the message of the last error, to print it
+ *
+ * The same as sms_errorString(), but never NULL.
+ *
+ * \return  pointer to a char string, "unknown error" if no error
+ */
+char* sms_errorMessage()
+{
+    char *pChError = sms_errorString();
+
+    return pChError ? pChError : "unknown error";
+}
+
 /*! \brief random number genorator
  *
  * \return random number between -1 and 1
@@ -922,6 +1046,11 @@ char* sms_errorString()
 sfloat sms_random()
 {
 #ifdef MERSENNE_TWISTER
+    if(!randomIsSeeded)
+    {
+        init_gen_rand(1234);
+        randomIsSeeded = 1;
+    }
     return genrand_real1();
 #else
     return (sfloat)(random() * 2 * INV_HALF_MAX);
@@ -34,10 +34,11 @@
 #include <sms_export.h>
 
 #define SMS_VERSION 1.15 /*!< \brief version control number */
+#define SMS_FILE_VERSION 2 /*!< \brief version of the SMS file format that is written */
 
-#define SMS_MAX_NPEAKS 400    /*!< \brief maximum number of peaks */
-#define SMS_MAX_FRAME_SIZE 10000 /* maximum size of input frame in samples */
-#define SMS_MAX_SPEC 8192  /*! \brief  maximum size for magnitude spectrum */
+#define SMS_MAX_NPEAKS 400    /*!< \brief default maximum number of peaks (SMS_PeakParams::iMaxPeaks) */
+#define SMS_MAX_FRAME_SIZE 10000 /* number of samples (of all channels) read from a sound file at once */
+#define SMS_MAX_SIZE_FFT 65536  /*! \brief  largest FFT size, the spectra are half of it */
 
 #ifdef DOUBLE_PRECISION
 #define sfloat double
@@ -45,6 +46,18 @@
 #define sfloat float
 #endif
 
+/*! \brief storage class for data that has to be private to each thread
+ *
+ * Used for the few pieces of library state that cannot be attached to an
+ * analysis or synthesis instance (the last error, the random number
+ * generator), so that several instances can run in different threads.
+ */
+#if defined(_MSC_VER)
+#define SMS_THREAD_LOCAL __declspec(thread)
+#else
+#define SMS_THREAD_LOCAL __thread
+#endif
+
 /*! \struct SMS_Header
  *  \brief structure for the header of an SMS file
  *
@@ -54,8 +67,10 @@
  *  The header also contains variable components for additional information
  *  that may be stored along with the analysis, such as descriptors or text.
  *
- *  The first four members of the Header are necessary in this order to correctly
- *  open the .sms files created by this library.
+ *  Files are written in a format that does not depend on the machine
+ *  (little-endian numbers of fixed size, see fileIO.c), with an index of the
+ *  offsets of the frames. Older files, which were a copy of this structure,
+ *  can still be read (iFileVersion 1).
  *
  *  iSampleRate contains the samplerate of the analysis signal because it is
  *  necessary to know this information to recreate the residual spectrum.
@@ -83,8 +98,72 @@ typedef struct
     sfloat fResidualPerc;    /*!< percentage of the residual to original */
     int nTextCharacters;     /*!< number of text characters */
     char *pChTextCharacters; /*!< Text string relating to the sound */
+    int iFileVersion;        /*!< version of the file format \see SMS_FILE_VERSION */
+    int iFrameEncoding;      /*!< how the frames are stored in the file \see SMS_FrameEncoding */
+    int iSampleBytes;        /*!< size in bytes of the values stored in the file (4 or 8) */
+    long long *pFrameOffsets; /*!< offset of each frame in the file, NULL when all the frames have the same size */
+    void *pReadState;        /*!< state of the decoding of the frames read from the file (private) */
+    void *pWriteState;       /*!< the SMS_FileWriter of sms_writeHeader() (private) */
 } SMS_Header;
 
+/*! \struct SMS_MappedFile
+ * \brief an SMS file mapped into memory for reading
+ *
+ * The frames are read directly from the mapping, with sms_getMappedFrame(),
+ * without copying them and without a system call for each frame. Frames
+ * that are not stored as they are in memory are converted when the file is
+ * mapped.
+ * \see sms_mapFile
+ */
+typedef struct
+{
+    SMS_Header *pSmsHeader;  /*!< header of the file (a copy, with the text) */
+    const char *pFrames;     /*!< the first frame, the next ones follow every iFrameBSize bytes */
+    void *pMap;              /*!< start of the mapping, NULL if the frames were copied */
+    size_t sizeMap;          /*!< size of the mapping in bytes */
+    void *pFrameCopy;        /*!< aligned copy of the frames, when they are not aligned in the file */
+    void *hMapping;          /*!< handle of the mapping (Windows) */
+} SMS_MappedFile;
+
+/*! \struct SMS_Model
+ * \brief an SMS model in memory: a header and its frames, one after the other
+ *
+ * A model is built from the frames of an analysis with sms_addModelFrame(),
+ * or read from the bytes of an SMS file with sms_deserializeModel(), and
+ * its frames are used where they are, with sms_getModelFrame(), without a
+ * file in between.
+ * \see sms_initModel
+ */
+typedef struct
+{
+    SMS_Header *pSmsHeader;  /*!< header of the model (a copy, with the text), nFrames is the number of frames */
+    char *pFrames;           /*!< the first frame, the next ones follow every iFrameBSize bytes */
+    int nAllocFrames;        /*!< number of frames there is memory for */
+} SMS_Model;
+
+/*! \struct SMS_TrackModel
+ * \brief an SMS model stored track by track
+ *
+ * The values are the transpose of the frames of an SMS_Model: each value
+ * of a frame is a row of nFrames values, one for every frame. The pointers
+ * are those of SMS_Data, to the first of their rows, so the frequencies
+ * of track i are pFSinFreq[i * nFrames] to pFSinFreq[i * nFrames + nFrames - 1].
+ * \see sms_modelToTracks, sms_tracksToModel
+ */
+typedef struct
+{
+    SMS_Header *pSmsHeader;  /*!< header of the model (a copy, with the text), with its number of frames */
+    int nValues;             /*!< number of values of a frame, the number of rows */
+    sfloat *pValues;         /*!< all of the rows, value i of frame j is pValues[i * nFrames + j] */
+    sfloat *pFSinFreq;       /*!< frequency of sinusoids, a row for each track */
+    sfloat *pFSinAmp;        /*!< magnitude of sinusoids (stored in dB), a row for each track */
+    sfloat *pFSinPha;        /*!< phase of sinusoids, a row for each track (NULL without phases) */
+    sfloat *pFStocCoeff;     /*!< stochastic coefficients, a row for each coefficient */
+    sfloat *pResPhase;       /*!< residual phase spectrum, a row for each coefficient */
+    sfloat *pFStocGain;      /*!< stochastic gain, one row */
+    sfloat *pSpecEnv;        /*!< spectral envelope, a row for each coefficient */
+} SMS_TrackModel;
+
 /*! \struct SMS_SndHeader
  *  \brief structure including sound header information
  */
@@ -94,6 +173,13 @@ typedef struct {
     int channelCount;  /*!< The number of channels */
     int iReadChannel;  /*!< the channel to read from */
     int sizeHeader;	   /*!< size of sound header in bytes */
+    SNDFILE *pSNDStream; /*!< libsndfile handle of the open sound (set by sms_openSF) */
+    int isSeekable;      /*!< whether the sound can be read from any position, 0 for a pipe */
+    FILE *pSpoolFile;    /*!< temporary copy of a sound whose length was not known (private) */
+    long iStreamPos;     /*!< next sample the stream reads (private) */
+    sfloat *pBlock;      /*!< the block of interleaved samples read last (private) */
+    long iBlockStart;    /*!< first sample in pBlock (private) */
+    int nBlockSamples;   /*!< number of samples of each channel in pBlock (private) */
 } SMS_SndHeader;
 
 /*! \struct SMS_Data
@@ -132,13 +218,19 @@ typedef struct
  * sample number of the sound source that corresponds to the first sample
  * in the buffer.
  *
+ * The sound buffer of the analysis is a ring: sample n of the sound is at
+ * n modulo sizeRing, and the first sizeMirror samples of the ring are
+ * repeated after its end, so that every frame is contiguous in memory.
+ * \see sms_soundBufferPointer
  */
 typedef struct
 {
     sfloat *pFBuffer; /*!< buffer for sound data*/
-    int sizeBuffer;   /*!< size of buffer */
+    int sizeBuffer;   /*!< size of buffer (number of samples kept, from iMarker on) */
     int iMarker;      /*!< sample marker relating to sound source */
     int iFirstGood;   /*!< first sample in buffer that is a good one */
+    int sizeRing;     /*!< size of the ring, a power of 2 (0 for a plain buffer) */
+    int sizeMirror;   /*!< number of samples repeated after the ring, the longest contiguous run */
 } SMS_SndBuffer;
 
 /*! \struct SMS_Peak
@@ -170,6 +262,19 @@ typedef struct
     int iStatus;              /*!< status of frame enumerated by SMS_FRAME_STATUS \see SMS_FRAME_STATUS */
 } SMS_AnalFrame;
 
+/*! \struct SMS_FramePeaks
+ *  \brief spectral peaks of a frame computed ahead of the analysis
+ *
+ * \see sms_analyzePipelined
+ */
+typedef struct
+{
+    int iFrameNum;            /*!< frame number, as in SMS_AnalFrame */
+    int iFrameSize;           /*!< size of the window used to find the peaks */
+    SMS_Peak *pSpectralPeaks; /*!< spectral peaks found in frame (iMaxPeaks) */
+    int nPeaks;               /*!< number of peaks found, -1 if not computed */
+} SMS_FramePeaks;
+
 /*! \struct SMS_PeakParams
  * \brief structure with useful information for peak detection and continuation
  *
@@ -201,6 +306,7 @@ typedef struct
     sfloat fLambda; /*!< regularization factor */
     int nCoeff;     /*!< number of coefficients (bins) in the envelope */
     int iAnchor;    /*!< whether to make anchor points at DC / Nyquist or not */
+    void *pWork;    /*!< work buffers for the discrete cepstrum \see sms_initSpectralEnvelope */
 } SMS_SEnvParams;
 
 /*! \struct SMS_Guide
@@ -219,6 +325,25 @@ typedef struct
     int iPeakChosen; /*!< peak number chosen by the guide */
 } SMS_Guide;
 
+/*! \struct SMS_ReAnalysisStats
+ * \brief counters of the re-analysis of the previous frames by sms_analyze()
+ *
+ * \see SMS_AnalParams::iMaxReAnalysis
+ */
+typedef struct
+{
+    int nChecks;         /*!< frames after which the previous frames were checked */
+    int nGood;           /*!< checks after which the previous frames fit the fundamental */
+    int nFailed;         /*!< checks with unstable last frames, or a recomputed frame that still did not fit */
+    int nCut;            /*!< checks stopped by the budget with frames left to recompute */
+    int nDropped;        /*!< cuts whose frame was too old to go on from by the next check */
+    int nRuns;           /*!< checks that recomputed frames */
+    int nFrames;         /*!< frames recomputed */
+    int nDeferred;       /*!< checks run on SMS_AnalParams::pReAnalysisPool */
+    double fSeconds;     /*!< time spent recomputing frames */
+    double fMaxSeconds;  /*!< longest time spent recomputing frames in one check */
+} SMS_ReAnalysisStats;
+
 /*! \struct SMS_AnalParams
  * \brief structure with useful information for analysis functions
  *
@@ -247,11 +372,15 @@ typedef struct
     sfloat fPeakContToGuide;         /*!< contribution of previous peak to current guide (between 0 and 1) */
     sfloat fFundContToGuide;         /*!< contribution of current fundamental to current guide (between 0 and 1) */
     sfloat fFreqDeviation;           /*!< maximum deviation from peak to peak */
+    int iTracking;                   /*!< how the guides are continued to the peaks \see SMS_Tracking */
+    void *pTrackingWork;             /*!< work buffers of SMS_TRACK_ASSIGN \see sms_initPeakContinuation */
     int iSamplingRate;               /*! sampling rate of sound to be analyzed */
     int iDefaultSizeWindow;          /*!< default size of analysis window in samples */
     int sizeWindow;
     int sizeHop;                     /*!< hop size of analysis window in samples */
     sfloat fSizeWindow;              /*!< size of analysis window in number of periods */
+    int iSizeWindowStep;             /*!< round the window sizes that follow the fundamental to odd multiples of this (an even step is taken as the next odd number), 0 for exact sizes */
+    int iMaxSizeWindow;              /*!< largest analysis window, 0 to use the window of fLowestFundamental (set by sms_initAnalysis) */
     int nTracks;                     /*!< number of sinusoidal tracks in frame */
     int nGuides;                     /*!< number of guides used for peak detection and continuation \see SMS_Guide */
     int iCleanTracks;                /*!< whether or not to clean sinusoidal tracks */
@@ -270,10 +399,19 @@ typedef struct
     int minGoodFrames;               /*!< minimum number of stable frames for backward search */
     sfloat maxDeviation;             /*!< maximum deviation allowed */
     int analDelay;                   /*! number of frames in the past to be looked in possible re-analyze */
+    int iMaxReAnalysis;              /*!< most previous frames recomputed after a frame, -1 for no limit */
+    sfloat fMaxReAnalysisTime;       /*!< seconds after which no more previous frames are recomputed after a frame, 0 for no limit */
+    struct SMS_ThreadPool *pReAnalysisPool; /*!< pool to recompute the previous frames on while sms_analyze() returns, NULL to do it in sms_analyze() \see sms_waitReAnalysis */
+    void *pReAnalysisWork;           /*!< state of the re-analysis on pReAnalysisPool \see sms_initReAnalysis */
+    int iReAnalysisFrame;            /*!< number of the frame the re-analysis goes on from after a cut by the budget, 0 for none */
+    SMS_ReAnalysisStats reAnalysisStats; /*!< what the re-analysis of the previous frames did */
     sfloat fResidualAccumPerc;       /*!< accumalitive residual percentage */
     int sizeNextRead;                /*!< size of samples to read from sound file next analysis */
     int preEmphasis;                 /*!< whether or not to perform pre-emphasis */
     sfloat preEmphasisLastValue;
+    sfloat fResidualMag;             /*!< running energy of the residual (sms_residual) */
+    sfloat fOriginalMag;             /*!< running energy of the original sound (sms_residual) */
+    sfloat highPassDelay[5];         /*!< delay line of the residual high-pass filter (sms_filterHighPass) */
     SMS_PeakParams peakParams;       /*!< structure with parameters for spectral peaks */
     SMS_Data prevFrame;              /*!< the previous analysis frame */
     SMS_SEnvParams specEnvParams;    /*!< all data for spectral enveloping */
@@ -281,16 +419,18 @@ typedef struct
     SMS_SndBuffer synthBuffer;       /*!< resynthesized signal used to create the residual */
     SMS_AnalFrame *pFrames;          /*!< an array of frames that have already been analyzed */
     SMS_AnalFrame **ppFrames;        /*!< pointers to the frames analyzed (it is circular-shifted once the array is full) */
-    sfloat magSpectrum[SMS_MAX_SPEC];
-    sfloat phaseSpectrum[SMS_MAX_SPEC];
-    sfloat spectrumWindow[SMS_MAX_SPEC];
-    sfloat fftBuffer[SMS_MAX_SPEC * 2];
+    SMS_FramePeaks *pFramePeaks;     /*!< peaks of the next frames computed ahead, consecutive frame numbers (or NULL) */
+    int nFramePeaks;                 /*!< number of frames in pFramePeaks */
+    int sizeSpectrum;                /*!< size of magSpectrum and phaseSpectrum, sms_power2(iMaxSizeWindow) */
+    sfloat *magSpectrum;
+    sfloat *phaseSpectrum;
+    sfloat *spectrumWindow;          /*!< iMaxSizeWindow */
+    sfloat *fftBuffer;               /*!< 2 * sizeSpectrum, or more for the stochastic analysis */
     int sizeResidual;
     sfloat *residual;
     sfloat *residualWindow;
     int *guideStates;
     SMS_Guide* guides;
-    sfloat inputBuffer[SMS_MAX_FRAME_SIZE];
     int sizeStocMagSpectrum;
     sfloat *stocMagSpectrum;
     sfloat *approxEnvelope;          /*!< spectral approximation envelope */
@@ -347,6 +487,9 @@ typedef struct
     int deEmphasis;             /*!< whether or not to perform de-emphasis */
     sfloat deEmphasisLastValue;
     sfloat *approxEnvelope;     /*!< spectral approximation envelope */
+    sfloat *pBatchSpectra;      /*!< spectra of a batch of frames \see sms_synthesizeFrames */
+    int *pBatchStoc;            /*!< where the stochastic spectrum of each frame of the batch is, -1 for none */
+    int nBatchFrames;           /*!< number of frames pBatchSpectra has room for */
 } SMS_SynthParams;
 
 /*! \struct SMS_HarmCandidate
@@ -378,6 +521,44 @@ typedef struct
     int iPeak;        /*!< peak number (organized according to frequency)*/
 } SMS_ContCandidate;
 
+/*! \struct SMS_ThreadPool
+ * \brief a pool of worker threads with work-stealing (opaque)
+ *
+ * \see sms_createThreadPool
+ */
+typedef struct SMS_ThreadPool SMS_ThreadPool;
+
+/*! \struct SMS_FileWriter
+ * \brief writes an SMS file through large buffers, and gives it its name once it is complete (opaque)
+ *
+ * \see sms_openFileWriter
+ */
+typedef struct SMS_FileWriter SMS_FileWriter;
+
+/*! \struct SMS_FrameReader
+ * \brief reads the frames of an SMS file ahead of playback on a thread (opaque)
+ *
+ * \see sms_openFrameReader
+ */
+typedef struct SMS_FrameReader SMS_FrameReader;
+
+/*! \brief function run as a task by an SMS_ThreadPool */
+typedef void (*SMS_TaskFunc)(void *pArg);
+
+/*! \brief precomputed FFT of one size, shared by all threads
+ *
+ * \see sms_getFFTPlan
+ */
+typedef struct SMS_FFTPlan SMS_FFTPlan;
+
+/*! \brief function receiving the analyzed frames, returns non-zero to stop the analysis
+ *
+ * The error it reports with sms_error(), if any, is the error of the analysis.
+ *
+ * \see sms_analyzeSegments, sms_analyzePipelined, sms_analyzeChannels
+ */
+typedef int (*SMS_FrameFunc)(const SMS_Data *pSmsData, void *pUserData);
+
 /*!  \brief analysis format
  *
  * Is the signal is known to be harmonic, using format harmonic (with out without
@@ -394,6 +575,19 @@ enum SMS_Format
     SMS_FORMAT_IHP  /*!< 3, format inharmonic with phase */
 };
 
+/*! \brief peak continuation modes
+ *
+ * The guides either take their best peak one after the other, solving the
+ * conflicts between two guides as they come, or get the assignment of the
+ * peaks of the frame to all guides that keeps the sum of the frequency
+ * distances the smallest, which follows crossing and close partials better.
+ */
+enum SMS_Tracking
+{
+    SMS_TRACK_GREEDY, /*!< 0, guide by guide */
+    SMS_TRACK_ASSIGN  /*!< 1, optimal assignment of the peaks to the guides */
+};
+
 /*! \brief synthesis types
  *
  * These values are used to determine whether to synthesize
@@ -467,6 +661,36 @@ enum SMS_SpecEnvType
     SMS_ENV_FBINS  /*!< frequency bins */
 };
 
+/*! \brief how the frames are stored in an SMS file
+ *
+ * The dense encoding stores all the tracks of every frame. The track count
+ * encoding stores the number of tracks of each frame in front of it, and
+ * leaves out the inactive tracks at the end of the frame. The sparse
+ * encoding only stores the active tracks of each frame, with their track
+ * numbers, which is much smaller when most of the tracks are inactive most
+ * of the time. The tracks that are left out (all of their values are 0) are
+ * read back as zeros. These frames differ in size, so they are found through
+ * the frame index of the file.
+ *
+ * The quantized encoding is lossy: frequencies are stored in half cents,
+ * amplitudes in tenths of dB of full scale (0 and the amplitudes below
+ * -3276 dB read back as 0), phases in 12 bits and the stochastic
+ * coefficients in tenths of dB below the largest one of their frame (down
+ * to 102 dB, below that they read back as 0). Each track is coded as the
+ * difference to its value in the frame before, with an adaptive Rice code.
+ * The frames are stored in blocks of 32 frames that are decoded on their
+ * own, so reading a frame decodes at most the frames before it in its block.
+ * Tracks without a frequency are read back as inactive. The stochastic gain
+ * and the spectral envelope are stored as they are.
+ */
+enum SMS_FrameEncoding
+{
+    SMS_ENC_DENSE,      /*!< 0, all tracks in every frame */
+    SMS_ENC_TRACKCOUNT, /*!< 1, number of tracks per frame, without the inactive tracks at the end */
+    SMS_ENC_SPARSE,     /*!< 2, only the active tracks of every frame, with their track numbers */
+    SMS_ENC_QUANTIZED   /*!< 3, quantized and entropy coded values, in blocks of frames (lossy) */
+};
+
 /*! \brief Error codes returned by SMS file functions */
 /* \todo remove me */
 enum SMS_ERRORS
@@ -501,7 +725,7 @@ enum SMS_DBG
     SMS_DBG_SYNC,        /*!< 12, write original, synthesis and residual to a text file */
 };
 
-#define SMS_MAX_WINDOW 8190    /*!< \brief maximum size for analysis window */
+#define SMS_EMPH_COEF    .9    /*!< \brief coefficient for pre_emphasis filter */
 
 /* \brief type of sound to be analyzed
  *
@@ -600,8 +824,23 @@ SMS_EXPORT void sms_arrayScalarTempered( int sizeArray, sfloat *pArray);
 /* function declarations */
 SMS_EXPORT int sms_analyze(int sizeWaveform, const sfloat *pWaveform, SMS_Data *pSmsFrame, SMS_AnalParams *pAnalParams);
 
+SMS_EXPORT int sms_findPeaks(int sizeWindow, const sfloat *pFData, int iWindowType, sfloat *pWindow,
+                              sfloat *pMag, sfloat *pPhase, sfloat *pFftBuffer, SMS_Peak *pSpectralPeaks,
+                              const SMS_PeakParams *pPeakParams);
+
+SMS_EXPORT void sms_findPeaksFrames(int nFrames, int sizeHop, int sizeWindow, const sfloat *pFData,
+                                    int iWindowType, sfloat *pWindow, sfloat *pMag, sfloat *pPhase,
+                                    sfloat *pFftBuffer, SMS_Peak *pSpectralPeaks, int *pNPeaks,
+                                    const SMS_PeakParams *pPeakParams);
+
 SMS_EXPORT void sms_analyzeFrame(int iCurrentFrame, SMS_AnalParams *pAnalParams, sfloat fRefFundamental);
 
+SMS_EXPORT int sms_initReAnalysis(SMS_AnalParams *pAnalParams);
+
+SMS_EXPORT void sms_waitReAnalysis(SMS_AnalParams *pAnalParams);
+
+SMS_EXPORT void sms_freeReAnalysis(SMS_AnalParams *pAnalParams);
+
 SMS_EXPORT int sms_init(void);
 
 SMS_EXPORT void sms_free(void);
@@ -622,14 +861,39 @@ SMS_EXPORT void sms_freeSynth( SMS_SynthParams *pSynthParams);
 
 SMS_EXPORT void sms_fillSoundBuffer(int sizeWaveform, const sfloat *pWaveform, SMS_AnalParams *pAnalParams);
 
+SMS_EXPORT sfloat *sms_getSoundBufferSpace(int sizeWaveform, SMS_AnalParams *pAnalParams);
+
+SMS_EXPORT sfloat *sms_soundBufferPointer(const SMS_SndBuffer *pSndBuffer, int iSample);
+
 SMS_EXPORT void sms_windowCentered(int sizeWindow, const sfloat *pWaveform, const sfloat *pWindow, int sizeFft, sfloat *pFftBuffer);
 
 SMS_EXPORT void sms_getWindow(int sizeWindow, sfloat *pWindow, int iWindowType);
 
 SMS_EXPORT void sms_scaleWindow(int sizeWindow, sfloat *pWindow);
 
+SMS_EXPORT const sfloat *sms_getScaledWindow(int sizeWindow, int iWindowType);
+
+SMS_EXPORT void sms_releaseScaledWindow(const sfloat *pWindow);
+
+SMS_EXPORT void sms_clearWindows(void);
+
+SMS_EXPORT const char *sms_vecBackend(void);
+
+SMS_EXPORT void sms_vecRectToPolar(int sizeMag, const sfloat *pRect, sfloat *pMag, sfloat *pPhase, int iPhaseSign);
+
+SMS_EXPORT void sms_vecMagToDB(int sizeArray, const sfloat *pMag, sfloat *pDB, sfloat fMagThresh);
+
+SMS_EXPORT void sms_vecDBToMag(int sizeArray, const sfloat *pDB, sfloat *pMag, sfloat fMagThresh);
+
+SMS_EXPORT void sms_vecDeinterleave(int nFrames, const sfloat *pIn, int nChannels, int iChannel, sfloat *pOut);
+
+SMS_EXPORT int sms_vecFindMaxima(const sfloat *pMag, int iFirstBin, int iLastBin, sfloat fMinMag,
+                                 int *pBins, int nMaxBins);
+
 SMS_EXPORT int sms_spectrum(int sizeWindow, const sfloat *pWaveform, const sfloat *pWindow, int sizeMag, sfloat *pMag, sfloat *pPhase, sfloat *pFftBuffer);
 
+SMS_EXPORT int sms_spectra(int nFrames, int sizeHop, int sizeWindow, const sfloat *pWaveform, const sfloat *pWindow, int sizeMag, sfloat *pMag, sfloat *pPhase, sfloat *pFftBuffer);
+
 SMS_EXPORT int sms_invSpectrum(int sizeWaveform, sfloat *pWaveform, const sfloat *pWindow, int sizeMag, const sfloat *pMag, const sfloat *pPhase, sfloat *pFftBuffer);
 
 SMS_EXPORT /* \todo remove this once invSpectrum is completely implemented */
@@ -645,6 +909,10 @@ SMS_EXPORT void sms_dCepstrumEnvelope(int sizeCepstrum, const sfloat *pCepstrum,
 
 SMS_EXPORT void sms_spectralEnvelope( SMS_Data *pSmsData, const SMS_SEnvParams *pSpecEnvParams);
 
+SMS_EXPORT int sms_initSpectralEnvelope( SMS_SEnvParams *pSpecEnvParams, int nTracks);
+
+SMS_EXPORT void sms_freeSpectralEnvelope( SMS_SEnvParams *pSpecEnvParams);
+
 SMS_EXPORT int sms_sizeNextWindow(int iCurrentFrame, const SMS_AnalParams *pAnalParams);
 
 SMS_EXPORT sfloat sms_fundDeviation( const SMS_AnalParams *pAnalParams, int iCurrentFrame);
@@ -653,6 +921,10 @@ SMS_EXPORT int sms_detectPeaks(int sizeSpec, const sfloat *pFMag, const sfloat *
 
 SMS_EXPORT void sms_harmDetection( SMS_AnalFrame *pFrame, sfloat fRefFundamental, const SMS_PeakParams *pPeakParams);
 
+SMS_EXPORT int sms_initPeakContinuation(SMS_AnalParams *pAnalParams);
+
+SMS_EXPORT void sms_freePeakContinuation(SMS_AnalParams *pAnalParams);
+
 SMS_EXPORT int sms_peakContinuation(int iFrame, const SMS_AnalParams *pAnalParams);
 
 SMS_EXPORT sfloat sms_preEmphasis(sfloat fInput, SMS_AnalParams *pAnalParams);
@@ -673,6 +945,8 @@ SMS_EXPORT void sms_clearSinc(void);
 
 SMS_EXPORT void sms_synthesize( SMS_Data *pSmsFrame, sfloat *pSynthesis, SMS_SynthParams *pSynthParams);
 
+SMS_EXPORT int sms_synthesizeFrames(int nFrames, SMS_Data *pSmsFrames, sfloat *pFSynthesis, SMS_SynthParams *pSynthParams);
+
 SMS_EXPORT void sms_sineSynthFrame( const SMS_Data *pSmsFrame, sfloat *pBuffer, int sizeBuffer, SMS_Data *pLastFrame, int iSamplingRate);
 
 SMS_EXPORT void sms_initHeader( SMS_Header *pSmsHeader);
@@ -685,6 +959,8 @@ SMS_EXPORT int sms_writeHeader( const char *pFileName, SMS_Header *pSmsHeader, F
 
 SMS_EXPORT int sms_writeFile( FILE *pSmsFile, SMS_Header *pSmsHeader);
 
+SMS_EXPORT void sms_abortFile( FILE *pSmsFile, SMS_Header *pSmsHeader);
+
 SMS_EXPORT int sms_initFrame(int iCurrentFrame, SMS_AnalParams *pAnalParams, int sizeWindow);
 
 SMS_EXPORT int sms_clearAnalysisFrame(int iCurrentFrame, SMS_AnalParams *pAnalParams);
@@ -695,8 +971,42 @@ SMS_EXPORT int sms_allocFrameH( const SMS_Header *pSmsHeader, SMS_Data *pSmsFram
 
 SMS_EXPORT int sms_getFrame( FILE *pInputFile, SMS_Header *pSmsHeader, int iFrame, SMS_Data *pSmsFrame);
 
+SMS_EXPORT int sms_mapFile(const char *pChFileName, SMS_MappedFile *pMappedFile);
+
+SMS_EXPORT int sms_getMappedFrame(const SMS_MappedFile *pMappedFile, int iFrame, SMS_Data *pSmsFrame);
+
+SMS_EXPORT void sms_unmapFile(SMS_MappedFile *pMappedFile);
+
+SMS_EXPORT int sms_initModel(SMS_Model *pModel, const SMS_Header *pSmsHeader);
+
+SMS_EXPORT int sms_addModelFrame(const SMS_Data *pSmsFrame, void *pModel);
+
+SMS_EXPORT int sms_getModelFrame(const SMS_Model *pModel, int iFrame, SMS_Data *pSmsFrame);
+
+SMS_EXPORT int sms_serializeModel(const SMS_Model *pModel, void **ppBytes, size_t *pSize);
+
+SMS_EXPORT int sms_deserializeModel(SMS_Model *pModel, const void *pBytes, size_t size);
+
+SMS_EXPORT void sms_freeModel(SMS_Model *pModel);
+
+SMS_EXPORT int sms_initTrackModel(SMS_TrackModel *pTracks, const SMS_Header *pSmsHeader, int nFrames);
+
+SMS_EXPORT int sms_modelToTracks(const SMS_Model *pModel, SMS_TrackModel *pTracks);
+
+SMS_EXPORT int sms_tracksToModel(const SMS_TrackModel *pTracks, SMS_Model *pModel);
+
+SMS_EXPORT void sms_freeTrackModel(SMS_TrackModel *pTracks);
+
 SMS_EXPORT int sms_writeFrame( FILE *pSmsFile, const SMS_Header *pSmsHeader, const SMS_Data *pSmsFrame);
 
+SMS_EXPORT SMS_FileWriter *sms_openFileWriter( const char *pChFileName, const SMS_Header *pSmsHeader, int useThread);
+
+SMS_EXPORT int sms_writerAddFrame( SMS_FileWriter *pWriter, const SMS_Data *pSmsFrame);
+
+SMS_EXPORT int sms_closeFileWriter( SMS_FileWriter *pWriter, const SMS_Header *pSmsHeader);
+
+SMS_EXPORT void sms_abortFileWriter( SMS_FileWriter *pWriter);
+
 SMS_EXPORT void sms_freeFrame( SMS_Data *pSmsFrame);
 
 SMS_EXPORT void sms_clearFrame( SMS_Data *pSmsFrame);
@@ -705,9 +1015,9 @@ SMS_EXPORT void sms_copyFrame( SMS_Data *pCopySmsFrame, const SMS_Data *pOrigina
 
 SMS_EXPORT int sms_frameSizeB( const SMS_Header *pSmsHeader);
 
-SMS_EXPORT int sms_residual(int sizeWindow, const sfloat *pSynthesis, const sfloat *pOriginal, sfloat *pResidual, const sfloat *pWindow);
+SMS_EXPORT int sms_residual(int sizeWindow, const sfloat *pSynthesis, const sfloat *pOriginal, sfloat *pResidual, const sfloat *pWindow, SMS_AnalParams *pAnalParams);
 
-SMS_EXPORT void sms_filterHighPass(int sizeResidual, sfloat *pResidual, int iSamplingRate);
+SMS_EXPORT void sms_filterHighPass(int sizeResidual, sfloat *pResidual, SMS_AnalParams *pAnalParams);
 
 SMS_EXPORT int sms_stocAnalysis(int sizeWindow, const sfloat *pResidual, const sfloat *pWindow, SMS_Data *pSmsFrame, SMS_AnalParams *pAnalParams);
 
@@ -715,9 +1025,11 @@ SMS_EXPORT void sms_interpolateFrames( const SMS_Data *pSmsFrame1, const SMS_Dat
 
 SMS_EXPORT int sms_openSF( const char *pChInputSoundFile, SMS_SndHeader *pSoundHeader);
 
-SMS_EXPORT void sms_closeSF();
+SMS_EXPORT void sms_closeSF( SMS_SndHeader *pSoundHeader);
+
+SMS_EXPORT int sms_getSound( SMS_SndHeader *pSoundHeader, long sizeSound, sfloat *pSound, long offset, SMS_AnalParams *pAnalParams);
 
-SMS_EXPORT int sms_getSound( const SMS_SndHeader *pSoundHeader, long sizeSound, sfloat *pSound, long offset, SMS_AnalParams *pAnalParams);
+SMS_EXPORT int sms_getSoundChannels( SMS_SndHeader *pSoundHeader, long sizeSound, sfloat **ppSound, long offset);
 
 SMS_EXPORT int sms_createSF( const char *pChOutputSoundFile, int iSamplingRate, int iType);
 
@@ -725,6 +1037,22 @@ SMS_EXPORT void sms_writeSound( const sfloat *pBuffer, int sizeBuffer);
 
 SMS_EXPORT void sms_writeSF(void);
 
+SMS_EXPORT int sms_prepFFT(int sizeFft);
+
+SMS_EXPORT const SMS_FFTPlan *sms_getFFTPlan(int sizeFft);
+
+SMS_EXPORT void sms_clearFFT(void);
+
+SMS_EXPORT const char *sms_fftBackend(void);
+
+SMS_EXPORT void sms_fftPlanned(const SMS_FFTPlan *pPlan, sfloat *pArray);
+
+SMS_EXPORT void sms_ifftPlanned(const SMS_FFTPlan *pPlan, sfloat *pArray);
+
+SMS_EXPORT void sms_fftBatch(const SMS_FFTPlan *pPlan, int nFrames, sfloat *pFrames, int iStride);
+
+SMS_EXPORT void sms_ifftBatch(const SMS_FFTPlan *pPlan, int nFrames, sfloat *pFrames, int iStride);
+
 SMS_EXPORT void sms_fft(int sizeFft, sfloat *pArray);
 
 SMS_EXPORT void sms_ifft(int sizeFft, sfloat *pArray);
@@ -743,6 +1071,40 @@ SMS_EXPORT void sms_freeModify( SMS_ModifyParams *params);
 
 SMS_EXPORT void sms_modify( SMS_Data *frame, const SMS_ModifyParams *params);
 
+SMS_EXPORT int sms_numProcessors(void);
+
+SMS_EXPORT SMS_ThreadPool *sms_createThreadPool(int nThreads);
+
+SMS_EXPORT int sms_threadPoolSize( const SMS_ThreadPool *pPool);
+
+SMS_EXPORT int sms_threadPoolSubmit( SMS_ThreadPool *pPool, SMS_TaskFunc pFunc, void *pArg);
+
+SMS_EXPORT void sms_threadPoolWait( SMS_ThreadPool *pPool);
+
+SMS_EXPORT void sms_freeThreadPool( SMS_ThreadPool *pPool);
+
+SMS_EXPORT SMS_FrameReader *sms_openFrameReader( const char *pChFileName, int nFramesAhead);
+
+SMS_EXPORT const SMS_Header *sms_getReaderHeader( const SMS_FrameReader *pReader);
+
+SMS_EXPORT void sms_setReaderPosition( SMS_FrameReader *pReader, sfloat fFrame, sfloat fRate);
+
+SMS_EXPORT const SMS_Data *sms_getReaderFrame( SMS_FrameReader *pReader, int iFrame);
+
+SMS_EXPORT const SMS_Data *sms_waitReaderFrame( SMS_FrameReader *pReader, int iFrame);
+
+SMS_EXPORT void sms_closeFrameReader( SMS_FrameReader *pReader);
+
+SMS_EXPORT int sms_analyzeSegments( const char *pChInputSoundFile, const SMS_AnalParams *pAnalParams,
+                                    SMS_ThreadPool *pPool, int nSegmentFrames, SMS_FrameFunc pFrameFunc,
+                                    void *pUserData, sfloat *pResidualAccumPerc);
+
+SMS_EXPORT int sms_analyzePipelined( SMS_SndHeader *pSoundHeader, SMS_AnalParams *pAnalParams,
+                                     SMS_ThreadPool *pPool, SMS_FrameFunc pFrameFunc, void *pUserData);
+
+SMS_EXPORT int sms_analyzeChannels( SMS_SndHeader *pSoundHeader, SMS_AnalParams **ppAnalParams,
+                                    SMS_ThreadPool *pPool, SMS_FrameFunc pFrameFunc, void **ppUserData);
+
 SMS_EXPORT /***********************************************************************************/
 SMS_EXPORT /************* debug functions: ******************************************************/
 
@@ -758,4 +1120,6 @@ SMS_EXPORT int sms_errorCheck( void );
 
 SMS_EXPORT char* sms_errorString( void );
 
+SMS_EXPORT char* sms_errorMessage( void );
+
 #endif /* _SMS_H */
@@ -22,6 +22,7 @@
  * \brief soundfile input and output.
  */
 #include "sms.h"
+#include <limits.h>
 
 #ifdef DOUBLE_PRECISION
 # define sf_readf_sfloat sf_readf_double
@@ -31,8 +32,49 @@
 # define sf_writef_sfloat sf_writef_float
 #endif
 
-SNDFILE *pSNDStream, *pOutputSNDStream, *pResidualSNDStream;
-SF_INFO sfSoundHeader, sfResidualHeader, sfOutputSoundHeader;
+#define SMS_SOUND_BLOCK_SAMPLES 16384 /* samples of each channel read from a sound at once */
+
+SNDFILE *pOutputSNDStream, *pResidualSNDStream;
+SF_INFO sfResidualHeader, sfOutputSoundHeader;
+
+/* read a stream of unknown length up to its end into a temporary file,
+ * which is then read instead of the stream */
+static int SpoolSound(SMS_SndHeader *pSoundHeader)
+{
+    size_t sizeFrame = pSoundHeader->channelCount * sizeof(sfloat);
+    sf_count_t nRead, nSamples = 0;
+
+    if((pSoundHeader->pSpoolFile = tmpfile()) == NULL)
+    {
+        sms_error("could not create a temporary file for the sound");
+        return -1;
+    }
+    while((nRead = sf_readf_sfloat(pSoundHeader->pSNDStream, pSoundHeader->pBlock,
+                                   SMS_SOUND_BLOCK_SAMPLES)) > 0)
+    {
+        if(fwrite(pSoundHeader->pBlock, sizeFrame, nRead, pSoundHeader->pSpoolFile) != (size_t)nRead)
+        {
+            sms_error("could not write the sound to a temporary file");
+            return -1;
+        }
+        nSamples += nRead;
+        if(nSamples >= INT_MAX || (sf_count_t)(nSamples * sizeFrame) > LONG_MAX)
+        {
+            sms_error("the sound is too long");
+            return -1;
+        }
+    }
+    if(nSamples == 0)
+    {
+        sms_error("the sound is empty");
+        return -1;
+    }
+    sf_close(pSoundHeader->pSNDStream);
+    pSoundHeader->pSNDStream = NULL;
+    pSoundHeader->nSamples = nSamples;
+    pSoundHeader->isSeekable = 1;
+    return 0;
+}
 
 /*! \brief open a sound file and check its header
  *
@@ -41,15 +83,24 @@ SF_INFO sfSoundHeader, sfResidualHeader, sfOutputSoundHeader;
  * they need to set SMS_SndHeader->iReadChannel to the
  * desired channel number.
  *
+ * The open sound belongs to pSoundHeader, so several sounds can be
+ * read at the same time. The sound can be a pipe, or the standard input
+ * when the name is "-". Such a sound can only be read forward, unless its
+ * length is not in its header: it is then read up to its end into a
+ * temporary file first, which can be read like any other sound.
+ *
  * \param pChInputSoundFile    name of soundfile
  * \param pSoundHeader    information of the sound
  * \return 0 on success, -1 on failure
  */
 int sms_openSF(const char *pChInputSoundFile, SMS_SndHeader *pSoundHeader)
 {
+    SF_INFO sfSoundHeader;
+
     memset(&sfSoundHeader, 0, sizeof (sfSoundHeader));
+    memset(pSoundHeader, 0, sizeof(SMS_SndHeader));
 
-    if(!(pSNDStream = sf_open(pChInputSoundFile, SFM_READ, &sfSoundHeader)))
+    if(!(pSoundHeader->pSNDStream = sf_open(pChInputSoundFile, SFM_READ, &sfSoundHeader)))
     {
         sms_error("cannot open soundfile");
         return -1;
@@ -60,14 +111,133 @@ int sms_openSF(const char *pChInputSoundFile, SMS_SndHeader *pSoundHeader)
     pSoundHeader->iSamplingRate = sfSoundHeader.samplerate;
     pSoundHeader->nSamples = sfSoundHeader.frames;
     pSoundHeader->sizeHeader = 0;
+    pSoundHeader->isSeekable = sfSoundHeader.seekable;
+    if((pSoundHeader->pBlock = (sfloat *)malloc(SMS_SOUND_BLOCK_SAMPLES * sfSoundHeader.channels *
+                                                sizeof(sfloat))) == NULL)
+    {
+        sms_closeSF(pSoundHeader);
+        sms_error("could not allocate memory for the input buffer");
+        return -1;
+    }
+    if(sfSoundHeader.frames <= 0 || sfSoundHeader.frames >= INT_MAX)
+    {
+        if(sfSoundHeader.seekable || SpoolSound(pSoundHeader) < 0)
+        {
+            if(sfSoundHeader.seekable)
+                sms_error("the length of the sound is not known");
+            sms_closeSF(pSoundHeader);
+            return -1;
+        }
+    }
     return 0;
 }
 
 /*! \brief close a sound file that was open for reading
-*/
-void sms_closeSF()
+ *
+ * \param pSoundHeader    information of the sound, as filled by sms_openSF
+ */
+void sms_closeSF(SMS_SndHeader *pSoundHeader)
+{
+    if(pSoundHeader->pSNDStream)
+        sf_close(pSoundHeader->pSNDStream);
+    if(pSoundHeader->pSpoolFile)
+        fclose(pSoundHeader->pSpoolFile);
+    if(pSoundHeader->pBlock)
+        free(pSoundHeader->pBlock);
+    pSoundHeader->pSNDStream = NULL;
+    pSoundHeader->pSpoolFile = NULL;
+    pSoundHeader->pBlock = NULL;
+    pSoundHeader->nBlockSamples = 0;
+}
+
+/* read the block of samples that starts at sample iStart from the
+ * temporary file of a spooled sound */
+static int ReadSpoolBlock(SMS_SndHeader *pSoundHeader, long iStart)
+{
+    size_t sizeFrame = pSoundHeader->channelCount * sizeof(sfloat), nRead;
+
+    if(fseek(pSoundHeader->pSpoolFile, (long)(iStart * sizeFrame), SEEK_SET) != 0)
+    {
+        sms_error("failure trying to seek to the sound location (fseek)");
+        return -1;
+    }
+    nRead = fread(pSoundHeader->pBlock, sizeFrame, SMS_SOUND_BLOCK_SAMPLES, pSoundHeader->pSpoolFile);
+    if(nRead == 0)
+    {
+        sms_error("could not read the requested number of frames");
+        return -1;
+    }
+    pSoundHeader->iBlockStart = iStart;
+    pSoundHeader->nBlockSamples = nRead;
+    return 0;
+}
+
+/* read the block of samples that starts at sample iStart, a sound that is
+ * not seekable is read up to there */
+static int ReadBlock(SMS_SndHeader *pSoundHeader, long iStart)
+{
+    sf_count_t nRead;
+
+    pSoundHeader->nBlockSamples = 0;
+    if(pSoundHeader->pSpoolFile)
+        return ReadSpoolBlock(pSoundHeader, iStart);
+    if(iStart != pSoundHeader->iStreamPos && pSoundHeader->isSeekable)
+    {
+        if(sf_seek(pSoundHeader->pSNDStream, iStart, SEEK_SET) < 0)
+        {
+            sms_error("failure trying to seek to the sound location (sf_seek)");
+            return -1;
+        }
+        pSoundHeader->iStreamPos = iStart;
+    }
+    else if(iStart < pSoundHeader->iStreamPos)
+    {
+        sms_error("cannot go back in a sound that is not seekable");
+        return -1;
+    }
+    while(pSoundHeader->iStreamPos < iStart)
+    {
+        nRead = sf_readf_sfloat(pSoundHeader->pSNDStream, pSoundHeader->pBlock,
+                                MIN(iStart - pSoundHeader->iStreamPos, SMS_SOUND_BLOCK_SAMPLES));
+        if(nRead <= 0)
+        {
+            sms_error("could not read the requested number of frames");
+            return -1;
+        }
+        pSoundHeader->iStreamPos += nRead;
+    }
+
+    nRead = sf_readf_sfloat(pSoundHeader->pSNDStream, pSoundHeader->pBlock, SMS_SOUND_BLOCK_SAMPLES);
+    if(nRead <= 0)
+    {
+        sms_error("could not read the requested number of frames");
+        return -1;
+    }
+    pSoundHeader->iBlockStart = iStart;
+    pSoundHeader->nBlockSamples = nRead;
+    pSoundHeader->iStreamPos += nRead;
+    return 0;
+}
+
+/* make the block hold the sample offset, going backward it ends with the
+ * sizeSound samples from offset on, returns the position of offset in it */
+static long BlockPosition(SMS_SndHeader *pSoundHeader, long offset, long sizeSound)
 {
-    sf_close(pSNDStream);
+    long iInBlock = offset - pSoundHeader->iBlockStart, iStart = offset;
+
+    if(iInBlock >= 0 && iInBlock < pSoundHeader->nBlockSamples)
+        return iInBlock;
+    if(pSoundHeader->isSeekable && iInBlock < 0 && pSoundHeader->nBlockSamples > 0)
+        iStart = MAX(0, offset + sizeSound - SMS_SOUND_BLOCK_SAMPLES);
+    if(ReadBlock(pSoundHeader, iStart) < 0)
+        return -1;
+    iInBlock = offset - pSoundHeader->iBlockStart;
+    if(iInBlock >= pSoundHeader->nBlockSamples)
+    {
+        sms_error("could not read the requested number of frames");
+        return -1;
+    }
+    return iInBlock;
 }
 
 /*! \brief get a chunk of sound from input file
@@ -76,38 +246,68 @@ void sms_closeSF()
  * the channel specified by SMS_SndHeader->iReadChannel to an array,
  * which is by default the first channel.
  *
+ * The sound is read in large blocks, in order, so reading it forward (or
+ * backward) a chunk at a time never seeks, and can be done from a sound
+ * that is not seekable (forward only).
+ *
  * \param pSoundHeader       sound header information to hold extracted information
  * \param sizeSound               number of samples read
  * \param pSound             buffer for samples read
  * \param offset                      which sound frame to start reading from
+ * \param pAnalParams           not used, kept for API compatibility
  * \return 0 on success, -1 on failure
  */
-int sms_getSound(const SMS_SndHeader *pSoundHeader, long sizeSound, sfloat *pSound,
+int sms_getSound(SMS_SndHeader *pSoundHeader, long sizeSound, sfloat *pSound,
                  long offset, SMS_AnalParams *pAnalParams)
 {
-    int nFrames;
-    int i;
     int iChannelCount = pSoundHeader->channelCount;
-    int iReadChannel = pSoundHeader->iReadChannel;
+    long iInBlock, sizeCopy;
 
-    if(sf_seek(pSNDStream, offset, SEEK_SET) < 0)
-    {
-        sms_error ("failure trying to seek to the sound location (sf_seek)");
-        return -1;
-    }
+    (void)pAnalParams; /* kept for API compatibility */
 
-    nFrames = sf_readf_sfloat(pSNDStream, pAnalParams->inputBuffer, sizeSound);
-    if(nFrames != sizeSound)
+    while(sizeSound > 0)
     {
-        sms_error("could not read the requested number of frames");
-        return -1;
+        if((iInBlock = BlockPosition(pSoundHeader, offset, sizeSound)) < 0)
+            return -1;
+        sizeCopy = MIN(sizeSound, pSoundHeader->nBlockSamples - iInBlock);
+        sms_vecDeinterleave(sizeCopy, pSoundHeader->pBlock + iInBlock * iChannelCount, iChannelCount,
+                            pSoundHeader->iReadChannel, pSound);
+        pSound += sizeCopy;
+        offset += sizeCopy;
+        sizeSound -= sizeCopy;
     }
+    return 0;
+}
 
-    /* now need to sift through interleaved frames to build one channel
-       of samples -- this should work even with one channel */
-    for(i = 0; i < nFrames; i++)
-        pSound[i] = pAnalParams->inputBuffer[i*iChannelCount +iReadChannel];
+/*! \brief get a chunk of sound from all of the channels of the input file
+ *
+ * The same as sms_getSound() for each channel, but the sound is only read
+ * once.
+ *
+ * \param pSoundHeader       sound header information
+ * \param sizeSound               number of samples read from each channel
+ * \param ppSound             buffer for the samples of each channel, NULL for a channel that is not needed
+ * \param offset                      which sound frame to start reading from
+ * \return 0 on success, -1 on failure
+ */
+int sms_getSoundChannels(SMS_SndHeader *pSoundHeader, long sizeSound, sfloat **ppSound, long offset)
+{
+    int iChannelCount = pSoundHeader->channelCount, iChannel;
+    long iInBlock, sizeCopy, iOut = 0;
 
+    while(sizeSound > 0)
+    {
+        if((iInBlock = BlockPosition(pSoundHeader, offset, sizeSound)) < 0)
+            return -1;
+        sizeCopy = MIN(sizeSound, pSoundHeader->nBlockSamples - iInBlock);
+        for(iChannel = 0; iChannel < iChannelCount; iChannel++)
+            if(ppSound[iChannel])
+                sms_vecDeinterleave(sizeCopy, pSoundHeader->pBlock + iInBlock * iChannelCount,
+                                    iChannelCount, iChannel, ppSound[iChannel] + iOut);
+        iOut += sizeCopy;
+        offset += sizeCopy;
+        sizeSound -= sizeCopy;
+    }
     return 0;
 }
 
@@ -156,7 +356,52 @@ void sms_writeSF()
     sf_close(pOutputSNDStream);
 }
 
+/*! \brief pointer to a sample in a sound buffer
+ *
+ * In the ring of the analysis (sizeRing > 0) the sample is followed in
+ * memory by at least sizeMirror - 1 more samples of the sound.
+ *
+ * \param pSndBuffer       pointer to the sound buffer
+ * \param iSample           sample number of the sound source, from iMarker on
+ * \return pointer to the sample
+ */
+sfloat *sms_soundBufferPointer(const SMS_SndBuffer *pSndBuffer, int iSample)
+{
+    if(pSndBuffer->sizeRing > 0)
+        return pSndBuffer->pFBuffer + (iSample & (pSndBuffer->sizeRing - 1));
+    return pSndBuffer->pFBuffer + (iSample - pSndBuffer->iMarker);
+}
+
+/*! \brief get the place of the next input samples in the sound buffer
+ *
+ * The next samples can be read directly to this place and then given to
+ * sms_analyze() (or sms_fillSoundBuffer()) as pWaveform, which saves
+ * copying them. The pointer is good until the next call of sms_analyze().
+ * Waits for the re-analysis of the previous frames, see sms_waitReAnalysis().
+ *
+ * \param sizeWaveform        number of samples that will be put there
+ * \param pAnalParams        pointer to structure of analysis parameters
+ * \return pointer to space for sizeWaveform samples, NULL on error
+ */
+sfloat *sms_getSoundBufferSpace(int sizeWaveform, SMS_AnalParams *pAnalParams)
+{
+    SMS_SndBuffer *pSoundBuf = &pAnalParams->soundBuffer;
+
+    /* the previous frames may still be re-analyzed from this sound */
+    sms_waitReAnalysis(pAnalParams);
+    if(sizeWaveform > pSoundBuf->sizeMirror)
+    {
+        sms_error("sms_getSoundBufferSpace: more samples than the largest analysis window");
+        return NULL;
+    }
+    return sms_soundBufferPointer(pSoundBuf, pSoundBuf->iMarker + pSoundBuf->sizeBuffer);
+}
+
 /*! \brief fill the sound buffer
+ *
+ * The new samples are added to the ring of the sound buffer, nothing that
+ * is already in it is moved. pWaveform can be the space given by
+ * sms_getSoundBufferSpace(), the samples are then filtered in place.
  *
  * \param sizeWaveform        size of input data
  * \param pWaveform           input data
@@ -164,24 +409,48 @@ void sms_writeSF()
  */
 void sms_fillSoundBuffer(int sizeWaveform, const sfloat *pWaveform, SMS_AnalParams *pAnalParams)
 {
-    int i;
-    long sizeNewData = (long)sizeWaveform;
+    SMS_SndBuffer *pSoundBuf = &pAnalParams->soundBuffer;
+    int iStart = (pSoundBuf->iMarker + pSoundBuf->sizeBuffer) & (pSoundBuf->sizeRing - 1);
+    int iMask = pSoundBuf->sizeRing - 1;
+    int i, iPos, iStep = 1;
+    sfloat fValue, fLastValue = pAnalParams->preEmphasisLastValue;
 
-    /* leave space for new data */
-    memcpy(pAnalParams->soundBuffer.pFBuffer, pAnalParams->soundBuffer.pFBuffer+sizeNewData,
-           sizeof(sfloat) * (pAnalParams->soundBuffer.sizeBuffer - sizeNewData));
+    if(pAnalParams->iAnalysisDirection == SMS_DIR_REV)
+    {
+        /* read there by the caller, turn it around in place */
+        if(pWaveform == pSoundBuf->pFBuffer + iStart)
+        {
+            sfloat *pNew = pSoundBuf->pFBuffer + iStart;
+            for(i = 0; i < sizeWaveform / 2; i++)
+            {
+                fValue = pNew[i];
+                pNew[i] = pNew[sizeWaveform - 1 - i];
+                pNew[sizeWaveform - 1 - i] = fValue;
+            }
+        }
+        else
+        {
+            pWaveform += sizeWaveform - 1;
+            iStep = -1;
+        }
+    }
 
-    pAnalParams->soundBuffer.iFirstGood =
-        MAX(0, pAnalParams->soundBuffer.iFirstGood - sizeNewData);
-    pAnalParams->soundBuffer.iMarker += sizeNewData;
+    /* put the new data in (twice if it is in the mirrored part), and do some pre-emphasis */
+    for(i = 0; i < sizeWaveform; i++, pWaveform += iStep)
+    {
+        fValue = *pWaveform;
+        if(pAnalParams->preEmphasis)
+        {
+            fValue = fValue - SMS_EMPH_COEF * fLastValue;
+            fLastValue = fValue;
+        }
+        iPos = (iStart + i) & iMask;
+        pSoundBuf->pFBuffer[iPos] = fValue;
+        if(iPos < pSoundBuf->sizeMirror)
+            pSoundBuf->pFBuffer[iPos + pSoundBuf->sizeRing] = fValue;
+    }
+    pAnalParams->preEmphasisLastValue = fLastValue;
 
-    /* put the new data in, and do some pre-emphasis */
-    if(pAnalParams->iAnalysisDirection == SMS_DIR_REV)
-        for(i=0; i<sizeNewData; i++)
-            pAnalParams->soundBuffer.pFBuffer[pAnalParams->soundBuffer.sizeBuffer - sizeNewData + i] =
-                sms_preEmphasis(pWaveform[sizeNewData - (1+ i)], pAnalParams);
-    else
-        for(i=0; i<sizeNewData; i++)
-            pAnalParams->soundBuffer.pFBuffer[pAnalParams->soundBuffer.sizeBuffer - sizeNewData + i] =
-                sms_preEmphasis(pWaveform[i], pAnalParams);
+    pSoundBuf->iFirstGood = MAX(0, pSoundBuf->iFirstGood - sizeWaveform);
+    pSoundBuf->iMarker += sizeWaveform;
 }
@@ -23,6 +23,13 @@
  */
 #include "sms.h"
 
+/* convert an FFT result (in the OOURA packing) to magnitude and zero-windowed phase */
+static void FftToPolar(int sizeMag, const sfloat *pFftBuffer, sfloat *pMag, sfloat *pPhase)
+{
+    /* \todo why is fImag negated? */
+    sms_vecRectToPolar(sizeMag, pFftBuffer, pMag, pPhase, -1);
+}
+
 /*! \brief compute a complex spectrum from a waveform
  *
  * \param sizeWindow               size of analysis window
@@ -36,26 +43,47 @@
 int sms_spectrum(int sizeWindow, const sfloat *pWaveform, const sfloat *pWindow, int sizeMag,
                  sfloat *pMag, sfloat *pPhase, sfloat *pFftBuffer)
 {
-    int i, it2;
-    int err = 0;
-    sfloat fReal, fImag;
+    return sms_spectra(1, 0, sizeWindow, pWaveform, pWindow, sizeMag, pMag, pPhase, pFftBuffer);
+}
 
+/*! \brief compute the complex spectra of several frames of a waveform
+ *
+ * Gives the same spectra as calling sms_spectrum() on every frame, but all
+ * the FFTs are done in one batch, which with the OOURA FFT is no faster than
+ * one frame at a time \see sms_fftBatch.
+ *
+ * \param nFrames                 number of frames
+ * \param sizeHop                 distance in samples from the start of one frame to the next
+ * \param sizeWindow               size of analysis window
+ * \param pWaveform            pointer to the first frame of the input waveform
+ * \param pWindow                      pointer to input window
+ * \param sizeMag                      size of each output magnitude and phase spectrum
+ * \param pMag                          pointer to output magnitude spectra (nFrames * sizeMag)
+ * \param pPhase                       pointer to output phase spectra (nFrames * sizeMag)
+ * \param pFftBuffer                  buffer for the FFTs (nFrames * 2 * sizeMag)
+ * \return sizeFft, -1 on error
+ */
+int sms_spectra(int nFrames, int sizeHop, int sizeWindow, const sfloat *pWaveform, const sfloat *pWindow,
+                int sizeMag, sfloat *pMag, sfloat *pPhase, sfloat *pFftBuffer)
+{
+    int iFrame;
     int sizeFft = sizeMag << 1;
-    memset(pFftBuffer, 0, sizeFft * sizeof(sfloat));
+    const SMS_FFTPlan *pPlan = sms_getFFTPlan(sizeFft);
+
+    if(pPlan == NULL)
+        return -1;
+    memset(pFftBuffer, 0, (size_t)nFrames * sizeFft * sizeof(sfloat));
 
     /* apply window to waveform and center window around 0 (zero-phase windowing)*/
-    sms_windowCentered(sizeWindow, pWaveform, pWindow, sizeFft, pFftBuffer);
-    sms_fft(sizeFft, pFftBuffer);
+    for(iFrame = 0; iFrame < nFrames; iFrame++)
+        sms_windowCentered(sizeWindow, pWaveform + (long)iFrame * sizeHop, pWindow, sizeFft,
+                           pFftBuffer + (long)iFrame * sizeFft);
+    sms_fftBatch(pPlan, nFrames, pFftBuffer, sizeFft);
 
     /* convert from rectangular to polar coordinates */
-    for (i = 0; i < sizeMag; i++)
-    {
-        it2 = i << 1; //even numbers 0-N
-        fReal = pFftBuffer[it2]; /*odd numbers 1->N+1 */
-        fImag = pFftBuffer[it2 + 1]; /*even numbers 2->N+2 */
-        pMag[i] = sqrt(fReal * fReal + fImag * fImag);
-        pPhase[i] = atan2(-fImag, fReal); /* \todo why is fImag negated? */
-    }
+    for(iFrame = 0; iFrame < nFrames; iFrame++)
+        FftToPolar(sizeMag, pFftBuffer + (long)iFrame * sizeFft,
+                   pMag + (long)iFrame * sizeMag, pPhase + (long)iFrame * sizeMag);
 
     return sizeFft;
 }
@@ -76,9 +104,8 @@ int sms_spectrum(int sizeWindow, const sfloat *pWaveform, const sfloat *pWindow,
 int sms_spectrumMag(int sizeWindow, const sfloat *pWaveform, const sfloat *pWindow,
                     int sizeMag, sfloat *pMag, sfloat *pFftBuffer)
 {
-    int i,it2;
+    int i;
     int sizeFft = sizeMag << 1;
-    sfloat fReal, fImag;
 
     /* apply window to waveform, zero the rest of the array */
     for (i = 0; i < sizeWindow; i++)
@@ -90,13 +117,7 @@ int sms_spectrumMag(int sizeWindow, const sfloat *pWaveform, const sfloat *pWind
     sms_fft(sizeFft, pFftBuffer);
 
     /* convert from rectangular to polar coordinates */
-    for (i=0; i<sizeMag; i++)
-    {
-        it2 = i << 1;
-        fReal = pFftBuffer[it2];
-        fImag = pFftBuffer[it2+1];
-        pMag[i] = sqrtf(fReal * fReal + fImag * fImag);
-    }
+    sms_vecRectToPolar(sizeMag, pFftBuffer, pMag, NULL, 1);
 
     return sizeFft;
 }
@@ -180,19 +201,7 @@ int sms_invQuickSpectrumW(const sfloat *pFMagSpectrum, const sfloat *pFPhaseSpec
  */
 void sms_RectToPolar(int sizeMag, const sfloat *pRect, sfloat *pMag, sfloat *pPhase)
 {
-    int i, it2;
-    sfloat fReal, fImag;
-
-    for(i=0; i<sizeMag; i++)
-    {
-        it2 = i << 1;
-        fReal = pRect[it2];
-        fImag = pRect[it2+1];
-
-        pMag[i] = sqrtf(fReal * fReal + fImag * fImag);
-        if(pPhase)
-            pPhase[i] = atan2f(fImag, fReal);
-    }
+    sms_vecRectToPolar(sizeMag, pRect, pMag, pPhase, 1);
 }
 
 /*! \brief convert spectrum from Rectangular to Polar form
@@ -224,14 +233,5 @@ void sms_PolarToRect(int sizeSpec, sfloat *pRect, const sfloat *pMag, const sflo
  */
 void sms_spectrumRMS(int sizeMag, const sfloat *pInRect, sfloat *pOutMag)
 {
-    int i, it2;
-    sfloat fReal, fImag;
-
-    for(i=0; i<sizeMag; i++)
-    {
-        it2 = i << 1;
-        fReal = pInRect[it2];
-        fImag = pInRect[it2+1];
-        pOutMag[i] = sqrtf(fReal * fReal + fImag * fImag);
-    }
+    sms_vecRectToPolar(sizeMag, pInRect, pOutMag, NULL, 1);
 }
@@ -23,12 +23,11 @@
  */
 #include "sms.h"
 
-/*! \brief synthesis of one frame of the deterministic component using the IFFT
+/* spectrum of one frame of the deterministic component for the IFFT synthesis
  *
- * \param pSmsData pointer to SMS data structure frame
- * \param pSynthParams pointer to structure of synthesis parameters
- */
-static void SineSynthIFFT(SMS_Data *pSmsData, SMS_SynthParams *pSynthParams)
+ * pSpectra is the output spectrum (2x sizeHop), the phases of the tracks
+ * are updated in pSynthParams->prevFrame. */
+static void SineSpectrumIFFT(SMS_Data *pSmsData, SMS_SynthParams *pSynthParams, sfloat *pSpectra)
 {
     int sizeFft = pSynthParams->sizeHop << 1;
     int iHalfSamplingRate = pSynthParams->iSamplingRate >> 1;
@@ -39,7 +38,7 @@ static void SineSynthIFFT(SMS_Data *pSmsData, SMS_SynthParams *pSynthParams)
     sfloat fMag=0.0, fFreq=0.0, fPhase=0.0, fLoc, fSin, fCos, fBinRemainder,
            fTmp, fNewMag,  fIndex;
     sfloat fSamplingPeriod = 1.0 / pSynthParams->iSamplingRate;
-    memset(pSynthParams->pSpectra, 0, sizeFft * sizeof(sfloat));
+    memset(pSpectra, 0, sizeFft * sizeof(sfloat));
     for(i = 0; i < nTracks; i++)
     {
         if(((fMag = pSmsData->pFSinAmp[i]) > 0) &&
@@ -66,28 +65,28 @@ static void SineSynthIFFT(SMS_Data *pSmsData, SMS_SynthParams *pSynthParams)
                 fNewMag = fMag * sms_sinc (fIndex);
                 if(l > 0 && l < sizeMag)
                 {
-                    pSynthParams->pSpectra[l*2+1] += fNewMag * fCos;
-                    pSynthParams->pSpectra[l*2] += fNewMag * fSin;
+                    pSpectra[l*2+1] += fNewMag * fCos;
+                    pSpectra[l*2] += fNewMag * fSin;
                 }
                 else if(l == 0)
                 {
-                    pSynthParams->pSpectra[0] += 2 * fNewMag * fSin;
+                    pSpectra[0] += 2 * fNewMag * fSin;
                 }
                 else if(l < 0)
                 {
                     b = abs(l);
-                    pSynthParams->pSpectra[b*2+1] -= fNewMag * fCos;
-                    pSynthParams->pSpectra[b*2] += fNewMag * fSin;
+                    pSpectra[b*2+1] -= fNewMag * fCos;
+                    pSpectra[b*2] += fNewMag * fSin;
                 }
                 else if(l > sizeMag)
                 {
                     b = sizeMag - (l - sizeMag);
-                    pSynthParams->pSpectra[b*2+1] -= fNewMag * fCos;
-                    pSynthParams->pSpectra[b*2] += fNewMag * fSin;
+                    pSpectra[b*2+1] -= fNewMag * fCos;
+                    pSpectra[b*2] += fNewMag * fSin;
                 }
                 else if(l == sizeMag)
                 {
-                    pSynthParams->pSpectra[1] += 2 * fNewMag * fSin;
+                    pSpectra[1] += 2 * fNewMag * fSin;
                 }
             }
         }
@@ -96,30 +95,44 @@ static void SineSynthIFFT(SMS_Data *pSmsData, SMS_SynthParams *pSynthParams)
         pSynthParams->prevFrame.pFSinFreq[i] = fFreq;
     }
 
-    sms_ifft(sizeFft, pSynthParams->pSpectra);
+}
+
+/* overlap-add an inverse transformed spectrum of the deterministic component */
+static void AddSineIFFT(const sfloat *pSpectra, SMS_SynthParams *pSynthParams)
+{
+    int sizeMag = pSynthParams->sizeHop;
+    int sizeFft = sizeMag << 1;
+    int i, k;
 
     for(i = 0, k = sizeMag; i < sizeMag; i++, k++)
-        pSynthParams->pSynthBuff[i] += pSynthParams->pSpectra[k] * pSynthParams->pFDetWindow[i];
+        pSynthParams->pSynthBuff[i] += pSpectra[k] * pSynthParams->pFDetWindow[i];
     for(i= sizeMag, k = 0; i < sizeFft; i++, k++)
-        pSynthParams->pSynthBuff[i] +=  pSynthParams->pSpectra[k] * pSynthParams->pFDetWindow[i];
+        pSynthParams->pSynthBuff[i] +=  pSpectra[k] * pSynthParams->pFDetWindow[i];
 }
 
-/*! \brief synthesis of one frame of the stochastic component by apprimating phases
- *
- * computes a linearly interpolated spectral envelope to fit the correct number of output
- * audio samples. Phases are generated randomly.
+/*! \brief synthesis of one frame of the deterministic component using the IFFT
  *
- * \param pSmsData pointer to the current SMS frame
- * \param pSynthParams pointer to a strucure of synthesis parameters
- * \return
- * \todo cleanup returns and various constant multipliers. check that approximation is ok
+ * \param pSmsData pointer to SMS data structure frame
+ * \param pSynthParams pointer to structure of synthesis parameters
  */
-static int StocSynthApprox(SMS_Data *pSmsData, SMS_SynthParams *pSynthParams)
+static void SineSynthIFFT(SMS_Data *pSmsData, SMS_SynthParams *pSynthParams)
+{
+    SineSpectrumIFFT(pSmsData, pSynthParams, pSynthParams->pSpectra);
+    sms_ifft(pSynthParams->sizeHop << 1, pSynthParams->pSpectra);
+    AddSineIFFT(pSynthParams->pSpectra, pSynthParams);
+}
+
+/* spectrum of one frame of the stochastic component, made from the
+ * spectral envelope with random phases
+ *
+ * pSpectra is the output spectrum (2x sizeHop).
+ * Returns 0 if the frame has no stochastic component, 1 otherwise. */
+static int StocSpectrumApprox(SMS_Data *pSmsData, SMS_SynthParams *pSynthParams, sfloat *pSpectra)
 {
     int i, sizeSpec1Used;
     int sizeSpec1 = pSmsData->nCoeff;
     int sizeSpec2 = pSynthParams->sizeHop;
-    int sizeFft = pSynthParams->sizeHop << 1; /* 50% overlap, so sizeFft is 2x sizeHop */
+    sfloat fPower;
 
     /* if no gain or no coefficients return  */
     if(pSmsData->nCoeff == 0)
@@ -142,9 +155,43 @@ static int StocSynthApprox(SMS_Data *pSmsData, SMS_SynthParams *pSynthParams)
     for(i = 0; i < sizeSpec2; i++)
         pSynthParams->pPhaseBuff[i] =  TWO_PI * sms_random();
 
-    sms_invQuickSpectrumW(pSynthParams->pMagBuff, pSynthParams->pPhaseBuff,
-                          sizeFft, pSynthParams->pSynthBuff, sizeFft,
-                          pSynthParams->pFStocWindow, pSynthParams->pSpectra);
+    /* convert from polar coordinates to rectangular, as sms_invQuickSpectrumW */
+    for(i = 0; i < sizeSpec2; i++)
+    {
+        fPower = pSynthParams->pMagBuff[i];
+        pSpectra[i << 1] =  fPower * cos (pSynthParams->pPhaseBuff[i]);
+        pSpectra[(i << 1) + 1] = fPower * sin (pSynthParams->pPhaseBuff[i]);
+    }
+    return 1;
+}
+
+/* overlap-add an inverse transformed spectrum of the stochastic component */
+static void AddStocIFFT(const sfloat *pSpectra, SMS_SynthParams *pSynthParams)
+{
+    int i;
+    int sizeFft = pSynthParams->sizeHop << 1;
+
+    for (i = 0; i < sizeFft; i++)
+        pSynthParams->pSynthBuff[i] +=  (pSpectra[i] * pSynthParams->pFStocWindow[i] * .5);
+}
+
+/*! \brief synthesis of one frame of the stochastic component by apprimating phases
+ *
+ * computes a linearly interpolated spectral envelope to fit the correct number of output
+ * audio samples. Phases are generated randomly.
+ *
+ * \param pSmsData pointer to the current SMS frame
+ * \param pSynthParams pointer to a strucure of synthesis parameters
+ * \return
+ * \todo cleanup returns and various constant multipliers. check that approximation is ok
+ */
+static int StocSynthApprox(SMS_Data *pSmsData, SMS_SynthParams *pSynthParams)
+{
+    if(!StocSpectrumApprox(pSmsData, pSynthParams, pSynthParams->pSpectra))
+        return 0;
+
+    sms_ifft(pSynthParams->sizeHop << 1, pSynthParams->pSpectra);
+    AddStocIFFT(pSynthParams->pSpectra, pSynthParams);
     return 1;
 }
 
@@ -195,3 +242,99 @@ void sms_synthesize(SMS_Data *pSmsData, sfloat *pFSynthesis,  SMS_SynthParams *p
     for(i = 0; i < sizeHop; i++)
         pFSynthesis[i] = sms_deEmphasis(pSynthParams->pSynthBuff[i], pSynthParams);
 }
+
+/*! \brief synthesizes several consecutive frames of SMS data
+ *
+ * Gives the same sound as calling sms_synthesize() on every frame, but the
+ * inverse FFTs of all the frames are done in batches, which with the OOURA
+ * FFT is no faster than one frame at a time \see sms_ifftBatch. When the
+ * deterministic component is made with oscillators (SMS_DET_SIN) the random
+ * phases of new tracks and of the stochastic component are drawn in a
+ * different order, so only that part of the sound differs.
+ *
+ * \param nFrames      number of frames
+ * \param pSmsFrames   input SMS data, nFrames frames (the magnitudes are converted to dB in place)
+ * \param pFSynthesis  output sound buffer (nFrames * sizeHop samples)
+ * \param pSynthParams synthesis parameters
+ * \return 0 on success, -1 on error
+ */
+int sms_synthesizeFrames(int nFrames, SMS_Data *pSmsFrames, sfloat *pFSynthesis,
+                         SMS_SynthParams *pSynthParams)
+{
+    int i, iFrame, nStoc = 0;
+    int sizeHop = pSynthParams->sizeHop;
+    int sizeFft = sizeHop << 1;
+    int doDet = pSynthParams->iSynthesisType != SMS_STYPE_STOC;
+    int doDetIFFT = doDet && pSynthParams->iDetSynthType == SMS_DET_IFFT;
+    int doStoc = pSynthParams->iSynthesisType != SMS_STYPE_DET;
+    const SMS_FFTPlan *pPlan = sms_getFFTPlan(sizeFft);
+    sfloat *pDetSpectra, *pStocSpectra;
+
+    if(pPlan == NULL)
+        return -1;
+    if(nFrames > pSynthParams->nBatchFrames)
+    {
+        sfloat *pBatchSpectra = (sfloat *)realloc(pSynthParams->pBatchSpectra,
+                                                  (size_t)nFrames * 2 * sizeFft * sizeof(sfloat));
+        int *pBatchStoc;
+        if(pBatchSpectra == NULL)
+        {
+            sms_error("could not allocate memory for the batch of spectra");
+            return -1;
+        }
+        pSynthParams->pBatchSpectra = pBatchSpectra;
+        if((pBatchStoc = (int *)realloc(pSynthParams->pBatchStoc, nFrames * sizeof(int))) == NULL)
+        {
+            sms_error("could not allocate memory for the batch of spectra");
+            return -1;
+        }
+        pSynthParams->pBatchStoc = pBatchStoc;
+        pSynthParams->nBatchFrames = nFrames;
+    }
+    pDetSpectra = pSynthParams->pBatchSpectra;
+    pStocSpectra = pDetSpectra + (size_t)nFrames * sizeFft;
+
+    /* make the spectra of all the frames, in frame order because of the phases */
+    for(iFrame = 0; iFrame < nFrames; iFrame++)
+    {
+        SMS_Data *pSmsData = &pSmsFrames[iFrame];
+
+        /* convert mags from linear to db */
+        sms_arrayMagToDB(pSmsData->nTracks, pSmsData->pFSinAmp);
+
+        if(doDetIFFT)
+            SineSpectrumIFFT(pSmsData, pSynthParams, pDetSpectra + (size_t)iFrame * sizeFft);
+        pSynthParams->pBatchStoc[iFrame] = -1;
+        if(doStoc && StocSpectrumApprox(pSmsData, pSynthParams, pStocSpectra + (size_t)nStoc * sizeFft))
+            pSynthParams->pBatchStoc[iFrame] = nStoc++;
+    }
+
+    if(doDetIFFT)
+        sms_ifftBatch(pPlan, nFrames, pDetSpectra, sizeFft);
+    if(nStoc > 0)
+        sms_ifftBatch(pPlan, nStoc, pStocSpectra, sizeFft);
+
+    /* overlap-add them */
+    for(iFrame = 0; iFrame < nFrames; iFrame++)
+    {
+        sfloat *pFFrameSynthesis = pFSynthesis + (size_t)iFrame * sizeHop;
+
+        memcpy(pSynthParams->pSynthBuff, (sfloat *)(pSynthParams->pSynthBuff+sizeHop),
+               sizeof(sfloat) * sizeHop);
+        memset(pSynthParams->pSynthBuff+sizeHop, 0, sizeof(sfloat) * sizeHop);
+
+        if(doDetIFFT)
+            AddSineIFFT(pDetSpectra + (size_t)iFrame * sizeFft, pSynthParams);
+        else if(doDet)
+            sms_sineSynthFrame(&pSmsFrames[iFrame], pSynthParams->pSynthBuff, sizeHop,
+                               &(pSynthParams->prevFrame), pSynthParams->iSamplingRate);
+        if(pSynthParams->pBatchStoc[iFrame] >= 0)
+            AddStocIFFT(pStocSpectra + (size_t)pSynthParams->pBatchStoc[iFrame] * sizeFft,
+                        pSynthParams);
+
+        /* de-emphasize the sound and normalize*/
+        for(i = 0; i < sizeHop; i++)
+            pFFrameSynthesis[i] = sms_deEmphasis(pSynthParams->pSynthBuff[i], pSynthParams);
+    }
+    return 0;
+}
@@ -0,0 +1,382 @@
+/*
+ * Copyright (c) 2008 MUSIC TECHNOLOGY GROUP (MTG)
+ *                         UNIVERSITAT POMPEU FABRA
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+/*! \file threadPool.c
+ * \brief a pool of worker threads with work-stealing
+ *
+ * Every worker has its own queue of tasks. sms_threadPoolSubmit() hands out
+ * tasks to the queues in turn (tasks submitted from a worker go to the queue
+ * of that worker), a worker takes tasks from the front of its own queue and,
+ * once that is empty, steals from the back of the queue of another worker.
+ * This way a few long tasks do not leave the other workers idle.
+ *
+ * The analysis and synthesis instances are independent since the library
+ * keeps no hidden global state, so each task can run its own SMS_AnalParams
+ * or SMS_SynthParams. sms_init() has to be called before starting tasks.
+ *
+ * The errors are kept per thread (see sms_error()). An error that a task
+ * leaves on its worker is taken off the worker, so that it does not show up
+ * in the next task, and sms_threadPoolWait() reports it to its caller.
+ */
+#include "sms.h"
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#define SIZE_QUEUE_START 16 /* initial number of slots in a worker queue */
+
+typedef struct
+{
+    SMS_TaskFunc pFunc;
+    void *pArg;
+} Task;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    Task *pTasks;   /* circular buffer of tasks */
+    int sizeQueue;  /* number of slots in pTasks */
+    int iFirst;     /* slot of the first task */
+    int nTasks;     /* number of tasks in the queue */
+} TaskQueue;
+
+typedef struct
+{
+    SMS_ThreadPool *pPool;
+    int iWorker;
+} Worker;
+
+struct SMS_ThreadPool
+{
+    int nThreads;
+    int nStarted;             /* number of threads actually running */
+    pthread_t *pThreads;
+    Worker *pWorkers;
+    TaskQueue *pQueues;
+    pthread_mutex_t lock;     /* protects the counters below */
+    pthread_cond_t workCond;  /* signaled when tasks are queued or the pool quits */
+    pthread_cond_t doneCond;  /* signaled when all tasks are done */
+    int nQueued;              /* tasks waiting in the queues */
+    int nPending;             /* tasks submitted and not finished yet */
+    int iNextQueue;           /* queue for the next task submitted from outside the pool */
+    int quit;
+    int hasError;             /* whether a task left an error since the last wait */
+    char pChError[256];       /* the first of these errors */
+};
+
+/* the worker running in the calling thread, NULL outside of a pool */
+static SMS_THREAD_LOCAL Worker *pCurrentWorker = NULL;
+
+static int PushTask(TaskQueue *pQueue, SMS_TaskFunc pFunc, void *pArg)
+{
+    pthread_mutex_lock(&pQueue->lock);
+    if(pQueue->nTasks == pQueue->sizeQueue)
+    {
+        int i, sizeQueue = pQueue->sizeQueue * 2;
+        Task *pTasks = (Task *)malloc(sizeQueue * sizeof(Task));
+        if(pTasks == NULL)
+        {
+            pthread_mutex_unlock(&pQueue->lock);
+            return -1;
+        }
+        for(i = 0; i < pQueue->nTasks; i++)
+            pTasks[i] = pQueue->pTasks[(pQueue->iFirst + i) % pQueue->sizeQueue];
+        free(pQueue->pTasks);
+        pQueue->pTasks = pTasks;
+        pQueue->sizeQueue = sizeQueue;
+        pQueue->iFirst = 0;
+    }
+    pQueue->pTasks[(pQueue->iFirst + pQueue->nTasks) % pQueue->sizeQueue].pFunc = pFunc;
+    pQueue->pTasks[(pQueue->iFirst + pQueue->nTasks) % pQueue->sizeQueue].pArg = pArg;
+    pQueue->nTasks++;
+    pthread_mutex_unlock(&pQueue->lock);
+    return 0;
+}
+
+/* take a task from the front (the owner) or the back (a thief) of a queue */
+static int PopTask(TaskQueue *pQueue, Task *pTask, int fromBack)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&pQueue->lock);
+    if(pQueue->nTasks > 0)
+    {
+        if(fromBack)
+            *pTask = pQueue->pTasks[(pQueue->iFirst + pQueue->nTasks - 1) % pQueue->sizeQueue];
+        else
+        {
+            *pTask = pQueue->pTasks[pQueue->iFirst];
+            pQueue->iFirst = (pQueue->iFirst + 1) % pQueue->sizeQueue;
+        }
+        pQueue->nTasks--;
+        found = 1;
+    }
+    pthread_mutex_unlock(&pQueue->lock);
+    return found;
+}
+
+/* find work for worker iWorker: its own queue first, then the others */
+static int GetTask(SMS_ThreadPool *pPool, int iWorker, Task *pTask)
+{
+    int i;
+
+    if(PopTask(&pPool->pQueues[iWorker], pTask, 0))
+        return 1;
+    for(i = 1; i < pPool->nThreads; i++)
+        if(PopTask(&pPool->pQueues[(iWorker + i) % pPool->nThreads], pTask, 1))
+            return 1;
+    return 0;
+}
+
+static void *WorkerThread(void *pData)
+{
+    Worker *pWorker = (Worker *)pData;
+    SMS_ThreadPool *pPool = pWorker->pPool;
+    Task task;
+    char *pChError;
+
+    pCurrentWorker = pWorker;
+    while(1)
+    {
+        if(GetTask(pPool, pWorker->iWorker, &task))
+        {
+            pthread_mutex_lock(&pPool->lock);
+            pPool->nQueued--;
+            pthread_mutex_unlock(&pPool->lock);
+
+            task.pFunc(task.pArg);
+            pChError = sms_errorString();
+
+            pthread_mutex_lock(&pPool->lock);
+            if(pChError && !pPool->hasError)
+            {
+                strncpy(pPool->pChError, pChError, sizeof(pPool->pChError) - 1);
+                pPool->hasError = 1;
+            }
+            if(--pPool->nPending == 0)
+                pthread_cond_broadcast(&pPool->doneCond);
+            pthread_mutex_unlock(&pPool->lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&pPool->lock);
+        while(pPool->nQueued == 0 && !pPool->quit)
+            pthread_cond_wait(&pPool->workCond, &pPool->lock);
+        if(pPool->nQueued == 0 && pPool->quit)
+        {
+            pthread_mutex_unlock(&pPool->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pPool->lock);
+    }
+    pCurrentWorker = NULL;
+    return NULL;
+}
+
+/*! \brief number of processors available to this process
+ *
+ * \return the number of online processors, at least 1
+ */
+int sms_numProcessors(void)
+{
+    int nProcessors;
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    nProcessors = info.dwNumberOfProcessors;
+#else
+    nProcessors = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return MAX(1, nProcessors);
+}
+
+/*! \brief create a pool of worker threads
+ *
+ * \param nThreads number of worker threads, 0 for one per processor
+ * \return pointer to the new pool, NULL on error
+ */
+SMS_ThreadPool *sms_createThreadPool(int nThreads)
+{
+    int i;
+    SMS_ThreadPool *pPool;
+
+    if(nThreads <= 0)
+        nThreads = sms_numProcessors();
+
+    if((pPool = (SMS_ThreadPool *)calloc(1, sizeof(SMS_ThreadPool))) == NULL)
+    {
+        sms_error("could not allocate memory for thread pool");
+        return NULL;
+    }
+    pPool->nThreads = nThreads;
+    pPool->pThreads = (pthread_t *)calloc(nThreads, sizeof(pthread_t));
+    pPool->pWorkers = (Worker *)calloc(nThreads, sizeof(Worker));
+    pPool->pQueues = (TaskQueue *)calloc(nThreads, sizeof(TaskQueue));
+    if(pPool->pThreads == NULL || pPool->pWorkers == NULL || pPool->pQueues == NULL)
+    {
+        sms_error("could not allocate memory for thread pool");
+        free(pPool->pThreads);
+        free(pPool->pWorkers);
+        free(pPool->pQueues);
+        free(pPool);
+        return NULL;
+    }
+    pthread_mutex_init(&pPool->lock, NULL);
+    pthread_cond_init(&pPool->workCond, NULL);
+    pthread_cond_init(&pPool->doneCond, NULL);
+
+    for(i = 0; i < nThreads; i++)
+    {
+        pthread_mutex_init(&pPool->pQueues[i].lock, NULL);
+        pPool->pQueues[i].sizeQueue = SIZE_QUEUE_START;
+        pPool->pQueues[i].pTasks = (Task *)malloc(SIZE_QUEUE_START * sizeof(Task));
+        pPool->pWorkers[i].pPool = pPool;
+        pPool->pWorkers[i].iWorker = i;
+    }
+    for(i = 0; i < nThreads; i++)
+    {
+        if(pPool->pQueues[i].pTasks == NULL ||
+           pthread_create(&pPool->pThreads[i], NULL, WorkerThread, &pPool->pWorkers[i]) != 0)
+        {
+            sms_error("could not start worker thread");
+            sms_freeThreadPool(pPool);
+            return NULL;
+        }
+        pPool->nStarted++;
+    }
+    return pPool;
+}
+
+/*! \brief number of worker threads in a pool
+ *
+ * \param pPool pointer to the pool
+ * \return the number of worker threads
+ */
+int sms_threadPoolSize(const SMS_ThreadPool *pPool)
+{
+    return pPool->nThreads;
+}
+
+/*! \brief run a task in a pool
+ *
+ * The task is queued and this function returns immediately. Tasks submitted
+ * from within a task of the same pool go to the queue of the worker running it.
+ *
+ * \param pPool pointer to the pool
+ * \param pFunc function to run
+ * \param pArg argument passed to pFunc
+ * \return 0 on success, -1 on error
+ */
+int sms_threadPoolSubmit(SMS_ThreadPool *pPool, SMS_TaskFunc pFunc, void *pArg)
+{
+    int iQueue;
+
+    if(pCurrentWorker && pCurrentWorker->pPool == pPool)
+        iQueue = pCurrentWorker->iWorker;
+    else
+    {
+        pthread_mutex_lock(&pPool->lock);
+        iQueue = pPool->iNextQueue;
+        pPool->iNextQueue = (pPool->iNextQueue + 1) % pPool->nThreads;
+        pthread_mutex_unlock(&pPool->lock);
+    }
+
+    pthread_mutex_lock(&pPool->lock);
+    pPool->nPending++;
+    pthread_mutex_unlock(&pPool->lock);
+
+    if(PushTask(&pPool->pQueues[iQueue], pFunc, pArg) < 0)
+    {
+        pthread_mutex_lock(&pPool->lock);
+        if(--pPool->nPending == 0)
+            pthread_cond_broadcast(&pPool->doneCond);
+        pthread_mutex_unlock(&pPool->lock);
+        sms_error("could not allocate memory for task");
+        return -1;
+    }
+
+    pthread_mutex_lock(&pPool->lock);
+    pPool->nQueued++;
+    pthread_cond_signal(&pPool->workCond);
+    pthread_mutex_unlock(&pPool->lock);
+    return 0;
+}
+
+/*! \brief wait until all tasks submitted to a pool are done
+ *
+ * If a task left an error on its worker since the last wait, the first one
+ * becomes the error of the calling thread (see sms_errorCheck()).
+ * This must not be called from within a task of the same pool.
+ *
+ * \param pPool pointer to the pool
+ */
+void sms_threadPoolWait(SMS_ThreadPool *pPool)
+{
+    char pChError[256];
+    int hasError;
+
+    pthread_mutex_lock(&pPool->lock);
+    while(pPool->nPending > 0)
+        pthread_cond_wait(&pPool->doneCond, &pPool->lock);
+    if((hasError = pPool->hasError))
+    {
+        memcpy(pChError, pPool->pChError, sizeof(pChError));
+        pPool->hasError = 0;
+    }
+    pthread_mutex_unlock(&pPool->lock);
+    if(hasError)
+        sms_error(pChError);
+}
+
+/*! \brief finish all tasks, stop the worker threads and free a pool
+ *
+ * \param pPool pointer to the pool
+ */
+void sms_freeThreadPool(SMS_ThreadPool *pPool)
+{
+    int i;
+
+    if(pPool == NULL)
+        return;
+
+    pthread_mutex_lock(&pPool->lock);
+    pPool->quit = 1;
+    pthread_cond_broadcast(&pPool->workCond);
+    pthread_mutex_unlock(&pPool->lock);
+
+    for(i = 0; i < pPool->nStarted; i++)
+        pthread_join(pPool->pThreads[i], NULL);
+
+    for(i = 0; i < pPool->nThreads; i++)
+    {
+        pthread_mutex_destroy(&pPool->pQueues[i].lock);
+        free(pPool->pQueues[i].pTasks);
+    }
+    pthread_mutex_destroy(&pPool->lock);
+    pthread_cond_destroy(&pPool->workCond);
+    pthread_cond_destroy(&pPool->doneCond);
+    free(pPool->pThreads);
+    free(pPool->pWorkers);
+    free(pPool->pQueues);
+    free(pPool);
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2008 MUSIC TECHNOLOGY GROUP (MTG)
+ *                         UNIVERSITAT POMPEU FABRA
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+/*! \file trackModel.c
+ * \brief an SMS model stored track by track
+ *
+ * An SMS_Model stores the frames one after the other, so the values of one
+ * track are a frame apart. An SMS_TrackModel stores the same values the
+ * other way around, as the transpose of the frames: each value of a frame
+ * (the frequency of a track, a stochastic coefficient, ...) is a row of
+ * nFrames values, one for every frame. The values of a track over time are
+ * then contiguous, and going through them is a linear scan.
+ */
+#include "sms.h"
+
+#define TRANSPOSE_BLOCK 32 /* size of the square blocks a matrix is transposed in */
+
+/* transpose the nRows x nColumns matrix pIn to pOut, a block at a time so
+ * that both stay in the cache */
+static void Transpose(const sfloat *pIn, sfloat *pOut, int nRows, int nColumns)
+{
+    int iRow, iColumn, iRowBlock, iColumnBlock;
+
+    for(iRowBlock = 0; iRowBlock < nRows; iRowBlock += TRANSPOSE_BLOCK)
+        for(iColumnBlock = 0; iColumnBlock < nColumns; iColumnBlock += TRANSPOSE_BLOCK)
+        {
+            int nRowsBlock = MIN(TRANSPOSE_BLOCK, nRows - iRowBlock);
+            int nColumnsBlock = MIN(TRANSPOSE_BLOCK, nColumns - iColumnBlock);
+
+            for(iRow = iRowBlock; iRow < iRowBlock + nRowsBlock; iRow++)
+                for(iColumn = iColumnBlock; iColumn < iColumnBlock + nColumnsBlock; iColumn++)
+                    pOut[(size_t)iColumn * nRows + iRow] = pIn[(size_t)iRow * nColumns + iColumn];
+        }
+}
+
+/* the row of the track model with the values at pValue in a frame */
+static sfloat *Row(const SMS_TrackModel *pTracks, const SMS_Data *pSmsFrame, const sfloat *pValue)
+{
+    if(pValue == NULL)
+        return NULL;
+    return pTracks->pValues + (size_t)(pValue - pSmsFrame->pSmsData) * pTracks->pSmsHeader->nFrames;
+}
+
+/*! \brief initialize an SMS track model with all of its values 0
+ *
+ * Free with sms_freeTrackModel().
+ *
+ * \param pTracks      the track model to initialize
+ * \param pSmsHeader header of the frames of the model
+ * \param nFrames       number of frames
+ * \return 0 on success, -1 on error
+ */
+int sms_initTrackModel(SMS_TrackModel *pTracks, const SMS_Header *pSmsHeader, int nFrames)
+{
+    SMS_Model model;
+    SMS_Data smsFrame;
+
+    memset(pTracks, 0, sizeof(SMS_TrackModel));
+    if(nFrames <= 0)
+    {
+        sms_error("number of frames <= 0");
+        return -1;
+    }
+    /* the header is the one of a model, which also gives the layout of the frames */
+    if(sms_initModel(&model, pSmsHeader) < 0)
+        return -1;
+    pTracks->pSmsHeader = model.pSmsHeader;
+    pTracks->pSmsHeader->nFrames = nFrames;
+    pTracks->nValues = pTracks->pSmsHeader->iFrameBSize / sizeof(sfloat);
+    if((pTracks->pValues = (sfloat *)calloc((size_t)nFrames * pTracks->nValues, sizeof(sfloat))) == NULL)
+    {
+        sms_freeTrackModel(pTracks);
+        sms_error("cannot allocate memory for the SMS tracks");
+        return -1;
+    }
+
+    if(sms_allocFrameH(pTracks->pSmsHeader, &smsFrame) < 0)
+    {
+        sms_freeTrackModel(pTracks);
+        return -1;
+    }
+    pTracks->pFSinFreq = Row(pTracks, &smsFrame, smsFrame.pFSinFreq);
+    pTracks->pFSinAmp = Row(pTracks, &smsFrame, smsFrame.pFSinAmp);
+    pTracks->pFSinPha = Row(pTracks, &smsFrame, smsFrame.pFSinPha);
+    pTracks->pFStocCoeff = Row(pTracks, &smsFrame, smsFrame.pFStocCoeff);
+    pTracks->pResPhase = Row(pTracks, &smsFrame, smsFrame.pResPhase);
+    pTracks->pFStocGain = Row(pTracks, &smsFrame, smsFrame.pFStocGain);
+    pTracks->pSpecEnv = Row(pTracks, &smsFrame, smsFrame.pSpecEnv);
+    sms_freeFrame(&smsFrame);
+    return 0;
+}
+
+/*! \brief convert an SMS model to a track model
+ *
+ * \param pModel       the model
+ * \param pTracks      the track model to initialize with the frames of the model
+ * \return 0 on success, -1 on error
+ */
+int sms_modelToTracks(const SMS_Model *pModel, SMS_TrackModel *pTracks)
+{
+    if(sms_initTrackModel(pTracks, pModel->pSmsHeader, pModel->pSmsHeader->nFrames) < 0)
+        return -1;
+    Transpose((const sfloat *)pModel->pFrames, pTracks->pValues, pModel->pSmsHeader->nFrames,
+              pTracks->nValues);
+    return 0;
+}
+
+/*! \brief convert a track model to an SMS model
+ *
+ * \param pTracks      the track model
+ * \param pModel       the model to initialize with the frames of the track model
+ * \return 0 on success, -1 on error
+ */
+int sms_tracksToModel(const SMS_TrackModel *pTracks, SMS_Model *pModel)
+{
+    int nFrames = pTracks->pSmsHeader->nFrames;
+
+    if(sms_initModel(pModel, pTracks->pSmsHeader) < 0)
+        return -1;
+    if((pModel->pFrames = (char *)malloc((size_t)nFrames * pModel->pSmsHeader->iFrameBSize)) == NULL)
+    {
+        sms_freeModel(pModel);
+        sms_error("cannot allocate memory for the SMS frames");
+        return -1;
+    }
+    pModel->nAllocFrames = nFrames;
+    pModel->pSmsHeader->nFrames = nFrames;
+    Transpose(pTracks->pValues, (sfloat *)pModel->pFrames, pTracks->nValues, nFrames);
+    return 0;
+}
+
+/*! \brief free an SMS track model
+ *
+ * \param pTracks      the track model
+ */
+void sms_freeTrackModel(SMS_TrackModel *pTracks)
+{
+    if(pTracks->pValues)
+        free(pTracks->pValues);
+    if(pTracks->pSmsHeader)
+        free(pTracks->pSmsHeader);
+    memset(pTracks, 0, sizeof(SMS_TrackModel));
+}
@@ -21,37 +21,575 @@
 /*! \file transforms.c
  * \brief routines for different Fast Fourier Transform Algorithms
  *
+ * All FFTs go through a plan for their size, made the first time the size
+ * is used and shared by all threads afterwards. The plans use the bundled
+ * OOURA routines, or FFTW when the library is built with SMS_FFT_FFTW
+ * (the SMS_FFT_BACKEND option of CMake). Both give the spectra in the
+ * packing of the OOURA rdft(), so the backend makes no difference to the
+ * callers.
  */
 
 #include "sms.h"
 #include "OOURA.h"
+#include <pthread.h>
+#ifdef SMS_FFT_FFTW
+#include <fftw3.h>
+#ifdef DOUBLE_PRECISION
+#define FFTW(name) fftw_ ## name
+#else
+#define FFTW(name) fftwf_ ## name
+#endif
+#endif
 
-static int ip[NMAXSQRT +2];
+#define SMS_FFT_MAX_LOG2 16 /* log2 of the largest FFT size, SMS_MAX_SIZE_FFT = 2 * NMAX */
+#define SMS_FFT_BATCH_PLANS 8 /* FFTW plans of several frames kept for each size */
+
+#ifdef SMS_FFT_FFTW
+/* the FFTW plans for nFrames frames iStride samples apart */
+typedef struct
+{
+        int nFrames;
+        int iStride;
+        int isAligned;         /* whether the first frame is aligned as by FFTW(malloc) */
+        FFTW(plan) forward;
+        FFTW(plan) backward;
+} BatchPlan;
+#endif
+
+/* an FFT of one size */
+struct SMS_FFTPlan
+{
+        int sizeFft;
+#ifdef SMS_FFT_FFTW
+        /* real to complex and complex to real, [0] for any real array, [1]
+         * for the real arrays aligned as by FFTW(malloc), which can use SIMD */
+        FFTW(plan) forward[2];
+        FFTW(plan) backward[2];
+        /* the layouts of several frames used so far, made with planLock held */
+        BatchPlan batches[SMS_FFT_BATCH_PLANS];
+        int nBatches;
+#endif
+};
+
+static SMS_FFTPlan *pPlans[SMS_FFT_MAX_LOG2 + 1];
+static pthread_mutex_t planLock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef SMS_FFT_FFTW
+/* FFTW transforms the real arrays to a separate complex spectrum, which is
+ * a buffer of each thread. It grows to the largest spectrum the thread
+ * has used and is freed when the thread ends. */
+typedef struct
+{
+        size_t size;
+        FFTW(complex) *pSpectrum;
+} SpectrumBuffer;
+
+static pthread_key_t spectrumKey;
+static pthread_once_t spectrumOnce = PTHREAD_ONCE_INIT;
+
+static void FreeSpectrumBuffer(void *pData)
+{
+        SpectrumBuffer *pBuffer = (SpectrumBuffer *) pData;
+
+        if(pBuffer->pSpectrum)
+                FFTW(free)(pBuffer->pSpectrum);
+        free(pBuffer);
+}
+
+static void MakeSpectrumKey(void)
+{
+        pthread_key_create(&spectrumKey, FreeSpectrumBuffer);
+}
+
+/* the spectrum buffer of the calling thread, of at least size bins */
+static FFTW(complex) *GetSpectrumBuffer(size_t size)
+{
+        SpectrumBuffer *pBuffer;
+
+        pthread_once(&spectrumOnce, MakeSpectrumKey);
+        if((pBuffer = (SpectrumBuffer *) pthread_getspecific(spectrumKey)) == NULL)
+        {
+                if((pBuffer = (SpectrumBuffer *) calloc(1, sizeof(SpectrumBuffer))) == NULL)
+                        return NULL;
+                pthread_setspecific(spectrumKey, pBuffer);
+        }
+        if(pBuffer->size < size)
+        {
+                if(pBuffer->pSpectrum)
+                        FFTW(free)(pBuffer->pSpectrum);
+                pBuffer->pSpectrum = (FFTW(complex) *) FFTW(malloc)(size * sizeof(FFTW(complex)));
+                pBuffer->size = pBuffer->pSpectrum ? size : 0;
+        }
+        return pBuffer->pSpectrum;
+}
+#endif
+
+#ifndef SMS_FFT_FFTW
+/* The OOURA cos/sin table is made once for the largest FFT size and is only
+ * read afterwards, which is fine for all smaller sizes as well.  rdft() also
+ * uses ip[2...] as a work area for the bit reversal, so every call gets its
+ * own copy of ip on the stack.  This way FFTs can run in several threads. */
+static int ipTable[2] = {0, 0};
 static sfloat w[NMAX * 5 / 4];
 
+/* make the OOURA tables, called with planLock held */
+static void MakeTables(void)
+{
+        int ip[NMAXSQRT + 2];
+
+        if(ipTable[0] != 0)
+                return;
+        ip[0] = ip[1] = 0;
+        makewt(NMAX >> 1, ip, w);
+        makect(NMAX >> 1, ip, w + (NMAX >> 1));
+        ipTable[1] = ip[1];
+        ipTable[0] = ip[0];
+}
+#endif
+
+/*! \brief prepare the tables for the Fast Fourier Transforms
+ *
+ * This is done by sms_init(). The OOURA tables are always made for the
+ * largest size, 2 * NMAX, so that they never change once FFTs are running.
+ * The plans for the single sizes are made when they are first used.
+ *
+ * \param sizeFft         largest FFT size that will be used (at most 2 * NMAX)
+ * \return 0 on success, -1 on error
+ */
+int sms_prepFFT(int sizeFft)
+{
+        if(sizeFft > (NMAX << 1))
+        {
+                sms_error("fft size too large");
+                return -1;
+        }
+#ifndef SMS_FFT_FFTW
+        pthread_mutex_lock(&planLock);
+        MakeTables();
+        pthread_mutex_unlock(&planLock);
+#endif
+        return 0;
+}
+
+/* make the plan for an FFT size, called with planLock held */
+static SMS_FFTPlan *MakePlan(int sizeFft)
+{
+        SMS_FFTPlan *pPlan = (SMS_FFTPlan *) malloc(sizeof(SMS_FFTPlan));
+
+        if(pPlan == NULL)
+                return NULL;
+        pPlan->sizeFft = sizeFft;
+#ifdef SMS_FFT_FFTW
+        {
+                /* only used for planning, the transforms get their own arrays */
+                sfloat *pReal = (sfloat *) FFTW(malloc)(sizeFft * sizeof(sfloat));
+                FFTW(complex) *pComplex = (FFTW(complex) *) FFTW(malloc)((sizeFft / 2 + 1) * sizeof(FFTW(complex)));
+                int i, isMade = 1;
+
+                for(i = 0; i < 2; i++)
+                {
+                        unsigned int flags = FFTW_ESTIMATE | (i ? 0 : FFTW_UNALIGNED);
+
+                        pPlan->forward[i] = pPlan->backward[i] = NULL;
+                        if(pReal && pComplex)
+                        {
+                                pPlan->forward[i] = FFTW(plan_dft_r2c_1d)(sizeFft, pReal, pComplex, flags);
+                                pPlan->backward[i] = FFTW(plan_dft_c2r_1d)(sizeFft, pComplex, pReal, flags);
+                        }
+                        isMade = isMade && pPlan->forward[i] && pPlan->backward[i];
+                }
+                if(pReal)
+                        FFTW(free)(pReal);
+                if(pComplex)
+                        FFTW(free)(pComplex);
+                if(!isMade)
+                {
+                        for(i = 0; i < 2; i++)
+                        {
+                                if(pPlan->forward[i])
+                                        FFTW(destroy_plan)(pPlan->forward[i]);
+                                if(pPlan->backward[i])
+                                        FFTW(destroy_plan)(pPlan->backward[i]);
+                        }
+                        free(pPlan);
+                        return NULL;
+                }
+                pPlan->nBatches = 0;
+        }
+#else
+        MakeTables();
+#endif
+        return pPlan;
+}
+
+/*! \brief get the plan for an FFT size
+ *
+ * The plan is made the first time a size is asked for, and is then kept
+ * until sms_clearFFT(). Plans can be used from any number of threads at
+ * the same time.
+ *
+ * \param sizeFft         size of the FFT in samples (a power of 2, 2 <= sizeFft <= 2 * NMAX)
+ * \return the plan, NULL on error
+ */
+const SMS_FFTPlan *sms_getFFTPlan(int sizeFft)
+{
+        SMS_FFTPlan *pPlan;
+        int iLog2 = 1;
+
+        while((1 << iLog2) < sizeFft && iLog2 < SMS_FFT_MAX_LOG2)
+                iLog2++;
+        if(sizeFft != (1 << iLog2))
+        {
+                sms_error("fft size has to be a power of 2 not larger than 2 * NMAX");
+                return NULL;
+        }
+
+        pthread_mutex_lock(&planLock);
+        if(pPlans[iLog2] == NULL)
+                pPlans[iLog2] = MakePlan(sizeFft);
+        pPlan = pPlans[iLog2];
+        pthread_mutex_unlock(&planLock);
+
+        if(pPlan == NULL)
+                sms_error("could not make the fft plan");
+        return pPlan;
+}
+
+/*! \brief free all FFT plans
+ *
+ * No plan returned by sms_getFFTPlan() may be in use.
+ */
+void sms_clearFFT(void)
+{
+        int i;
+
+        pthread_mutex_lock(&planLock);
+        for(i = 0; i <= SMS_FFT_MAX_LOG2; i++)
+        {
+                if(pPlans[i] == NULL)
+                        continue;
+#ifdef SMS_FFT_FFTW
+                FFTW(destroy_plan)(pPlans[i]->forward[0]);
+                FFTW(destroy_plan)(pPlans[i]->backward[0]);
+                FFTW(destroy_plan)(pPlans[i]->forward[1]);
+                FFTW(destroy_plan)(pPlans[i]->backward[1]);
+                while(pPlans[i]->nBatches > 0)
+                {
+                        BatchPlan *pBatch = &pPlans[i]->batches[--pPlans[i]->nBatches];
+
+                        FFTW(destroy_plan)(pBatch->forward);
+                        FFTW(destroy_plan)(pBatch->backward);
+                }
+#endif
+                free(pPlans[i]);
+                pPlans[i] = NULL;
+        }
+        pthread_mutex_unlock(&planLock);
+}
+
+/*! \brief name of the FFT implementation the library was built with
+ *
+ * \return "OOURA" or "FFTW"
+ */
+const char *sms_fftBackend(void)
+{
+#ifdef SMS_FFT_FFTW
+        return "FFTW";
+#else
+        return "OOURA";
+#endif
+}
+
+#ifdef SMS_FFT_FFTW
+/* distance in bins between the spectra of a batch, even so that every
+ * spectrum is aligned as the first */
+static int SpectrumDistance(int sizeFft)
+{
+        return (sizeFft / 2 + 2) & ~1;
+}
+
+/* the FFTW plan for an array: the aligned one when it is aligned as the
+ * arrays the plans were made with */
+static FFTW(plan) FftwPlan(const FFTW(plan) *pPlans, const sfloat *pArray)
+{
+        return pPlans[FFTW(alignment_of)((sfloat *) pArray) == 0];
+}
+
+/* put an FFTW spectrum to pArray, packed as by rdft() */
+static void PackSpectrum(int sizeFft, FFTW(complex) *pSpectrum, sfloat *pArray)
+{
+        int i;
+
+        pArray[0] = pSpectrum[0][0];
+        pArray[1] = pSpectrum[sizeFft / 2][0];
+        for(i = 1; i < sizeFft / 2; i++)
+        {
+                pArray[2 * i] = pSpectrum[i][0];
+                pArray[2 * i + 1] = -pSpectrum[i][1];
+        }
+}
+
+/* put a spectrum packed as by rdft() to an FFTW spectrum */
+static void UnpackSpectrum(int sizeFft, const sfloat *pArray, FFTW(complex) *pSpectrum)
+{
+        int i;
+
+        pSpectrum[0][0] = pArray[0];
+        pSpectrum[0][1] = 0;
+        pSpectrum[sizeFft / 2][0] = pArray[1];
+        pSpectrum[sizeFft / 2][1] = 0;
+        for(i = 1; i < sizeFft / 2; i++)
+        {
+                pSpectrum[i][0] = pArray[2 * i];
+                pSpectrum[i][1] = -pArray[2 * i + 1];
+        }
+}
+
+/* scale the result of the FFTW inverse FFT as the one of rdft() */
+static void ScaleInverse(int sizeFft, sfloat *pArray)
+{
+        int i;
+
+        for(i = 0; i < sizeFft; i++)
+                pArray[i] *= .5;
+}
+
+/* make the plans of a batch layout, called with planLock held */
+static int MakeBatchPlan(BatchPlan *pBatch, int sizeFft, int nFrames, int iStride, int isAligned)
+{
+        int distance = SpectrumDistance(sizeFft);
+        unsigned int flags = FFTW_ESTIMATE | (isAligned ? 0 : FFTW_UNALIGNED);
+        /* only used for planning, the transforms get their own arrays */
+        sfloat *pReal = (sfloat *) FFTW(malloc)(((size_t) (nFrames - 1) * iStride + sizeFft) * sizeof(sfloat));
+        FFTW(complex) *pComplex = (FFTW(complex) *) FFTW(malloc)((size_t) nFrames * distance * sizeof(FFTW(complex)));
+
+        pBatch->nFrames = nFrames;
+        pBatch->iStride = iStride;
+        pBatch->isAligned = isAligned;
+        pBatch->forward = pBatch->backward = NULL;
+        if(pReal && pComplex)
+        {
+                pBatch->forward = FFTW(plan_many_dft_r2c)(1, &sizeFft, nFrames, pReal, NULL, 1, iStride,
+                                                          pComplex, NULL, 1, distance, flags);
+                pBatch->backward = FFTW(plan_many_dft_c2r)(1, &sizeFft, nFrames, pComplex, NULL, 1, distance,
+                                                           pReal, NULL, 1, iStride, flags);
+        }
+        if(pReal)
+                FFTW(free)(pReal);
+        if(pComplex)
+                FFTW(free)(pComplex);
+        if(pBatch->forward && pBatch->backward)
+                return 0;
+        if(pBatch->forward)
+                FFTW(destroy_plan)(pBatch->forward);
+        if(pBatch->backward)
+                FFTW(destroy_plan)(pBatch->backward);
+        return -1;
+}
+
+/* the plans for a batch of frames, made the first time its layout is
+ * used. NULL if they cannot be made, or if the size has too many layouts
+ * already: those batches are transformed one frame at a time. */
+static const BatchPlan *GetBatchPlan(const SMS_FFTPlan *pPlan, int nFrames, int iStride, const sfloat *pFrames)
+{
+        /* the batches are the only part of a plan that changes once it is made */
+        SMS_FFTPlan *pSharedPlan = (SMS_FFTPlan *) pPlan;
+        int isAligned = FFTW(alignment_of)((sfloat *) pFrames) == 0;
+        const BatchPlan *pBatch = NULL;
+        int i;
+
+        pthread_mutex_lock(&planLock);
+        for(i = 0; i < pSharedPlan->nBatches && pBatch == NULL; i++)
+                if(pSharedPlan->batches[i].nFrames == nFrames && pSharedPlan->batches[i].iStride == iStride &&
+                   pSharedPlan->batches[i].isAligned == isAligned)
+                        pBatch = &pSharedPlan->batches[i];
+        if(pBatch == NULL && pSharedPlan->nBatches < SMS_FFT_BATCH_PLANS &&
+           MakeBatchPlan(&pSharedPlan->batches[pSharedPlan->nBatches], pPlan->sizeFft,
+                         nFrames, iStride, isAligned) == 0)
+                pBatch = &pSharedPlan->batches[pSharedPlan->nBatches++];
+        pthread_mutex_unlock(&planLock);
+        return pBatch;
+}
+
+/* the spectrum buffer of the calling thread for nFrames spectra, NULL with an error if it cannot be had */
+static FFTW(complex) *GetSpectra(int sizeFft, int nFrames)
+{
+        FFTW(complex) *pSpectrum = GetSpectrumBuffer((size_t) nFrames * SpectrumDistance(sizeFft));
+
+        if(pSpectrum == NULL)
+                sms_error("could not allocate memory for the fft");
+        return pSpectrum;
+}
+#endif
+
+/*! \brief Forward Fast Fourier Transform with a plan
+ *
+ * Operation is in place. The result is packed as by the OOURA rdft():
+ * pArray[0] is the real part of bin 0, pArray[1] the real part of bin
+ * sizeFft / 2, and pArray[2k], pArray[2k+1] are the real part and the
+ * negated imaginary part of bin k.
+ *
+ * \param pPlan          plan for the size of the FFT \see sms_getFFTPlan
+ * \param pArray         pointer to real array
+ */
+void sms_fftPlanned(const SMS_FFTPlan *pPlan, sfloat *pArray)
+{
+#ifdef SMS_FFT_FFTW
+        FFTW(complex) *pSpectrum = GetSpectra(pPlan->sizeFft, 1);
+
+        if(pSpectrum == NULL)
+                return;
+        FFTW(execute_dft_r2c)(FftwPlan(pPlan->forward, pArray), pArray, pSpectrum);
+        PackSpectrum(pPlan->sizeFft, pSpectrum, pArray);
+#else
+        int ip[NMAXSQRT + 2];
+
+        ip[0] = ipTable[0];
+        ip[1] = ipTable[1];
+        rdft(pPlan->sizeFft, 1, pArray, ip, w);
+#endif
+}
+
+/*! \brief Inverse Fast Fourier Transform with a plan
+ *
+ * Operation is in place, on a spectrum packed as sms_fftPlanned() leaves
+ * it. Like the OOURA rdft(), the result is not scaled: a forward and
+ * inverse transform multiply the signal by sizeFft / 2.
+ *
+ * \param pPlan          plan for the size of the FFT \see sms_getFFTPlan
+ * \param pArray         pointer to real array
+ */
+void sms_ifftPlanned(const SMS_FFTPlan *pPlan, sfloat *pArray)
+{
+#ifdef SMS_FFT_FFTW
+        FFTW(complex) *pSpectrum = GetSpectra(pPlan->sizeFft, 1);
+
+        if(pSpectrum == NULL)
+                return;
+        UnpackSpectrum(pPlan->sizeFft, pArray, pSpectrum);
+        FFTW(execute_dft_c2r)(FftwPlan(pPlan->backward, pArray), pSpectrum, pArray);
+        ScaleInverse(pPlan->sizeFft, pArray);
+#else
+        int ip[NMAXSQRT + 2];
+
+        ip[0] = ipTable[0];
+        ip[1] = ipTable[1];
+        rdft(pPlan->sizeFft, -1, pArray, ip, w);
+#endif
+}
+
+/*! \brief Forward Fast Fourier Transforms of several frames
+ *
+ * The same as sms_fftPlanned() on every frame. With FFTW all the frames go
+ * through one plan, made the first time their number and layout are used.
+ * Each size keeps the plans of SMS_FFT_BATCH_PLANS layouts, the batches of
+ * other layouts are transformed one frame at a time. With the OOURA FFT
+ * the frames are transformed one after the other, which is no faster than
+ * calling sms_fftPlanned() on each.
+ *
+ * \param pPlan          plan for the size of the FFTs \see sms_getFFTPlan
+ * \param nFrames        number of frames
+ * \param pFrames        pointer to the first frame, every frame is transformed in place
+ * \param iStride        distance in samples from one frame to the next, at least the
+ *                       size of the FFT, or 0 if they are contiguous
+ */
+void sms_fftBatch(const SMS_FFTPlan *pPlan, int nFrames, sfloat *pFrames, int iStride)
+{
+#ifdef SMS_FFT_FFTW
+        FFTW(complex) *pSpectrum;
+        const BatchPlan *pBatch;
+#endif
+        int iFrame;
+
+        if(iStride <= 0)
+                iStride = pPlan->sizeFft;
+#ifdef SMS_FFT_FFTW
+        if(nFrames > 1 && (pBatch = GetBatchPlan(pPlan, nFrames, iStride, pFrames)) != NULL)
+        {
+                if((pSpectrum = GetSpectra(pPlan->sizeFft, nFrames)) == NULL)
+                        return;
+                FFTW(execute_dft_r2c)(pBatch->forward, pFrames, pSpectrum);
+                for(iFrame = 0; iFrame < nFrames; iFrame++)
+                        PackSpectrum(pPlan->sizeFft, pSpectrum + (size_t) iFrame * SpectrumDistance(pPlan->sizeFft),
+                                     pFrames + (long) iFrame * iStride);
+                return;
+        }
+#endif
+        for(iFrame = 0; iFrame < nFrames; iFrame++)
+                sms_fftPlanned(pPlan, pFrames + (long) iFrame * iStride);
+}
+
+/*! \brief Inverse Fast Fourier Transforms of several frames
+ *
+ * The same as sms_ifftPlanned() on every frame. With FFTW all the frames go
+ * through one plan, made the first time their number and layout are used.
+ * Each size keeps the plans of SMS_FFT_BATCH_PLANS layouts, the batches of
+ * other layouts are transformed one frame at a time. With the OOURA FFT
+ * the frames are transformed one after the other, which is no faster than
+ * calling sms_ifftPlanned() on each.
+ *
+ * \param pPlan          plan for the size of the FFTs \see sms_getFFTPlan
+ * \param nFrames        number of frames
+ * \param pFrames        pointer to the first frame, every frame is transformed in place
+ * \param iStride        distance in samples from one frame to the next, at least the
+ *                       size of the FFT, or 0 if they are contiguous
+ */
+void sms_ifftBatch(const SMS_FFTPlan *pPlan, int nFrames, sfloat *pFrames, int iStride)
+{
+#ifdef SMS_FFT_FFTW
+        FFTW(complex) *pSpectrum;
+        const BatchPlan *pBatch;
+#endif
+        int iFrame;
+
+        if(iStride <= 0)
+                iStride = pPlan->sizeFft;
+#ifdef SMS_FFT_FFTW
+        if(nFrames > 1 && (pBatch = GetBatchPlan(pPlan, nFrames, iStride, pFrames)) != NULL)
+        {
+                if((pSpectrum = GetSpectra(pPlan->sizeFft, nFrames)) == NULL)
+                        return;
+                for(iFrame = 0; iFrame < nFrames; iFrame++)
+                        UnpackSpectrum(pPlan->sizeFft, pFrames + (long) iFrame * iStride,
+                                       pSpectrum + (size_t) iFrame * SpectrumDistance(pPlan->sizeFft));
+                FFTW(execute_dft_c2r)(pBatch->backward, pSpectrum, pFrames);
+                for(iFrame = 0; iFrame < nFrames; iFrame++)
+                        ScaleInverse(pPlan->sizeFft, pFrames + (long) iFrame * iStride);
+                return;
+        }
+#endif
+        for(iFrame = 0; iFrame < nFrames; iFrame++)
+                sms_ifftPlanned(pPlan, pFrames + (long) iFrame * iStride);
+}
+
 /*! \brief Forward Fast Fourier Transform
  *
- * function to call the OOURA routines to calculate
- * the forward FFT.  Operation is in place.
- * \todo if sizeFft != power of 2, there is a silent crash.. cuidado!
+ * function to calculate the forward FFT with the plan for its size.
+ * Operation is in place.
  *
  * \param sizeFft         size of the FFT in samples (must be a power of 2 >= 2)
  * \param pArray         pointer to real array (n >= 2, n = power of 2)
  */
 void sms_fft(  int sizeFft, sfloat *pArray)
 {
-        rdft( sizeFft, 1, pArray, ip, w);
+        const SMS_FFTPlan *pPlan = sms_getFFTPlan(sizeFft);
+
+        if(pPlan)
+                sms_fftPlanned(pPlan, pArray);
 }
 
 /*! \brief Inverse Forward Fast Fourier Transform
  *
- * function to call the OOURA routines to calculate
- * the Inverse FFT.  Operation is in place.
+ * function to calculate the Inverse FFT with the plan for its size.
+ * Operation is in place.
  *
  * \param sizeFft         size of the FFT in samples (must be a power of 2 >= 2)
  * \param pArray         pointer to real array (n >= 2, n = power of 2)
  */
 void sms_ifft(  int sizeFft, sfloat *pArray)
 {
-        rdft( sizeFft, -1, pArray, ip, w);
+        const SMS_FFTPlan *pPlan = sms_getFFTPlan(sizeFft);
+
+        if(pPlan)
+                sms_ifftPlanned(pPlan, pArray);
 }
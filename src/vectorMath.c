@@ -0,0 +1,534 @@
+/*
+ * Copyright (c) 2008 MUSIC TECHNOLOGY GROUP (MTG)
+ *                         UNIVERSITAT POMPEU FABRA
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+/*! \file vectorMath.c
+ * \brief vectorized conversions of whole spectra (magnitude, phase, dB),
+ * of interleaved sound, and the search of spectral peaks
+ *
+ * The kernels are written once with the vector types of GCC (8 floats),
+ * which the compiler turns into SSE2 or NEON instructions. On x86 a second
+ * copy is compiled for AVX2 and used when the processor has it. Other
+ * compilers and double precision builds use the scalar functions of the
+ * math library.
+ *
+ * The magnitudes are exact (the same as sqrtf). The phase, log and exp use
+ * the polynomial approximations of the Cephes library, accurate to:
+ * - phase: 5e-7 radians
+ * - magnitude to dB: 1e-5 dB for results below 256 dB (half a float step
+ *   is 7.6e-6 dB there), half a float step plus 1e-6 dB above
+ * - dB to magnitude: 2e-6 relative, for dB values up to 200
+ */
+#include "sms.h"
+
+#if defined(__GNUC__) && (__GNUC__ >= 9 || defined(__clang__)) && !defined(DOUBLE_PRECISION)
+#define SMS_VECTOR_MATH
+#endif
+
+#ifdef SMS_VECTOR_MATH
+
+#define VECTOR_SIZE 8
+
+typedef float v8sf __attribute__ ((vector_size (32)));
+typedef int v8si __attribute__ ((vector_size (32)));
+
+#define VECTOR_INLINE static inline __attribute__ ((always_inline))
+
+VECTOR_INLINE v8sf Splat(float x)
+{
+    v8sf v = {x, x, x, x, x, x, x, x};
+    return v;
+}
+
+/* a where the mask is set, b elsewhere */
+VECTOR_INLINE v8sf Select(v8si mask, v8sf a, v8sf b)
+{
+    return (v8sf)(((v8si)a & mask) | ((v8si)b & ~mask));
+}
+
+VECTOR_INLINE v8sf Abs(v8sf x)
+{
+    return (v8sf)((v8si)x & 0x7fffffff);
+}
+
+VECTOR_INLINE v8sf Sqrt(v8sf x)
+{
+    v8sf r;
+    int i;
+
+    /* compiled to a vector square root */
+    for(i = 0; i < VECTOR_SIZE; i++)
+        r[i] = __builtin_sqrtf(x[i]);
+    return r;
+}
+
+/* atan2(y, x), with the Cephes atanf polynomial on [0, tan(pi/8)] */
+VECTOR_INLINE v8sf Atan2(v8sf y, v8sf x)
+{
+    v8sf ax = Abs(x), ay = Abs(y);
+    v8si ySteep = ay > ax;
+    v8sf fMax = Select(ySteep, ay, ax), fMin = Select(ySteep, ax, ay);
+    v8sf a = Select(fMax > Splat(0.f), fMin / Select(fMax > Splat(0.f), fMax, Splat(1.f)), Splat(0.f));
+    v8si reduce = a > Splat(0.4142135623730950f);
+    v8sf t = Select(reduce, (a - 1.f) / (a + 1.f), a);
+    v8sf z = t * t;
+    v8sf r = ((((8.05374449538e-2f * z - 1.38776856032e-1f) * z + 1.99777106478e-1f) * z
+               - 3.33329491539e-1f) * z * t + t);
+
+    r = Select(reduce, r + 0.7853981633974483f, r);
+    r = Select(ySteep, 1.5707963267948966f - r, r);
+    r = Select((v8si)x < 0, 3.1415926535897932f - r, r);
+    return (v8sf)((v8si)r ^ ((v8si)y & (int)0x80000000));
+}
+
+/* 20 log10(x) - fDBOffsetHi - fDBOffsetLo for positive normal numbers,
+ * with the Cephes logf polynomial on the mantissa. The exponent times
+ * 20 log10(2) and the offset are split in a part that adds up exactly
+ * (multiples of 2^-12) and a small rest, so only the last sum rounds a
+ * value of the size of the result */
+VECTOR_INLINE v8sf DB(v8sf x, float fDBOffsetHi, float fDBOffsetLo)
+{
+    v8si xi = (v8si)x;
+    v8sf e = __builtin_convertvector(((xi >> 23) & 0xff) - 126, v8sf);
+    v8sf m = (v8sf)((xi & 0x807fffff) | 0x3f000000); /* in [0.5, 1) */
+    v8si small = m < 0.707106781186547524f;
+    v8sf z, y;
+
+    e = Select(small, e - 1.f, e);
+    m = Select(small, m + m, m) - 1.f;
+    z = m * m;
+    y = ((((((((7.0376836292e-2f * m - 1.1514610310e-1f) * m + 1.1676998740e-1f) * m
+              - 1.2420140846e-1f) * m + 1.4249322787e-1f) * m - 1.6668057665e-1f) * m
+           + 2.0000714765e-1f) * m - 2.4999993993e-1f) * m + 3.3333331174e-1f) * m * z;
+    y += -0.5f * z;
+
+    /* log(1 + m) in dB, plus the exponent in dB, 6.0205078125 having 15 bits */
+    return (e * 6.0205078125f - fDBOffsetHi)
+        + ((e * 9.21007796241824e-5f - fDBOffsetLo) + 8.685889638065035f * (m + y));
+}
+
+/* exponential, Cephes expf */
+VECTOR_INLINE v8sf Exp(v8sf x)
+{
+    v8sf fx, n, z, y;
+    v8si ni;
+
+    x = Select(x > 88.3762626647949f, Splat(88.3762626647949f), x);
+    x = Select(x < -87.3365447504019f, Splat(-87.3365447504019f), x);
+
+    /* n = floor(x / log(2) + .5) */
+    fx = x * 1.44269504088896341f + .5f;
+    n = __builtin_convertvector(__builtin_convertvector(fx, v8si), v8sf);
+    n = Select(n > fx, n - 1.f, n);
+
+    x = x - n * 0.693359375f + n * 2.12194440e-4f;
+    z = x * x;
+    y = (((((1.9875691500e-4f * x + 1.3981999507e-3f) * x + 8.3334519073e-3f) * x
+           + 4.1665795894e-2f) * x + 1.6666665459e-1f) * x + 5.0000001201e-1f) * z + x + 1.f;
+
+    /* times 2^n */
+    ni = __builtin_convertvector(n, v8si);
+    return y * (v8sf)((ni + 127) << 23);
+}
+
+VECTOR_INLINE void RectToPolarBlock(const float *pRect, float *pMag, float *pPhase, float fPhaseSign)
+{
+    v8sf fReal, fImag;
+    int i;
+
+    for(i = 0; i < VECTOR_SIZE; i++)
+    {
+        fReal[i] = pRect[i << 1];
+        fImag[i] = pRect[(i << 1) + 1];
+    }
+    {
+        v8sf fMag = Sqrt(fReal * fReal + fImag * fImag);
+        __builtin_memcpy(pMag, &fMag, sizeof(v8sf));
+    }
+    if(pPhase)
+    {
+        v8sf fPhase = Atan2(fImag * fPhaseSign, fReal);
+        __builtin_memcpy(pPhase, &fPhase, sizeof(v8sf));
+    }
+}
+
+VECTOR_INLINE void MagToDBBlock(const float *pMag, float *pDB, float fMagThresh,
+                                float fDBOffsetHi, float fDBOffsetLo)
+{
+    v8sf x, fDB;
+
+    __builtin_memcpy(&x, pMag, sizeof(v8sf));
+    fDB = DB(Select(x < fMagThresh, Splat(fMagThresh), x), fDBOffsetHi, fDBOffsetLo);
+    fDB = Select(x < fMagThresh, Splat(0.f), fDB);
+    __builtin_memcpy(pDB, &fDB, sizeof(v8sf));
+}
+
+VECTOR_INLINE void DBToMagBlock(const float *pDB, float *pMag, float fMagThresh)
+{
+    v8sf x, fMag;
+
+    __builtin_memcpy(&x, pDB, sizeof(v8sf));
+    fMag = fMagThresh * Exp(x * 0.11512925464970229f);
+    fMag = Select(x < 0.00001f, Splat(0.f), fMag);
+    __builtin_memcpy(pMag, &fMag, sizeof(v8sf));
+}
+
+/* the samples of one channel of 8 stereo frames, the even (iOdd = 0) or odd
+ * (iOdd = 1) ones of 16 interleaved values */
+VECTOR_INLINE void DeinterleaveStereoBlock(const float *pIn, float *pOut, int iOdd)
+{
+    v8sf a, b, r;
+
+    __builtin_memcpy(&a, pIn, sizeof(v8sf));
+    __builtin_memcpy(&b, pIn + VECTOR_SIZE, sizeof(v8sf));
+    if(iOdd)
+        r = (v8sf){a[1], a[3], a[5], a[7], b[1], b[3], b[5], b[7]};
+    else
+        r = (v8sf){a[0], a[2], a[4], a[6], b[0], b[2], b[4], b[6]};
+    __builtin_memcpy(pOut, &r, sizeof(v8sf));
+}
+
+/* bit j set for bin j of 8 bins that is a local maximum above fMinMag, the
+ * same test as a scan of one bin at a time; pMag[-1] and pMag[8] are read */
+VECTOR_INLINE int FindMaximaBlock(const float *pMag, v8sf fMinMag)
+{
+    const v8si bit = {1, 2, 4, 8, 16, 32, 64, 128};
+    v8sf fLeft, fBin, fRight;
+    v8si isMax;
+
+    __builtin_memcpy(&fLeft, pMag - 1, sizeof(v8sf));
+    __builtin_memcpy(&fBin, pMag, sizeof(v8sf));
+    __builtin_memcpy(&fRight, pMag + 1, sizeof(v8sf));
+    isMax = (fBin > fMinMag) & (fBin >= fLeft) & (fBin >= fRight) & bit;
+    isMax |= (v8si){isMax[4], isMax[5], isMax[6], isMax[7], 0, 0, 0, 0};
+    isMax |= (v8si){isMax[2], isMax[3], 0, 0, 0, 0, 0, 0};
+    return isMax[0] | isMax[1];
+}
+
+/* the loops over whole arrays, the last few values are done in a padded vector */
+#define VECTOR_LOOPS(suffix, attributes)                                        \
+attributes static void RectToPolar##suffix(int sizeMag, const float *pRect,     \
+                                           float *pMag, float *pPhase,          \
+                                           float fPhaseSign)                    \
+{                                                                               \
+    float rect[2 * VECTOR_SIZE] = {0}, mag[VECTOR_SIZE], phase[VECTOR_SIZE];    \
+    int i, nLeft;                                                               \
+                                                                                \
+    for(i = 0; i + VECTOR_SIZE <= sizeMag; i += VECTOR_SIZE)                    \
+        RectToPolarBlock(pRect + 2 * i, pMag + i, pPhase ? pPhase + i : NULL,  \
+                          fPhaseSign);                                          \
+    if((nLeft = sizeMag - i) > 0)                                               \
+    {                                                                           \
+        __builtin_memcpy(rect, pRect + 2 * i, 2 * nLeft * sizeof(float));       \
+        RectToPolarBlock(rect, mag, phase, fPhaseSign);                        \
+        __builtin_memcpy(pMag + i, mag, nLeft * sizeof(float));                 \
+        if(pPhase)                                                              \
+            __builtin_memcpy(pPhase + i, phase, nLeft * sizeof(float));         \
+    }                                                                           \
+}                                                                               \
+                                                                                \
+attributes static void MagToDB##suffix(int sizeArray, const float *pMag,        \
+                                       float *pDB, float fMagThresh)            \
+{                                                                               \
+    float in[VECTOR_SIZE] = {0}, out[VECTOR_SIZE];                              \
+    /* 20 log10(fMagThresh), the part in multiples of 2^-12 and the rest */   \
+    double fDBOffset = 20. * log10((double)fMagThresh);                         \
+    float fDBOffsetHi = (float)(floor(fDBOffset * 4096. + .5) / 4096.);         \
+    float fDBOffsetLo = (float)(fDBOffset - fDBOffsetHi);                       \
+    int i, nLeft;                                                               \
+                                                                                \
+    for(i = 0; i + VECTOR_SIZE <= sizeArray; i += VECTOR_SIZE)                  \
+        MagToDBBlock(pMag + i, pDB + i, fMagThresh, fDBOffsetHi, fDBOffsetLo);  \
+    if((nLeft = sizeArray - i) > 0)                                             \
+    {                                                                           \
+        __builtin_memcpy(in, pMag + i, nLeft * sizeof(float));                  \
+        MagToDBBlock(in, out, fMagThresh, fDBOffsetHi, fDBOffsetLo);            \
+        __builtin_memcpy(pDB + i, out, nLeft * sizeof(float));                  \
+    }                                                                           \
+}                                                                               \
+                                                                                \
+attributes static void DBToMag##suffix(int sizeArray, const float *pDB,         \
+                                       float *pMag, float fMagThresh)           \
+{                                                                               \
+    float in[VECTOR_SIZE] = {0}, out[VECTOR_SIZE];                              \
+    int i, nLeft;                                                               \
+                                                                                \
+    for(i = 0; i + VECTOR_SIZE <= sizeArray; i += VECTOR_SIZE)                  \
+        DBToMagBlock(pDB + i, pMag + i, fMagThresh);                           \
+    if((nLeft = sizeArray - i) > 0)                                             \
+    {                                                                           \
+        __builtin_memcpy(in, pDB + i, nLeft * sizeof(float));                   \
+        DBToMagBlock(in, out, fMagThresh);                                     \
+        __builtin_memcpy(pMag + i, out, nLeft * sizeof(float));                 \
+    }                                                                           \
+}                                                                               \
+                                                                                \
+attributes static void DeinterleaveStereo##suffix(int nFrames, const float *pIn, \
+                                                  int iChannel, float *pOut)   \
+{                                                                               \
+    float in[2 * VECTOR_SIZE] = {0}, out[VECTOR_SIZE];                          \
+    int i, nLeft;                                                               \
+                                                                                \
+    for(i = 0; i + VECTOR_SIZE <= nFrames; i += VECTOR_SIZE)                    \
+        DeinterleaveStereoBlock(pIn + 2 * i, pOut + i, iChannel);              \
+    if((nLeft = nFrames - i) > 0)                                               \
+    {                                                                           \
+        __builtin_memcpy(in, pIn + 2 * i, 2 * nLeft * sizeof(float));           \
+        DeinterleaveStereoBlock(in, out, iChannel);                            \
+        __builtin_memcpy(pOut + i, out, nLeft * sizeof(float));                 \
+    }                                                                           \
+}                                                                               \
+                                                                                \
+attributes static int FindMaxima##suffix(const float *pMag, int iFirstBin,      \
+                                         int iLastBin, float fMinMag,           \
+                                         int *pBins, int nMaxBins)              \
+{                                                                               \
+    float in[2 * VECTOR_SIZE] = {0};                                            \
+    v8sf fMin = Splat(fMinMag);                                                 \
+    int i, nLeft, bits, nBins = 0;                                              \
+                                                                                \
+    for(i = iFirstBin; i + VECTOR_SIZE <= iLastBin + 1; i += VECTOR_SIZE)       \
+    {                                                                           \
+        for(bits = FindMaximaBlock(pMag + i, fMin); bits; bits &= bits - 1)     \
+        {                                                                       \
+            if(nBins == nMaxBins)                                               \
+                return nBins;                                                   \
+            pBins[nBins++] = i + __builtin_ctz(bits);                           \
+        }                                                                       \
+    }                                                                           \
+    if((nLeft = iLastBin + 1 - i) > 0)                                          \
+    {                                                                           \
+        __builtin_memcpy(in, pMag + i - 1, (nLeft + 2) * sizeof(float));        \
+        bits = FindMaximaBlock(in + 1, fMin) & ((1 << nLeft) - 1);              \
+        for(; bits && nBins < nMaxBins; bits &= bits - 1)                       \
+            pBins[nBins++] = i + __builtin_ctz(bits);                           \
+    }                                                                           \
+    return nBins;                                                               \
+}
+
+VECTOR_LOOPS(Default, )
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SMS_VECTOR_AVX2
+VECTOR_LOOPS(Avx2, __attribute__ ((target ("avx2"))))
+
+static int UseAvx2(void)
+{
+    static int iUseAvx2 = -1; /* the same answer in every thread */
+
+    if(iUseAvx2 < 0)
+    {
+        __builtin_cpu_init();
+        iUseAvx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return iUseAvx2;
+}
+#endif
+
+#endif /* SMS_VECTOR_MATH */
+
+/*! \brief name of the instruction set the vectorized kernels use
+ *
+ * \return "avx2", "sse2", "neon", "vector" (another instruction set) or "scalar"
+ */
+const char *sms_vecBackend(void)
+{
+#ifdef SMS_VECTOR_MATH
+#ifdef SMS_VECTOR_AVX2
+    if(UseAvx2())
+        return "avx2";
+#endif
+#if defined(__SSE2__)
+    return "sse2";
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    return "neon";
+#else
+    return "vector";
+#endif
+#else
+    return "scalar";
+#endif
+}
+
+/*! \brief convert a spectrum from rectangular to polar form
+ *
+ * The magnitudes are exact, the phases are within 5e-7 radians
+ * \see vectorMath.c
+ *
+ * \param sizeMag          size of spectrum (pMag and pPhase arrays)
+ * \param pRect        pointer to the spectrum in rectangular form (2x sizeMag, real/imag pairs)
+ * \param pMag         pointer to output magnitude spectrum
+ * \param pPhase           pointer to output phase spectrum, or NULL for the magnitudes only
+ * \param iPhaseSign    -1 to negate the imaginary part for the phase (as for the OOURA rdft), 1 otherwise
+ */
+void sms_vecRectToPolar(int sizeMag, const sfloat *pRect, sfloat *pMag, sfloat *pPhase, int iPhaseSign)
+{
+#ifdef SMS_VECTOR_MATH
+#ifdef SMS_VECTOR_AVX2
+    if(UseAvx2())
+    {
+        RectToPolarAvx2(sizeMag, pRect, pMag, pPhase, (float)iPhaseSign);
+        return;
+    }
+#endif
+    RectToPolarDefault(sizeMag, pRect, pMag, pPhase, (float)iPhaseSign);
+#else
+    int i, it2;
+    sfloat fReal, fImag;
+
+    for(i = 0; i < sizeMag; i++)
+    {
+        it2 = i << 1;
+        fReal = pRect[it2];
+        fImag = pRect[it2 + 1];
+        pMag[i] = sqrt(fReal * fReal + fImag * fImag);
+        if(pPhase)
+            pPhase[i] = atan2(iPhaseSign * fImag, fReal);
+    }
+#endif
+}
+
+/*! \brief convert an array of magnitudes to decibels
+ *
+ * The same as sms_magToDB() on every value, within 1e-5 dB for results
+ * below 256 dB \see vectorMath.c
+ *
+ * \param sizeArray   size of the arrays
+ * \param pMag          input magnitudes
+ * \param pDB            output decibels (can be the same array as pMag)
+ * \param fMagThresh   magnitude of 0 dB \see sms_setMagThresh
+ */
+void sms_vecMagToDB(int sizeArray, const sfloat *pMag, sfloat *pDB, sfloat fMagThresh)
+{
+#ifdef SMS_VECTOR_MATH
+#ifdef SMS_VECTOR_AVX2
+    if(UseAvx2())
+    {
+        MagToDBAvx2(sizeArray, pMag, pDB, fMagThresh);
+        return;
+    }
+#endif
+    MagToDBDefault(sizeArray, pMag, pDB, fMagThresh);
+#else
+    int i;
+    sfloat fInvMagThresh = 1. / fMagThresh;
+
+    for(i = 0; i < sizeArray; i++)
+        pDB[i] = (pMag[i] < fMagThresh) ? 0. : (20. / log(10.)) * log(pMag[i] * fInvMagThresh);
+#endif
+}
+
+/*! \brief convert an array of decibels to magnitudes
+ *
+ * The same as sms_dBToMag() on every value, within a relative error of
+ * 2e-6 for values up to 200 dB \see vectorMath.c
+ *
+ * \param sizeArray   size of the arrays
+ * \param pDB            input decibels
+ * \param pMag          output magnitudes (can be the same array as pDB)
+ * \param fMagThresh   magnitude of 0 dB \see sms_setMagThresh
+ */
+void sms_vecDBToMag(int sizeArray, const sfloat *pDB, sfloat *pMag, sfloat fMagThresh)
+{
+#ifdef SMS_VECTOR_MATH
+#ifdef SMS_VECTOR_AVX2
+    if(UseAvx2())
+    {
+        DBToMagAvx2(sizeArray, pDB, pMag, fMagThresh);
+        return;
+    }
+#endif
+    DBToMagDefault(sizeArray, pDB, pMag, fMagThresh);
+#else
+    int i;
+
+    for(i = 0; i < sizeArray; i++)
+        pMag[i] = (pDB[i] < 0.00001) ? 0. : fMagThresh * pow(10., pDB[i] * 0.05);
+#endif
+}
+
+/*! \brief copy one channel of interleaved samples
+ *
+ * Stereo sounds are done with vectors, other numbers of channels a sample
+ * at a time.
+ *
+ * \param nFrames        number of samples of each channel
+ * \param pIn             interleaved samples, nFrames * nChannels of them
+ * \param nChannels     number of channels
+ * \param iChannel       channel to copy, from 0
+ * \param pOut           output samples of the channel
+ */
+void sms_vecDeinterleave(int nFrames, const sfloat *pIn, int nChannels, int iChannel, sfloat *pOut)
+{
+    int i;
+
+    if(nChannels == 1)
+    {
+        memcpy(pOut, pIn, nFrames * sizeof(sfloat));
+        return;
+    }
+#ifdef SMS_VECTOR_MATH
+    if(nChannels == 2)
+    {
+#ifdef SMS_VECTOR_AVX2
+        if(UseAvx2())
+        {
+            DeinterleaveStereoAvx2(nFrames, pIn, iChannel, pOut);
+            return;
+        }
+#endif
+        DeinterleaveStereoDefault(nFrames, pIn, iChannel, pOut);
+        return;
+    }
+#endif
+    for(i = 0; i < nFrames; i++)
+        pOut[i] = pIn[i * nChannels + iChannel];
+}
+
+/*! \brief find the local maxima of a spectrum above a threshold
+ *
+ * A bin is a local maximum if it is above fMinMag and not below either of
+ * its neighbors. Whole vectors of bins below fMinMag are skipped at once.
+ *
+ * \param pMag            magnitude spectrum, pMag[iFirstBin - 1] and pMag[iLastBin + 1] are read
+ * \param iFirstBin       first bin to test, at least 1
+ * \param iLastBin        last bin to test
+ * \param fMinMag         threshold of the maxima
+ * \param pBins           output bins of the maxima, in increasing order
+ * \param nMaxBins        size of pBins, the search stops when it is full
+ * \return the number of maxima found
+ */
+int sms_vecFindMaxima(const sfloat *pMag, int iFirstBin, int iLastBin, sfloat fMinMag,
+                      int *pBins, int nMaxBins)
+{
+#ifdef SMS_VECTOR_MATH
+#ifdef SMS_VECTOR_AVX2
+    if(UseAvx2())
+        return FindMaximaAvx2(pMag, iFirstBin, iLastBin, fMinMag, pBins, nMaxBins);
+#endif
+    return FindMaximaDefault(pMag, iFirstBin, iLastBin, fMinMag, pBins, nMaxBins);
+#else
+    int i, nBins = 0;
+
+    for(i = iFirstBin; i <= iLastBin && nBins < nMaxBins; i++)
+        if(pMag[i] > fMinMag && pMag[i] >= pMag[i - 1] && pMag[i] >= pMag[i + 1])
+            pBins[nBins++] = i;
+    return nBins;
+#endif
+}
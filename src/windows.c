@@ -21,9 +21,34 @@
 /*! \file windows.c
  * \brief functions for creating various windows
  *
- * Use sms_getWindow() for selecting which window will be made
+ * Use sms_getWindow() for selecting which window will be made, or
+ * sms_getScaledWindow() for a shared copy of a scaled analysis window
  */
 #include "sms.h"
+#include <stddef.h>
+#include <pthread.h>
+
+#define SMS_WINDOW_CACHE_SIZE 256 /* number of windows (of any type and size) kept */
+#define SMS_WINDOW_HASH_SIZE 512  /* buckets of the window cache, a power of 2 */
+
+/* a scaled window, never changed once it is in the cache. The windows
+ * that are not in use are in a list from the least recently used on,
+ * the first ones are dropped when the cache is full. */
+typedef struct CachedWindow
+{
+	int iWindowType;
+	int sizeWindow;
+	int nUsers;                   /* number of sms_getScaledWindow() not yet released */
+	struct CachedWindow *pNext;   /* next window of the same bucket */
+	struct CachedWindow *pOlder;  /* windows not in use, in order of use */
+	struct CachedWindow *pNewer;
+	sfloat pWindow[1];            /* the samples, allocated with the window */
+} CachedWindow;
+
+static CachedWindow *pWindowBuckets[SMS_WINDOW_HASH_SIZE];
+static CachedWindow *pOldestWindow = NULL, *pNewestWindow = NULL;
+static int nCachedWindows = 0;
+static pthread_mutex_t windowCacheLock = PTHREAD_MUTEX_INITIALIZER;
 
 
 /* \brief scale a window by its integral (numeric quadrature)
@@ -316,3 +341,162 @@ void sms_windowCentered (int sizeWindow, const sfloat *pWaveform, const sfloat *
 	for (i=0; i<iMiddleWindow; i++)
 		pFftBuffer[i] = pWindow[iOffset + i] * pWaveform[iOffset + i];
 }
+
+static CachedWindow **WindowBucket(int sizeWindow, int iWindowType)
+{
+	unsigned int hash = (unsigned int)sizeWindow * 2654435761u + (unsigned int)iWindowType;
+
+	return &pWindowBuckets[(hash >> 16) & (SMS_WINDOW_HASH_SIZE - 1)];
+}
+
+/* the window of a type and size in the cache, NULL if it is not there.
+ * Called with windowCacheLock held. */
+static CachedWindow *FindWindow(int sizeWindow, int iWindowType)
+{
+	CachedWindow *pCached = *WindowBucket(sizeWindow, iWindowType);
+
+	while(pCached && (pCached->sizeWindow != sizeWindow || pCached->iWindowType != iWindowType))
+		pCached = pCached->pNext;
+	return pCached;
+}
+
+/* take a window out of the list of the windows not in use, or put it last
+ * (as the most recently used). Called with windowCacheLock held. */
+static void UnlinkUnused(CachedWindow *pCached)
+{
+	if(pCached->pOlder)
+		pCached->pOlder->pNewer = pCached->pNewer;
+	else
+		pOldestWindow = pCached->pNewer;
+	if(pCached->pNewer)
+		pCached->pNewer->pOlder = pCached->pOlder;
+	else
+		pNewestWindow = pCached->pOlder;
+	pCached->pOlder = pCached->pNewer = NULL;
+}
+
+static void LinkUnused(CachedWindow *pCached)
+{
+	pCached->pOlder = pNewestWindow;
+	pCached->pNewer = NULL;
+	if(pNewestWindow)
+		pNewestWindow->pNewer = pCached;
+	else
+		pOldestWindow = pCached;
+	pNewestWindow = pCached;
+}
+
+/* drop the least recently used window that is not in use, returns 0 if all
+ * of them are in use. Called with windowCacheLock held. */
+static int DropOldestWindow(void)
+{
+	CachedWindow *pCached = pOldestWindow, **ppLink;
+
+	if(pCached == NULL)
+		return 0;
+	UnlinkUnused(pCached);
+	ppLink = WindowBucket(pCached->sizeWindow, pCached->iWindowType);
+	while(*ppLink != pCached)
+		ppLink = &(*ppLink)->pNext;
+	*ppLink = pCached->pNext;
+	free(pCached);
+	nCachedWindows--;
+	return 1;
+}
+
+/*! \brief get a scaled window from the window cache
+ *
+ * Returns the same values as sms_getWindow() followed by
+ * sms_scaleWindow(), but every type and size is only computed once and
+ * then shared by all frames, analyses and threads. The window must not be
+ * changed, and has to be given back with sms_releaseScaledWindow(). The
+ * cache keeps SMS_WINDOW_CACHE_SIZE windows, when it is full the least
+ * recently used window that nobody is using is dropped to make room.
+ *
+ * \param sizeWindow   window size
+ * \param iWindowType the desired window type defined by #SMS_WINDOWS
+ * \return pointer to the window, NULL if all the windows of the cache are in use or out of memory
+ */
+const sfloat *sms_getScaledWindow(int sizeWindow, int iWindowType)
+{
+	CachedWindow *pCached, *pNew, **ppBucket;
+
+	pthread_mutex_lock(&windowCacheLock);
+	if((pCached = FindWindow(sizeWindow, iWindowType)) != NULL)
+	{
+		if(pCached->nUsers++ == 0)
+			UnlinkUnused(pCached);
+		pthread_mutex_unlock(&windowCacheLock);
+		return pCached->pWindow;
+	}
+	pthread_mutex_unlock(&windowCacheLock);
+
+	/* the window is made without the lock, another thread may add it meanwhile */
+	pNew = (CachedWindow *)malloc(offsetof(CachedWindow, pWindow) + sizeWindow * sizeof(sfloat));
+	if(pNew == NULL)
+		return NULL;
+	sms_getWindow(sizeWindow, pNew->pWindow, iWindowType);
+	sms_scaleWindow(sizeWindow, pNew->pWindow);
+	pNew->iWindowType = iWindowType;
+	pNew->sizeWindow = sizeWindow;
+	pNew->nUsers = 1;
+	pNew->pOlder = pNew->pNewer = NULL;
+
+	pthread_mutex_lock(&windowCacheLock);
+	if((pCached = FindWindow(sizeWindow, iWindowType)) != NULL)
+	{
+		if(pCached->nUsers++ == 0)
+			UnlinkUnused(pCached);
+		free(pNew);
+	}
+	else if(nCachedWindows < SMS_WINDOW_CACHE_SIZE || DropOldestWindow())
+	{
+		ppBucket = WindowBucket(sizeWindow, iWindowType);
+		pNew->pNext = *ppBucket;
+		*ppBucket = pNew;
+		nCachedWindows++;
+		pCached = pNew;
+	}
+	else
+		free(pNew);
+	pthread_mutex_unlock(&windowCacheLock);
+	return pCached ? pCached->pWindow : NULL;
+}
+
+/*! \brief give back a window of the window cache
+ *
+ * Once every sms_getScaledWindow() of a window has been released, the
+ * cache can drop it.
+ *
+ * \param pWindow   window returned by sms_getScaledWindow()
+ */
+void sms_releaseScaledWindow(const sfloat *pWindow)
+{
+	CachedWindow *pCached = (CachedWindow *)((char *)pWindow - offsetof(CachedWindow, pWindow));
+
+	pthread_mutex_lock(&windowCacheLock);
+	if(--pCached->nUsers == 0)
+		LinkUnused(pCached);
+	pthread_mutex_unlock(&windowCacheLock);
+}
+
+/*! \brief free the windows in the window cache
+ *
+ * No window returned by sms_getScaledWindow() may be in use.
+ */
+void sms_clearWindows(void)
+{
+	CachedWindow *pCached;
+	int i;
+
+	pthread_mutex_lock(&windowCacheLock);
+	for(i = 0; i < SMS_WINDOW_HASH_SIZE; i++)
+		while((pCached = pWindowBuckets[i]) != NULL)
+		{
+			pWindowBuckets[i] = pCached->pNext;
+			free(pCached);
+		}
+	pOldestWindow = pNewestWindow = NULL;
+	nCachedWindows = 0;
+	pthread_mutex_unlock(&windowCacheLock);
+}
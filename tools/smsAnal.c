@@ -29,25 +29,159 @@ const char *help_header_text =
 "See the man page for details.\n\n"
 "Options:\n";
 
+typedef struct
+{
+    FILE *pOutputSmsFile;
+    SMS_Header *pSmsHeader;
+    int verbose;
+    int iFrame;
+} FrameWriter;
+
+/* write a frame from sms_analyzeSegments */
+static int WriteFrame(const SMS_Data *pSmsData, void *pUserData)
+{
+    FrameWriter *pWriter = (FrameWriter *)pUserData;
+
+    /* the error message is printed by the caller of the analysis */
+    if(sms_writeFrame (pWriter->pOutputSmsFile, pWriter->pSmsHeader, pSmsData) < 0)
+    {
+        printf("error: could not write sms frame %d\n", pWriter->iFrame);
+        return -1;
+    }
+    if(pWriter->verbose && pWriter->iFrame % 10 == 0)
+        printf ("%.2f ", pWriter->iFrame / (float) pWriter->pSmsHeader->iFrameRate);
+    pWriter->iFrame++;
+    return 0;
+}
+
+/* analyze all of the channels of the sound in one pass, into one file per
+ * channel: <outputSmsFile>.<channel>.sms (without the .sms of outputSmsFile) */
+static int AnalyzeChannels(const char *pChOutputSmsFile, SMS_SndHeader *pSoundHeader,
+                           const SMS_AnalParams *pAnalParams, int iFrameEncoding, int verbose)
+{
+    int nChannels = pSoundHeader->channelCount, iChannel, nInit = 0, nFiles = 0, iError = 0;
+    int sizeBase = strlen(pChOutputSmsFile);
+    SMS_AnalParams **ppAnalParams = (SMS_AnalParams **) calloc(nChannels, sizeof(SMS_AnalParams *));
+    SMS_Header *pSmsHeaders = (SMS_Header *) calloc(nChannels, sizeof(SMS_Header));
+    FrameWriter *pWriters = (FrameWriter *) calloc(nChannels, sizeof(FrameWriter));
+    void **ppWriters = (void **) calloc(nChannels, sizeof(void *));
+    char **ppChFileNames = (char **) calloc(nChannels, sizeof(char *));
+    SMS_ThreadPool *pPool = NULL;
+
+    if(!ppAnalParams || !pSmsHeaders || !pWriters || !ppWriters || !ppChFileNames)
+    {
+        printf("error: could not allocate memory for the channels\n");
+        return -1;
+    }
+    if(sizeBase > 4 && strcmp(pChOutputSmsFile + sizeBase - 4, ".sms") == 0)
+        sizeBase -= 4;
+
+    for(iChannel = 0; iChannel < nChannels && !iError; iChannel++)
+    {
+        ppAnalParams[iChannel] = (SMS_AnalParams *) malloc(sizeof(SMS_AnalParams));
+        ppChFileNames[iChannel] = (char *) malloc(sizeBase + 32);
+        if(!ppAnalParams[iChannel] || !ppChFileNames[iChannel])
+        {
+            printf("error: could not allocate memory for the channels\n");
+            iError = -1;
+            break;
+        }
+        memcpy(ppAnalParams[iChannel], pAnalParams, sizeof(SMS_AnalParams));
+        if(sms_initAnalysis(ppAnalParams[iChannel], pSoundHeader))
+        {
+            printf("error in sms_initAnalysis: %s \n", sms_errorMessage());
+            iError = -1;
+            break;
+        }
+        nInit++;
+        sprintf(ppChFileNames[iChannel], "%.*s.%d.sms", sizeBase, pChOutputSmsFile, iChannel);
+        sms_fillHeader(&pSmsHeaders[iChannel], ppAnalParams[iChannel], "smsAnal");
+        pSmsHeaders[iChannel].iFrameEncoding = iFrameEncoding;
+        if(sms_writeHeader(ppChFileNames[iChannel], &pSmsHeaders[iChannel],
+                           &pWriters[iChannel].pOutputSmsFile) < 0)
+        {
+            printf("error in sms_writeHeader: %s \n", sms_errorMessage());
+            iError = -1;
+            break;
+        }
+        nFiles++;
+        pWriters[iChannel].pSmsHeader = &pSmsHeaders[iChannel];
+        /* only the progress of the first channel is printed */
+        pWriters[iChannel].verbose = verbose && iChannel == 0;
+        ppWriters[iChannel] = &pWriters[iChannel];
+    }
+
+    if(!iError)
+    {
+        if(verbose)
+            printf("\nanalyzing %d channels now:\n", nChannels);
+        pPool = sms_createThreadPool(nChannels);
+        if(pPool == NULL ||
+           sms_analyzeChannels(pSoundHeader, ppAnalParams, pPool, WriteFrame, ppWriters) < 0)
+        {
+            printf("error in sms_analyzeChannels: %s \n", sms_errorMessage());
+            iError = -1;
+        }
+        if(pPool)
+            sms_freeThreadPool(pPool);
+        if(verbose)
+            printf("\n");
+    }
+
+    for(iChannel = 0; iChannel < nFiles; iChannel++)
+    {
+        pSmsHeaders[iChannel].nFrames = pWriters[iChannel].iFrame;
+        pSmsHeaders[iChannel].fResidualPerc = ppAnalParams[iChannel]->fResidualAccumPerc / pWriters[iChannel].iFrame;
+        /* only a complete analysis gets the name of the SMS file */
+        if(iError)
+            sms_abortFile(pWriters[iChannel].pOutputSmsFile, &pSmsHeaders[iChannel]);
+        else if(sms_writeFile(pWriters[iChannel].pOutputSmsFile, &pSmsHeaders[iChannel]) < 0)
+            printf("error in sms_writeFile: %s \n", sms_errorMessage());
+        else
+            printf("wrote %d analysis frames to %s\n", pWriters[iChannel].iFrame, ppChFileNames[iChannel]);
+    }
+    for(iChannel = 0; iChannel < nChannels; iChannel++)
+    {
+        if(iChannel < nInit)
+            sms_freeAnalysis(ppAnalParams[iChannel]);
+        free(ppAnalParams[iChannel]);
+        free(ppChFileNames[iChannel]);
+    }
+    free(ppAnalParams);
+    free(pSmsHeaders);
+    free(pWriters);
+    free(ppWriters);
+    free(ppChFileNames);
+    return iError;
+}
+
 int main (int argc, const char *argv[])
 {
     FILE *pOutputSmsFile; 
     SMS_Data smsData;
     SMS_Header smsHeader;
 
-    float pSoundData[SMS_MAX_WINDOW];
+    sfloat *pSoundData;
     SMS_SndHeader soundHeader;
 
     char *pChInputSoundFile = NULL, *pChOutputSmsFile = NULL;
     int verbose = 0;
+    int nThreads = 0;
+    int nPipelineThreads = 0;
+    int iAllChannels = 0;
+    int iDeferReAnalysis = 0;
+    int iFrameEncoding = SMS_ENC_DENSE;
     int iDoAnalysis = 1;
     int iFrame = 0;
+    int iError = 0;
     long iStatus = 0, iSample = 0, sizeNewData = 0;
 
     int optc;   /* switch */
     poptContext pc;
 
     SMS_AnalParams analParams;
+    SMS_AnalParams *pSegmentParams = NULL;
+    SMS_ThreadPool *pReAnalysisPool = NULL;
     sms_initAnalParams(&analParams);    /* initialize arguments to defaults*/
 
     struct poptOption options[] =
@@ -56,17 +190,27 @@ int main (int argc, const char *argv[])
             "verbose mode", 0},
         {"debug", 'd', POPT_ARG_INT, &analParams.iDebugMode, 0, 
             "debug mode (0)", "int"},
+        {"threads", 'T', POPT_ARG_INT, &nThreads, 0,
+            "analyze segments of the sound in parallel on this many threads (0, off)", "int"},
+        {"pipeline", 'P', POPT_ARG_INT, &nPipelineThreads, 0,
+            "compute the spectra ahead of the analysis on this many threads (0, off)", "int"},
+        {"channels", 'C', POPT_ARG_NONE, &iAllChannels, 0,
+            "analyze all channels in one pass, into one file per channel", 0},
         {"format", 'f', POPT_ARG_INT, &analParams.iFormat, 0, 
             "analysis format (0, harmonic)", "int"},
         {"sound-type", 'q', POPT_ARG_INT, &analParams.iSoundType, 0, 
             "sound type (0, phrase)", "int"},
         {"direction", 'x', POPT_ARG_INT, &analParams.iAnalysisDirection, 0, 
             "analysis direction (0, forward)", "int"},
+        {"encoding", 'E', POPT_ARG_INT, &iFrameEncoding, 0, 
+            "frame encoding of the output file (0, dense)", "int"},
         /* STFT Parameters: */
         {"window-size", 's', POPT_ARG_FLOAT, &analParams.fSizeWindow, 0, 
             "size of the window in f0 periods (3.5)", "float"},
         {"window-type", 'i', POPT_ARG_INT, &analParams.iWindowType, 0, 
             "window type (1, blackman harris 70 dB)", "int"},
+        {"window-step", 'W', POPT_ARG_INT, &analParams.iSizeWindowStep, 0, 
+            "round window sizes to odd multiples of this many samples (0, exact)", "int"},
         {"frame-rate", 'r', POPT_ARG_INT, &analParams.iFrameRate, 0, 
             "frame rate in hertz (300)", "int"},
         /* Peak Detection Parameters */
@@ -87,6 +231,12 @@ int main (int argc, const char *argv[])
             "lowest fundamental frequency(hz), or frequency in inharmonic analysis, to search for (default 50)", "float"}, 
         {"highest-fund", 'h', POPT_ARG_FLOAT, &analParams.fDefaultFundamental, 0, 
             "highest fundamental frequency to search for, has no effect on inharmonic analysis (default 1000)", "float"}, 
+        {"max-reanalysis", 'R', POPT_ARG_INT, &analParams.iMaxReAnalysis, 0, 
+            "most previous frames analyzed again after a frame, -1 for no limit (default -1)", "int"}, 
+        {"max-reanalysis-time", 0, POPT_ARG_FLOAT, &analParams.fMaxReAnalysisTime, 0, 
+            "seconds after which no more previous frames are analyzed again after a frame, 0 for no limit (default 0)", "float"}, 
+        {"defer-reanalysis", 'D', POPT_ARG_NONE, &iDeferReAnalysis, 0, 
+            "analyze the previous frames again on a thread of their own", 0}, 
         /* Peak Continuation parameters */
         {"guides", 'n', POPT_ARG_INT, &analParams.nGuides, 0, 
             "number of guides to use in partial tracking (default 100)", "int"},
@@ -98,6 +248,8 @@ int main (int argc, const char *argv[])
             "contribution of the frequency of the previous peak of a given trajectory to the current guide frequency value (default .4).", "float"}, 
         {"fund-cont-guide", 'o', POPT_ARG_FLOAT, &analParams.fFundContToGuide, 0, 
             "contribution of the fundamental frequency of the previous peak of a given trajectory to the current guide frequency value (default .5).", "float"}, 
+        {"tracking", 'K', POPT_ARG_INT, &analParams.iTracking, 0, 
+            "peak continuation: 0 guide by guide, 1 optimal assignment of the peaks to the guides (default 0)", "int"}, 
         /* Track Cleaning parameters:\n" */
         {"clean-track", 'g', POPT_ARG_INT, &analParams.iCleanTracks, 0, 
             "turn on/off track cleaning (default is on, 1)", "int"}, 
@@ -159,17 +311,45 @@ int main (int argc, const char *argv[])
     /* open input sound */
     if (sms_openSF(pChInputSoundFile, &soundHeader))
     {
-        printf("error in sms_openSF: %s \n", sms_errorString());
+        printf("error in sms_openSF: %s \n", sms_errorMessage());
         exit(EXIT_FAILURE);
     }       
 
     /* initialize everything */
     sms_init();
+    if(iAllChannels)
+    {
+        iStatus = AnalyzeChannels(pChOutputSmsFile, &soundHeader, &analParams, iFrameEncoding, verbose);
+        sms_closeSF(&soundHeader);
+        sms_free();
+        return iStatus ? 1 : 0;
+    }
+    /* the segments initialize their own copy of the parameters */
+    if(nThreads > 0)
+    {
+        pSegmentParams = (SMS_AnalParams *) malloc(sizeof(SMS_AnalParams));
+        memcpy(pSegmentParams, &analParams, sizeof(SMS_AnalParams));
+    }
+    if(iDeferReAnalysis && (pReAnalysisPool = sms_createThreadPool(1)) == NULL)
+    {
+        printf("error in sms_createThreadPool: %s \n", sms_errorMessage());
+        return 1;
+    }
+    analParams.pReAnalysisPool = pReAnalysisPool;
     /* TODO NExt: go from here through all the functions that need to look at specEnvParams */
-    sms_initAnalysis (&analParams, &soundHeader);
+    if (sms_initAnalysis (&analParams, &soundHeader))
+    {
+        printf("error in sms_initAnalysis: %s \n", sms_errorMessage());
+        return 1;
+    }
 
     sms_fillHeader (&smsHeader, &analParams, "smsAnal");
-    sms_writeHeader (pChOutputSmsFile, &smsHeader, &pOutputSmsFile);
+    smsHeader.iFrameEncoding = iFrameEncoding;
+    if (sms_writeHeader (pChOutputSmsFile, &smsHeader, &pOutputSmsFile))
+    {
+        printf("error in sms_writeHeader: %s \n", sms_errorMessage());
+        return 1;
+    }
 
     /* allocate output SMS record */
     sms_allocFrameH (&smsHeader, &smsData);
@@ -206,6 +386,43 @@ int main (int argc, const char *argv[])
         printf("\n\ndoing analysis now:\n");
     }
 
+    if(pSegmentParams)
+    {
+        FrameWriter writer = {pOutputSmsFile, &smsHeader, verbose, 0};
+        SMS_ThreadPool *pPool = sms_createThreadPool(nThreads);
+
+        if(pPool == NULL ||
+           sms_analyzeSegments(pChInputSoundFile, pSegmentParams, pPool, 0, WriteFrame,
+                               &writer, &analParams.fResidualAccumPerc) < 0)
+        {
+            printf("error in sms_analyzeSegments: %s \n", sms_errorMessage());
+            iError = 1;
+        }
+        if(pPool)
+            sms_freeThreadPool(pPool);
+        free(pSegmentParams);
+        iFrame = writer.iFrame;
+        smsHeader.nFrames = iFrame;
+        iDoAnalysis = 0;
+    }
+    else if(nPipelineThreads > 0 && analParams.iAnalysisDirection != SMS_DIR_REV)
+    {
+        FrameWriter writer = {pOutputSmsFile, &smsHeader, verbose, 0};
+        SMS_ThreadPool *pPool = sms_createThreadPool(nPipelineThreads);
+
+        if(pPool == NULL ||
+           sms_analyzePipelined(&soundHeader, &analParams, pPool, WriteFrame, &writer) < 0)
+        {
+            printf("error in sms_analyzePipelined: %s \n", sms_errorMessage());
+            iError = 1;
+        }
+        if(pPool)
+            sms_freeThreadPool(pPool);
+        iFrame = writer.iFrame;
+        smsHeader.nFrames = iFrame;
+        iDoAnalysis = 0;
+    }
+
     while(iDoAnalysis > 0)
     {
         if (analParams.iAnalysisDirection == SMS_DIR_REV)
@@ -224,11 +441,14 @@ int main (int argc, const char *argv[])
             else
                 sizeNewData = soundHeader.nSamples - iSample;
         }
-        /* get one frame of sound */
-        if (sms_getSound(&soundHeader, sizeNewData, pSoundData, iSample, &analParams))
+        /* get one frame of sound, directly into the sound buffer of the analysis */
+        pSoundData = sms_getSoundBufferSpace(sizeNewData, &analParams);
+        if (pSoundData == NULL ||
+            sms_getSound(&soundHeader, sizeNewData, pSoundData, iSample, &analParams))
         {
             printf("error: could not read sound frame %d\n", iFrame);
-            printf("error message in sms_getSound: %s \n", sms_errorString());
+            printf("error message in sms_getSound: %s \n", sms_errorMessage());
+            iError = 1;
             break;
         }
         /* perform analysis of one frame of sound */
@@ -242,7 +462,8 @@ int main (int argc, const char *argv[])
             if(sms_errorCheck())
             {
                 printf("error: could not write sms frame %d:\n", iFrame);
-                printf("error message in sms_writeFrame: %s \n", sms_errorString());
+                printf("error message in sms_writeFrame: %s \n", sms_errorMessage());
+                iError = 1;
                 break;
             }
             if(verbose)
@@ -268,21 +489,41 @@ int main (int argc, const char *argv[])
     {
         printf("\n");
         printf("residual percentage: %f \n", smsHeader.fResidualPerc);
+        printf("re-analysis: %d frames in %d of %d checks (%d good, %d failed, %d cut short, "
+               "%d cuts dropped, %d deferred), %f s, at most %f s \n",
+               analParams.reAnalysisStats.nFrames, analParams.reAnalysisStats.nRuns,
+               analParams.reAnalysisStats.nChecks, analParams.reAnalysisStats.nGood,
+               analParams.reAnalysisStats.nFailed, analParams.reAnalysisStats.nCut,
+               analParams.reAnalysisStats.nDropped, analParams.reAnalysisStats.nDeferred,
+               analParams.reAnalysisStats.fSeconds, analParams.reAnalysisStats.fMaxSeconds);
     }                
     if(smsHeader.nFrames != analParams.nFrames && verbose)
         printf("warning: wrong number of analyzed frames: analParams: %d, smsHeader: %d \n", 
                 analParams.nFrames, smsHeader.nFrames); 
-    /* write an close output files */
-    sms_writeFile (pOutputSmsFile, &smsHeader);
+    /* write an close output files, only a complete analysis gets the
+     * name of the SMS file */
+    if (iError)
+    {
+        sms_abortFile (pOutputSmsFile, &smsHeader);
+        printf("analysis stopped, %s not written\n", pChOutputSmsFile);
+    }
+    else if (sms_writeFile (pOutputSmsFile, &smsHeader) < 0)
+    {
+        printf("error in sms_writeFile: %s \n", sms_errorMessage());
+        iError = 1;
+    }
+    else
+        printf("wrote %d analysis frames to %s\n", iFrame, pChOutputSmsFile);
     if (analParams.iDebugMode == SMS_DBG_SYNC)
         sms_writeDebugFile ();
 
-    printf("wrote %d analysis frames to %s\n", iFrame, pChOutputSmsFile);
-
     /* cleanup */
+    sms_closeSF(&soundHeader);
     sms_freeFrame(&smsData);
     sms_freeAnalysis(&analParams);
+    if(pReAnalysisPool)
+        sms_freeThreadPool(pReAnalysisPool);
     sms_free();
-    return 0;   
+    return iError;   
 }
 
@@ -0,0 +1,446 @@
+/*
+ * Copyright (c) 2008 MUSIC TECHNOLOGY GROUP (MTG)
+ *                         UNIVERSITAT POMPEU FABRA
+ *
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ */
+#include "sms.h"
+#include <popt.h>
+#include <sys/stat.h>
+
+#define SIZE_PATH 1024
+
+const char *help_header_text =
+"\n\n"
+"Usage: smsBatchAnal [options]  <manifestFile>\n"
+"\n"
+"analyzes all sound files listed in a manifest, several at a time, and stores each one in a "
+"binary SMS file. Each line of the manifest is an input sound file, optionally followed by a tab "
+"and the output SMS file. The analysis parameters are the same as for smsAnal. "
+"See the man page for details.\n\n"
+"Options:\n";
+
+typedef struct
+{
+    char pChInputSoundFile[SIZE_PATH];
+    char pChOutputSmsFile[SIZE_PATH];
+    long sizeFile;       /* size of the sound file in bytes, longest files are started first */
+    int nFrames;         /* number of frames written */
+    int iStatus;         /* 0 on success, -1 on error */
+    char pChError[256];  /* error message if iStatus is -1 */
+} BatchJob;
+
+static SMS_AnalParams templateParams; /* analysis parameters given on the command line */
+static int verbose = 0;
+
+/* keep the error of the calling thread as the error of a job */
+static int JobError(BatchJob *pJob)
+{
+    char *pChError = sms_errorString();
+
+    strncpy(pJob->pChError, pChError ? pChError : "unknown error", sizeof(pJob->pChError) - 1);
+    return -1;
+}
+
+/* analyze one sound file with its own copy of the analysis parameters,
+ * this is the same as what smsAnal does */
+static int AnalyzeSound(BatchJob *pJob, SMS_AnalParams *pAnalParams)
+{
+    FILE *pOutputSmsFile;
+    SMS_Data smsData;
+    SMS_Header smsHeader;
+    sfloat *pSoundData;
+    SMS_SndHeader soundHeader;
+    int iDoAnalysis = 1;
+    int iFrame = 0, iError = 0;
+    long iStatus = 0, iSample = 0, sizeNewData = 0;
+
+    if (sms_openSF(pJob->pChInputSoundFile, &soundHeader))
+        return JobError(pJob);
+
+    if (sms_initAnalysis (pAnalParams, &soundHeader))
+    {
+        JobError(pJob);
+        sms_closeSF(&soundHeader);
+        return -1;
+    }
+
+    sms_fillHeader (&smsHeader, pAnalParams, "smsBatchAnal");
+    if (sms_writeHeader (pJob->pChOutputSmsFile, &smsHeader, &pOutputSmsFile))
+    {
+        JobError(pJob);
+        sms_closeSF(&soundHeader);
+        sms_freeAnalysis(pAnalParams);
+        return -1;
+    }
+    sms_allocFrameH (&smsHeader, &smsData);
+
+    if (pAnalParams->iAnalysisDirection == SMS_DIR_REV)
+        iSample = soundHeader.nSamples;
+
+    while(iDoAnalysis > 0)
+    {
+        if (pAnalParams->iAnalysisDirection == SMS_DIR_REV)
+        {
+            if ((iSample - pAnalParams->sizeNextRead) >= 0)
+                sizeNewData = pAnalParams->sizeNextRead;
+            else
+                sizeNewData = iSample;
+            iSample -= sizeNewData;
+        }
+        else
+        {
+            iSample += sizeNewData;
+            if((iSample + pAnalParams->sizeNextRead) < soundHeader.nSamples)
+                sizeNewData = pAnalParams->sizeNextRead;
+            else
+                sizeNewData = soundHeader.nSamples - iSample;
+        }
+        /* get one frame of sound, directly into the sound buffer of the analysis */
+        pSoundData = sms_getSoundBufferSpace(sizeNewData, pAnalParams);
+        if (pSoundData == NULL ||
+            sms_getSound(&soundHeader, sizeNewData, pSoundData, iSample, pAnalParams))
+        {
+            iError = JobError(pJob);
+            break;
+        }
+
+        /* perform analysis of one frame of sound */
+        iStatus = sms_analyze (sizeNewData, pSoundData, &smsData, pAnalParams);
+
+        /* if there is an output SMS record, write it */
+        if (iStatus == 1)
+        {
+            if(sms_writeFrame (pOutputSmsFile, &smsHeader, &smsData) < 0)
+            {
+                iError = JobError(pJob);
+                break;
+            }
+            iFrame++;
+        }
+        else if (iStatus == -1) /* done */
+        {
+            iDoAnalysis = 0;
+            smsHeader.nFrames = iFrame;
+        }
+    }
+
+    /* only a complete analysis gets the name of the SMS file */
+    smsHeader.nFrames = iFrame;
+    if(iFrame > 0)
+        smsHeader.fResidualPerc = pAnalParams->fResidualAccumPerc / iFrame;
+    if (iError)
+        sms_abortFile (pOutputSmsFile, &smsHeader);
+    else if (sms_writeFile (pOutputSmsFile, &smsHeader) < 0)
+        iError = JobError(pJob);
+
+    sms_closeSF(&soundHeader);
+    sms_freeFrame(&smsData);
+    sms_freeAnalysis(pAnalParams);
+
+    pJob->nFrames = iFrame;
+    return iError;
+}
+
+/* task run by the thread pool for each sound file */
+static void AnalysisTask(void *pArg)
+{
+    BatchJob *pJob = (BatchJob *)pArg;
+    SMS_AnalParams *pAnalParams;
+
+    /* the worker may still have the error of its last job */
+    sms_errorString();
+    /* SMS_AnalParams is large, keep it off the stack of the worker */
+    if((pAnalParams = (SMS_AnalParams *)malloc(sizeof(SMS_AnalParams))) == NULL)
+    {
+        pJob->iStatus = -1;
+        strcpy(pJob->pChError, "could not allocate memory for analysis parameters");
+        return;
+    }
+    memcpy(pAnalParams, &templateParams, sizeof(SMS_AnalParams));
+
+    pJob->iStatus = AnalyzeSound(pJob, pAnalParams);
+    if(pJob->iStatus < 0)
+        fprintf(stderr, "error: %s: %s\n", pJob->pChInputSoundFile, pJob->pChError);
+    else if(verbose)
+        printf("%s: wrote %d analysis frames to %s\n", pJob->pChInputSoundFile,
+               pJob->nFrames, pJob->pChOutputSmsFile);
+
+    free(pAnalParams);
+}
+
+/* output file name from the input file name: same name with the .sms
+ * extension, in pChOutputDir if given */
+static void OutputFileName(const char *pChInput, const char *pChOutputDir, char *pChOutput)
+{
+    const char *pChBase = strrchr(pChInput, '/');
+    char *pChExt;
+
+    if(pChOutputDir)
+        snprintf(pChOutput, SIZE_PATH, "%s/%s", pChOutputDir, pChBase ? pChBase + 1 : pChInput);
+    else
+        snprintf(pChOutput, SIZE_PATH, "%s", pChInput);
+
+    pChBase = strrchr(pChOutput, '/');
+    pChExt = strrchr(pChOutput, '.');
+    if(pChExt && (pChBase == NULL || pChExt > pChBase))
+        *pChExt = '\0';
+    strncat(pChOutput, ".sms", SIZE_PATH - strlen(pChOutput) - 1);
+}
+
+/* read the list of jobs from a manifest, returns the number of jobs or -1 */
+static int ReadManifest(const char *pChManifest, const char *pChOutputDir, BatchJob **ppJobs)
+{
+    FILE *pManifest;
+    char pChLine[2 * SIZE_PATH];
+    BatchJob *pJobs = NULL;
+    int nJobs = 0, sizeJobs = 0;
+    struct stat fileInfo;
+
+    if(strcmp(pChManifest, "-") == 0)
+        pManifest = stdin;
+    else if((pManifest = fopen(pChManifest, "r")) == NULL)
+    {
+        fprintf(stderr, "error: cannot open manifest %s\n", pChManifest);
+        return -1;
+    }
+
+    while(fgets(pChLine, sizeof(pChLine), pManifest))
+    {
+        char *pChInput = pChLine, *pChOutput, *pChEnd;
+
+        /* strip whitespace at the ends, skip empty lines and comments */
+        while(*pChInput == ' ' || *pChInput == '\t')
+            pChInput++;
+        pChEnd = pChInput + strlen(pChInput);
+        while(pChEnd > pChInput && (pChEnd[-1] == '\n' || pChEnd[-1] == '\r' ||
+                                    pChEnd[-1] == ' ' || pChEnd[-1] == '\t'))
+            *--pChEnd = '\0';
+        if(*pChInput == '\0' || *pChInput == '#')
+            continue;
+
+        if(nJobs == sizeJobs)
+        {
+            BatchJob *pNewJobs;
+            sizeJobs = sizeJobs ? sizeJobs * 2 : 64;
+            if((pNewJobs = (BatchJob *)realloc(pJobs, sizeJobs * sizeof(BatchJob))) == NULL)
+            {
+                fprintf(stderr, "error: could not allocate memory for the manifest\n");
+                free(pJobs);
+                if(pManifest != stdin)
+                    fclose(pManifest);
+                return -1;
+            }
+            pJobs = pNewJobs;
+        }
+        memset(&pJobs[nJobs], 0, sizeof(BatchJob));
+
+        if((pChOutput = strchr(pChInput, '\t')) != NULL)
+        {
+            *pChOutput++ = '\0';
+            while(*pChOutput == ' ' || *pChOutput == '\t')
+                pChOutput++;
+        }
+        snprintf(pJobs[nJobs].pChInputSoundFile, SIZE_PATH, "%s", pChInput);
+        if(pChOutput && *pChOutput)
+            snprintf(pJobs[nJobs].pChOutputSmsFile, SIZE_PATH, "%s", pChOutput);
+        else
+            OutputFileName(pChInput, pChOutputDir, pJobs[nJobs].pChOutputSmsFile);
+        if(stat(pChInput, &fileInfo) == 0)
+            pJobs[nJobs].sizeFile = fileInfo.st_size;
+        nJobs++;
+    }
+    if(pManifest != stdin)
+        fclose(pManifest);
+
+    *ppJobs = pJobs;
+    return nJobs;
+}
+
+static int CompareJobSize(const void *pA, const void *pB)
+{
+    long sizeA = ((const BatchJob *)pA)->sizeFile;
+    long sizeB = ((const BatchJob *)pB)->sizeFile;
+    return (sizeA < sizeB) - (sizeA > sizeB);
+}
+
+int main (int argc, const char *argv[])
+{
+    char *pChManifest = NULL, *pChOutputDir = NULL;
+    int nThreads = 0;
+    int nJobs, nFailed = 0, i;
+    BatchJob *pJobs = NULL;
+    SMS_ThreadPool *pPool;
+
+    int optc;   /* switch */
+    poptContext pc;
+
+    SMS_AnalParams *pAnalParams = &templateParams;
+    sms_initAnalParams(pAnalParams);    /* initialize arguments to defaults*/
+
+    struct poptOption options[] =
+    {
+        {"verbose", 'v', POPT_ARG_NONE, &verbose, 0,
+            "verbose mode", 0},
+        {"threads", 'T', POPT_ARG_INT, &nThreads, 0,
+            "number of files analyzed at the same time (default is one per processor)", "int"},
+        {"output-dir", 'O', POPT_ARG_STRING, &pChOutputDir, 0,
+            "directory for output files that are not named in the manifest (default is next to the input)", "dir"},
+        {"format", 'f', POPT_ARG_INT, &pAnalParams->iFormat, 0,
+            "analysis format (0, harmonic)", "int"},
+        {"sound-type", 'q', POPT_ARG_INT, &pAnalParams->iSoundType, 0,
+            "sound type (0, phrase)", "int"},
+        {"direction", 'x', POPT_ARG_INT, &pAnalParams->iAnalysisDirection, 0,
+            "analysis direction (0, forward)", "int"},
+        /* STFT Parameters: */
+        {"window-size", 's', POPT_ARG_FLOAT, &pAnalParams->fSizeWindow, 0,
+            "size of the window in f0 periods (3.5)", "float"},
+        {"window-type", 'i', POPT_ARG_INT, &pAnalParams->iWindowType, 0,
+            "window type (1, blackman harris 70 dB)", "int"},
+        {"frame-rate", 'r', POPT_ARG_INT, &pAnalParams->iFrameRate, 0,
+            "frame rate in hertz (300)", "int"},
+        /* Peak Detection Parameters */
+        {"highest-freq", 'j', POPT_ARG_FLOAT, &pAnalParams->fHighestFreq, 0,
+            "highest frequency to look for peaks (12000hz)", "float"},
+        {"min-peak-mag", 'k', POPT_ARG_FLOAT, &pAnalParams->fMinPeakMag, 0,
+            "minimum peak magnitude (0 normalized dB, which corresponds to -100dB)", "float"},
+        /* Harmonic Detection Parameters */
+        {"ref-harmonic", 'y', POPT_ARG_INT, &pAnalParams->iRefHarmonic, 0,
+            "reference harmonic number in series (1)", "int"},
+        {"min-ref-harm-mag", 'm', POPT_ARG_FLOAT, &pAnalParams->fMinRefHarmMag, 0,
+            "minimum reference harmonic magnitude (30 normalized dB)", "float"},
+        {"ref-harm-mag-diff", 'z', POPT_ARG_FLOAT, &pAnalParams->fRefHarmMagDiffFromMax, 0,
+            " maximum dB difference between the harmonic used for reference and the maximum peak (default 30)", "float"},
+        {"default-fund", 'u', POPT_ARG_FLOAT, &pAnalParams->fDefaultFundamental, 0,
+            "default fundamental frequency (hz), used to set initial window size, or window size for entire sound if inharmonic (default 100)", "float"},
+        {"lowest-fund", 'l', POPT_ARG_FLOAT, &pAnalParams->fLowestFundamental, 0,
+            "lowest fundamental frequency(hz), or frequency in inharmonic analysis, to search for (default 50)", "float"},
+        {"highest-fund", 'h', POPT_ARG_FLOAT, &pAnalParams->fHighestFundamental, 0,
+            "highest fundamental frequency to search for, has no effect on inharmonic analysis (default 1000)", "float"},
+        /* Peak Continuation parameters */
+        {"guides", 'n', POPT_ARG_INT, &pAnalParams->nGuides, 0,
+            "number of guides to use in partial tracking (default 100)", "int"},
+        {"tracks", 'p', POPT_ARG_INT, &pAnalParams->nTracks, 0,
+            "number of output partial tracks (default 60)", "int"},
+        {"freq-deviation", 'w', POPT_ARG_FLOAT, &pAnalParams->fFreqDeviation, 0,
+            "maximum permitted frequency deviation from guide frequency (default .45)", "float"},
+        {"peak-cont-guide", 't', POPT_ARG_FLOAT, &pAnalParams->fPeakContToGuide, 0,
+            "contribution of the frequency of the previous peak of a given trajectory to the current guide frequency value (default .4).", "float"},
+        {"fund-cont-guide", 'o', POPT_ARG_FLOAT, &pAnalParams->fFundContToGuide, 0,
+            "contribution of the fundamental frequency of the previous peak of a given trajectory to the current guide frequency value (default .5).", "float"},
+        /* Track Cleaning parameters:\n" */
+        {"clean-track", 'g', POPT_ARG_INT, &pAnalParams->iCleanTracks, 0,
+            "turn on/off track cleaning (default is on, 1)", "int"},
+        {"min-track-length", 'a', POPT_ARG_INT, &pAnalParams->iMinTrackLength, 0,
+            "minimum track length in frames (40)", "int"},
+        {"max-sleeping-time", 'b', POPT_ARG_INT, &pAnalParams->iMaxSleepingTime, 0,
+            "maximum number of frames a track can sleep (40)", "int"},
+        /* Stochastic Analysis parameters */
+        {"stochastic", 'e', POPT_ARG_INT, &pAnalParams->iStochasticType, 0,
+            "turn on/off stochastic analysis (default is on, 1)", "int"},
+        {"stoch-coeff", 'c', POPT_ARG_INT, &pAnalParams->nStochasticCoeff, 0,
+            "number of stochastic coefficients in approximation (default 128)", "int"},
+        /* spectral enveloping parameters */
+        {"se",0, POPT_ARG_INT, &pAnalParams->specEnvParams.iType, 0,
+            "spectral enveloping type (0, off)", "int"},
+        {"co", 0, POPT_ARG_INT, &pAnalParams->specEnvParams.iOrder, 0,
+            "discrete cepstrum order (25)", "int"},
+        {"la", 0, POPT_ARG_FLOAT, &pAnalParams->specEnvParams.fLambda, 0,
+            "lambda, regularizing coefficient (0.00001)", "float"},
+        {"an", 0, POPT_ARG_NONE, &pAnalParams->specEnvParams.iAnchor, 0,
+            "turn on anchoring of spectral envelope endpoints", 0},
+        {"mef", 0, POPT_ARG_INT, &pAnalParams->specEnvParams.iMaxFreq, 0,
+            "maximum envelope frequency (default is highest-freq", "int"},
+        POPT_AUTOHELP
+            POPT_TABLEEND
+    };
+
+    pc = poptGetContext("smsBatchAnal", argc, argv, options, 0);
+    poptSetOtherOptionHelp(pc, help_header_text);
+
+    while ((optc = poptGetNextOpt(pc)) > 0) {
+        switch (optc) {
+            /* specific arguments are handled here */
+            case 'v':
+                verbose = 1;
+            default:
+                ;
+        }
+    }
+    if (optc < -1)
+    {
+        /* an error occurred during option processing */
+        printf("%s: %s\n",
+                poptBadOption(pc, POPT_BADOPTION_NOALIAS),
+                poptStrerror(optc));
+        return 1;
+    }
+    if ((pChManifest = (char *) poptGetArg(pc)) == NULL)
+    {
+        poptPrintUsage(pc,stderr,0);
+        return 1;
+    }
+    /* parsing done */
+
+    if((nJobs = ReadManifest(pChManifest, pChOutputDir, &pJobs)) < 0)
+        return 1;
+    if(nJobs == 0)
+    {
+        printf("no sound files in %s\n", pChManifest);
+        return 0;
+    }
+
+    /* start the longest files first, so they do not end up last on one core */
+    qsort(pJobs, nJobs, sizeof(BatchJob), CompareJobSize);
+
+    /* initialize the shared tables once, before the workers start */
+    if(sms_init())
+    {
+        printf("error in sms_init: %s \n", sms_errorMessage());
+        return 1;
+    }
+
+    if((pPool = sms_createThreadPool(nThreads)) == NULL)
+    {
+        printf("error in sms_createThreadPool: %s \n", sms_errorMessage());
+        return 1;
+    }
+    if(verbose)
+        printf("analyzing %d sound files with %d threads\n", nJobs, sms_threadPoolSize(pPool));
+
+    for(i = 0; i < nJobs; i++)
+    {
+        if(sms_threadPoolSubmit(pPool, AnalysisTask, &pJobs[i]) < 0)
+        {
+            pJobs[i].iStatus = -1;
+            strcpy(pJobs[i].pChError, "could not start analysis");
+        }
+    }
+    sms_threadPoolWait(pPool);
+    sms_freeThreadPool(pPool);
+
+    for(i = 0; i < nJobs; i++)
+        if(pJobs[i].iStatus < 0)
+            nFailed++;
+    printf("analyzed %d of %d sound files\n", nJobs - nFailed, nJobs);
+
+    /* cleanup */
+    free(pJobs);
+    poptFreeContext(pc);
+    sms_free();
+    return nFailed > 0 ? 1 : 0;
+}
@@ -40,43 +40,35 @@ void usage (void)
 }
 
 /*
- * search over all the data of a record for empy slots
- *
- * SMS_Data smsData     SMS data record
- * float *pFFreq
- * int *pIGoodRecords
+ * mean frequency of each track over the frames it is active in,
+ * reading each track straight along its row of the track model
  *
+ * SMS_TrackModel *pTracks     the tracks
+ * float *pFFreq                   mean frequency of each track, 0 if it is never active
+ * return the number of tracks that are active at least once
  */
-void SearchSms (SMS_Data smsData, float *pFFreq, int *pIGoodRecords)
+int MeanTrackFreqs (const SMS_TrackModel *pTracks, float *pFFreq)
 {
-	int i;
-
-	for (i = 0; i < smsData.nTracks; i++)
-		if (smsData.pFSinAmp[i] > 0)
-		{		
-			pFFreq[i] += smsData.pFSinFreq[i];
-			pIGoodRecords[i]++;
-		}
-}	    
+	int nFrames = pTracks->pSmsHeader->nFrames, iTrack, iFrame, nGood = 0;
 
-/*
- *   calculate size of record in bytes
- */
-int CalcRecordBSize (SMS_Header *pSmsHeader, int nTrajectories)
-{
-	int iSize = 0, nGain = 1, nComp = 2;
-    
-	if (pSmsHeader->iStochasticType == SMS_STOC_NONE)
-		nGain = 0;
-    
-	if (pSmsHeader->iFormat == SMS_FORMAT_HP ||
-	    pSmsHeader->iFormat == SMS_FORMAT_IHP)
-		nComp = 3;
-     
-	iSize = sizeof (float) * (nComp * nTrajectories + 
-		pSmsHeader->nStochasticCoeff + nGain);
-	return(iSize);
-}	     
+	for (iTrack = 0; iTrack < pTracks->pSmsHeader->nTracks; iTrack++)
+	{
+		const sfloat *pFreq = pTracks->pFSinFreq + (size_t)iTrack * nFrames;
+		const sfloat *pAmp = pTracks->pFSinAmp + (size_t)iTrack * nFrames;
+		double fSum = 0;
+		int nActive = 0;
+
+		for (iFrame = 0; iFrame < nFrames; iFrame++)
+			if (pAmp[iFrame] > 0)
+			{
+				fSum += pFreq[iFrame];
+				nActive++;
+			}
+		pFFreq[iTrack] = (nActive > 0) ? fSum / nActive : 0;
+		nGood += (nActive > 0);
+	}
+	return nGood;
+}
 
 void SetTraj (float *pFFreq, int inNTraj, 
                int *pITrajOrder, int outNTraj)
@@ -100,133 +92,118 @@ void SetTraj (float *pFFreq, int inNTraj,
 	}
 }
 
-void CleanSms (SMS_Data inSmsData, SMS_Data *pOutSmsData, int *pITrajOrder)
+/*
+ * copy the tracks in the order of pITrajOrder, and the rest of the
+ * frames as they are
+ */
+void CleanSms (const SMS_TrackModel *pInTracks, SMS_TrackModel *pOutTracks, int *pITrajOrder)
 {
-	int iTrack, iCoeff;
+	size_t nFrames = pInTracks->pSmsHeader->nFrames;
+	int nInTracks = pInTracks->pSmsHeader->nTracks, iTrack;
+	const sfloat *pInRest = pInTracks->pFSinAmp + nInTracks * nFrames;
+	sfloat *pOutRest = pOutTracks->pFSinAmp + pOutTracks->pSmsHeader->nTracks * nFrames;
 
-	for (iTrack = 0; iTrack < pOutSmsData->nTracks; iTrack++)
+	for (iTrack = 0; iTrack < pOutTracks->pSmsHeader->nTracks; iTrack++)
 	{
-		pOutSmsData->pFSinFreq[iTrack] = 
-			inSmsData.pFSinFreq[pITrajOrder[iTrack]];
-		pOutSmsData->pFSinAmp[iTrack] = 
-			inSmsData.pFSinAmp[pITrajOrder[iTrack]];
-	}
+		size_t iIn = pITrajOrder[iTrack] * nFrames, iOut = iTrack * nFrames;
 
-	if (inSmsData.nCoeff > 0)
+		memcpy (pOutTracks->pFSinFreq + iOut, pInTracks->pFSinFreq + iIn, nFrames * sizeof (sfloat));
+		memcpy (pOutTracks->pFSinAmp + iOut, pInTracks->pFSinAmp + iIn, nFrames * sizeof (sfloat));
+		if (pInTracks->pFSinPha)
+			memcpy (pOutTracks->pFSinPha + iOut, pInTracks->pFSinPha + iIn, nFrames * sizeof (sfloat));
+	}
+	if (pInTracks->pFSinPha)
 	{
-		pOutSmsData->nCoeff = inSmsData.nCoeff;
-			*(pOutSmsData->pFStocGain) = *(inSmsData.pFStocGain);
-
-		for (iCoeff = 0; iCoeff < pOutSmsData->nCoeff; iCoeff++)
-			pOutSmsData->pFStocCoeff[iCoeff] = 
-				inSmsData.pFStocCoeff[iCoeff];
+		pInRest = pInTracks->pFSinPha + nInTracks * nFrames;
+		pOutRest = pOutTracks->pFSinPha + pOutTracks->pSmsHeader->nTracks * nFrames;
 	}
+	memcpy (pOutRest, pInRest,
+	        (pInTracks->pValues + pInTracks->nValues * nFrames - pInRest) * sizeof (sfloat));
 }
 
 int main (int argc, char *argv[])
 {
-	char *pChInputSmsFile = NULL, *pChOutputSmsFile = NULL;
-	SMS_Header *pInSmsHeader, OutSmsHeader;
-	FILE *pInSmsFile, *pOutSmsFile;
+	SMS_Header outSmsHeader;
+	SMS_MappedFile inFile;
+	SMS_Model inModel, outModel;
+	SMS_TrackModel inTracks, outTracks;
+	SMS_FileWriter *pWriter;
+	SMS_Data smsFrame;
 	float *pFFreq;
-	SMS_Data inSmsData, outSmsData;
-	int iError, *pIGoodRecords, *pITrajOrder, iRecord, iGoodTraj = 0, iTrack,
-		iFrameBSize, iHeadBSize, iDataBSize;
-  
+	int *pITrajOrder, iFrame, iGoodTraj;
+
 	/* get user arguments */
 	if (argc != 3) usage();
-		
-    
-	pChInputSmsFile = argv[1];
-	pChOutputSmsFile = argv[2];
-
-	/* open SMS file and read the header */
-	if ((iError = sms_getHeader (pChInputSmsFile, &pInSmsHeader, 
-	                            &pInSmsFile)) < 0)
+
+	/* load the SMS file, track by track */
+	if (sms_mapFile (argv[1], &inFile) < 0 ||
+	    sms_initModel (&inModel, inFile.pSmsHeader) < 0)
+	{
+		printf("error reading %s: %s\n", argv[1], sms_errorMessage());
+		exit(EXIT_FAILURE);
+	}
+	for (iFrame = 0; iFrame < inFile.pSmsHeader->nFrames; iFrame++)
+		if (sms_getMappedFrame (&inFile, iFrame, &smsFrame) < 0 ||
+		    sms_addModelFrame (&smsFrame, &inModel) < 0)
+		{
+			printf("error reading %s: %s\n", argv[1], sms_errorMessage());
+			exit(EXIT_FAILURE);
+		}
+	sms_unmapFile (&inFile);
+	if (sms_modelToTracks (&inModel, &inTracks) < 0)
 	{
-                printf("error in sms_getHeader: %s", sms_errorString());
-                exit(EXIT_FAILURE);
-	}	    
-  
-	if ((pFFreq =  
-	     (float *) calloc (pInSmsHeader->nTracks, sizeof (float))) == 
-		 NULL)
-        {
-                printf("error allocating memory for pFFreq: %s", sms_errorString());
-                exit(EXIT_FAILURE);
-        }
-	if ((pIGoodRecords =  
-	     (int *) calloc (pInSmsHeader->nTracks, sizeof (int))) == NULL)
-        {
-                printf("error allocating memory for plGoodRecords: %s", sms_errorString());
-                exit(EXIT_FAILURE);
-        }
-
-	sms_allocFrameH (pInSmsHeader, &inSmsData);
-
-	for (iRecord = 1; iRecord < pInSmsHeader->nFrames; iRecord++)
+		printf("error: %s\n", sms_errorMessage());
+		exit(EXIT_FAILURE);
+	}
+	sms_freeModel (&inModel);
+
+	if ((pFFreq = (float *) calloc (inTracks.pSmsHeader->nTracks + 1, sizeof (float))) == NULL ||
+	    (pITrajOrder = (int *) calloc (inTracks.pSmsHeader->nTracks + 1, sizeof (int))) == NULL)
 	{
-		sms_getFrame (pInSmsFile, pInSmsHeader, iRecord, &inSmsData);
-		SearchSms (inSmsData, pFFreq, pIGoodRecords);	
+		printf("error allocating memory for the tracks\n");
+		exit(EXIT_FAILURE);
 	}
-  
-	for (iTrack = 0; iTrack < pInSmsHeader->nTracks; iTrack++)
-		if (pIGoodRecords[iTrack] > 0)
+	iGoodTraj = MeanTrackFreqs (&inTracks, pFFreq);
+	SetTraj (pFFreq, inTracks.pSmsHeader->nTracks, pITrajOrder, iGoodTraj);
+
+	/* the clean tracks */
+	outSmsHeader = *inTracks.pSmsHeader;
+	outSmsHeader.nTracks = iGoodTraj;
+	if (sms_initTrackModel (&outTracks, &outSmsHeader, inTracks.pSmsHeader->nFrames) < 0)
+	{
+		printf("error: %s\n", sms_errorMessage());
+		exit(EXIT_FAILURE);
+	}
+	CleanSms (&inTracks, &outTracks, pITrajOrder);
+
+	/* write them frame by frame */
+	if (sms_tracksToModel (&outTracks, &outModel) < 0 ||
+	    (pWriter = sms_openFileWriter (argv[2], outModel.pSmsHeader, 0)) == NULL)
+	{
+		printf("error writing %s: %s\n", argv[2], sms_errorMessage());
+		exit(EXIT_FAILURE);
+	}
+	for (iFrame = 0; iFrame < outModel.pSmsHeader->nFrames; iFrame++)
+	{
+		sms_getModelFrame (&outModel, iFrame, &smsFrame);
+		if (sms_writerAddFrame (pWriter, &smsFrame) < 0)
 		{
-			iGoodTraj++;
-			pFFreq[iTrack] /= pIGoodRecords[iTrack];
+			sms_abortFileWriter (pWriter);
+			pWriter = NULL;
+			break;
 		}
-	
-	iFrameBSize = CalcRecordBSize (pInSmsHeader, iGoodTraj);
-	iHeadBSize = sizeof (SMS_Header);
-	iDataBSize = iFrameBSize * pInSmsHeader->nFrames;
-	
-	sms_initHeader (&OutSmsHeader);
-	OutSmsHeader.iFrameBSize = iFrameBSize;
-	OutSmsHeader.nFrames = pInSmsHeader->nFrames;
-	OutSmsHeader.iFormat = pInSmsHeader->iFormat;
-	OutSmsHeader.iFrameRate = pInSmsHeader->iFrameRate;
-	OutSmsHeader.iStochasticType = pInSmsHeader->iStochasticType;
-	OutSmsHeader.nTracks = iGoodTraj;
-	OutSmsHeader.nStochasticCoeff = pInSmsHeader->nStochasticCoeff;
-	OutSmsHeader.iSamplingRate = pInSmsHeader->iSamplingRate;
-	OutSmsHeader.nTextCharacters = pInSmsHeader->nTextCharacters;
-	OutSmsHeader.pChTextCharacters = pInSmsHeader->pChTextCharacters;
-	OutSmsHeader.iEnvType = pInSmsHeader->iEnvType;
-	OutSmsHeader.nEnvCoeff = pInSmsHeader->nEnvCoeff;
-	OutSmsHeader.iMaxFreq = pInSmsHeader->iMaxFreq;
-
-
-	sms_allocFrameH (&OutSmsHeader, &outSmsData);
-	if ((pITrajOrder =  
-	     (int *) calloc (OutSmsHeader.nTracks, sizeof (int))) == NULL)
-        {
-                printf("error allocating memory for pITrajOrder: %s", sms_errorString());
-                exit(EXIT_FAILURE);
-        }
-
-	SetTraj (pFFreq, pInSmsHeader->nTracks, pITrajOrder, 
-	         OutSmsHeader.nTracks);
-
-	/* create output SMS file and write the header */
-	sms_writeHeader (pChOutputSmsFile, &OutSmsHeader, &pOutSmsFile);
-	
-	/* iterate over the input file and clean it */
-	for (iRecord = 1; iRecord < OutSmsHeader.nFrames; iRecord++)
+	}
+	if (pWriter == NULL || sms_closeFileWriter (pWriter, NULL) < 0)
 	{
-		sms_getFrame (pInSmsFile, pInSmsHeader, iRecord, &inSmsData);
-		CleanSms (inSmsData, &outSmsData, pITrajOrder);
-		sms_writeFrame (pOutSmsFile, &OutSmsHeader, &outSmsData);
+		printf("error writing %s: %s\n", argv[2], sms_errorMessage());
+		exit(EXIT_FAILURE);
 	}
-	
-	/* rewrite the header and close the output SMS file */
-	sms_writeFile (pOutSmsFile, &OutSmsHeader);
 
-	free (pInSmsHeader);
+	sms_freeModel (&outModel);
+	sms_freeTrackModel (&inTracks);
+	sms_freeTrackModel (&outTracks);
 	free (pFFreq);
-	free (pIGoodRecords);
 	free (pITrajOrder);
-	fclose (pInSmsFile);
 
 	return 0;
 }
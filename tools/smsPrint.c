@@ -101,14 +101,14 @@ int main (int argc, const char *argv[])
         sms_getHeader ((char *) pInName, &pSmsHeader, &pSmsFile);
         if(sms_errorCheck())
         {
-                printf("error in sms_getHeader: %s \n", sms_errorString());
+                printf("error in sms_getHeader: %s \n", sms_errorMessage());
                 printf("failed when trying to open file %s \n", pInName );
                 exit(EXIT_FAILURE);
         }	    
         sms_allocFrameH (pSmsHeader, &smsData);
         if(sms_errorCheck())
         {
-                printf("error in sms_allocFrameH: %s \n", sms_errorString());
+                printf("error in sms_allocFrameH: %s \n", sms_errorMessage());
                 exit(EXIT_FAILURE);
         }	    
 	
@@ -144,6 +144,15 @@ int main (int argc, const char *argv[])
         else if(pSmsHeader->iEnvType == SMS_ENV_NONE) 
                 fprintf(fp,"none\n");
         fprintf(fp,"    iSamplingRate   : %d\n", pSmsHeader->iSamplingRate);  
+        fprintf(fp,"    iFileVersion    : %d\n", pSmsHeader->iFileVersion);
+        if(pSmsHeader->iFrameEncoding == SMS_ENC_TRACKCOUNT)
+                fprintf(fp,"    iFrameEncoding  : track count\n");
+        else if(pSmsHeader->iFrameEncoding == SMS_ENC_SPARSE)
+                fprintf(fp,"    iFrameEncoding  : sparse\n");
+        else if(pSmsHeader->iFrameEncoding == SMS_ENC_QUANTIZED)
+                fprintf(fp,"    iFrameEncoding  : quantized\n");
+        else
+                fprintf(fp,"    iFrameEncoding  : dense\n");
 
         //:::::::::::: Write Analysis Arguments :::::::::::::::
         if (pSmsHeader->nTextCharacters > 0)
@@ -196,7 +205,7 @@ int main (int argc, const char *argv[])
                         sms_getFrame (pSmsFile, pSmsHeader, i, &smsData);
                         if(sms_errorCheck())
                         {
-                                printf("error in sms_getFrame: %s \n", sms_errorString());
+                                printf("error in sms_getFrame: %s \n", sms_errorMessage());
                                 exit(EXIT_FAILURE);
                         }	    
                         fprintf(fp,"\n  - frame    : %d \n", i);
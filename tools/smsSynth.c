@@ -27,6 +27,9 @@
 #include "sms.h"
 #include <popt.h>
 
+#define SYNTH_BATCH_FRAMES 64 /* frames synthesized together */
+#define SYNTH_READ_AHEAD 512  /* frames read ahead of the synthesis */
+
 const char *help_header_text =
 "\n\n"
 "Usage: smsSynth [options]  <inputSmsFile> <outputSoundFile>\n"
@@ -39,13 +42,15 @@ const char *help_header_text =
 int main (int argc, const char *argv[])
 {
     char *pChInputSmsFile = NULL, *pChOutputSoundFile = NULL;
-    SMS_Header *pSmsHeader = NULL;
-    FILE *pSmsFile; /* pointer to sms file to be synthesized */
-    SMS_Data smsFrameL, smsFrameR, smsFrame; /* left, right, and interpolated frames */
+    const SMS_Header *pSmsHeader = NULL;
+    SMS_FrameReader *pReader; /* reads the sms file to be synthesized ahead on a thread */
+    const SMS_Data *pSmsFrameL, *pSmsFrameR; /* left and right frames */
+    SMS_Data smsFrames[SYNTH_BATCH_FRAMES]; /* the interpolated frames */
     float *pFSynthesis; /* waveform synthesis buffer */
     long iSample, i, nSamples, iLeftFrame, iRightFrame;
+    int nBatch;
     float fFrameLoc; /* exact sms frame location, used to interpolate smsFrame */
-    float fFsRatio,  fLocIncr;
+    float fFsRatio,  fLocIncr, fFrameIncr;
     int verbose = 0;
     int iSoundFileType = 0; /* wav file */
     int doInterp = 1;
@@ -108,13 +113,12 @@ int main (int argc, const char *argv[])
     pChOutputSoundFile = (char *) poptGetArg(pc);
     /* parsing done */
 
-    sms_getHeader (pChInputSmsFile, &pSmsHeader, &pSmsFile);
-
-    if (sms_errorCheck())
+    if ((pReader = sms_openFrameReader (pChInputSmsFile, SYNTH_READ_AHEAD)) == NULL)
     {
-        printf("error in sms_getHeader: %s", sms_errorString());
+        printf("error in sms_openFrameReader: %s", sms_errorMessage());
         exit(EXIT_FAILURE);
     }       
+    pSmsHeader = sms_getReaderHeader (pReader);
 
     sms_init();
     sms_initSynth( pSmsHeader, &synthParams );
@@ -152,15 +156,12 @@ int main (int argc, const char *argv[])
     /* initialize libsndfile for writing a soundfile */
     sms_createSF ( pChOutputSoundFile, synthParams.iSamplingRate, iSoundFileType);
 
-    /* setup for synthesis from file */
-    if(doInterp)
-    {
-        sms_allocFrameH (pSmsHeader, &smsFrameL);
-        sms_allocFrameH (pSmsHeader, &smsFrameR);
-    }
-    sms_allocFrameH (pSmsHeader, &smsFrame); /* the actual frame to be handed to synthesizer */
+    /* the left and right frames for interpolation are in the reader */
+    /* the actual frames to be handed to synthesizer */
+    for(i = 0; i < SYNTH_BATCH_FRAMES; i++)
+        sms_allocFrameH (pSmsHeader, &smsFrames[i]);
 
-    if ((pFSynthesis = (float *) calloc(synthParams.sizeHop, sizeof(float)))
+    if ((pFSynthesis = (float *) calloc(synthParams.sizeHop * SYNTH_BATCH_FRAMES, sizeof(float)))
             == NULL)
     {
         printf ("Could not allocate memory for pFSynthesis");
@@ -177,38 +178,66 @@ int main (int argc, const char *argv[])
     /* divide timeFactor out to get the correct frame */
     fLocIncr = pSmsHeader->iSamplingRate / 
         ( synthParams.origSizeHop * synthParams.iSamplingRate * timeFactor); 
+    /* frames advanced per synthesized frame, the rate at which the frames are read */
+    fFrameIncr = fLocIncr * synthParams.sizeHop;
 
     while (iSample < nSamples)
     {
-        if(doInterp)
+        /* read a batch of frames and synthesize them together */
+        for(nBatch = 0; nBatch < SYNTH_BATCH_FRAMES && iSample < nSamples; nBatch++)
         {
-            fFrameLoc =  iSample *  fLocIncr;
-            /* left and right frames around location, gaurding for end of file */
-            iLeftFrame = MIN (pSmsHeader->nFrames - 1, floor (fFrameLoc)); 
-            iRightFrame = (iLeftFrame < pSmsHeader->nFrames - 2)
-                ? (1+ iLeftFrame) : iLeftFrame;
-            sms_getFrame (pSmsFile, pSmsHeader, iLeftFrame, &smsFrameL);
-            sms_getFrame (pSmsFile, pSmsHeader, iRightFrame,&smsFrameR);
-            sms_interpolateFrames (&smsFrameL, &smsFrameR, &smsFrame,
-                    fFrameLoc - iLeftFrame);
-        }
-        else
-        {
-            sms_getFrame (pSmsFile, pSmsHeader, (int) iSample * fLocIncr, &smsFrame);
-            printf("frame: %d \n",  (int) (iSample * fLocIncr));
-        }
-        sms_modify(&smsFrame, &synthParams.modParams); 
-        sms_synthesize (&smsFrame, pFSynthesis, &synthParams);
-        sms_writeSound (pFSynthesis, synthParams.sizeHop);
+            SMS_Data *pSmsFrame = &smsFrames[nBatch];
 
-        iSample += synthParams.sizeHop;
+            if(doInterp)
+            {
+                fFrameLoc =  iSample *  fLocIncr;
+                /* left and right frames around location, gaurding for end of file */
+                iLeftFrame = MIN (pSmsHeader->nFrames - 1, floor (fFrameLoc)); 
+                iRightFrame = (iLeftFrame < pSmsHeader->nFrames - 2)
+                    ? (1+ iLeftFrame) : iLeftFrame;
+                /* writing a file does not have to keep up with a clock, so
+                 * wait for the frames rather than skip them */
+                sms_setReaderPosition (pReader, fFrameLoc, fFrameIncr);
+                pSmsFrameL = sms_waitReaderFrame (pReader, iLeftFrame);
+                pSmsFrameR = sms_waitReaderFrame (pReader, iRightFrame);
+                if (pSmsFrameL == NULL || pSmsFrameR == NULL)
+                {
+                    printf("error in sms_waitReaderFrame: %s\n", sms_errorMessage());
+                    exit(EXIT_FAILURE);
+                }
+                sms_interpolateFrames (pSmsFrameL, pSmsFrameR, pSmsFrame,
+                        fFrameLoc - iLeftFrame);
+            }
+            else
+            {
+                /* the frame of the reader is read-only, sms_modify works on a copy */
+                iLeftFrame = MIN (pSmsHeader->nFrames - 1, (int) (iSample * fLocIncr));
+                sms_setReaderPosition (pReader, iSample * fLocIncr, fFrameIncr);
+                if ((pSmsFrameL = sms_waitReaderFrame (pReader, iLeftFrame)) == NULL)
+                {
+                    printf("error in sms_waitReaderFrame: %s\n", sms_errorMessage());
+                    exit(EXIT_FAILURE);
+                }
+                sms_copyFrame (pSmsFrame, pSmsFrameL);
+                printf("frame: %d \n",  (int) (iSample * fLocIncr));
+            }
+            sms_modify(pSmsFrame, &synthParams.modParams); 
 
-        if(verbose)
-        {
-            if (iSample % (synthParams.sizeHop * 20) == 0)
-                fprintf(stderr,"%.2f ", iSample / (float) synthParams.iSamplingRate);
+            iSample += synthParams.sizeHop;
+
+            if(verbose)
+            {
+                if (iSample % (synthParams.sizeHop * 20) == 0)
+                    fprintf(stderr,"%.2f ", iSample / (float) synthParams.iSamplingRate);
+            }
         }
 
+        if(sms_synthesizeFrames (nBatch, smsFrames, pFSynthesis, &synthParams) < 0)
+        {
+            printf("error in sms_synthesizeFrames: %s \n", sms_errorMessage());
+            break;
+        }
+        sms_writeSound (pFSynthesis, nBatch * synthParams.sizeHop);
     }
 
     if(verbose)
@@ -219,14 +248,10 @@ int main (int argc, const char *argv[])
 
     /* close output sound file, free memory and exit */
     sms_writeSF ();
-    if(doInterp)
-    {
-        sms_freeFrame(&smsFrameL);
-        sms_freeFrame(&smsFrameR);
-    }
-    sms_freeFrame(&smsFrame);
+    for(i = 0; i < SYNTH_BATCH_FRAMES; i++)
+        sms_freeFrame(&smsFrames[i]);
     free (pFSynthesis);
-    free (pSmsHeader);
+    sms_closeFrameReader (pReader);
     sms_freeSynth(&synthParams);
     sms_free();
     return(1);